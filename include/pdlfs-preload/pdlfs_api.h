@@ -11,6 +11,7 @@
 
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -18,14 +19,26 @@ extern "C" {
 
 int pdlfs_mkdir(const char* __path, mode_t __mode);
 int pdlfs_open(const char* __path, int __oflags, mode_t __mode, struct stat*);
+int pdlfs_stat(const char* __path, struct stat*);
+int pdlfs_rename(const char* __oldpath, const char* __newpath);
 int pdlfs_fstat(int __fd, struct stat*);
 int pdlfs_ftruncate(int __fd, off_t __length);
 ssize_t pdlfs_pread(int __fd, void* __buf, size_t __sz, off_t __off);
 ssize_t pdlfs_read(int __fd, void* __buf, size_t __sz);
 ssize_t pdlfs_pwrite(int __fd, const void* __buf, size_t __sz, off_t __off);
 ssize_t pdlfs_write(int __fd, const void* __buf, size_t __sz);
+ssize_t pdlfs_preadv(int __fd, const struct iovec* __iov, int __iovcnt,
+                     off_t __off);
+ssize_t pdlfs_readv(int __fd, const struct iovec* __iov, int __iovcnt);
+ssize_t pdlfs_pwritev(int __fd, const struct iovec* __iov, int __iovcnt,
+                      off_t __off);
+ssize_t pdlfs_writev(int __fd, const struct iovec* __iov, int __iovcnt);
 int pdlfs_close(int __fd);
 
+// Optional. Make data written through __fd durable; metadata too unless
+// __datasync is set.
+int pdlfs_fsync(int __fd, int __datasync);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "attr_cache.h"
+
+#include <time.h>
+
+static inline unsigned long long NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+         ts.tv_nsec;
+}
+
+AttrCache::AttrCache(unsigned long long ttl_nanos) : ttl_nanos_(ttl_nanos) {
+  pthread_mutex_init(&mu_, NULL);
+}
+
+AttrCache::~AttrCache() { pthread_mutex_destroy(&mu_); }
+
+bool AttrCache::Get(const std::string& path, struct stat* buf) {
+  bool found = false;
+  pthread_mutex_lock(&mu_);
+  EntryMap::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    if (it->second.expiry > NowNanos() && held_.count(path) == 0) {
+      *buf = it->second.buf;
+      found = true;
+    } else {
+      entries_.erase(it);
+    }
+  }
+  pthread_mutex_unlock(&mu_);
+  return found;
+}
+
+void AttrCache::Put(const std::string& path, const struct stat& buf) {
+  unsigned long long now = NowNanos();
+  pthread_mutex_lock(&mu_);
+  if (held_.count(path) != 0) {
+    pthread_mutex_unlock(&mu_);
+    return;
+  }
+  if (entries_.size() >= kMaxEntries) {
+    EvictExpired(now);
+  }
+  Entry* entry = &entries_[path];
+  entry->buf = buf;
+  entry->expiry = now + ttl_nanos_;
+  pthread_mutex_unlock(&mu_);
+}
+
+void AttrCache::Extend(const std::string& path, off_t end) {
+  SetSize(path, end, false);
+}
+
+void AttrCache::Truncate(const std::string& path, off_t size) {
+  SetSize(path, size, true);
+}
+
+void AttrCache::SetSize(const std::string& path, off_t size, bool truncate) {
+  pthread_mutex_lock(&mu_);
+  EntryMap::iterator it = entries_.find(path);
+  if (it != entries_.end()) {
+    struct stat* buf = &it->second.buf;
+    if (truncate || size > buf->st_size) {
+      buf->st_size = size;
+      buf->st_blocks = (size + 511) / 512;
+    }
+    buf->st_mtime = buf->st_ctime = time(NULL);
+  }
+  pthread_mutex_unlock(&mu_);
+}
+
+void AttrCache::Erase(const std::string& path) {
+  pthread_mutex_lock(&mu_);
+  entries_.erase(path);
+  std::string prefix = path;
+  if (prefix.empty() || prefix[prefix.size() - 1] != '/') {
+    prefix += '/';
+  }
+  EntryMap::iterator it = entries_.lower_bound(prefix);
+  while (it != entries_.end() &&
+         it->first.compare(0, prefix.size(), prefix) == 0) {
+    entries_.erase(it++);
+  }
+  pthread_mutex_unlock(&mu_);
+}
+
+void AttrCache::Hold(const std::string& path) {
+  pthread_mutex_lock(&mu_);
+  entries_.erase(path);
+  held_[path]++;
+  pthread_mutex_unlock(&mu_);
+}
+
+void AttrCache::Release(const std::string& path) {
+  pthread_mutex_lock(&mu_);
+  std::map<std::string, int>::iterator it = held_.find(path);
+  if (it != held_.end() && --it->second == 0) {
+    held_.erase(it);
+  }
+  entries_.erase(path);
+  pthread_mutex_unlock(&mu_);
+}
+
+// Caller must hold mu_. Drops everything if no entry has expired.
+void AttrCache::EvictExpired(unsigned long long now) {
+  EntryMap::iterator it = entries_.begin();
+  while (it != entries_.end()) {
+    if (it->second.expiry <= now) {
+      entries_.erase(it++);
+    } else {
+      ++it;
+    }
+  }
+  if (entries_.size() >= kMaxEntries) {
+    entries_.clear();
+  }
+}
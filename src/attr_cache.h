@@ -0,0 +1,68 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <map>
+#include <string>
+
+// Recently seen attributes of pdlfs files, keyed by pdlfs path. Entries
+// expire after a fixed time-to-live so changes made by other processes
+// become visible eventually. Thread-safe.
+class AttrCache {
+ public:
+  explicit AttrCache(unsigned long long ttl_nanos);
+  ~AttrCache();
+
+  // Return true and fill *buf if path has an unexpired entry.
+  bool Get(const std::string& path, struct stat* buf);
+
+  // Insert or replace the entry for path.
+  void Put(const std::string& path, const struct stat& buf);
+
+  // Record a write that ended at end. The cached size grows to end if it
+  // was smaller, and the modification time is updated.
+  void Extend(const std::string& path, off_t end);
+
+  // Record a truncate to size.
+  void Truncate(const std::string& path, off_t size);
+
+  // Drop path and everything below it.
+  void Erase(const std::string& path);
+
+  // Drop path and stop caching it until a matching Release(). Used while
+  // the file is written in ways the cache cannot follow, such as through
+  // a stream whose buffer may be written out at any time.
+  void Hold(const std::string& path);
+  void Release(const std::string& path);
+
+ private:
+  struct Entry {
+    struct stat buf;
+    unsigned long long expiry;
+  };
+  typedef std::map<std::string, Entry> EntryMap;
+
+  enum { kMaxEntries = 65536 };
+
+  void SetSize(const std::string& path, off_t size, bool truncate);
+  void EvictExpired(unsigned long long now);
+
+  pthread_mutex_t mu_;
+  EntryMap entries_;
+  std::map<std::string, int> held_;  // Path -> number of holds
+  const unsigned long long ttl_nanos_;
+
+  // No copying allowed
+  AttrCache(const AttrCache&);
+  void operator=(const AttrCache&);
+};
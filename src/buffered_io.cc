@@ -10,125 +10,733 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <fnmatch.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
+#include <time.h>
+#include <algorithm>
 #include <string>
+#include <vector>
 
 #include "buffered_io.h"
-#include "pdlfs-preload/pdlfs_api.h"
+#include "compressed_io.h"
+#include "mount_table.h"
+#include "thread_pool.h"
 
 namespace {
 
+struct Options {
+  size_t min_readahead;  // Initial readahead window
+  size_t max_readahead;  // Maximum readahead window, 0 disables readahead
+  size_t buffer_size;    // Initial write buffer size
+  size_t max_buffer_size;
+  bool write_behind;  // Write full buffers from background threads
+  bool compress_all;
+  std::vector<std::string> compress;  // Patterns of file names to compress
+  int compress_shuffle;  // Element size to shuffle before compression
+
+  Options()
+      : min_readahead(128 << 10),
+        max_readahead(4 << 20),
+        buffer_size(1 << 20),
+        max_buffer_size(16 << 20),
+        write_behind(false),
+        compress_all(false),
+        compress_shuffle(0) {
+    const char* env = getenv("PDLFS_ReadAhead");
+    if (env != NULL) {
+      max_readahead = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_BufferSize");
+    if (env != NULL) {
+      buffer_size = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_MaxBufferSize");
+    if (env != NULL) {
+      max_buffer_size = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_WriteBehind");
+    if (env != NULL) {
+      write_behind = atoi(env) != 0;
+    }
+    env = getenv("PDLFS_Compress");
+    if (env != NULL && strcmp(env, "1") == 0) {
+      compress_all = true;
+    } else if (env != NULL && env[0] != 0 && strcmp(env, "0") != 0) {
+      std::string list = env;
+      size_t start = 0;
+      while (start <= list.size()) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+        if (end > start) compress.push_back(list.substr(start, end - start));
+        start = end + 1;
+      }
+    }
+    env = getenv("PDLFS_CompressShuffle");
+    if (env != NULL) {
+      compress_shuffle = atoi(env);
+      if (compress_shuffle < 0 || compress_shuffle > 255) {
+        compress_shuffle = 0;
+      }
+    }
+    if (buffer_size > max_buffer_size) {
+      max_buffer_size = buffer_size;
+    }
+    if (min_readahead > max_readahead) {
+      min_readahead = max_readahead;
+    }
+  }
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static Options* options = NULL;
+
+static void InitOptions() { options = new Options; }
+
+static const Options& GetOptions() {
+  if (options == NULL) {
+    pthread_once(&once, &InitOptions);
+  }
+  return *options;
+}
+
+// Patterns are matched against the last component of the path.
+static bool ShouldCompress(const char* path) {
+  const Options& options = GetOptions();
+  if (options.compress_all) return true;
+  const char* base = strrchr(path, '/');
+  base = (base != NULL) ? base + 1 : path;
+  for (size_t i = 0; i < options.compress.size(); i++) {
+    if (fnmatch(options.compress[i].c_str(), base, 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static inline unsigned long long NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+         ts.tv_nsec;
+}
+
+// A buffer being written out by a background thread.
+struct Writeback {
+  Writeback(const PdlfsOps* ops, int fd, off_t off)
+      : ops(ops),
+        fd(fd),
+        off(off), n(0), err(0), nanos(0), done(false) {
+    pthread_mutex_init(&mu, NULL);
+    pthread_cond_init(&cv, NULL);
+  }
+
+  ~Writeback() {
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&mu);
+  }
+
+  static void Run(void* arg) {
+    Writeback* w = reinterpret_cast<Writeback*>(arg);
+    unsigned long long start = NowNanos();
+    ssize_t n = w->ops->pwrite(w->fd, w->buf.data(), w->buf.size(), w->off);
+    int err = 0;
+    if (n != w->buf.size()) {
+      err = (n == -1) ? errno : EIO;
+    }
+    unsigned long long nanos = NowNanos() - start;
+    pthread_mutex_lock(&w->mu);
+    w->n = n;
+    w->err = err;
+    w->nanos = nanos;
+    w->done = true;
+    pthread_cond_signal(&w->cv);
+    pthread_mutex_unlock(&w->mu);
+  }
+
+  void Wait() {
+    pthread_mutex_lock(&mu);
+    while (!done) {
+      pthread_cond_wait(&cv, &mu);
+    }
+    pthread_mutex_unlock(&mu);
+  }
+
+  const PdlfsOps* ops;
+  int fd;
+  off_t off;
+  std::string buf;
+  ssize_t n;
+  int err;  // Error of a failed or short write
+  unsigned long long nanos;
+  bool done;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+};
+
+// A read issued ahead of time by a background thread.
+struct Prefetch {
+  Prefetch(const PdlfsOps* ops, int fd, off_t off, size_t size)
+      : ops(ops),
+        fd(fd),
+        off(off), size(size), n(0), done(false) {
+    pthread_mutex_init(&mu, NULL);
+    pthread_cond_init(&cv, NULL);
+  }
+
+  ~Prefetch() {
+    pthread_cond_destroy(&cv);
+    pthread_mutex_destroy(&mu);
+  }
+
+  static void Run(void* arg) {
+    Prefetch* p = reinterpret_cast<Prefetch*>(arg);
+    p->buf.resize(p->size);
+    ssize_t n = p->ops->pread(p->fd, &p->buf[0], p->size, p->off);
+    pthread_mutex_lock(&p->mu);
+    p->n = n;
+    p->done = true;
+    pthread_cond_signal(&p->cv);
+    pthread_mutex_unlock(&p->mu);
+  }
+
+  void Wait() {
+    pthread_mutex_lock(&mu);
+    while (!done) {
+      pthread_cond_wait(&cv, &mu);
+    }
+    pthread_mutex_unlock(&mu);
+  }
+
+  const PdlfsOps* ops;
+  int fd;
+  off_t off;
+  size_t size;
+  std::string buf;
+  ssize_t n;
+  bool done;
+  pthread_mutex_t mu;
+  pthread_cond_t cv;
+};
+
 class BufferedFile {
  public:
-  BufferedFile(int fd, off_t size)
-      : err_(false),
+  BufferedFile(const PdlfsOps* ops, int fd, off_t size, const char* path,
+               int flags)
+      : magic_(PDLFS_FILE_MAGIC),
+        err_(false),
+        error_(0),
         eof_(false),
         append_(false),
+        buf_mode_(_IOFBF),
+        buf_fixed_(false),
+        buf_size_(GetOptions().buffer_size),
         buf_pos_(0),
         off_(0),
         size_(size),
-        fd_(fd) {}
+        ops_(ops),
+        fd_(fd),
+        fileno_(-1),
+        flags_(flags),
+        path_(path),
+        ra_off_(0),
+        ra_next_(0),
+        ra_window_(GetOptions().min_readahead),
+        ra_pending_(NULL),
+        wb_pending_(NULL),
+        cz_(NULL),
+        prev_(NULL),
+        next_(NULL) {}
 
-  ~BufferedFile() {}
+  ~BufferedFile() {
+    DiscardReadAhead();
+    WaitWriteBehind();
+    delete cz_;
+    magic_ = 0;
+  }
+
+  // Keep data in compressed blocks. Offsets and sizes seen by the caller
+  // become logical and writes are only accepted at the end of the file.
+  // Readahead and write-behind are not used.
+  void SetCompressed(CompressedFile* cz) {
+    cz_ = cz;
+    size_ = cz->size();
+  }
 
   void Clearerr() { err_ = eof_ = false; }
 
   void Seek(off_t off) {
+    unget_.clear();
     off_ = off;
     eof_ = false;
   }
 
+  // Each pushed back byte moves the position back by one.
+  off_t Tell() const {
+    off_t off = off_ - static_cast<off_t>(unget_.size());
+    return off < 0 ? 0 : off;
+  }
+
+  // Return c, or EOF if c is EOF.
+  int Unget(int c) {
+    if (c == EOF) return EOF;
+    unget_.push_back(static_cast<char>(c));
+    eof_ = false;
+    return static_cast<unsigned char>(c);
+  }
+
+  // Writes start at the position seen by the caller.
+  void DropPushback() {
+    if (!unget_.empty()) {
+      off_ = Tell();
+      unget_.clear();
+    }
+  }
+
+  // Return the number of pushed back bytes copied into buf.
+  size_t TakePushback(char* buf, size_t nbytes) {
+    size_t n = 0;
+    while (n < nbytes && !unget_.empty()) {
+      buf[n++] = unget_[unget_.size() - 1];
+      unget_.resize(unget_.size() - 1);
+    }
+    return n;
+  }
+
   void SetAppend() {
     buf_pos_ = size_;
+    off_ = size_;
     append_ = true;
   }
 
+  // Return 0 on success, or EOF on errors.
+  int SetBuffering(int mode, size_t size) {
+    if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF) {
+      errno = EINVAL;
+      return EOF;
+    }
+    int r = Flush(true);
+    if (r == 0) {
+      buf_mode_ = mode;
+      buf_fixed_ = true;
+      if (mode == _IONBF) {
+        buf_size_ = 0;
+      } else if (size != 0) {
+        buf_size_ = size;
+      }
+    }
+    return r;
+  }
+
+  // Grow the buffer while flushes are cheap enough that issuing fewer,
+  // larger backend writes is a win. Writes that outgrow the buffer skip it
+  // and do not affect its size.
+  void AdaptBuffer(size_t flush_size, unsigned long long flush_nanos) {
+    if (buf_fixed_) return;
+    if (flush_size >= buf_size_ && flush_nanos < kTargetFlushNanos) {
+      buf_size_ = std::min(2 * buf_size_, GetOptions().max_buffer_size);
+    }
+  }
+
+  // Put the stream in the error state. errno is kept and reported again
+  // by later calls that fail because of it.
+  void SetError() {
+    if (!err_) {
+      err_ = true;
+      error_ = errno;
+    }
+  }
+
+  // Return EOF with errno set to the error that stopped the stream.
+  int Error() const {
+    errno = error_;
+    return EOF;
+  }
+
+  // Drop the last nbytes of the buffer, copied there by a write whose
+  // flush failed, so that the write is reported as not done.
+  void Unbuffer(size_t nbytes, off_t size) {
+    buf_.resize(buf_.size() - nbytes);
+    off_ = buf_pos_ + buf_.size();
+    size_ = size;
+  }
+
+  // Copy prefetched data at the current offset into buf.
+  // Return the number of bytes copied.
+  size_t CopyReadAhead(char* buf, size_t nbytes) {
+    off_t end = ra_off_ + ra_buf_.size();
+    if (off_ < ra_off_ || off_ >= end) return 0;
+    size_t n = end - off_;
+    if (n > nbytes) n = nbytes;
+    memcpy(buf, ra_buf_.data() + (off_ - ra_off_), n);
+    off_ += n;
+    return n;
+  }
+
+  // Wait for the pending prefetch and make its data readable.
+  // Return false if it failed or found nothing to read.
+  bool WaitReadAhead() {
+    Prefetch* p = ra_pending_;
+    ra_pending_ = NULL;
+    p->Wait();
+    bool ok = p->n > 0;
+    if (ok) {
+      ra_buf_.swap(p->buf);
+      ra_buf_.resize(p->n);
+      ra_off_ = p->off;
+    }
+    delete p;
+    return ok;
+  }
+
+  // Keep one window of data being prefetched beyond what has been read.
+  void StartReadAhead() {
+    if (ra_pending_ != NULL || ra_window_ == 0 || cz_ != NULL) return;
+    off_t end = ra_off_ + ra_buf_.size();
+    off_t off = (off_ >= ra_off_ && off_ < end) ? end : off_;
+    ra_pending_ = new Prefetch(ops_, fd_, off, ra_window_);
+    io_thread_pool()->Schedule(&Prefetch::Run, ra_pending_);
+    // Grow the window while reads remain sequential
+    ra_window_ *= 2;
+    if (ra_window_ > GetOptions().max_readahead) {
+      ra_window_ = GetOptions().max_readahead;
+    }
+  }
+
+  void DiscardReadAhead() {
+    if (ra_pending_ != NULL) {
+      ra_pending_->Wait();
+      delete ra_pending_;
+      ra_pending_ = NULL;
+    }
+    if (!ra_buf_.empty()) {
+      std::string empty;
+      ra_buf_.swap(empty);
+    }
+  }
+
   // Return the number of bytes read which is less then nbytes
   // only if a read error or end-of-file is encountered.
   size_t Read(void* buf, size_t nbytes) {
-    if (err_ || eof_) return 0;
+    char* dst = reinterpret_cast<char*>(buf);
+    size_t total = TakePushback(dst, nbytes);
+    if (err_ || eof_ || total == nbytes) return total;
     int r = Flush(true);
-    if (r == 0) {
-      ssize_t n = pdlfs_pread(fd_, buf, nbytes, off_);
+    if (r != 0) return total;
+    bool sequential = (off_ == ra_next_);
+    if (!sequential) {
+      ra_window_ = GetOptions().min_readahead;
+    }
+    while (total < nbytes) {
+      size_t n = CopyReadAhead(dst + total, nbytes - total);
+      if (n != 0) {
+        total += n;
+      } else if (ra_pending_ != NULL && ra_pending_->off == off_) {
+        if (!WaitReadAhead()) break;
+      } else {
+        break;
+      }
+    }
+    if (total < nbytes) {
+      DiscardReadAhead();
+      ssize_t n = ReadAt(dst + total, nbytes - total, off_);
       if (n == -1) {
-        err_ = true;
+        SetError();
       } else {
         off_ += n;
-        if (n < nbytes) eof_ = true;
-        if (off_ > size_) size_ = off_;
-        return n;
+        total += n;
+        if (total < nbytes) eof_ = true;
       }
     }
+    if (off_ > size_) size_ = off_;
+    ra_next_ = off_;
+    if (sequential && !err_ && !eof_) {
+      StartReadAhead();
+    }
 
-    return 0;
+    return total;
+  }
+
+  int Getc() {
+    unsigned char c;
+    return Read(&c, 1) == 1 ? c : EOF;
   }
 
-  // Return the number of bytes written.
+  // Read up to n - 1 bytes, stopping after a newline, and terminate s.
+  // Lines are scanned in place in the prefetched data when possible.
+  // Return false if nothing was read.
+  bool Gets(char* s, int n) {
+    size_t max = n - 1;
+    size_t total = 0;
+    while (total < max) {
+      off_t end = ra_off_ + ra_buf_.size();
+      if (unget_.empty() && off_ >= ra_off_ && off_ < end) {
+        const char* p = ra_buf_.data() + (off_ - ra_off_);
+        size_t avail = end - off_;
+        if (avail > max - total) avail = max - total;
+        const char* nl =
+            reinterpret_cast<const char*>(memchr(p, '\n', avail));
+        size_t k = (nl != NULL) ? nl - p + 1 : avail;
+        memcpy(s + total, p, k);
+        off_ += k;
+        ra_next_ = off_;
+        total += k;
+        if (nl != NULL) break;
+      } else if (Read(s + total, 1) == 1) {
+        if (s[total++] == '\n') break;
+      } else {
+        break;
+      }
+    }
+    s[total] = 0;
+    return total != 0;
+  }
+
+  // Return true if the buffer should be written out after buffering
+  // the nbytes at buf.
+  bool NeedsFlush(const void* buf, size_t nbytes) const {
+    if (buf_.size() >= buf_size_) {
+      return true;
+    } else if (buf_mode_ == _IOLBF) {
+      return memchr(buf, '\n', nbytes) != NULL;
+    } else {
+      return false;
+    }
+  }
+
+  // Return true if a write is large enough to skip the buffer.
+  bool IsLargeWrite(size_t nbytes) const { return nbytes >= buf_size_; }
+
+  // Write out buffered data followed by the nbytes at buf, which must be
+  // contiguous with it, without copying buf into the buffer.
+  // Return the number of bytes written or 0 on errors.
+  size_t WriteDirect(const void* buf, size_t nbytes) {
+    if (WaitWriteBehind() != 0) return 0;
+    if (buf_.empty()) {
+      buf_pos_ = off_;
+    }
+    off_t off = buf_pos_ + buf_.size();
+    // Buffered bytes and the caller's data go out in a single call.
+    struct iovec iov[2];
+    iov[0].iov_base = &buf_[0];
+    iov[0].iov_len = buf_.size();
+    iov[1].iov_base = const_cast<void*>(buf);
+    iov[1].iov_len = nbytes;
+    ssize_t n = WriteAt(iov, 2, buf_pos_);
+    if (n != buf_.size() + nbytes) {
+      if (n >= 0) errno = EIO;
+      SetError();
+      return 0;
+    }
+    buf_.resize(0);
+    buf_pos_ = off + nbytes;
+    off_ = buf_pos_;
+    if (off_ > size_) {
+      size_ = off_;
+    }
+    return nbytes;
+  }
+
+  // Return the number of bytes written or 0 on errors.
   size_t Append(const void* buf, size_t nbytes) {
+    DiscardReadAhead();
+    if (IsLargeWrite(nbytes)) {
+      off_ = buf_pos_ + buf_.size();
+      return WriteDirect(buf, nbytes);
+    }
+    const off_t size = size_;
     buf_.append(reinterpret_cast<const char*>(buf), nbytes);
     off_t end = buf_pos_ + buf_.size();
     if (end > size_) {
       size_ = end;
     }
+    off_ = end;
+    if (NeedsFlush(buf, nbytes)) {
+      if (StartFlush() != 0) {
+        Unbuffer(nbytes, size);
+        return 0;
+      }
+    }
     return nbytes;
   }
 
-  // Return the number of bytes written or 0 on errors.
-  size_t Write(const void* buf, size_t nbytes) {
-    if (err_) return 0;
-    if (append_) return Append(buf, nbytes);
+  // Make the buffer end at the current offset, writing out buffered data
+  // that is not contiguous with it. Return 0 on success, or EOF on errors.
+  int Reposition() {
+    DropPushback();
+    DiscardReadAhead();
+    if (append_) return 0;
+    if (!buf_.empty() && off_ != buf_pos_ + buf_.size()) {
+      if (StartFlush() != 0) {
+        return EOF;
+      }
+    }
     if (buf_.empty()) {
       buf_pos_ = off_;
     }
-    if (off_ == buf_pos_ + buf_.size()) {
-      buf_.append(reinterpret_cast<const char*>(buf), nbytes);
-      off_ += nbytes;
-      if (off_ > size_) {
-        size_ = off_;
+    return 0;
+  }
+
+  // Return the number of bytes written or 0 on errors. Data is buffered
+  // until the buffer fills up or a non-contiguous write arrives.
+  size_t Write(const void* buf, size_t nbytes) {
+    if (err_) {
+      Error();
+      return 0;
+    }
+    if (Reposition() != 0) return 0;
+    if (append_) return Append(buf, nbytes);
+    if (IsLargeWrite(nbytes)) {
+      return WriteDirect(buf, nbytes);
+    }
+    const off_t size = size_;
+    buf_.append(reinterpret_cast<const char*>(buf), nbytes);
+    off_ += nbytes;
+    if (off_ > size_) {
+      size_ = off_;
+    }
+    if (NeedsFlush(buf, nbytes)) {
+      if (StartFlush() != 0) {
+        Unbuffer(nbytes, size);
+        return 0;
       }
-      return nbytes;
-    } else {
-      int r = Flush(true);
-      if (r == 0) {
-        ssize_t n = pdlfs_pwrite(fd_, buf, nbytes, off_);
-        if (n != nbytes) {
-          err_ = true;
-        } else {
-          off_ += nbytes;
-          if (off_ > size_) {
-            size_ = off_;
-          }
-          return nbytes;
-        }
+    }
+
+    return nbytes;
+  }
+
+  // Format directly into the buffer, growing it if the output does not fit
+  // in the space reserved for it. Return the number of bytes written, or -1
+  // on errors.
+  int Printf(const char* fmt, va_list ap) {
+    if (err_) {
+      Error();
+      return -1;
+    }
+    if (Reposition() != 0) return -1;
+    const size_t used = buf_.size();
+    const off_t size = size_;
+    va_list aq;
+    va_copy(aq, ap);
+    buf_.resize(used + kFormatReserve);
+    int n = vsnprintf(&buf_[used], kFormatReserve, fmt, ap);
+    if (n >= static_cast<int>(kFormatReserve)) {
+      buf_.resize(used + n + 1);
+      vsnprintf(&buf_[used], n + 1, fmt, aq);
+    }
+    va_end(aq);
+    if (n < 0) {
+      buf_.resize(used);
+      SetError();
+      return -1;
+    }
+    buf_.resize(used + n);
+    off_ = buf_pos_ + buf_.size();
+    if (off_ > size_) {
+      size_ = off_;
+    }
+    if (NeedsFlush(&buf_[used], n)) {
+      if (StartFlush() != 0) {
+        Unbuffer(n, size);
+        return -1;
       }
     }
 
+    return n;
+  }
+
+  // Wait for the background write, if any, to finish.
+  // Return 0 on success, or EOF on errors.
+  int WaitWriteBehind() {
+    Writeback* w = wb_pending_;
+    if (w == NULL) return 0;
+    wb_pending_ = NULL;
+    w->Wait();
+    bool ok = (w->n == w->buf.size());
+    if (ok) {
+      AdaptBuffer(w->buf.size(), w->nanos);
+    } else {
+      errno = w->err;
+      SetError();
+    }
+    // Keep the memory for the next buffer
+    buf_spare_.swap(w->buf);
+    buf_spare_.resize(0);
+    delete w;
+    return ok ? 0 : Error();
+  }
+
+  // Start writing out the buffer. With write-behind the buffer is handed to
+  // a background thread and writes continue into a second buffer. Errors
+  // are reported by the next flush. Return 0 on success, or EOF on errors.
+  int StartFlush() {
+    if (!GetOptions().write_behind || buf_mode_ != _IOFBF || cz_ != NULL) {
+      return Flush(true);
+    }
+    if (err_) return Error();
+    if (buf_.size() == 0) return 0;
+    if (WaitWriteBehind() != 0) return EOF;
+    Writeback* w = new Writeback(ops_, fd_, buf_pos_);
+    w->buf.swap(buf_);
+    buf_.swap(buf_spare_);
+    buf_pos_ += w->buf.size();
+    wb_pending_ = w;
+    io_thread_pool()->Schedule(&Writeback::Run, w);
     return 0;
   }
 
   // Return 0 on success, or EOF on errors.
   int Flush(bool force = false) {
-    if (err_) return EOF;
+    if (WaitWriteBehind() != 0) return EOF;
+    if (err_) return Error();
     if (buf_.size() == 0) return 0;
-    if (force || buf_.size() >= kMaxBufSize) {
-      ssize_t n = pdlfs_pwrite(fd_, buf_.data(), buf_.size(), buf_pos_);
-      if (n != buf_.size()) {
-        err_ = true;
+    if (force || buf_.size() >= buf_size_) {
+      size_t size = buf_.size();
+      unsigned long long start = NowNanos();
+      struct iovec iov;
+      iov.iov_base = &buf_[0];
+      iov.iov_len = size;
+      ssize_t n = WriteAt(&iov, 1, buf_pos_);
+      if (n != size) {
+        if (n >= 0) errno = EIO;
+        SetError();
         return EOF;
       } else {
-        buf_pos_ += buf_.size();
+        buf_pos_ += size;
         buf_.resize(0);
+        AdaptBuffer(size, NowNanos() - start);
       }
     }
 
     return 0;
   }
 
+  // Write out everything buffered, including the index of a compressed
+  // file, without closing the file. Return 0 on success, or EOF on errors.
+  int Sync() {
+    DiscardReadAhead();
+    // Waits for the buffer being written out by a background thread, if
+    // any, so that both buffers of a write-behind stream are written
+    int r = Flush(true);
+    if (cz_ != NULL && cz_->Finish() != 0) {
+      r = EOF;
+    }
+    return r;
+  }
+
   // Return 0 on success, or EOF on errors.
   int Close() {
+    DiscardReadAhead();
+    // Close the file even if a pending write failed
     int r = Flush(true);
-    if (r == 0) {
-      r = pdlfs_close(fd_);
+    if (cz_ != NULL && cz_->Finish() != 0) {
+      r = EOF;
+    }
+    if (ops_->close(fd_) != 0) {
+      r = EOF;
     }
     if (r != 0) {
       return EOF;
@@ -137,43 +745,129 @@ class BufferedFile {
     return 0;
   }
 
-  enum { kMaxBufSize = 4096 };
+  // Offsets are logical for compressed files.
+  ssize_t ReadAt(char* buf, size_t nbytes, off_t off) {
+    if (cz_ != NULL) {
+      return cz_->Read(buf, nbytes, off);
+    } else {
+      return ops_->pread(fd_, buf, nbytes, off);
+    }
+  }
+
+  // Compressed data can only be appended.
+  ssize_t WriteAt(const struct iovec* iov, int iovcnt, off_t off) {
+    if (cz_ == NULL && iovcnt == 1) {
+      return ops_->pwrite(fd_, iov[0].iov_base, iov[0].iov_len, off);
+    } else if (cz_ == NULL) {
+      return ops_->pwritev(fd_, iov, iovcnt, off);
+    } else if (off != cz_->size()) {
+      errno = ESPIPE;
+      return -1;
+    }
+    ssize_t total = 0;
+    for (int i = 0; i < iovcnt; i++) {
+      const char* p = reinterpret_cast<const char*>(iov[i].iov_base);
+      if (cz_->Append(p, iov[i].iov_len) == -1) {
+        return -1;
+      }
+      total += iov[i].iov_len;
+    }
+    return total;
+  }
+
+  // Stop growing the buffer once a flush takes longer than this
+  static const unsigned long long kTargetFlushNanos = 50 * 1000 * 1000;
+  // Bytes set aside for formatted output before its length is known
+  static const size_t kFormatReserve = 256;
+  unsigned int magic_;  // Must be the first member
   bool err_;
+  int error_;  // errno of the failure that set err_
   bool eof_;
   bool append_;
+  int buf_mode_;     // _IOFBF, _IOLBF, or _IONBF
+  bool buf_fixed_;   // Buffer size set by setvbuf and not adapted
+  size_t buf_size_;  // Flush once this many bytes are buffered
   std::string buf_;
+  std::string buf_spare_;  // Recycled from the last background write
   off_t buf_pos_;
   off_t off_;
   off_t size_;
+  const PdlfsOps* const ops_;  // Backend of the file's mount
   int fd_;
+  int fileno_;  // Descriptor handed out by fileno(), -1 if none
+  const int flags_;
+  const std::string path_;
+  std::string unget_;  // Pushed back bytes, last pushed at the end
+  std::string ra_buf_;  // Prefetched data starting at ra_off_
+  off_t ra_off_;
+  off_t ra_next_;  // Where the next read is expected if sequential
+  size_t ra_window_;
+  Prefetch* ra_pending_;
+  Writeback* wb_pending_;
+  CompressedFile* cz_;  // Non-NULL if data is compressed
+  BufferedFile* prev_;  // Links in the list of open streams
+  BufferedFile* next_;
 };
+
+// Streams not yet closed, so that they can be written out at exit.
+static pthread_mutex_t streams_mu = PTHREAD_MUTEX_INITIALIZER;
+static BufferedFile* streams = NULL;  // Guarded by streams_mu
+
+static void AddStream(BufferedFile* f) {
+  pthread_mutex_lock(&streams_mu);
+  f->next_ = streams;
+  if (streams != NULL) streams->prev_ = f;
+  streams = f;
+  pthread_mutex_unlock(&streams_mu);
+}
+
+static void RemoveStream(BufferedFile* f) {
+  pthread_mutex_lock(&streams_mu);
+  if (f->prev_ != NULL) {
+    f->prev_->next_ = f->next_;
+  } else {
+    streams = f->next_;
+  }
+  if (f->next_ != NULL) f->next_->prev_ = f->prev_;
+  pthread_mutex_unlock(&streams_mu);
+}
 }  // namespace
 
 static inline BufferedFile* buffered_file(FILE* f) {
   return reinterpret_cast<BufferedFile*>(f);
 }
 
-static int __convert_to_flags(std::string modes) {
-  if (modes == "r") {
-    return O_RDONLY;
-  } else if (modes == "r+") {
-    return O_RDWR;
-  } else if (modes == "w") {
-    return O_CREAT | O_WRONLY | O_TRUNC;
-  } else if (modes == "w+") {
-    return O_CREAT | O_RDWR | O_TRUNC;
-  } else if (modes == "a") {
-    return O_CREAT | O_WRONLY;
-  } else if (modes == "a+") {
-    return O_CREAT | O_RDWR;
-  } else {
+// Modes may carry "b", which has no effect, "x" for O_EXCL, and "e" for
+// O_CLOEXEC after the access mode.
+static int __convert_to_flags(const char* modes) {
+  if (modes[0] != 'r' && modes[0] != 'w' && modes[0] != 'a') {
     return -1;
   }
+  bool rw = false;
+  int extra = 0;
+  for (const char* p = modes + 1; *p != 0; p++) {
+    if (*p == '+') {
+      rw = true;
+    } else if (*p == 'x') {
+      extra |= O_EXCL;
+    } else if (*p == 'e') {
+      extra |= O_CLOEXEC;
+    } else if (*p != 'b') {
+      return -1;
+    }
+  }
+  if (modes[0] == 'r') {
+    return extra | (rw ? O_RDWR : O_RDONLY);
+  } else if (modes[0] == 'w') {
+    return extra | O_CREAT | O_TRUNC | (rw ? O_RDWR : O_WRONLY);
+  } else {
+    return extra | O_CREAT | (rw ? O_RDWR : O_WRONLY);
+  }
 }
 
 extern "C" {
 
-FILE* pdlfs_fopen(const char* fname, const char* modes) {
+FILE* pdlfs_fopen(const PdlfsOps* ops, const char* fname, const char* modes) {
   int flags = __convert_to_flags(modes);
   if (flags == -1) {
     errno = EINVAL;
@@ -183,12 +877,29 @@ FILE* pdlfs_fopen(const char* fname, const char* modes) {
   FILE* file = NULL;
   struct stat stat_buf;
   BufferedFile* bf;
-  int fd = pdlfs_open(fname, flags, DEFFILEMODE, &stat_buf);
+  const bool compress = ShouldCompress(fname);
+  int open_flags = flags;
+  // The index of a compressed file is read before appending to it
+  if (compress && (flags & O_ACCMODE) == O_WRONLY) {
+    open_flags = (flags & ~O_ACCMODE) | O_RDWR;
+  }
+  int fd = ops->open(fname, open_flags, DEFFILEMODE, &stat_buf);
   if (fd != -1) {
-    bf = new BufferedFile(fd, stat_buf.st_size);
+    bf = new BufferedFile(ops, fd, stat_buf.st_size, fname, flags);
+    if (compress) {
+      CompressedFile* cz =
+          new CompressedFile(ops, fd, GetOptions().compress_shuffle);
+      // Existing files that are not compressed are accessed as they are
+      if (cz->Load(stat_buf.st_size)) {
+        bf->SetCompressed(cz);
+      } else {
+        delete cz;
+      }
+    }
     if (modes[0] == 'a') {
       bf->SetAppend();
     }
+    AddStream(bf);
     file = reinterpret_cast<FILE*>(bf);
   }
 
@@ -213,35 +924,145 @@ size_t pdlfs_fwrite(const void* ptr, size_t sz, size_t n, FILE* stream) {
   } else {
     BufferedFile* file = buffered_file(stream);
     size_t ret = file->Write(ptr, sz * n) / sz;
-    file->Flush();
     return ret;
   }
 }
 
-int pdlfs_fseek(FILE* stream, long int off, int whence) {
+int pdlfs_fseeko(FILE* stream, off_t off, int whence) {
   if (stream == NULL) {
     errno = EINVAL;
     return -1;
   } else {
     BufferedFile* file = buffered_file(stream);
     if (whence == SEEK_CUR) {
-      file->Seek(file->off_ + off);
+      off += file->Tell();
     } else if (whence == SEEK_END) {
-      file->Seek(file->size_ + off);
-    } else {
-      file->Seek(off);
+      off += file->size_;
+    } else if (whence != SEEK_SET) {
+      errno = EINVAL;
+      return -1;
     }
+    if (off < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    file->Seek(off);
     return 0;
   }
 }
 
-long int pdlfs_ftell(FILE* stream) {
+int pdlfs_fseek(FILE* stream, long int off, int whence) {
+  return pdlfs_fseeko(stream, off, whence);
+}
+
+off_t pdlfs_ftello(FILE* stream) {
   if (stream == NULL) {
     errno = EINVAL;
     return -1;
   } else {
     BufferedFile* file = buffered_file(stream);
-    return file->off_;
+    return file->Tell();
+  }
+}
+
+long int pdlfs_ftell(FILE* stream) { return pdlfs_ftello(stream); }
+
+void pdlfs_rewind(FILE* stream) {
+  if (stream != NULL) {
+    BufferedFile* file = buffered_file(stream);
+    file->Seek(0);
+    file->Clearerr();
+  }
+}
+
+int pdlfs_vfprintf(FILE* stream, const char* fmt, va_list ap) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return -1;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    return file->Printf(fmt, ap);
+  }
+}
+
+int pdlfs_fputs(const char* s, FILE* stream) {
+  size_t n = strlen(s);
+  if (pdlfs_fwrite(s, 1, n, stream) != n) {
+    return EOF;
+  }
+  return 0;
+}
+
+int pdlfs_fputc(int c, FILE* stream) {
+  unsigned char ch = static_cast<unsigned char>(c);
+  if (pdlfs_fwrite(&ch, 1, 1, stream) != 1) {
+    return EOF;
+  }
+  return ch;
+}
+
+char* pdlfs_fgets(char* s, int n, FILE* stream) {
+  if (stream == NULL || n <= 0) {
+    errno = EINVAL;
+    return NULL;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    if (n == 1) {
+      s[0] = 0;
+      return s;
+    }
+    return file->Gets(s, n) ? s : NULL;
+  }
+}
+
+int pdlfs_fgetc(FILE* stream) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return EOF;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    return file->Getc();
+  }
+}
+
+int pdlfs_ungetc(int c, FILE* stream) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return EOF;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    return file->Unget(c);
+  }
+}
+
+int pdlfs_fbackend(FILE* stream, const PdlfsOps** ops, const char** path,
+                   int* flags) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return -1;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    *ops = file->ops_;
+    *path = file->path_.c_str();
+    *flags = file->flags_;
+    return file->fd_;
+  }
+}
+
+int pdlfs_fileno(FILE* stream) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return -1;
+  } else {
+    BufferedFile* file = buffered_file(stream);
+    return __atomic_load_n(&file->fileno_, __ATOMIC_ACQUIRE);
+  }
+}
+
+void pdlfs_setfileno(FILE* stream, int fd) {
+  if (stream != NULL) {
+    BufferedFile* file = buffered_file(stream);
+    __atomic_store_n(&file->fileno_, fd, __ATOMIC_RELEASE);
   }
 }
 
@@ -262,12 +1083,36 @@ int pdlfs_fclose(FILE* stream) {
     return -1;
   } else {
     BufferedFile* file = buffered_file(stream);
+    RemoveStream(file);
     int r = file->Close();
     delete file;
     return r;
   }
 }
 
+int pdlfs_setvbuf(FILE* stream, char* buf, int mode, size_t size) {
+  if (stream == NULL) {
+    errno = EINVAL;
+    return EOF;
+  } else {
+    // Streams always manage their own memory so buf is not used
+    BufferedFile* file = buffered_file(stream);
+    return file->SetBuffering(mode, size);
+  }
+}
+
+int pdlfs_fflushall() {
+  int r = 0;
+  pthread_mutex_lock(&streams_mu);
+  for (BufferedFile* f = streams; f != NULL; f = f->next_) {
+    if (f->Sync() != 0) {
+      r = EOF;
+    }
+  }
+  pthread_mutex_unlock(&streams_mu);
+  return r;
+}
+
 void pdlfs_clearerr(FILE* stream) {
   if (stream != NULL) {
     BufferedFile* file = buffered_file(stream);
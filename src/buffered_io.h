@@ -9,6 +9,7 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <stdarg.h>
 #include <stdio.h>
 #include <sys/types.h>
 
@@ -16,16 +17,56 @@
 extern "C" {
 #endif
 
+/*
+ * Streams returned by pdlfs_fopen() start with this tag. It never matches the
+ * leading _flags word of a glibc FILE, whose upper half is always 0xFBAD.
+ */
+#define PDLFS_FILE_MAGIC 0x50444C46U
+
+struct PdlfsOps;
+
+static inline int pdlfs_isfile(FILE* __stream) {
+  return __stream != NULL &&
+         *(const unsigned int*)(const void*)__stream == PDLFS_FILE_MAGIC;
+}
+
 extern int pdlfs_feof(FILE* __stream);
 extern int pdlfs_ferror(FILE* __stream);
 extern void pdlfs_clearerr(FILE* __stream);
-FILE* pdlfs_fopen(const char* __fname, const char* __modes);
+/* Open a stream on the backend behind __ops. */
+FILE* pdlfs_fopen(const struct PdlfsOps* __ops, const char* __fname,
+                  const char* __modes);
 size_t pdlfs_fread(void* __ptr, size_t __sz, size_t __n, FILE* __stream);
 size_t pdlfs_fwrite(const void* __ptr, size_t __sz, size_t __n, FILE* __stream);
 int pdlfs_fseek(FILE* __stream, long int __off, int __whence);
+int pdlfs_fseeko(FILE* __stream, off_t __off, int __whence);
 long int pdlfs_ftell(FILE* __stream);
+off_t pdlfs_ftello(FILE* __stream);
+void pdlfs_rewind(FILE* __stream);
+int pdlfs_vfprintf(FILE* __stream, const char* __fmt, va_list __ap);
+int pdlfs_fputs(const char* __s, FILE* __stream);
+int pdlfs_fputc(int __c, FILE* __stream);
+char* pdlfs_fgets(char* __s, int __n, FILE* __stream);
+int pdlfs_fgetc(FILE* __stream);
+int pdlfs_ungetc(int __c, FILE* __stream);
 int pdlfs_fflush(FILE* __stream);
+int pdlfs_setvbuf(FILE* __stream, char* __buf, int __mode, size_t __size);
 int pdlfs_fclose(FILE* __stream);
+/* Write out every stream that is still open, as exit() does for glibc
+   streams. Return 0 on success, or EOF if any stream failed. */
+int pdlfs_fflushall(void);
+
+/*
+ * A stream has no descriptor of its own. The descriptor returned by fileno()
+ * is allocated on first use by the caller and recorded in the stream.
+ */
+/* Return the backend descriptor and the backend, path and flags of the
+   open file. */
+int pdlfs_fbackend(FILE* __stream, const struct PdlfsOps** __ops,
+                   const char** __path, int* __flags);
+/* Return the descriptor recorded in the stream, or -1 if none. */
+int pdlfs_fileno(FILE* __stream);
+void pdlfs_setfileno(FILE* __stream, int __fd);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,781 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "checksum_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "mount_table.h"
+
+// CRC32C is computed 8 bytes at a time with the crc32 instruction when
+// available, running three independent streams to hide its latency and
+// combining them by shifting the earlier ones over the later ones. The
+// fallback is table-driven, 8 bytes at a time.
+
+static const uint32_t kPoly = 0x82f63b78U;  // Reflected Castagnoli
+static const size_t kLong = 8192;
+static const size_t kShort = 256;
+
+static uint32_t table[8][256];
+static uint32_t shift_long[4][256];  // Appends kLong zero bytes
+static uint32_t shift_short[4][256];
+static bool has_sse42 = false;
+
+static uint32_t MatrixTimes(const uint32_t* mat, uint32_t vec) {
+  uint32_t sum = 0;
+  while (vec != 0) {
+    if (vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void MatrixSquare(uint32_t* square, const uint32_t* mat) {
+  for (int i = 0; i < 32; i++) {
+    square[i] = MatrixTimes(mat, mat[i]);
+  }
+}
+
+// Build the tables applying the operator that appends len zero bytes,
+// len being a power of two, to a crc one byte at a time.
+static void InitShift(uint32_t zeros[][256], size_t len) {
+  uint32_t even[32];
+  uint32_t odd[32];
+  odd[0] = kPoly;  // One zero bit
+  uint32_t row = 1;
+  for (int i = 1; i < 32; i++) {
+    odd[i] = row;
+    row <<= 1;
+  }
+  MatrixSquare(even, odd);  // Two zero bits
+  MatrixSquare(odd, even);  // Four zero bits
+  const uint32_t* op = odd;
+  while (true) {
+    MatrixSquare(even, odd);
+    len >>= 1;
+    if (len == 0) {
+      op = even;
+      break;
+    }
+    MatrixSquare(odd, even);
+    len >>= 1;
+    if (len == 0) {
+      op = odd;
+      break;
+    }
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    zeros[0][i] = MatrixTimes(op, i);
+    zeros[1][i] = MatrixTimes(op, i << 8);
+    zeros[2][i] = MatrixTimes(op, i << 16);
+    zeros[3][i] = MatrixTimes(op, i << 24);
+  }
+}
+
+static inline uint32_t Shift(uint32_t zeros[][256], uint32_t crc) {
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+         zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void InitCrc() {
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++) {
+      crc = (crc & 1) ? (crc >> 1) ^ kPoly : crc >> 1;
+    }
+    table[0][i] = crc;
+  }
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = table[0][i];
+    for (int k = 1; k < 8; k++) {
+      crc = table[0][crc & 0xff] ^ (crc >> 8);
+      table[k][i] = crc;
+    }
+  }
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  has_sse42 = __builtin_cpu_supports("sse4.2");
+#endif
+  if (has_sse42) {
+    InitShift(shift_long, kLong);
+    InitShift(shift_short, kShort);
+  }
+}
+
+static uint32_t SoftCrc(uint32_t crc, const unsigned char* p, size_t n) {
+  uint64_t c = crc ^ 0xffffffffU;
+  while (n != 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    n--;
+  }
+  while (n >= 8) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+    c ^= v;
+    c = table[7][c & 0xff] ^ table[6][(c >> 8) & 0xff] ^
+        table[5][(c >> 16) & 0xff] ^ table[4][(c >> 24) & 0xff] ^
+        table[3][(c >> 32) & 0xff] ^ table[2][(c >> 40) & 0xff] ^
+        table[1][(c >> 48) & 0xff] ^ table[0][c >> 56];
+    p += 8;
+    n -= 8;
+  }
+  while (n != 0) {
+    c = table[0][(c ^ *p++) & 0xff] ^ (c >> 8);
+    n--;
+  }
+  return static_cast<uint32_t>(c) ^ 0xffffffffU;
+}
+
+#if defined(__x86_64__)
+static inline uint64_t Word(const unsigned char* p) {
+  uint64_t v;
+  memcpy(&v, p, 8);
+  return v;
+}
+
+__attribute__((target("sse4.2"))) static uint32_t HardCrc(
+    uint32_t crc, const unsigned char* p, size_t n) {
+  uint64_t c0 = crc ^ 0xffffffffU;
+  while (n != 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0) {
+    c0 = _mm_crc32_u8(c0, *p++);
+    n--;
+  }
+  while (n >= 3 * kLong) {
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+    const unsigned char* end = p + kLong;
+    do {
+      c0 = _mm_crc32_u64(c0, Word(p));
+      c1 = _mm_crc32_u64(c1, Word(p + kLong));
+      c2 = _mm_crc32_u64(c2, Word(p + 2 * kLong));
+      p += 8;
+    } while (p < end);
+    c0 = Shift(shift_long, c0) ^ c1;
+    c0 = Shift(shift_long, c0) ^ c2;
+    p += 2 * kLong;
+    n -= 3 * kLong;
+  }
+  while (n >= 3 * kShort) {
+    uint64_t c1 = 0;
+    uint64_t c2 = 0;
+    const unsigned char* end = p + kShort;
+    do {
+      c0 = _mm_crc32_u64(c0, Word(p));
+      c1 = _mm_crc32_u64(c1, Word(p + kShort));
+      c2 = _mm_crc32_u64(c2, Word(p + 2 * kShort));
+      p += 8;
+    } while (p < end);
+    c0 = Shift(shift_short, c0) ^ c1;
+    c0 = Shift(shift_short, c0) ^ c2;
+    p += 2 * kShort;
+    n -= 3 * kShort;
+  }
+  while (n >= 8) {
+    c0 = _mm_crc32_u64(c0, Word(p));
+    p += 8;
+    n -= 8;
+  }
+  while (n != 0) {
+    c0 = _mm_crc32_u8(c0, *p++);
+    n--;
+  }
+  return static_cast<uint32_t>(c0) ^ 0xffffffffU;
+}
+#endif
+
+uint32_t Crc32c(uint32_t crc, const char* data, size_t n) {
+  pthread_once(&crc_once, &InitCrc);
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+#if defined(__x86_64__)
+  if (has_sse42) {
+    return HardCrc(crc, p, n);
+  }
+#endif
+  return SoftCrc(crc, p, n);
+}
+
+namespace {
+
+// A sidecar starts with a header followed by an Entry per block. Entries
+// cover the first len bytes of their blocks. Bytes past len, including
+// whole blocks with len 0, were not written through this layer and are
+// not checked. The header names the inode of the file so a sidecar left
+// behind by a file renamed or removed outside the layer is not applied to
+// another file that later takes the name.
+struct Header {
+  uint32_t magic;
+  uint32_t block_size;
+  uint64_t ino;
+};
+
+struct Entry {
+  uint32_t crc;
+  uint32_t len;
+};
+
+static const uint32_t kMagic = 0x43524332U;  // "2CRC"
+
+struct ChecksumFile {
+  pthread_mutex_t mu;
+  int crc_fd;  // Sidecar, -1 if the file has no checksums
+  size_t block_size;
+  bool append;
+  off_t off;  // Used by read() and write()
+  off_t size;  // Used by appends
+  std::string scratch;
+};
+
+static ChecksumStats stats;
+
+static inline void Add(unsigned long long* ctr, unsigned long long n) {
+  __atomic_add_fetch(ctr, n, __ATOMIC_RELAXED);
+}
+
+static size_t IovLength(const struct iovec* iov, int iovcnt) {
+  size_t n = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    n += iov[i].iov_len;
+  }
+  return n;
+}
+
+// Checksum, or copy into dst, len bytes starting from byte from of the
+// data gathered by iov.
+static uint32_t IovCrc(const struct iovec* iov, int iovcnt, size_t from,
+                       size_t len, uint32_t crc = 0) {
+  for (int i = 0; i < iovcnt && len != 0; i++) {
+    if (from >= iov[i].iov_len) {
+      from -= iov[i].iov_len;
+      continue;
+    }
+    size_t k = std::min(len, iov[i].iov_len - from);
+    crc = Crc32c(crc, reinterpret_cast<const char*>(iov[i].iov_base) + from,
+                 k);
+    len -= k;
+    from = 0;
+  }
+  return crc;
+}
+
+static void IovCopy(const struct iovec* iov, int iovcnt, size_t from,
+                    size_t len, char* dst) {
+  for (int i = 0; i < iovcnt && len != 0; i++) {
+    if (from >= iov[i].iov_len) {
+      from -= iov[i].iov_len;
+      continue;
+    }
+    size_t k = std::min(len, iov[i].iov_len - from);
+    memcpy(dst, reinterpret_cast<const char*>(iov[i].iov_base) + from, k);
+    dst += k;
+    len -= k;
+    from = 0;
+  }
+}
+
+// Return the sidecar of path, .<name>.crc in the same directory.
+static std::string SidecarPath(const char* path) {
+  const char* base = strrchr(path, '/');
+  base = (base != NULL) ? base + 1 : path;
+  std::string result(path, base - path);
+  result.push_back('.');
+  result.append(base);
+  result.append(".crc");
+  return result;
+}
+
+static size_t DefaultBlockSize() {
+  size_t size = 64 << 10;
+  const char* env = getenv("PDLFS_ChecksumBlock");
+  if (env != NULL && strtoull(env, NULL, 10) != 0) {
+    size = strtoull(env, NULL, 10);
+  }
+  return size;
+}
+
+class ChecksumLayer {
+ public:
+  explicit ChecksumLayer(const PdlfsOps* base)
+      : base_(base), block_size_(DefaultBlockSize()) {
+    pthread_rwlock_init(&lock_, NULL);
+  }
+
+  const PdlfsOps* base() const { return base_; }
+
+  int Open(const char* path, int flags, mode_t mode, struct stat* buf);
+  int Rename(const char* oldpath, const char* newpath);
+  int Ftruncate(int fd, off_t len);
+  ssize_t Preadv(int fd, const struct iovec* iov, int iovcnt, off_t off);
+  ssize_t Pwritev(int fd, const struct iovec* iov, int iovcnt, off_t off);
+  ssize_t Readv(int fd, const struct iovec* iov, int iovcnt);
+  ssize_t Writev(int fd, const struct iovec* iov, int iovcnt);
+  int Close(int fd);
+  int Fsync(int fd, int datasync);
+
+ private:
+  ChecksumFile* Get(int fd) {
+    pthread_rwlock_rdlock(&lock_);
+    std::unordered_map<int, ChecksumFile*>::iterator it = files_.find(fd);
+    ChecksumFile* f = (it != files_.end()) ? it->second : NULL;
+    pthread_rwlock_unlock(&lock_);
+    return f;
+  }
+
+  static off_t EntryOffset(size_t block) {
+    return sizeof(Header) + block * sizeof(Entry);
+  }
+
+  // Missing entries are read as zeros.
+  int ReadEntries(ChecksumFile* f, size_t first, size_t num, Entry* e) {
+    size_t bytes = num * sizeof(Entry);
+    ssize_t n = base_->pread(f->crc_fd, e, bytes, EntryOffset(first));
+    if (n == -1) return -1;
+    memset(reinterpret_cast<char*>(e) + n, 0, bytes - n);
+    return 0;
+  }
+
+  int SetupSidecar(ChecksumFile* f, const char* path, const struct stat& st,
+                   bool writable);
+  ssize_t ReadLocked(ChecksumFile* f, int fd, const struct iovec* iov,
+                     int iovcnt, off_t off);
+  ssize_t WriteLocked(ChecksumFile* f, int fd, const struct iovec* iov,
+                      int iovcnt, off_t off);
+
+  const PdlfsOps* const base_;
+  const size_t block_size_;  // For new sidecars
+  pthread_rwlock_t lock_;
+  std::unordered_map<int, ChecksumFile*> files_;  // Keyed by backend fd
+};
+
+// Open or create the sidecar of a file. A new sidecar is started for
+// empty files and for files the sidecar was not written for, so stale
+// checksums of a removed file are not reused.
+int ChecksumLayer::SetupSidecar(ChecksumFile* f, const char* path,
+                                const struct stat& st, bool writable) {
+  std::string sidecar = SidecarPath(path);
+  struct stat ignored;
+  if (!writable) {
+    f->crc_fd = base_->open(sidecar.c_str(), O_RDONLY, 0, &ignored);
+  } else {
+    int flags = O_RDWR | O_CREAT | (st.st_size == 0 ? O_TRUNC : 0);
+    f->crc_fd = base_->open(sidecar.c_str(), flags, DEFFILEMODE, &ignored);
+    if (f->crc_fd == -1) return -1;
+  }
+  if (f->crc_fd == -1) {
+    return 0;
+  }
+  Header h;
+  if (base_->pread(f->crc_fd, &h, sizeof(h), 0) == sizeof(h) &&
+      h.magic == kMagic && h.block_size != 0 && h.ino == st.st_ino) {
+    f->block_size = h.block_size;
+  } else if (writable) {
+    h.magic = kMagic;
+    h.block_size = block_size_;
+    h.ino = st.st_ino;
+    if (base_->ftruncate(f->crc_fd, 0) != 0 ||
+        base_->pwrite(f->crc_fd, &h, sizeof(h), 0) != sizeof(h)) {
+      return -1;
+    }
+    f->block_size = h.block_size;
+  } else {
+    base_->close(f->crc_fd);
+    f->crc_fd = -1;
+  }
+  return 0;
+}
+
+// Files are opened for reading as well as writing so partially written
+// blocks can be checksummed. O_APPEND is emulated so that positioned writes
+// land where they are checksummed.
+int ChecksumLayer::Open(const char* path, int flags, mode_t mode,
+                        struct stat* buf) {
+  int data_flags = flags & ~O_APPEND;
+  if ((flags & O_ACCMODE) == O_WRONLY) {
+    data_flags = (data_flags & ~O_ACCMODE) | O_RDWR;
+  }
+  int fd = base_->open(path, data_flags, mode, buf);
+  if (fd == -1) {
+    return -1;
+  }
+  ChecksumFile* f = new ChecksumFile;
+  pthread_mutex_init(&f->mu, NULL);
+  f->crc_fd = -1;
+  f->block_size = 0;
+  f->append = (flags & O_APPEND) != 0;
+  f->off = 0;
+  f->size = buf->st_size;
+  bool writable = (flags & O_ACCMODE) != O_RDONLY;
+  if (SetupSidecar(f, path, *buf, writable) != 0) {
+    int err = errno;
+    if (f->crc_fd != -1) base_->close(f->crc_fd);
+    base_->close(fd);
+    pthread_mutex_destroy(&f->mu);
+    delete f;
+    errno = err;
+    return -1;
+  }
+  pthread_rwlock_wrlock(&lock_);
+  ChecksumFile*& slot = files_[fd];
+  delete slot;  // Left by a descriptor closed behind our back
+  slot = f;
+  pthread_rwlock_unlock(&lock_);
+  return fd;
+}
+
+// Checksums follow the file. A stale sidecar of the target is emptied if
+// the source has none.
+int ChecksumLayer::Rename(const char* oldpath, const char* newpath) {
+  int r = base_->rename(oldpath, newpath);
+  if (r != 0) {
+    return r;
+  }
+  std::string from = SidecarPath(oldpath);
+  std::string to = SidecarPath(newpath);
+  if (base_->rename(from.c_str(), to.c_str()) != 0 && errno == ENOENT) {
+    struct stat ignored;
+    int fd = base_->open(to.c_str(), O_WRONLY | O_TRUNC, 0, &ignored);
+    if (fd != -1) base_->close(fd);
+  }
+  return 0;
+}
+
+ssize_t ChecksumLayer::ReadLocked(ChecksumFile* f, int fd,
+                                  const struct iovec* iov, int iovcnt,
+                                  off_t off) {
+  ssize_t n = base_->preadv(fd, iov, iovcnt, off);
+  if (n <= 0 || f->crc_fd == -1) {
+    return n;
+  }
+  const size_t bs = f->block_size;
+  size_t first = off / bs;
+  size_t last = (off + n - 1) / bs;
+  std::vector<Entry> entries(last - first + 1);
+  if (ReadEntries(f, first, entries.size(), &entries[0]) != 0) {
+    return -1;
+  }
+  for (size_t b = first; b <= last; b++) {
+    const Entry& e = entries[b - first];
+    off_t start = b * bs;
+    off_t end = start + e.len;
+    if (e.len == 0 || end <= off) continue;
+    uint32_t crc;
+    if (start >= off && end <= off + n) {
+      crc = IovCrc(iov, iovcnt, start - off, e.len);
+    } else {
+      // The read covers part of the block, so check all of it
+      f->scratch.resize(e.len);
+      ssize_t r = base_->pread(fd, &f->scratch[0], e.len, start);
+      if (r == -1) return -1;
+      crc = Crc32c(0, f->scratch.data(), r);
+      if (r != e.len) crc = ~e.crc;
+    }
+    Add(&stats.bytes_verified, e.len);
+    if (crc != e.crc) {
+      Add(&stats.mismatches, 1);
+      errno = EIO;
+      return -1;
+    }
+  }
+  return n;
+}
+
+// Each block written is checksummed from the new data when it covers all
+// checked bytes of the block, by extending its checksum when the new data
+// starts where they end, and otherwise from the block read back with the
+// new data laid over it.
+ssize_t ChecksumLayer::WriteLocked(ChecksumFile* f, int fd,
+                                   const struct iovec* iov, int iovcnt,
+                                   off_t off) {
+  if (f->append) {
+    off = f->size;
+  }
+  const size_t n = IovLength(iov, iovcnt);
+  if (n == 0 || f->crc_fd == -1) {
+    return base_->pwritev(fd, iov, iovcnt, off);
+  }
+  const size_t bs = f->block_size;
+  size_t first = off / bs;
+  size_t last = (off + n - 1) / bs;
+  std::vector<Entry> entries(last - first + 1);
+  if (ReadEntries(f, first, entries.size(), &entries[0]) != 0) {
+    return -1;
+  }
+  for (size_t b = first; b <= last; b++) {
+    Entry& e = entries[b - first];
+    off_t start = b * bs;
+    off_t lo = std::max(off, start);
+    off_t hi = std::min<off_t>(off + n, start + bs);
+    if (lo == start && hi - start >= e.len) {
+      e.crc = IovCrc(iov, iovcnt, lo - off, hi - lo);
+      e.len = hi - start;
+      Add(&stats.bytes_checksummed, e.len);
+    } else if (e.len != 0 && lo == start + e.len) {
+      e.crc = IovCrc(iov, iovcnt, lo - off, hi - lo, e.crc);
+      e.len = hi - start;
+      Add(&stats.bytes_checksummed, hi - lo);
+    } else {
+      f->scratch.resize(bs);
+      ssize_t r = base_->pread(fd, &f->scratch[0], bs, start);
+      if (r == -1) return -1;
+      size_t len = std::max<size_t>(r, hi - start);
+      memset(&f->scratch[r], 0, len - r);
+      IovCopy(iov, iovcnt, lo - off, hi - lo, &f->scratch[lo - start]);
+      e.crc = Crc32c(0, f->scratch.data(), len);
+      e.len = len;
+      Add(&stats.bytes_checksummed, e.len);
+    }
+  }
+  ssize_t r = base_->pwritev(fd, iov, iovcnt, off);
+  if (r != n) {
+    // Leave the blocks of a partial write unchecked
+    for (size_t i = 0; i < entries.size(); i++) {
+      entries[i].crc = entries[i].len = 0;
+    }
+  }
+  size_t bytes = entries.size() * sizeof(Entry);
+  if (base_->pwrite(f->crc_fd, &entries[0], bytes, EntryOffset(first)) !=
+      bytes) {
+    return -1;
+  }
+  if (r > 0 && off + r > f->size) {
+    f->size = off + r;
+  }
+  return r;
+}
+
+ssize_t ChecksumLayer::Preadv(int fd, const struct iovec* iov, int iovcnt,
+                              off_t off) {
+  ChecksumFile* f = Get(fd);
+  if (f == NULL) {
+    return base_->preadv(fd, iov, iovcnt, off);
+  }
+  pthread_mutex_lock(&f->mu);
+  ssize_t n = ReadLocked(f, fd, iov, iovcnt, off);
+  pthread_mutex_unlock(&f->mu);
+  return n;
+}
+
+ssize_t ChecksumLayer::Pwritev(int fd, const struct iovec* iov, int iovcnt,
+                               off_t off) {
+  ChecksumFile* f = Get(fd);
+  if (f == NULL) {
+    return base_->pwritev(fd, iov, iovcnt, off);
+  }
+  pthread_mutex_lock(&f->mu);
+  ssize_t n = WriteLocked(f, fd, iov, iovcnt, off);
+  pthread_mutex_unlock(&f->mu);
+  return n;
+}
+
+ssize_t ChecksumLayer::Readv(int fd, const struct iovec* iov, int iovcnt) {
+  ChecksumFile* f = Get(fd);
+  if (f == NULL) {
+    return base_->readv(fd, iov, iovcnt);
+  }
+  pthread_mutex_lock(&f->mu);
+  ssize_t n = ReadLocked(f, fd, iov, iovcnt, f->off);
+  if (n > 0) f->off += n;
+  pthread_mutex_unlock(&f->mu);
+  return n;
+}
+
+ssize_t ChecksumLayer::Writev(int fd, const struct iovec* iov, int iovcnt) {
+  ChecksumFile* f = Get(fd);
+  if (f == NULL) {
+    return base_->writev(fd, iov, iovcnt);
+  }
+  pthread_mutex_lock(&f->mu);
+  ssize_t n = WriteLocked(f, fd, iov, iovcnt, f->off);
+  if (n > 0) f->off = (f->append ? f->size : f->off + n);
+  pthread_mutex_unlock(&f->mu);
+  return n;
+}
+
+// Entries past the new end are dropped and the new last block is
+// checksummed again if it was cut.
+int ChecksumLayer::Ftruncate(int fd, off_t len) {
+  ChecksumFile* f = Get(fd);
+  if (f == NULL) {
+    return base_->ftruncate(fd, len);
+  }
+  pthread_mutex_lock(&f->mu);
+  int r = base_->ftruncate(fd, len);
+  if (r == 0 && f->crc_fd != -1) {
+    const size_t bs = f->block_size;
+    size_t b = len / bs;
+    size_t rest = len % bs;
+    r = base_->ftruncate(f->crc_fd, EntryOffset(b + (rest != 0 ? 1 : 0)));
+    Entry e;
+    if (r == 0 && rest != 0 && (r = ReadEntries(f, b, 1, &e)) == 0 &&
+        e.len > rest) {
+      f->scratch.resize(rest);
+      ssize_t n = base_->pread(fd, &f->scratch[0], rest, b * bs);
+      if (n == rest) {
+        e.crc = Crc32c(0, f->scratch.data(), rest);
+        e.len = rest;
+      } else {
+        e.crc = e.len = 0;
+      }
+      if (base_->pwrite(f->crc_fd, &e, sizeof(e), EntryOffset(b)) !=
+          sizeof(e)) {
+        r = -1;
+      }
+    }
+  }
+  if (r == 0) {
+    f->size = len;
+  }
+  pthread_mutex_unlock(&f->mu);
+  return r;
+}
+
+int ChecksumLayer::Close(int fd) {
+  pthread_rwlock_wrlock(&lock_);
+  ChecksumFile* f = NULL;
+  std::unordered_map<int, ChecksumFile*>::iterator it = files_.find(fd);
+  if (it != files_.end()) {
+    f = it->second;
+    files_.erase(it);
+  }
+  pthread_rwlock_unlock(&lock_);
+  int r = base_->close(fd);
+  if (f != NULL) {
+    if (f->crc_fd != -1 && base_->close(f->crc_fd) != 0) {
+      r = -1;
+    }
+    pthread_mutex_destroy(&f->mu);
+    delete f;
+  }
+  return r;
+}
+
+int ChecksumLayer::Fsync(int fd, int datasync) {
+  int r = base_->fsync(fd, datasync);
+  ChecksumFile* f = Get(fd);
+  if (r == 0 && f != NULL && f->crc_fd != -1) {
+    r = base_->fsync(f->crc_fd, datasync);
+  }
+  return r;
+}
+
+}  // namespace
+
+// The calls of a backend table have no room for a context pointer, so each
+// wrapped backend gets its own instantiation of the calls bound to a slot.
+static const int kMaxLayers = 8;
+static ChecksumLayer* layers[kMaxLayers];
+static int num_layers = 0;
+
+template <int k>
+struct LayerCalls {
+  static int Mkdir(const char* path, mode_t mode) {
+    return layers[k]->base()->mkdir(path, mode);
+  }
+  static int Open(const char* path, int flags, mode_t mode,
+                  struct stat* buf) {
+    return layers[k]->Open(path, flags, mode, buf);
+  }
+  static int Stat(const char* path, struct stat* buf) {
+    return layers[k]->base()->stat(path, buf);
+  }
+  static int Rename(const char* oldpath, const char* newpath) {
+    return layers[k]->Rename(oldpath, newpath);
+  }
+  static int Fstat(int fd, struct stat* buf) {
+    return layers[k]->base()->fstat(fd, buf);
+  }
+  static int Ftruncate(int fd, off_t len) {
+    return layers[k]->Ftruncate(fd, len);
+  }
+  static ssize_t Pread(int fd, void* buf, size_t sz, off_t off) {
+    struct iovec iov = {buf, sz};
+    return layers[k]->Preadv(fd, &iov, 1, off);
+  }
+  static ssize_t Read(int fd, void* buf, size_t sz) {
+    struct iovec iov = {buf, sz};
+    return layers[k]->Readv(fd, &iov, 1);
+  }
+  static ssize_t Pwrite(int fd, const void* buf, size_t sz, off_t off) {
+    struct iovec iov = {const_cast<void*>(buf), sz};
+    return layers[k]->Pwritev(fd, &iov, 1, off);
+  }
+  static ssize_t Write(int fd, const void* buf, size_t sz) {
+    struct iovec iov = {const_cast<void*>(buf), sz};
+    return layers[k]->Writev(fd, &iov, 1);
+  }
+  static ssize_t Preadv(int fd, const struct iovec* iov, int iovcnt,
+                        off_t off) {
+    return layers[k]->Preadv(fd, iov, iovcnt, off);
+  }
+  static ssize_t Readv(int fd, const struct iovec* iov, int iovcnt) {
+    return layers[k]->Readv(fd, iov, iovcnt);
+  }
+  static ssize_t Pwritev(int fd, const struct iovec* iov, int iovcnt,
+                         off_t off) {
+    return layers[k]->Pwritev(fd, iov, iovcnt, off);
+  }
+  static ssize_t Writev(int fd, const struct iovec* iov, int iovcnt) {
+    return layers[k]->Writev(fd, iov, iovcnt);
+  }
+  static int Close(int fd) { return layers[k]->Close(fd); }
+  static int Fsync(int fd, int datasync) {
+    return layers[k]->Fsync(fd, datasync);
+  }
+
+  static const PdlfsOps ops;
+};
+
+template <int k>
+const PdlfsOps LayerCalls<k>::ops = {
+    &Mkdir, &Open,   &Stat,   &Rename,  &Fstat,  &Ftruncate, &Pread, &Read,
+    &Pwrite, &Write, &Preadv, &Readv,   &Pwritev, &Writev,   &Close,
+    &Fsync};
+
+static const PdlfsOps* const layer_ops[kMaxLayers] = {
+    &LayerCalls<0>::ops, &LayerCalls<1>::ops, &LayerCalls<2>::ops,
+    &LayerCalls<3>::ops, &LayerCalls<4>::ops, &LayerCalls<5>::ops,
+    &LayerCalls<6>::ops, &LayerCalls<7>::ops};
+
+const PdlfsOps* ChecksumPdlfsOps(const PdlfsOps* base) {
+  if (num_layers == kMaxLayers) {
+    return NULL;
+  }
+  layers[num_layers] = new ChecksumLayer(base);
+  const PdlfsOps* ops = layer_ops[num_layers++];
+  if (base->fsync == NULL) {
+    // Keep the call optional in the stacked table as well
+    PdlfsOps* copy = new PdlfsOps(*ops);
+    copy->fsync = NULL;
+    ops = copy;
+  }
+  return ops;
+}
+
+void GetChecksumStats(ChecksumStats* result) {
+  result->bytes_checksummed =
+      __atomic_load_n(&stats.bytes_checksummed, __ATOMIC_RELAXED);
+  result->bytes_verified =
+      __atomic_load_n(&stats.bytes_verified, __ATOMIC_RELAXED);
+  result->mismatches = __atomic_load_n(&stats.mismatches, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct PdlfsOps;
+
+// Return the CRC32C (Castagnoli) of n bytes at data extending crc, which
+// is 0 for the first piece. Uses the SSE4.2 crc32 instruction if the CPU
+// has it.
+uint32_t Crc32c(uint32_t crc, const char* data, size_t n);
+
+// Return calls that keep a CRC32C for each fixed-size block of every file
+// written through them, and check the blocks covered by each read against
+// their checksums. Reads fail with EIO on a mismatch. Checksums are kept
+// in a sidecar file named .<name>.crc next to each file, stored through
+// the same backend. Sidecars are listed along with the files and are only
+// renamed with their files by renames made through the layer. A file
+// renamed or removed by other means leaves its sidecar behind, and loses
+// its checksums; the stale sidecar is ignored, and replaced when written,
+// by any other file that takes the name. Blocks written by other handles
+// of the same file at the same time may be checksummed inconsistently.
+// Called during startup. Return NULL if too many backends are wrapped.
+const PdlfsOps* ChecksumPdlfsOps(const PdlfsOps* base);
+
+// Counters of the checksum layer since startup
+struct ChecksumStats {
+  unsigned long long bytes_checksummed;
+  unsigned long long bytes_verified;
+  unsigned long long mismatches;
+};
+
+void GetChecksumStats(ChecksumStats* stats);
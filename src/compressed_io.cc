@@ -0,0 +1,407 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "compressed_io.h"
+
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+#include "mount_table.h"
+
+namespace {
+
+// Every block starts with a header and the file ends with a trailer
+// locating the seek index, an array of IndexEntry.
+struct BlockHeader {
+  uint32_t magic;
+  uint32_t raw_size;
+  uint32_t stored_size;
+  uint32_t flags;
+};
+
+struct IndexEntry {
+  uint64_t logical;
+  uint64_t physical;
+};
+
+struct Trailer {
+  uint32_t magic;
+  uint32_t unused;
+  uint64_t num_blocks;
+  uint64_t index_offset;
+  uint64_t logical_size;
+};
+
+static const uint32_t kBlockMagic = 0x425A4450U;  // "PDZB"
+static const uint32_t kTrailerMagic = 0x495A4450U;  // "PDZI"
+static const uint32_t kCompressed = 1;
+static const uint32_t kShuffled = 2;  // Element size in bits 8 to 15
+static const size_t kBlockSize = 256 << 10;
+static const int kHashBits = 14;
+static const size_t kMinMatch = 4;
+static const size_t kMaxOffset = 65535;
+
+}  // namespace
+
+static CompressionStats stats;
+
+void GetCompressionStats(CompressionStats* result) {
+  result->logical_written =
+      __atomic_load_n(&stats.logical_written, __ATOMIC_RELAXED);
+  result->physical_written =
+      __atomic_load_n(&stats.physical_written, __ATOMIC_RELAXED);
+  result->logical_read = __atomic_load_n(&stats.logical_read, __ATOMIC_RELAXED);
+  result->physical_read =
+      __atomic_load_n(&stats.physical_read, __ATOMIC_RELAXED);
+}
+
+static inline void Add(unsigned long long* ctr, unsigned long long n) {
+  __atomic_add_fetch(ctr, n, __ATOMIC_RELAXED);
+}
+
+// The codec is a byte-oriented LZ77 in the spirit of LZ4. Each sequence is
+// a token holding the literal and match lengths, the literals, and a
+// 16-bit match offset. The last sequence has literals only.
+
+static inline uint32_t Load32(const char* p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static inline uint32_t Hash(uint32_t v) {
+  return (v * 2654435761U) >> (32 - kHashBits);
+}
+
+static void PutLength(std::string* dst, size_t len) {
+  while (len >= 255) {
+    dst->push_back(static_cast<char>(255));
+    len -= 255;
+  }
+  dst->push_back(static_cast<char>(len));
+}
+
+static void PutSequence(std::string* dst, const char* lit, size_t lit_len,
+                        size_t offset, size_t match_len) {
+  size_t m = match_len != 0 ? match_len - kMinMatch : 0;
+  unsigned char token = (std::min<size_t>(lit_len, 15) << 4) |
+                        std::min<size_t>(m, 15);
+  dst->push_back(static_cast<char>(token));
+  if (lit_len >= 15) PutLength(dst, lit_len - 15);
+  dst->append(lit, lit_len);
+  if (match_len != 0) {
+    dst->push_back(static_cast<char>(offset & 0xff));
+    dst->push_back(static_cast<char>(offset >> 8));
+    if (m >= 15) PutLength(dst, m - 15);
+  }
+}
+
+// Append the compressed form of src to dst.
+static void Compress(const char* src, size_t n, uint32_t* table,
+                     std::string* dst) {
+  memset(table, 0, sizeof(uint32_t) << kHashBits);
+  size_t anchor = 0;
+  size_t i = 0;
+  const size_t limit = n > kMinMatch ? n - kMinMatch : 0;
+  while (i < limit) {
+    uint32_t v = Load32(src + i);
+    uint32_t* slot = &table[Hash(v)];
+    size_t cand = *slot;  // Position plus one, 0 if empty
+    *slot = i + 1;
+    if (cand == 0 || i - (cand - 1) > kMaxOffset ||
+        Load32(src + cand - 1) != v) {
+      i++;
+      continue;
+    }
+    size_t ref = cand - 1;
+    size_t len = kMinMatch;
+    while (i + len < n && src[ref + len] == src[i + len]) {
+      len++;
+    }
+    PutSequence(dst, src + anchor, i - anchor, i - ref, len);
+    i += len;
+    anchor = i;
+  }
+  PutSequence(dst, src + anchor, n - anchor, 0, 0);
+}
+
+static bool GetLength(const char* src, size_t n, size_t* ip, size_t* len) {
+  unsigned char b;
+  do {
+    if (*ip >= n) return false;
+    b = static_cast<unsigned char>(src[(*ip)++]);
+    *len += b;
+  } while (b == 255);
+  return true;
+}
+
+// Return false if src is not a valid encoding of raw_size bytes.
+static bool Uncompress(const char* src, size_t n, char* dst,
+                       size_t raw_size) {
+  size_t ip = 0;
+  size_t op = 0;
+  while (ip < n) {
+    unsigned char token = static_cast<unsigned char>(src[ip++]);
+    size_t lit = token >> 4;
+    if (lit == 15 && !GetLength(src, n, &ip, &lit)) return false;
+    if (lit > n - ip || lit > raw_size - op) return false;
+    memcpy(dst + op, src + ip, lit);
+    ip += lit;
+    op += lit;
+    if (ip == n) break;
+    if (n - ip < 2) return false;
+    size_t offset = static_cast<unsigned char>(src[ip]) |
+                    (static_cast<unsigned char>(src[ip + 1]) << 8);
+    ip += 2;
+    size_t len = token & 15;
+    if (len == 15 && !GetLength(src, n, &ip, &len)) return false;
+    len += kMinMatch;
+    if (offset == 0 || offset > op || len > raw_size - op) return false;
+    // Matches may overlap the bytes they produce
+    for (size_t k = 0; k < len; k++) {
+      dst[op + k] = dst[op - offset + k];
+    }
+    op += len;
+  }
+  return op == raw_size;
+}
+
+// Group byte j of every element together, for j in [0, width).
+static void Shuffle(const char* src, size_t n, int width, char* dst) {
+  size_t count = n / width;
+  for (size_t i = 0; i < count; i++) {
+    for (int j = 0; j < width; j++) {
+      dst[j * count + i] = src[i * width + j];
+    }
+  }
+  memcpy(dst + count * width, src + count * width, n - count * width);
+}
+
+static void Unshuffle(const char* src, size_t n, int width, char* dst) {
+  size_t count = n / width;
+  for (size_t i = 0; i < count; i++) {
+    for (int j = 0; j < width; j++) {
+      dst[i * width + j] = src[j * count + i];
+    }
+  }
+  memcpy(dst + count * width, src + count * width, n - count * width);
+}
+
+CompressedFile::CompressedFile(const PdlfsOps* ops, int fd, int shuffle)
+    : ops_(ops),
+      fd_(fd),
+      shuffle_(shuffle),
+      logical_size_(0),
+      physical_size_(0),
+      dirty_(false),
+      cached_(-1) {}
+
+bool CompressedFile::Load(off_t physical_size) {
+  blocks_.clear();
+  logical_size_ = 0;
+  physical_size_ = 0;
+  dirty_ = false;
+  cached_ = -1;
+  if (physical_size == 0) {
+    return true;
+  }
+  Trailer t;
+  if (physical_size >= sizeof(t) &&
+      ops_->pread(fd_, &t, sizeof(t), physical_size - sizeof(t)) ==
+          sizeof(t) &&
+      t.magic == kTrailerMagic &&
+      t.index_offset + t.num_blocks * sizeof(IndexEntry) + sizeof(t) ==
+          physical_size) {
+    std::vector<IndexEntry> index(t.num_blocks);
+    size_t bytes = t.num_blocks * sizeof(IndexEntry);
+    if (bytes == 0 ||
+        ops_->pread(fd_, &index[0], bytes, t.index_offset) == bytes) {
+      for (size_t i = 0; i < index.size(); i++) {
+        Block b;
+        b.logical = index[i].logical;
+        b.physical = index[i].physical;
+        blocks_.push_back(b);
+      }
+      logical_size_ = t.logical_size;
+      // New blocks overwrite the index, which is written again at the end
+      physical_size_ = t.index_offset;
+      return true;
+    }
+  }
+  return Scan(physical_size);
+}
+
+// Rebuild the index of a file that was not finished.
+bool CompressedFile::Scan(off_t physical_size) {
+  off_t off = 0;
+  BlockHeader h;
+  while (off + sizeof(h) <= physical_size &&
+         ops_->pread(fd_, &h, sizeof(h), off) == sizeof(h) &&
+         h.magic == kBlockMagic &&
+         off + sizeof(h) + h.stored_size <= physical_size) {
+    Block b;
+    b.logical = logical_size_;
+    b.physical = off;
+    blocks_.push_back(b);
+    logical_size_ += h.raw_size;
+    off += sizeof(h) + h.stored_size;
+  }
+  physical_size_ = off;
+  return !blocks_.empty();
+}
+
+ssize_t CompressedFile::Append(const char* data, size_t n) {
+  if (table_.empty()) {
+    table_.resize(1 << kHashBits);
+  }
+  std::string shuffled;
+  for (size_t done = 0; done < n;) {
+    size_t k = std::min(n - done, kBlockSize);
+    const char* raw = data + done;
+    BlockHeader h;
+    h.magic = kBlockMagic;
+    h.raw_size = k;
+    h.flags = kCompressed;
+    if (shuffle_ > 1) {
+      shuffled.resize(k);
+      Shuffle(raw, k, shuffle_, &shuffled[0]);
+      raw = shuffled.data();
+      h.flags |= kShuffled | (shuffle_ << 8);
+    }
+    scratch_.assign(sizeof(h), 0);
+    Compress(raw, k, &table_[0], &scratch_);
+    if (scratch_.size() - sizeof(h) >= k) {
+      // Not worth it, keep the data as is
+      scratch_.resize(sizeof(h));
+      scratch_.append(data + done, k);
+      h.flags = 0;
+    }
+    h.stored_size = scratch_.size() - sizeof(h);
+    memcpy(&scratch_[0], &h, sizeof(h));
+    ssize_t r =
+        ops_->pwrite(fd_, scratch_.data(), scratch_.size(), physical_size_);
+    if (r != scratch_.size()) {
+      return -1;
+    }
+    Block b;
+    b.logical = logical_size_;
+    b.physical = physical_size_;
+    blocks_.push_back(b);
+    logical_size_ += k;
+    physical_size_ += scratch_.size();
+    dirty_ = true;
+    Add(&stats.logical_written, k);
+    Add(&stats.physical_written, scratch_.size());
+    done += k;
+  }
+  return n;
+}
+
+int CompressedFile::LoadBlock(size_t i) {
+  if (cached_ == i) {
+    return 0;
+  }
+  BlockHeader h;
+  if (ops_->pread(fd_, &h, sizeof(h), blocks_[i].physical) != sizeof(h) ||
+      h.magic != kBlockMagic) {
+    errno = EIO;
+    return -1;
+  }
+  scratch_.resize(h.stored_size);
+  ssize_t r = ops_->pread(fd_, &scratch_[0], h.stored_size,
+                          blocks_[i].physical + sizeof(h));
+  if (r != h.stored_size) {
+    errno = EIO;
+    return -1;
+  }
+  Add(&stats.physical_read, sizeof(h) + h.stored_size);
+  cached_ = -1;
+  if (!(h.flags & kCompressed)) {
+    cache_.swap(scratch_);
+  } else {
+    std::string out(h.raw_size, 0);
+    if (!Uncompress(scratch_.data(), scratch_.size(), &out[0], h.raw_size)) {
+      errno = EIO;
+      return -1;
+    }
+    if (h.flags & kShuffled) {
+      int width = (h.flags >> 8) & 0xff;
+      if (width < 2) {
+        errno = EIO;
+        return -1;
+      }
+      cache_.resize(h.raw_size);
+      Unshuffle(out.data(), h.raw_size, width, &cache_[0]);
+    } else {
+      cache_.swap(out);
+    }
+  }
+  cached_ = i;
+  return 0;
+}
+
+ssize_t CompressedFile::Read(char* buf, size_t n, off_t off) {
+  size_t done = 0;
+  while (done < n && off + done < logical_size_) {
+    off_t pos = off + done;
+    // The last block starting at or before pos
+    size_t lo = 0;
+    size_t hi = blocks_.size();
+    while (hi - lo > 1) {
+      size_t mid = (lo + hi) / 2;
+      if (blocks_[mid].logical <= pos) {
+        lo = mid;
+      } else {
+        hi = mid;
+      }
+    }
+    if (LoadBlock(lo) != 0) {
+      return done != 0 ? done : -1;
+    }
+    size_t skip = pos - blocks_[lo].logical;
+    if (skip >= cache_.size()) break;
+    size_t k = std::min(n - done, cache_.size() - skip);
+    memcpy(buf + done, cache_.data() + skip, k);
+    done += k;
+  }
+  Add(&stats.logical_read, done);
+  return done;
+}
+
+int CompressedFile::Finish() {
+  if (!dirty_) {
+    return 0;
+  }
+  std::string index;
+  for (size_t i = 0; i < blocks_.size(); i++) {
+    IndexEntry e;
+    e.logical = blocks_[i].logical;
+    e.physical = blocks_[i].physical;
+    index.append(reinterpret_cast<const char*>(&e), sizeof(e));
+  }
+  Trailer t;
+  memset(&t, 0, sizeof(t));
+  t.magic = kTrailerMagic;
+  t.num_blocks = blocks_.size();
+  t.index_offset = physical_size_;
+  t.logical_size = logical_size_;
+  index.append(reinterpret_cast<const char*>(&t), sizeof(t));
+  if (ops_->pwrite(fd_, index.data(), index.size(), physical_size_) !=
+      index.size()) {
+    return -1;
+  }
+  // Drop what is left of an older, longer index
+  if (ops_->ftruncate(fd_, physical_size_ + index.size()) != 0) {
+    return -1;
+  }
+  Add(&stats.physical_written, index.size());
+  dirty_ = false;
+  return 0;
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+struct PdlfsOps;
+
+// Bytes moved through compressed streams since startup
+struct CompressionStats {
+  unsigned long long logical_written;
+  unsigned long long physical_written;
+  unsigned long long logical_read;
+  unsigned long long physical_read;
+};
+
+void GetCompressionStats(CompressionStats* stats);
+
+// A pdlfs file holding a stream of logical bytes as a sequence of
+// self-describing compressed blocks. A seek index of block offsets is
+// written after the last block when the file is finished, and is
+// rebuilt by scanning the blocks if it is missing. Data can only be
+// appended; reads at any logical offset are served from the index.
+// Not thread-safe: callers must serialize access to each file.
+class CompressedFile {
+ public:
+  // shuffle is the element size whose bytes are grouped together before
+  // compression, which helps with arrays of numbers, or 0 for none.
+  // It must be less than 256.
+  CompressedFile(const PdlfsOps* ops, int fd, int shuffle);
+
+  // Find the blocks in a file of physical_size bytes. Return false if the
+  // file is not empty and does not hold compressed blocks.
+  bool Load(off_t physical_size);
+
+  // Append n bytes at the logical end of the file.
+  // Return n on success, or -1 on errors.
+  ssize_t Append(const char* data, size_t n);
+
+  // Return the number of bytes read at logical offset off, or -1 on errors.
+  ssize_t Read(char* buf, size_t n, off_t off);
+
+  // Write out the seek index. Return 0 on success, or -1 on errors.
+  int Finish();
+
+  off_t size() const { return logical_size_; }
+
+ private:
+  struct Block {
+    off_t logical;
+    off_t physical;
+  };
+
+  bool Scan(off_t physical_size);
+  int LoadBlock(size_t i);
+
+  const PdlfsOps* const ops_;
+  const int fd_;
+  const int shuffle_;
+  std::vector<Block> blocks_;  // In logical order
+  off_t logical_size_;
+  off_t physical_size_;  // Where the next block goes
+  bool dirty_;  // Blocks were added since the index was written
+  size_t cached_;  // Index of the block in cache_, or -1
+  std::string cache_;  // Uncompressed data of one block
+  std::string scratch_;
+  std::vector<uint32_t> table_;  // Hash table used by the compressor
+
+  // No copying allowed
+  CompressedFile(const CompressedFile&);
+  void operator=(const CompressedFile&);
+};
@@ -31,6 +31,7 @@ struct DeltafsAPI {
   explicit DeltafsAPI() {
     LoadSym("deltafs_mkdir", &deltafs_mkdir);
     LoadSym("deltafs_open", &deltafs_open);
+    LoadSym("deltafs_stat", &deltafs_stat);
     LoadSym("deltafs_fstat", &deltafs_fstat);
     LoadSym("deltafs_ftruncate", &deltafs_ftruncate);
     LoadSym("deltafs_pread", &deltafs_pread);
@@ -42,6 +43,7 @@ struct DeltafsAPI {
 
   int (*deltafs_mkdir)(const char*, mode_t);
   int (*deltafs_open)(const char*, int, mode_t, struct stat*);
+  int (*deltafs_stat)(const char*, struct stat*);
   int (*deltafs_fstat)(int, struct stat*);
   int (*deltafs_ftruncate)(int, off_t);
   ssize_t (*deltafs_pread)(int, void*, size_t, off_t);
@@ -78,6 +80,14 @@ int deltsfs_open(const char* p, int f, mode_t m, struct stat* statbuf) {
   return deltafs_api->deltafs_open(p, f, m, statbuf);
 }
 
+int deltafs_stat(const char* p, struct stat* statbuf) {
+  if (deltafs_api == NULL) {
+    pthread_once(&once, &__init_deltafs_api);
+  }
+
+  return deltafs_api->deltafs_stat(p, statbuf);
+}
+
 int deltafs_fstat(int fd, struct stat* statbuf) {
   if (deltafs_api == NULL) {
     pthread_once(&once, &__init_deltafs_api);
@@ -18,6 +18,7 @@ extern "C" {
 
 int deltafs_mkdir(const char* __path, mode_t __mode);
 int deltafs_open(const char* __path, int __oflags, mode_t __mode, struct stat*);
+int deltafs_stat(const char* __path, struct stat*);
 int deltafs_fstat(int __fd, struct stat*);
 int deltafs_ftruncate(int __fd, off_t __length);
 ssize_t deltafs_pread(int __fd, void* __buf, size_t __sz, off_t __off);
@@ -0,0 +1,86 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "local_root.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "posix_api.h"
+#include "preload.h"
+
+bool JoinPath(const std::string& root, const char* path, char* buf) {
+  size_t n = root.size();
+  size_t m = strlen(path);
+  if (n + m >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(buf, root.data(), n);
+  memcpy(buf + n, path, m + 1);
+  return true;
+}
+
+LocalRoot::LocalRoot() {
+  const char* env = getenv("PDLFS_Root");
+  if (env == NULL) env = DEFAULT_PDLFS_ROOT;
+  std::string root = env;
+  if (root.empty()) root = DEFAULT_PDLFS_ROOT;
+  assert(root[0] == '/');
+  assert(root.size() > 1);
+  while (root.length() != 1 && root[root.size() - 1] == '/') {
+    root.resize(root.size() - 1);
+  }
+  pdlfs_root = root;
+  posix_mkdir(pdlfs_root.c_str(), kDirMode);
+}
+
+int LocalRoot::Mkdir(const char* path, mode_t mode) const {
+  char p[PATH_MAX];
+  if (!FullPath(path, p)) {
+    return -1;
+  }
+  return posix_mkdir(p, mode);
+}
+
+int LocalRoot::Open(const char* path, int oflags, mode_t mode,
+                    struct stat* buf) const {
+  char p[PATH_MAX];
+  if (!FullPath(path, p)) {
+    return -1;
+  }
+  int fd = posix_open(p, oflags, mode);
+  if (fd != -1 && posix_fstat(fd, buf) == -1) {
+    int err = errno;
+    posix_close(fd);
+    errno = err;
+    return -1;
+  }
+  return fd;
+}
+
+int LocalRoot::Stat(const char* path, struct stat* buf) const {
+  char p[PATH_MAX];
+  if (!FullPath(path, p)) {
+    return -1;
+  }
+  return posix_stat(p, buf);
+}
+
+int LocalRoot::Rename(const char* oldpath, const char* newpath) const {
+  char p[PATH_MAX];
+  char q[PATH_MAX];
+  if (!FullPath(oldpath, p) || !FullPath(newpath, q)) {
+    return -1;
+  }
+  return posix_rename(p, q);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+
+// Prepend root to path in buf, which holds PATH_MAX bytes.
+// Return false if the result does not fit.
+bool JoinPath(const std::string& root, const char* path, char* buf);
+
+// The local directory a backend keeps pdlfs files in, named by PDLFS_Root.
+// pdlfs paths map to the same paths below it. Backends that store files
+// this way share the directory handling and plain namespace operations.
+struct LocalRoot {
+  static const int kDirMode = S_IRWXU | S_IRWXG | S_IRWXO;
+  std::string pdlfs_root;  // No trailing slash
+
+  // Read PDLFS_Root and create the directory if needed.
+  LocalRoot();
+
+  // Prepend the root to path in buf, which holds PATH_MAX bytes.
+  // Return false if the result does not fit.
+  bool FullPath(const char* path, char* buf) const {
+    return JoinPath(pdlfs_root, path, buf);
+  }
+
+  // Operations on the file or directory path maps to, with the results
+  // and errors of the matching posix calls. Open also stats the file.
+  int Mkdir(const char* path, mode_t mode) const;
+  int Open(const char* path, int oflags, mode_t mode, struct stat* buf) const;
+  int Stat(const char* path, struct stat* buf) const;
+  int Rename(const char* oldpath, const char* newpath) const;
+};
@@ -0,0 +1,610 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "mapped_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <vector>
+#ifdef __NR_userfaultfd
+#include <linux/userfaultfd.h>
+#endif
+
+#include "mount_table.h"
+#include "posix_api.h"
+
+namespace {
+
+struct Options {
+  size_t chunk_size;  // Bytes read from the file per page fault
+  bool lazy;          // Read pages on first touch through userfaultfd
+
+  Options() : chunk_size(1 << 20), lazy(true) {
+    const char* env = getenv("PDLFS_MmapChunk");
+    if (env != NULL) {
+      chunk_size = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_MmapLazy");
+    if (env != NULL) {
+      lazy = atoi(env) != 0;
+    }
+    // Chunks are whole pages
+    size_t page = sysconf(_SC_PAGESIZE);
+    chunk_size = (chunk_size + page - 1) / page * page;
+    if (chunk_size == 0) {
+      chunk_size = page;
+    }
+  }
+};
+
+// A pdlfs file opened on behalf of one or more mappings. Mappings hold a
+// backend fd of their own so they outlive close() on the mapped fd.
+struct MappedFile {
+  const PdlfsOps* ops;
+  int fd;
+  off_t size;      // File size when mapped; write-back never goes past it
+  bool writeback;  // Shared and writable
+  // For shared writable mappings, what the file held at each mapped page
+  // when it was last read or written back, so that only pages that have
+  // changed since are written. Starts at file offset base.
+  char* clean;
+  size_t clean_len;
+  off_t base;
+  int refs;
+};
+
+struct Mapping {
+  uintptr_t start;
+  size_t len;
+  off_t off;  // File offset of start
+  MappedFile* file;
+  std::vector<bool> filled;  // Pages read from the file so far
+};
+
+typedef std::map<uintptr_t, Mapping*> MappingMap;  // Keyed by start
+}  // namespace
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static const Options* options = NULL;
+static size_t page_size = 0;
+static int uffd = -1;  // -1 if pages are read up front
+static MappingMap* mappings = NULL;  // Guarded by mu
+static int num_mappings = 0;
+
+static inline uintptr_t RoundUp(uintptr_t x, size_t n) {
+  return (x + n - 1) / n * n;
+}
+
+// Return where the saved contents of the page at p are kept.
+static inline char* Clean(Mapping* m, uintptr_t p) {
+  return m->file->clean + (m->off + (p - m->start) - m->file->base);
+}
+
+// Mark [a, b) as read from the file, which holds the contents at data.
+static inline void SetFilled(Mapping* m, uintptr_t a, uintptr_t b,
+                             const char* data) {
+  for (uintptr_t p = a; p < b; p += page_size) {
+    m->filled[(p - m->start) / page_size] = true;
+  }
+  if (m->file->clean != NULL) {
+    memcpy(Clean(m, a), data, b - a);
+  }
+}
+
+// Caller must hold mu.
+static Mapping* Find(uintptr_t addr) {
+  MappingMap::iterator it = mappings->upper_bound(addr);
+  if (it == mappings->begin()) {
+    return NULL;
+  }
+  --it;
+  Mapping* m = it->second;
+  return addr < m->start + m->len ? m : NULL;
+}
+
+// Caller must hold mu.
+static void Overlapping(uintptr_t a, uintptr_t b, std::vector<Mapping*>* r) {
+  MappingMap::iterator it = mappings->upper_bound(a);
+  if (it != mappings->begin()) {
+    --it;
+  }
+  for (; it != mappings->end() && it->first < b; ++it) {
+    Mapping* m = it->second;
+    if (m->start + m->len > a) {
+      r->push_back(m);
+    }
+  }
+}
+
+// Caller must hold mu.
+static void Release(MappedFile* file) {
+  if (--file->refs == 0) {
+    file->ops->close(file->fd);
+    if (file->clean != NULL) {
+      posix_munmap(file->clean, file->clean_len);
+    }
+    delete file;
+  }
+}
+
+#ifdef __NR_userfaultfd
+// Caller must hold mu.
+static void ZeroFill(uintptr_t page) {
+  struct uffdio_zeropage zero;
+  zero.range.start = page;
+  zero.range.len = page_size;
+  zero.mode = 0;
+  ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+}
+
+// Read the run of missing pages around page, up to a chunk, and install
+// them. Faults on pages no longer mapped get a zero page so the faulting
+// thread is not left hanging. mu is dropped while reading the file, so
+// the mapping is looked up again before the pages are installed.
+static void HandleFault(uintptr_t page, std::vector<char>* bounce) {
+  pthread_mutex_lock(&mu);
+  Mapping* m = Find(page);
+  if (m == NULL) {
+    ZeroFill(page);
+    pthread_mutex_unlock(&mu);
+    return;
+  }
+  const size_t chunk = options->chunk_size;
+  uintptr_t lo_limit = page - page % chunk;
+  if (lo_limit < m->start) lo_limit = m->start;
+  uintptr_t hi_limit = page - page % chunk + chunk;
+  if (hi_limit > m->start + m->len) hi_limit = m->start + m->len;
+  uintptr_t lo = page;
+  while (lo > lo_limit && !m->filled[(lo - m->start) / page_size - 1]) {
+    lo -= page_size;
+  }
+  uintptr_t hi = page + page_size;
+  while (hi < hi_limit && !m->filled[(hi - m->start) / page_size]) {
+    hi += page_size;
+  }
+
+  size_t size = hi - lo;
+  bounce->resize(size);
+  ssize_t n = 0;
+  const off_t off = m->off + (lo - m->start);
+  MappedFile* file = m->file;
+  file->refs++;
+  pthread_mutex_unlock(&mu);
+  if (off < file->size) {
+    n = file->ops->pread(file->fd, &(*bounce)[0], size, off);
+    if (n < 0) n = 0;
+  }
+  memset(&(*bounce)[0] + n, 0, size - n);
+  pthread_mutex_lock(&mu);
+
+  // The range may have been unmapped, split, or mapped over meanwhile.
+  // Only pages still mapped to the same file offsets are installed.
+  m = Find(page);
+  const bool moved =
+      m != NULL && (m->file != file ||
+                    m->off + static_cast<off_t>(page - m->start) !=
+                        off + static_cast<off_t>(page - lo));
+  Release(file);
+  if (m == NULL) {
+    ZeroFill(page);
+    pthread_mutex_unlock(&mu);
+    return;
+  } else if (moved) {
+    pthread_mutex_unlock(&mu);
+    HandleFault(page, bounce);  // Start over on the new mapping
+    return;
+  }
+  const uintptr_t first = lo;  // Address of (*bounce)[0]
+  if (lo < m->start) lo = m->start;
+  if (hi > m->start + m->len) hi = m->start + m->len;
+
+  struct uffdio_copy copy;
+  copy.dst = lo;
+  copy.src = reinterpret_cast<uintptr_t>(&(*bounce)[lo - first]);
+  copy.len = hi - lo;
+  copy.mode = 0;
+  if (ioctl(uffd, UFFDIO_COPY, &copy) == 0) {
+    SetFilled(m, lo, hi, &(*bounce)[lo - first]);
+  } else {
+    if (copy.copy > 0) {
+      SetFilled(m, lo, lo + copy.copy, &(*bounce)[lo - first]);
+    }
+    if (!m->filled[(page - m->start) / page_size]) {
+      copy.dst = page;
+      copy.src = reinterpret_cast<uintptr_t>(&(*bounce)[page - first]);
+      copy.len = page_size;
+      copy.mode = 0;
+      if (ioctl(uffd, UFFDIO_COPY, &copy) != 0 && errno == EEXIST) {
+        struct uffdio_range range;
+        range.start = page;
+        range.len = page_size;
+        ioctl(uffd, UFFDIO_WAKE, &range);
+      }
+      SetFilled(m, page, page + page_size, &(*bounce)[page - first]);
+    }
+  }
+  pthread_mutex_unlock(&mu);
+}
+
+static void* FaultThread(void* arg) {
+  std::vector<char> bounce;
+  struct uffd_msg msg;
+  while (true) {
+    ssize_t n = posix_read(uffd, &msg, sizeof(msg));
+    if (n == -1 && (errno == EINTR || errno == EAGAIN)) {
+      continue;
+    } else if (n != sizeof(msg)) {
+      break;
+    }
+    if (msg.event == UFFD_EVENT_PAGEFAULT) {
+      HandleFault(msg.arg.pagefault.address & ~(page_size - 1), &bounce);
+    }
+  }
+  return NULL;
+}
+
+static int OpenFaultHandler() {
+  int fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+  if (fd == -1) {
+    return -1;
+  }
+  struct uffdio_api api;
+  memset(&api, 0, sizeof(api));
+  api.api = UFFD_API;
+  if (ioctl(fd, UFFDIO_API, &api) != 0) {
+    posix_close(fd);
+    return -1;
+  }
+  // The handler thread should not take signals meant for the application
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t t;
+  uffd = fd;
+  int r = pthread_create(&t, NULL, &FaultThread, NULL);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    uffd = -1;
+    posix_close(fd);
+    return -1;
+  }
+  pthread_detach(t);
+  return fd;
+}
+
+static bool Register(uintptr_t start, size_t len) {
+  struct uffdio_register reg;
+  reg.range.start = start;
+  reg.range.len = len;
+  reg.mode = UFFDIO_REGISTER_MODE_MISSING;
+  return ioctl(uffd, UFFDIO_REGISTER, &reg) == 0;
+}
+#else
+static int OpenFaultHandler() { return -1; }
+static bool Register(uintptr_t start, size_t len) { return false; }
+#endif
+
+static void Init() {
+  Options* opts = new Options;
+  page_size = sysconf(_SC_PAGESIZE);
+  mappings = new MappingMap;
+  if (opts->lazy) {
+    OpenFaultHandler();
+  }
+  options = opts;
+}
+
+static inline void InitOnce() {
+  if (options == NULL) {
+    pthread_once(&once, &Init);
+  }
+}
+
+// Read the mapped part of the file up front.
+static int FillAll(Mapping* m) {
+  const size_t chunk = options->chunk_size;
+  char* base = reinterpret_cast<char*>(m->start);
+  for (size_t done = 0; done < m->len; done += chunk) {
+    if (m->off + static_cast<off_t>(done) >= m->file->size) {
+      break;
+    }
+    size_t n = m->len - done;
+    if (n > chunk) n = chunk;
+    if (m->file->ops->pread(m->file->fd, base + done, n, m->off + done) ==
+        -1) {
+      return -1;
+    }
+  }
+  SetFilled(m, m->start, m->start + m->len, base);
+  return 0;
+}
+
+// Return true if the page at p, of which len bytes are within the file,
+// differs from what the file held when it was last read or written back.
+// Pages never touched cannot have been modified.
+static inline bool IsDirty(Mapping* m, uintptr_t p, size_t len) {
+  return m->filled[(p - m->start) / page_size] &&
+         memcmp(reinterpret_cast<void*>(p), Clean(m, p), len) != 0;
+}
+
+// Write the pages of m within [a, b) that have changed since they were
+// read from the file. Caller must hold mu.
+static int WriteBack(Mapping* m, uintptr_t a, uintptr_t b) {
+  MappedFile* file = m->file;
+  if (!file->writeback) {
+    return 0;
+  }
+  if (a < m->start) a = m->start;
+  a -= (a - m->start) % page_size;
+  if (b > m->start + m->len) b = m->start + m->len;
+  if (m->off >= file->size) {
+    return 0;
+  }
+  uintptr_t eof = m->start + (file->size - m->off);
+  if (b > eof) b = eof;
+  std::vector<char> buf;
+  uintptr_t p = a;
+  while (p < b) {
+    if (!IsDirty(m, p, std::min<uintptr_t>(page_size, b - p))) {
+      p += page_size;
+      continue;
+    }
+    uintptr_t q = p + page_size;
+    while (q < b && IsDirty(m, q, std::min<uintptr_t>(page_size, b - q))) {
+      q += page_size;
+    }
+    if (q > b) q = b;
+    // Written from a copy so that changes made meanwhile are seen as
+    // dirty by the next write-back
+    buf.assign(reinterpret_cast<char*>(p), reinterpret_cast<char*>(q));
+    ssize_t n = file->ops->pwrite(file->fd, &buf[0], q - p,
+                                  m->off + (p - m->start));
+    if (n != static_cast<ssize_t>(q - p)) {
+      if (n >= 0) errno = EIO;
+      return -1;
+    }
+    memcpy(Clean(m, p), &buf[0], q - p);
+    p = q;
+  }
+  return 0;
+}
+
+// Caller must hold mu.
+static void Insert(Mapping* m) {
+  (*mappings)[m->start] = m;
+  __atomic_store_n(&num_mappings, static_cast<int>(mappings->size()),
+                   __ATOMIC_RELEASE);
+}
+
+// Caller must hold mu.
+static void Split(Mapping* m, uintptr_t a, uintptr_t b) {
+  Mapping* piece = new Mapping;
+  piece->start = a;
+  piece->len = b - a;
+  piece->off = m->off + (a - m->start);
+  piece->file = m->file;
+  piece->file->refs++;
+  std::vector<bool>::iterator first =
+      m->filled.begin() + (a - m->start) / page_size;
+  piece->filled.assign(first, first + piece->len / page_size);
+  Insert(piece);
+}
+
+// Write back and forget [a, b). Mappings that straddle the range are split.
+// Caller must hold mu.
+static int DropRange(uintptr_t a, uintptr_t b) {
+  int r = 0;
+  int err = 0;
+  std::vector<Mapping*> overlaps;
+  Overlapping(a, b, &overlaps);
+  for (size_t i = 0; i < overlaps.size(); i++) {
+    Mapping* m = overlaps[i];
+    if (WriteBack(m, a, b) != 0) {
+      err = errno;
+      r = -1;
+    }
+    mappings->erase(m->start);
+    uintptr_t end = m->start + m->len;
+    if (m->start < a) Split(m, m->start, a);
+    if (b < end) Split(m, b, end);
+    Release(m->file);
+    delete m;
+  }
+  __atomic_store_n(&num_mappings, static_cast<int>(mappings->size()),
+                   __ATOMIC_RELEASE);
+  if (r != 0) {
+    errno = err;
+  }
+  return r;
+}
+
+extern "C" {
+
+void* pdlfs_mmap(const PdlfsOps* ops, const char* path, int oflags,
+                 void* addr, size_t len, int prot, int flags, off_t off) {
+  InitOnce();
+  if (len == 0 || off < 0 || off % page_size != 0) {
+    errno = EINVAL;
+    return MAP_FAILED;
+  }
+  const int acc = oflags & O_ACCMODE;
+  const bool shared = (flags & MAP_TYPE) != MAP_PRIVATE;
+  const bool writeback = shared && (prot & PROT_WRITE) != 0;
+  if (acc == O_WRONLY || (writeback && acc != O_RDWR)) {
+    errno = EACCES;
+    return MAP_FAILED;
+  }
+  struct stat buf;
+  int fd = ops->open(path, writeback ? O_RDWR : O_RDONLY, 0, &buf);
+  if (fd == -1) {
+    return MAP_FAILED;
+  }
+
+  const size_t mlen = RoundUp(len, page_size);
+  if (flags & MAP_FIXED) {
+    pthread_mutex_lock(&mu);
+    uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+    DropRange(a, a + mlen);
+    pthread_mutex_unlock(&mu);
+  }
+  bool lazy = uffd != -1 && (flags & MAP_POPULATE) == 0;
+  int mflags =
+      MAP_PRIVATE | MAP_ANONYMOUS | (flags & (MAP_FIXED | MAP_NORESERVE));
+  void* p = posix_mmap(addr, mlen, lazy ? prot : PROT_READ | PROT_WRITE,
+                       mflags, -1, 0);
+  if (p == MAP_FAILED) {
+    int err = errno;
+    ops->close(fd);
+    errno = err;
+    return MAP_FAILED;
+  }
+
+  // Pages of the saved copy are only backed once they are filled
+  char* clean = NULL;
+  if (writeback) {
+    void* c = posix_mmap(NULL, mlen, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (c == MAP_FAILED) {
+      int err = errno;
+      posix_munmap(p, mlen);
+      ops->close(fd);
+      errno = err;
+      return MAP_FAILED;
+    }
+    clean = static_cast<char*>(c);
+  }
+
+  MappedFile* file = new MappedFile;
+  file->ops = ops;
+  file->fd = fd;
+  file->size = buf.st_size;
+  file->writeback = writeback;
+  file->clean = clean;
+  file->clean_len = mlen;
+  file->base = off;
+  file->refs = 1;
+  Mapping* m = new Mapping;
+  m->start = reinterpret_cast<uintptr_t>(p);
+  m->len = mlen;
+  m->off = off;
+  m->file = file;
+  m->filled.resize(mlen / page_size, false);
+  if (lazy && !Register(m->start, mlen)) {
+    lazy = false;
+    mprotect(p, mlen, PROT_READ | PROT_WRITE);
+  }
+  if (!lazy) {
+    if (FillAll(m) != 0) {
+      int err = errno;
+      posix_munmap(p, mlen);
+      Release(file);
+      delete m;
+      errno = err;
+      return MAP_FAILED;
+    }
+    mprotect(p, mlen, prot);
+  }
+
+  pthread_mutex_lock(&mu);
+  Insert(m);
+  pthread_mutex_unlock(&mu);
+  return p;
+}
+
+int pdlfs_ismapped(void* addr, size_t len) {
+  if (__atomic_load_n(&num_mappings, __ATOMIC_ACQUIRE) == 0) {
+    return 0;
+  }
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  std::vector<Mapping*> overlaps;
+  pthread_mutex_lock(&mu);
+  Overlapping(a, a + len, &overlaps);
+  pthread_mutex_unlock(&mu);
+  return !overlaps.empty();
+}
+
+int pdlfs_munmap(void* addr, size_t len) {
+  InitOnce();
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  if (a % page_size != 0 || len == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  pthread_mutex_lock(&mu);
+  int r = DropRange(a, a + RoundUp(len, page_size));
+  int err = errno;
+  pthread_mutex_unlock(&mu);
+  if (posix_munmap(addr, len) != 0) {
+    return -1;
+  }
+  if (r != 0) {
+    errno = err;
+  }
+  return r;
+}
+
+int pdlfs_mapfixed(void* addr, size_t len) {
+  InitOnce();
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  pthread_mutex_lock(&mu);
+  int r = DropRange(a, a + RoundUp(len, page_size));
+  pthread_mutex_unlock(&mu);
+  return r;
+}
+
+int pdlfs_msyncall() {
+  if (__atomic_load_n(&num_mappings, __ATOMIC_ACQUIRE) == 0) {
+    return 0;
+  }
+  int r = 0;
+  pthread_mutex_lock(&mu);
+  for (MappingMap::iterator it = mappings->begin(); it != mappings->end();
+       ++it) {
+    Mapping* m = it->second;
+    if (WriteBack(m, m->start, m->start + m->len) != 0) {
+      r = -1;
+    }
+  }
+  pthread_mutex_unlock(&mu);
+  return r;
+}
+
+int pdlfs_msync(void* addr, size_t len, int flags) {
+  InitOnce();
+  uintptr_t a = reinterpret_cast<uintptr_t>(addr);
+  if (a % page_size != 0 || (flags & MS_SYNC && flags & MS_ASYNC)) {
+    errno = EINVAL;
+    return -1;
+  }
+  uintptr_t b = a + RoundUp(len, page_size);
+  int r = 0;
+  std::vector<Mapping*> overlaps;
+  pthread_mutex_lock(&mu);
+  Overlapping(a, b, &overlaps);
+  for (size_t i = 0; i < overlaps.size() && r == 0; i++) {
+    r = WriteBack(overlaps[i], a, b);
+  }
+  pthread_mutex_unlock(&mu);
+  return r;
+}
+
+}  // extern C
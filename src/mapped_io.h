@@ -0,0 +1,47 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <sys/types.h>
+
+struct PdlfsOps;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Memory mappings of pdlfs files are backed by anonymous memory. Pages are
+ * read from the file on first touch when userfaultfd is available, or up
+ * front otherwise. Shared writable mappings are written back on msync and
+ * munmap, and at exit for mappings still open. Only pages that changed
+ * since they were read are written, so reading a mapping never overwrites
+ * the file. Mappings are private to the process even if MAP_SHARED, and a
+ * child created by fork() sees zeros for pages its parent never touched.
+ */
+
+/* Same contract as mmap(2). path and oflags describe the open file, which
+   lives on the backend behind ops. */
+void* pdlfs_mmap(const struct PdlfsOps* __ops, const char* __path,
+                 int __oflags, void* __addr, size_t __len, int __prot,
+                 int __flags, off_t __off);
+/* Return non-zero if [addr, addr + len) overlaps a pdlfs mapping. */
+int pdlfs_ismapped(void* __addr, size_t __len);
+int pdlfs_munmap(void* __addr, size_t __len);
+int pdlfs_msync(void* __addr, size_t __len, int __flags);
+/* Write back and forget the pdlfs mappings within [addr, addr + len),
+   which a MAP_FIXED mapping of any kind is about to replace. */
+int pdlfs_mapfixed(void* __addr, size_t __len);
+/* Write back every mapping still open. */
+int pdlfs_msyncall(void);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,109 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "mount_table.h"
+
+#include <dlfcn.h>
+
+template <typename T>
+static bool LoadSym(void* handle, const char* name, T* result) {
+  *result = reinterpret_cast<T>(dlsym(handle, name));
+  return *result != NULL;
+}
+
+bool LoadPdlfsOps(void* handle, PdlfsOps* ops) {
+  return LoadSym(handle, "pdlfs_mkdir", &ops->mkdir) &&
+         LoadSym(handle, "pdlfs_open", &ops->open) &&
+         LoadSym(handle, "pdlfs_stat", &ops->stat) &&
+         LoadSym(handle, "pdlfs_rename", &ops->rename) &&
+         LoadSym(handle, "pdlfs_fstat", &ops->fstat) &&
+         LoadSym(handle, "pdlfs_ftruncate", &ops->ftruncate) &&
+         LoadSym(handle, "pdlfs_pread", &ops->pread) &&
+         LoadSym(handle, "pdlfs_read", &ops->read) &&
+         LoadSym(handle, "pdlfs_pwrite", &ops->pwrite) &&
+         LoadSym(handle, "pdlfs_write", &ops->write) &&
+         LoadSym(handle, "pdlfs_preadv", &ops->preadv) &&
+         LoadSym(handle, "pdlfs_readv", &ops->readv) &&
+         LoadSym(handle, "pdlfs_pwritev", &ops->pwritev) &&
+         LoadSym(handle, "pdlfs_writev", &ops->writev) &&
+         LoadSym(handle, "pdlfs_close", &ops->close) &&
+         (LoadSym(handle, "pdlfs_fsync", &ops->fsync) || true);
+}
+
+struct MountTable::Node {
+  Node() : mount(NULL) {}
+  ~Node() {
+    for (size_t i = 0; i < kids.size(); i++) {
+      delete kids[i].second;
+    }
+  }
+
+  // Fan-out is small so children are scanned linearly
+  Node* Child(char c) const {
+    for (size_t i = 0; i < kids.size(); i++) {
+      if (kids[i].first == c) return kids[i].second;
+    }
+    return NULL;
+  }
+
+  const Mount* mount;  // Mounted at the path spelled out to this node
+  std::vector<std::pair<char, Node*> > kids;
+};
+
+MountTable::MountTable() : root_(new Node) {}
+
+MountTable::~MountTable() {
+  delete root_;
+  for (size_t i = 0; i < mounts_.size(); i++) {
+    delete mounts_[i];
+  }
+}
+
+bool MountTable::Add(const std::string& prefix, size_t strip,
+                     const PdlfsOps* ops) {
+  Node* n = root_;
+  for (size_t i = 0; i < prefix.size(); i++) {
+    Node* child = n->Child(prefix[i]);
+    if (child == NULL) {
+      child = new Node;
+      n->kids.push_back(std::make_pair(prefix[i], child));
+    }
+    n = child;
+  }
+  if (n->mount != NULL) {
+    return false;
+  }
+  Mount* m = new Mount;
+  m->prefix = prefix;
+  m->strip = strip;
+  m->ops = ops;
+  mounts_.push_back(m);
+  n->mount = m;
+  return true;
+}
+
+const Mount* MountTable::Lookup(const char* path, const char** rest) const {
+  const Mount* best = NULL;
+  const Node* n = root_;
+  const char* p = path;
+  while (true) {
+    if (n->mount != NULL && (*p == '/' || *p == 0)) {
+      best = n->mount;
+    }
+    if (*p == 0) break;
+    n = n->Child(*p);
+    if (n == NULL) break;
+    p++;
+  }
+  if (best != NULL) {
+    const char* r = path + best->strip;
+    *rest = (r[0] == 0) ? "/" : r;
+  }
+  return best;
+}
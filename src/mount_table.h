@@ -0,0 +1,76 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <string>
+#include <vector>
+
+// The calls exported by a backend library. See pdlfs-preload/pdlfs_api.h.
+struct PdlfsOps {
+  int (*mkdir)(const char*, mode_t);
+  int (*open)(const char*, int, mode_t, struct stat*);
+  int (*stat)(const char*, struct stat*);
+  int (*rename)(const char*, const char*);
+  int (*fstat)(int, struct stat*);
+  int (*ftruncate)(int, off_t);
+  ssize_t (*pread)(int, void*, size_t, off_t);
+  ssize_t (*read)(int, void*, size_t);
+  ssize_t (*pwrite)(int, const void*, size_t, off_t);
+  ssize_t (*write)(int, const void*, size_t);
+  ssize_t (*preadv)(int, const struct iovec*, int, off_t);
+  ssize_t (*readv)(int, const struct iovec*, int);
+  ssize_t (*pwritev)(int, const struct iovec*, int, off_t);
+  ssize_t (*writev)(int, const struct iovec*, int);
+  int (*close)(int);
+  int (*fsync)(int, int);  // Optional, NULL if the backend has none
+};
+
+// Look up every call in a dlopen() handle, or RTLD_DEFAULT for a backend
+// loaded with LD_PRELOAD. Return false if any required call is missing.
+bool LoadPdlfsOps(void* handle, PdlfsOps* ops);
+
+struct Mount {
+  std::string prefix;  // Absolute, without a trailing slash
+  size_t strip;  // Bytes removed from the front of paths given to the backend
+  const PdlfsOps* ops;
+};
+
+// Mount points matched by the longest prefix that ends at a path component
+// boundary. A lookup walks a byte trie once, so it takes time linear in the
+// length of the path regardless of the number of mounts. Mounts are added
+// during startup; lookups are then safe from any thread.
+class MountTable {
+ public:
+  MountTable();
+  ~MountTable();
+
+  // Return false if prefix is already mounted.
+  bool Add(const std::string& prefix, size_t strip, const PdlfsOps* ops);
+
+  // Return the mount path lies under, or NULL if none. *rest is set to the
+  // part of path to give the backend, which is "/" for the mount point.
+  const Mount* Lookup(const char* path, const char** rest) const;
+
+  size_t size() const { return mounts_.size(); }
+  const Mount* mount(size_t i) const { return mounts_[i]; }
+
+ private:
+  struct Node;
+
+  Node* root_;
+  std::vector<Mount*> mounts_;
+
+  // No copying allowed
+  MountTable(const MountTable&);
+  void operator=(const MountTable&);
+};
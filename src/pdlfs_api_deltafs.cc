@@ -7,9 +7,62 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <errno.h>
+
 #include "pdlfs-preload/pdlfs_api.h"
 #include "deltafs_api.h"
 
+// Deltafs has no vectored I/O, so each segment is transferred in turn.
+// Stops at the first short transfer. Returns the number of bytes
+// transferred, or -1 if nothing was transferred due to an error.
+template <typename Op>
+static ssize_t IterateIov(const struct iovec* iov, int iovcnt, Op op) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = op(iov[i].iov_base, iov[i].iov_len, total);
+    if (n == -1) {
+      return total == 0 ? -1 : total;
+    }
+    total += n;
+    if (static_cast<size_t>(n) < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
+namespace {
+struct PreadOp {
+  int fd;
+  off_t off;
+  ssize_t operator()(void* buf, size_t sz, ssize_t done) const {
+    return deltafs_pread(fd, buf, sz, off + done);
+  }
+};
+
+struct ReadOp {
+  int fd;
+  ssize_t operator()(void* buf, size_t sz, ssize_t /* done */) const {
+    return deltafs_read(fd, buf, sz);
+  }
+};
+
+struct PwriteOp {
+  int fd;
+  off_t off;
+  ssize_t operator()(void* buf, size_t sz, ssize_t done) const {
+    return deltafs_pwrite(fd, buf, sz, off + done);
+  }
+};
+
+struct WriteOp {
+  int fd;
+  ssize_t operator()(void* buf, size_t sz, ssize_t /* done */) const {
+    return deltafs_write(fd, buf, sz);
+  }
+};
+}  // namespace
+
 extern "C" {
 
 int pdlfs_mkdir(const char* p, mode_t m) { return deltafs_mkdir(p, m); }
@@ -18,10 +71,21 @@ int pdlfs_open(const char* p, int f, mode_t m, struct stat* statbuf) {
   return deltafs_open(p, f, m, statbuf);
 }
 
+int pdlfs_stat(const char* p, struct stat* statbuf) {
+  return deltafs_stat(p, statbuf);
+}
+
+int pdlfs_rename(const char* oldpath, const char* newpath) {
+  errno = ENOSYS;
+  return -1;
+}
+
 int pdlfs_fstat(int fd, struct stat* statbuf) {
   return deltafs_fstat(fd, statbuf);
 }
 
+int pdlfs_ftruncate(int fd, off_t len) { return deltafs_ftruncate(fd, len); }
+
 ssize_t pdlfs_pread(int fd, void* buf, size_t sz, off_t off) {
   return deltafs_pread(fd, buf, sz, off);
 }
@@ -38,6 +102,27 @@ ssize_t pdlfs_write(int fd, const void* buf, size_t sz) {
   return deltafs_write(fd, buf, sz);
 }
 
+ssize_t pdlfs_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  PreadOp op = {fd, off};
+  return IterateIov(iov, iovcnt, op);
+}
+
+ssize_t pdlfs_readv(int fd, const struct iovec* iov, int iovcnt) {
+  ReadOp op = {fd};
+  return IterateIov(iov, iovcnt, op);
+}
+
+ssize_t pdlfs_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  PwriteOp op = {fd, off};
+  return IterateIov(iov, iovcnt, op);
+}
+
+ssize_t pdlfs_writev(int fd, const struct iovec* iov, int iovcnt) {
+  WriteOp op = {fd};
+  return IterateIov(iov, iovcnt, op);
+}
+
 int pdlfs_close(int fd) { return deltafs_close(fd); }
 
 }  // extern C
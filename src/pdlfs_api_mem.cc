@@ -0,0 +1,796 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+// Keeps every file in process memory. The namespace is a hash table split
+// into shards with a lock each, so lookups from different threads rarely
+// contend. File data lives in fixed-size chunks allocated on first write,
+// so sparse files and appends never copy existing data. Nothing persists
+// unless PDLFS_MemDump names a directory to copy the files into at exit.
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "pdlfs-preload/pdlfs_api.h"
+#include "posix_api.h"
+#include "preload.h"
+
+namespace {
+
+struct Inode {
+  ino_t ino;
+  mode_t mode;
+  off_t size;  // Guarded by rwlock
+  std::vector<char*> chunks;  // NULL chunks read as zeros, guarded by rwlock
+  struct timespec mtime;  // Guarded by rwlock
+  struct timespec ctime;  // Guarded by rwlock
+  pthread_rwlock_t rwlock;
+  int refs;  // One for the name plus one per open file, updated atomically
+
+  ~Inode() {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      free(chunks[i]);
+    }
+    pthread_rwlock_destroy(&rwlock);
+  }
+};
+
+struct OpenFile {
+  Inode* inode;
+  int flags;
+  off_t off;  // Guarded by mu
+  pthread_mutex_t mu;
+  int refs;  // One for the fd plus one per call using it, updated atomically
+};
+
+typedef std::unordered_map<std::string, Inode*> Names;
+
+struct Shard {
+  pthread_mutex_t mu;
+  Names names;
+};
+
+struct Context {
+  static const int kShards = 64;
+  Shard shards[kShards];
+  size_t chunk_size;
+  std::string dump_dir;  // Empty if nothing is dumped at exit
+  ino_t next_ino;  // Updated atomically
+
+  pthread_mutex_t fd_mu;
+  std::vector<OpenFile*> files;  // Indexed by fd, guarded by fd_mu
+  std::vector<int> free_fds;  // Guarded by fd_mu
+
+  explicit Context() : chunk_size(64 << 10), next_ino(1) {
+    for (int i = 0; i < kShards; i++) {
+      pthread_mutex_init(&shards[i].mu, NULL);
+    }
+    pthread_mutex_init(&fd_mu, NULL);
+    const char* env = getenv("PDLFS_MemChunk");
+    if (env != NULL && strtoull(env, NULL, 10) > 0) {
+      chunk_size = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_MemDump");
+    if (env != NULL) {
+      dump_dir = env;
+    }
+    Insert("/", NewInode(S_IFDIR | 0777));
+  }
+
+  Shard* ShardFor(const std::string& path) {
+    return &shards[std::hash<std::string>()(path) % kShards];
+  }
+
+  Inode* NewInode(mode_t mode) {
+    Inode* inode = new Inode;
+    inode->ino = __atomic_fetch_add(&next_ino, 1, __ATOMIC_RELAXED);
+    inode->mode = mode;
+    inode->size = 0;
+    clock_gettime(CLOCK_REALTIME, &inode->mtime);
+    inode->ctime = inode->mtime;
+    pthread_rwlock_init(&inode->rwlock, NULL);
+    inode->refs = 1;
+    return inode;
+  }
+
+  void Insert(const std::string& path, Inode* inode) {
+    Shard* s = ShardFor(path);
+    pthread_mutex_lock(&s->mu);
+    s->names[path] = inode;
+    pthread_mutex_unlock(&s->mu);
+  }
+
+  // Return the inode named by path with a reference held, or NULL.
+  Inode* Lookup(const std::string& path) {
+    Shard* s = ShardFor(path);
+    pthread_mutex_lock(&s->mu);
+    Names::iterator it = s->names.find(path);
+    Inode* inode = NULL;
+    if (it != s->names.end()) {
+      inode = it->second;
+      __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->mu);
+    return inode;
+  }
+
+  // Fail with ENOENT or ENOTDIR unless the parent of path is a directory.
+  bool ParentIsDir(const std::string& path) {
+    size_t slash = path.rfind('/');
+    Inode* parent = Lookup(slash == 0 ? "/" : path.substr(0, slash));
+    if (parent == NULL) {
+      errno = ENOENT;
+      return false;
+    }
+    bool ok = S_ISDIR(parent->mode);
+    Unref(parent);
+    if (!ok) errno = ENOTDIR;
+    return ok;
+  }
+
+  static void Unref(Inode* inode) {
+    if (__atomic_sub_fetch(&inode->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      delete inode;
+    }
+  }
+
+  int NewFd(Inode* inode, int flags) {
+    OpenFile* file = new OpenFile;
+    file->inode = inode;
+    file->flags = flags;
+    file->off = 0;
+    pthread_mutex_init(&file->mu, NULL);
+    file->refs = 1;
+    pthread_mutex_lock(&fd_mu);
+    int fd;
+    if (!free_fds.empty()) {
+      fd = free_fds.back();
+      free_fds.pop_back();
+      files[fd] = file;
+    } else {
+      fd = files.size();
+      files.push_back(file);
+    }
+    pthread_mutex_unlock(&fd_mu);
+    return fd;
+  }
+
+  // Return the file open as fd with a reference held, or NULL. The
+  // reference keeps the file alive across a concurrent close.
+  OpenFile* GetFile(int fd) {
+    OpenFile* file = NULL;
+    pthread_mutex_lock(&fd_mu);
+    if (fd >= 0 && static_cast<size_t>(fd) < files.size()) {
+      file = files[fd];
+    }
+    if (file != NULL) {
+      __atomic_add_fetch(&file->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&fd_mu);
+    if (file == NULL) errno = EBADF;
+    return file;
+  }
+
+  static void Release(OpenFile* file) {
+    if (__atomic_sub_fetch(&file->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+      Unref(file->inode);
+      pthread_mutex_destroy(&file->mu);
+      delete file;
+    }
+  }
+
+  // Return the file open as fd with the reference of the fd, or NULL.
+  OpenFile* RemoveFd(int fd) {
+    OpenFile* file = NULL;
+    pthread_mutex_lock(&fd_mu);
+    if (fd >= 0 && static_cast<size_t>(fd) < files.size() &&
+        files[fd] != NULL) {
+      file = files[fd];
+      files[fd] = NULL;
+      free_fds.push_back(fd);
+    }
+    pthread_mutex_unlock(&fd_mu);
+    if (file == NULL) errno = EBADF;
+    return file;
+  }
+
+  void Dump();
+};
+}  // namespace
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static Context* api_ctx = NULL;
+
+// Run as a destructor, after the atexit handler of the preload library has
+// written out streams that are still open.
+__attribute__((destructor)) static void DumpAtExit() {
+  if (api_ctx != NULL && !api_ctx->dump_dir.empty()) api_ctx->Dump();
+}
+
+static void InitContext() {
+  Context* ctx = new Context;
+  api_ctx = ctx;
+}
+
+// Collapse repeated slashes and drop a trailing slash.
+static bool Normalize(const char* path, std::string* result) {
+  size_t n = strlen(path);
+  if (n >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  result->clear();
+  result->reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    if (path[i] != '/' || i == 0 || path[i - 1] != '/') {
+      result->push_back(path[i]);
+    }
+  }
+  if (result->size() > 1 && (*result)[result->size() - 1] == '/') {
+    result->resize(result->size() - 1);
+  }
+  return true;
+}
+
+static void Stat(Inode* inode, struct stat* buf) {
+  memset(buf, 0, sizeof(struct stat));
+  pthread_rwlock_rdlock(&inode->rwlock);
+  buf->st_ino = inode->ino;
+  buf->st_mode = inode->mode;
+  buf->st_nlink = S_ISDIR(inode->mode) ? 2 : 1;
+  buf->st_uid = getuid();
+  buf->st_gid = getgid();
+  buf->st_size = inode->size;
+  buf->st_blksize = api_ctx->chunk_size;
+  size_t used = 0;
+  for (size_t i = 0; i < inode->chunks.size(); i++) {
+    if (inode->chunks[i] != NULL) used++;
+  }
+  buf->st_blocks = used * api_ctx->chunk_size / 512;
+  buf->st_atim = inode->mtime;
+  buf->st_mtim = inode->mtime;
+  buf->st_ctim = inode->ctime;
+  pthread_rwlock_unlock(&inode->rwlock);
+}
+
+// Caller holds a read lock on the inode.
+static size_t ReadLocked(Inode* inode, char* dst, size_t sz, off_t off) {
+  if (off >= inode->size) return 0;
+  sz = std::min<off_t>(sz, inode->size - off);
+  const size_t chunk_size = api_ctx->chunk_size;
+  size_t done = 0;
+  while (done < sz) {
+    size_t idx = (off + done) / chunk_size;
+    size_t pos = (off + done) % chunk_size;
+    size_t n = std::min(sz - done, chunk_size - pos);
+    if (idx < inode->chunks.size() && inode->chunks[idx] != NULL) {
+      memcpy(dst + done, inode->chunks[idx] + pos, n);
+    } else {
+      memset(dst + done, 0, n);
+    }
+    done += n;
+  }
+  return sz;
+}
+
+// Caller holds a write lock on the inode.
+static ssize_t WriteLocked(Inode* inode, const char* src, size_t sz,
+                           off_t off) {
+  const size_t chunk_size = api_ctx->chunk_size;
+  size_t last = (off + sz + chunk_size - 1) / chunk_size;
+  if (inode->chunks.size() < last) {
+    inode->chunks.resize(last, NULL);
+  }
+  size_t done = 0;
+  while (done < sz) {
+    size_t idx = (off + done) / chunk_size;
+    size_t pos = (off + done) % chunk_size;
+    size_t n = std::min(sz - done, chunk_size - pos);
+    char*& chunk = inode->chunks[idx];
+    if (chunk == NULL) {
+      chunk = static_cast<char*>(calloc(1, chunk_size));
+      if (chunk == NULL) {
+        break;
+      }
+    }
+    memcpy(chunk + pos, src + done, n);
+    done += n;
+  }
+  if (done == 0 && sz != 0) {
+    errno = ENOSPC;
+    return -1;
+  }
+  if (off + static_cast<off_t>(done) > inode->size) {
+    inode->size = off + done;
+  }
+  clock_gettime(CLOCK_REALTIME, &inode->mtime);
+  inode->ctime = inode->mtime;
+  return done;
+}
+
+// Caller holds a write lock on the inode.
+static void TruncateLocked(Inode* inode, off_t length) {
+  const size_t chunk_size = api_ctx->chunk_size;
+  if (length < inode->size) {
+    size_t keep = (length + chunk_size - 1) / chunk_size;
+    for (size_t i = keep; i < inode->chunks.size(); i++) {
+      free(inode->chunks[i]);
+    }
+    if (inode->chunks.size() > keep) {
+      inode->chunks.resize(keep);
+    }
+    // Bytes past the end must read as zeros if the file grows again
+    size_t pos = length % chunk_size;
+    if (pos != 0 && keep != 0 && inode->chunks[keep - 1] != NULL) {
+      memset(inode->chunks[keep - 1] + pos, 0, chunk_size - pos);
+    }
+  }
+  inode->size = length;
+  clock_gettime(CLOCK_REALTIME, &inode->mtime);
+  inode->ctime = inode->mtime;
+}
+
+static ssize_t ReadFile(OpenFile* file, const struct iovec* iov, int iovcnt,
+                        off_t off) {
+  if ((file->flags & O_ACCMODE) == O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  Inode* inode = file->inode;
+  if (S_ISDIR(inode->mode)) {
+    errno = EISDIR;
+    return -1;
+  }
+  ssize_t total = 0;
+  pthread_rwlock_rdlock(&inode->rwlock);
+  for (int i = 0; i < iovcnt; i++) {
+    size_t n = ReadLocked(inode, static_cast<char*>(iov[i].iov_base),
+                          iov[i].iov_len, off + total);
+    total += n;
+    if (n < iov[i].iov_len) break;
+  }
+  pthread_rwlock_unlock(&inode->rwlock);
+  return total;
+}
+
+// Write at off, or at the end of the file if off is -1. The offset
+// written at is returned in *pos.
+static ssize_t WriteFile(OpenFile* file, const struct iovec* iov, int iovcnt,
+                         off_t off, off_t* pos) {
+  if ((file->flags & O_ACCMODE) == O_RDONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  Inode* inode = file->inode;
+  ssize_t total = 0;
+  pthread_rwlock_wrlock(&inode->rwlock);
+  if (off == -1) off = inode->size;
+  *pos = off;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = WriteLocked(inode, static_cast<const char*>(iov[i].iov_base),
+                            iov[i].iov_len, off + total);
+    if (n == -1) {
+      if (total == 0) total = -1;
+      break;
+    }
+    total += n;
+    if (static_cast<size_t>(n) < iov[i].iov_len) break;
+  }
+  pthread_rwlock_unlock(&inode->rwlock);
+  return total;
+}
+
+// Read or write at the file offset and advance it.
+static ssize_t SequentialIO(int fd, const struct iovec* iov, int iovcnt,
+                            bool write) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) return -1;
+  ssize_t n;
+  pthread_mutex_lock(&file->mu);
+  if (!write) {
+    n = ReadFile(file, iov, iovcnt, file->off);
+  } else {
+    off_t pos;
+    off_t off = (file->flags & O_APPEND) ? -1 : file->off;
+    n = WriteFile(file, iov, iovcnt, off, &pos);
+    file->off = pos;
+  }
+  if (n > 0) file->off += n;
+  pthread_mutex_unlock(&file->mu);
+  Context::Release(file);
+  return n;
+}
+
+void Context::Dump() {
+  std::vector<std::pair<std::string, Inode*> > all;
+  for (int i = 0; i < kShards; i++) {
+    pthread_mutex_lock(&shards[i].mu);
+    for (Names::iterator it = shards[i].names.begin();
+         it != shards[i].names.end(); ++it) {
+      __atomic_add_fetch(&it->second->refs, 1, __ATOMIC_RELAXED);
+      all.push_back(*it);
+    }
+    pthread_mutex_unlock(&shards[i].mu);
+  }
+  // Parents sort before their children
+  std::sort(all.begin(), all.end());
+  posix_mkdir(dump_dir.c_str(), 0777);
+  std::vector<char> buf(chunk_size);
+  for (size_t i = 0; i < all.size(); i++) {
+    Inode* inode = all[i].second;
+    std::string path = dump_dir + all[i].first;
+    if (S_ISDIR(inode->mode)) {
+      posix_mkdir(path.c_str(), inode->mode & 07777);
+    } else {
+      int fd = posix_open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC,
+                          inode->mode & 07777);
+      if (fd != -1) {
+        pthread_rwlock_rdlock(&inode->rwlock);
+        for (off_t off = 0; off < inode->size; off += chunk_size) {
+          size_t n = ReadLocked(inode, &buf[0], chunk_size, off);
+          if (posix_pwrite(fd, &buf[0], n, off) != ssize_t(n)) break;
+        }
+        pthread_rwlock_unlock(&inode->rwlock);
+        posix_close(fd);
+      }
+    }
+    Unref(inode);
+  }
+}
+
+extern "C" {
+
+int pdlfs_mkdir(const char* path, mode_t mode) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  std::string p;
+  if (!Normalize(path, &p) || !api_ctx->ParentIsDir(p)) {
+    return -1;
+  }
+
+  Shard* s = api_ctx->ShardFor(p);
+  pthread_mutex_lock(&s->mu);
+  Inode*& inode = s->names[p];
+  bool exists = inode != NULL;
+  if (!exists) {
+    inode = api_ctx->NewInode(S_IFDIR | (mode & 07777));
+  }
+  pthread_mutex_unlock(&s->mu);
+  if (exists) {
+    errno = EEXIST;
+    return -1;
+  }
+
+  return 0;
+}
+
+int pdlfs_open(const char* path, int oflags, mode_t mode, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  std::string p;
+  if (!Normalize(path, &p)) {
+    return -1;
+  }
+
+  Inode* inode = NULL;
+  if (oflags & O_CREAT) {
+    if (!api_ctx->ParentIsDir(p)) {
+      return -1;
+    }
+    Shard* s = api_ctx->ShardFor(p);
+    pthread_mutex_lock(&s->mu);
+    Inode*& slot = s->names[p];
+    bool exists = slot != NULL;
+    if (!exists) {
+      slot = api_ctx->NewInode(S_IFREG | (mode & 07777));
+    }
+    if (!exists || !(oflags & O_EXCL)) {
+      inode = slot;
+      __atomic_add_fetch(&inode->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&s->mu);
+    if (inode == NULL) {
+      errno = EEXIST;
+      return -1;
+    }
+  } else {
+    inode = api_ctx->Lookup(p);
+    if (inode == NULL) {
+      errno = ENOENT;
+      return -1;
+    }
+  }
+
+  if (S_ISDIR(inode->mode) && (oflags & O_ACCMODE) != O_RDONLY) {
+    Context::Unref(inode);
+    errno = EISDIR;
+    return -1;
+  } else if (!S_ISDIR(inode->mode) && (oflags & O_DIRECTORY)) {
+    Context::Unref(inode);
+    errno = ENOTDIR;
+    return -1;
+  }
+  if ((oflags & O_TRUNC) && (oflags & O_ACCMODE) != O_RDONLY) {
+    pthread_rwlock_wrlock(&inode->rwlock);
+    TruncateLocked(inode, 0);
+    pthread_rwlock_unlock(&inode->rwlock);
+  }
+
+  Stat(inode, buf);
+  return api_ctx->NewFd(inode, oflags);
+}
+
+ssize_t pdlfs_pread(int fd, void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sz;
+  return pdlfs_preadv(fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_read(int fd, void* buf, size_t sz) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sz;
+  return pdlfs_readv(fd, &iov, 1);
+}
+
+ssize_t pdlfs_pwrite(int fd, const void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(buf);
+  iov.iov_len = sz;
+  return pdlfs_pwritev(fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_write(int fd, const void* buf, size_t sz) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(buf);
+  iov.iov_len = sz;
+  return pdlfs_writev(fd, &iov, 1);
+}
+
+ssize_t pdlfs_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  ssize_t n;
+  if (off < 0) {
+    errno = EINVAL;
+    n = -1;
+  } else {
+    n = ReadFile(file, iov, iovcnt, off);
+  }
+  Context::Release(file);
+  return n;
+}
+
+ssize_t pdlfs_readv(int fd, const struct iovec* iov, int iovcnt) {
+  return SequentialIO(fd, iov, iovcnt, false);
+}
+
+ssize_t pdlfs_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  ssize_t n;
+  if (off < 0) {
+    errno = EINVAL;
+    n = -1;
+  } else {
+    off_t pos;
+    n = WriteFile(file, iov, iovcnt, off, &pos);
+  }
+  Context::Release(file);
+  return n;
+}
+
+ssize_t pdlfs_writev(int fd, const struct iovec* iov, int iovcnt) {
+  return SequentialIO(fd, iov, iovcnt, true);
+}
+
+int pdlfs_stat(const char* path, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  std::string p;
+  if (!Normalize(path, &p)) {
+    return -1;
+  }
+
+  Inode* inode = api_ctx->Lookup(p);
+  if (inode == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+
+  Stat(inode, buf);
+  Context::Unref(inode);
+  return 0;
+}
+
+int pdlfs_rename(const char* oldpath, const char* newpath) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(oldpath != NULL && newpath != NULL);
+  assert(oldpath[0] == '/' && newpath[0] == '/');
+
+  std::string p;
+  std::string q;
+  if (!Normalize(oldpath, &p) || !Normalize(newpath, &q) ||
+      !api_ctx->ParentIsDir(q)) {
+    return -1;
+  }
+  if (p == q) {
+    return 0;
+  } else if (q.compare(0, p.size() + 1, p + "/") == 0) {
+    errno = EINVAL;  // Cannot move a directory below itself
+    return -1;
+  }
+
+  // Lock every shard a directory's children may live in, otherwise just
+  // the two involved, always in shard order
+  Context* ctx = api_ctx;
+  Inode* src = ctx->Lookup(p);
+  if (src == NULL) {
+    errno = ENOENT;
+    return -1;
+  }
+  const bool is_dir = S_ISDIR(src->mode);
+  Context::Unref(src);
+  std::vector<Shard*> locked;
+  if (is_dir) {
+    for (int i = 0; i < Context::kShards; i++) {
+      locked.push_back(&ctx->shards[i]);
+    }
+  } else {
+    locked.push_back(ctx->ShardFor(p));
+    locked.push_back(ctx->ShardFor(q));
+    std::sort(locked.begin(), locked.end());
+    locked.erase(std::unique(locked.begin(), locked.end()), locked.end());
+  }
+  for (size_t i = 0; i < locked.size(); i++) {
+    pthread_mutex_lock(&locked[i]->mu);
+  }
+
+  int r = 0;
+  Names& from = ctx->ShardFor(p)->names;
+  Names& to = ctx->ShardFor(q)->names;
+  Names::iterator it = from.find(p);
+  Names::iterator dst = to.find(q);
+  if (it == from.end() || S_ISDIR(it->second->mode) != is_dir) {
+    errno = ENOENT;  // Changed since we looked
+    r = -1;
+  } else if (dst != to.end() && S_ISDIR(dst->second->mode) != is_dir) {
+    errno = is_dir ? ENOTDIR : EISDIR;
+    r = -1;
+  } else if (dst != to.end() && is_dir) {
+    errno = ENOTEMPTY;  // Replacing directories is not supported
+    r = -1;
+  } else {
+    Inode* inode = it->second;
+    from.erase(it);
+    Inode*& slot = to[q];
+    if (slot != NULL) {
+      Context::Unref(slot);
+    }
+    slot = inode;
+    if (is_dir) {
+      // Move everything below the directory as well
+      const std::string prefix = p + "/";
+      std::vector<std::pair<std::string, Inode*> > moved;
+      for (int i = 0; i < Context::kShards; i++) {
+        Names& names = ctx->shards[i].names;
+        for (Names::iterator c = names.begin(); c != names.end();) {
+          if (c->first.compare(0, prefix.size(), prefix) == 0) {
+            moved.push_back(std::make_pair(q + c->first.substr(p.size()),
+                                           c->second));
+            c = names.erase(c);
+          } else {
+            ++c;
+          }
+        }
+      }
+      for (size_t i = 0; i < moved.size(); i++) {
+        ctx->ShardFor(moved[i].first)->names[moved[i].first] = moved[i].second;
+      }
+    }
+  }
+
+  for (size_t i = locked.size(); i-- > 0;) {
+    pthread_mutex_unlock(&locked[i]->mu);
+  }
+  return r;
+}
+
+int pdlfs_fstat(int fd, struct stat* buf) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  Stat(file->inode, buf);
+  Context::Release(file);
+  return 0;
+}
+
+int pdlfs_ftruncate(int fd, off_t length) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  int r = 0;
+  if (length < 0 || S_ISDIR(file->inode->mode) ||
+      (file->flags & O_ACCMODE) == O_RDONLY) {
+    errno = EINVAL;
+    r = -1;
+  } else {
+    pthread_rwlock_wrlock(&file->inode->rwlock);
+    TruncateLocked(file->inode, length);
+    pthread_rwlock_unlock(&file->inode->rwlock);
+  }
+  Context::Release(file);
+  return r;
+}
+
+// Nothing outlives the process, so there is nothing to make durable.
+int pdlfs_fsync(int fd, int /* datasync */) {
+  OpenFile* file = api_ctx->GetFile(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  Context::Release(file);
+  return 0;
+}
+
+int pdlfs_close(int fd) {
+  OpenFile* file = api_ctx->RemoveFd(fd);
+  if (file == NULL) {
+    return -1;
+  }
+
+  Context::Release(file);
+  return 0;
+}
+
+}  // extern C
@@ -0,0 +1,996 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+// Stores each file as a container directory, in the style of PLFS. Every
+// process writing a file appends its data to a log of its own inside the
+// container and records where each write went in a compact index, so
+// ranks writing strided regions of one shared file never contend on the
+// underlying file system's locks. Readers merge all indexes in the
+// container to rebuild the file; overlapping writes are resolved by time.
+// Processes writing a file hold a shared lock on its marker. A truncating
+// open records a truncation only if it can take the lock exclusively, so
+// a rank opening a shared file late does not erase what others wrote.
+// Ordinary directories are passed through.
+
+#include <assert.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "local_root.h"
+#include "pdlfs-preload/pdlfs_api.h"
+#include "posix_api.h"
+
+namespace {
+
+static const char kMarker[] = ".plfs";  // Holds the file's permissions
+
+struct IndexEntry {
+  int64_t logical;
+  int64_t length;
+  int64_t physical;  // -1 marks a truncation to logical
+  int64_t time;
+};
+
+// What this process writes to one container. Shared by every descriptor
+// the process has open for writing the file.
+struct Writer {
+  dev_t dev;
+  ino_t ino;
+  int data_fd;
+  int index_fd;
+  int lock_fd;  // Marker, locked shared while the writer exists
+  int refs;  // Guarded by the context mutex
+  pthread_mutex_t mu;
+  off_t data_size;  // Guarded by mu
+  int64_t last_time;  // Guarded by mu
+  std::vector<IndexEntry> pending;  // Not yet in the index log, guarded by mu
+  unsigned long long version;  // Bumped on every write, guarded by mu
+};
+
+struct Extent {
+  off_t length;
+  int log;
+  off_t physical;
+};
+
+// All indexes in a container merged into one logical view
+struct Index {
+  Index() : eof(0) { memset(&mtime, 0, sizeof(mtime)); }
+  std::vector<std::string> logs;  // Data log names
+  std::map<off_t, Extent> extents;  // Non-overlapping, keyed by offset
+  off_t eof;
+  struct timespec mtime;
+};
+
+struct Handle {
+  int dirfd;
+  int flags;
+  bool is_dir;
+  Writer* writer;  // NULL unless open for writing
+  pthread_mutex_t mu;
+  off_t off;  // Guarded by mu
+  Index* index;  // Built on first use, guarded by mu
+  unsigned long long version;  // Writer version the index reflects
+  std::vector<int> log_fds;  // Opened on first read, guarded by mu
+};
+
+typedef std::map<std::pair<dev_t, ino_t>, Writer*> WriterMap;
+
+struct Context : public LocalRoot {
+  static const size_t kMaxPending = 1024;
+  std::string id;  // Names this process's logs
+
+  pthread_mutex_t mu;
+  WriterMap writers;  // Guarded by mu
+  std::vector<Handle*> handles;  // Indexed by fd, guarded by mu
+  std::vector<int> free_fds;  // Guarded by mu
+
+  explicit Context() {
+    SetId();
+    pthread_mutex_init(&mu, NULL);
+  }
+
+  void SetId() {
+    char host[HOST_NAME_MAX + 1];
+    if (gethostname(host, sizeof(host)) != 0) {
+      strcpy(host, "localhost");
+    }
+    host[HOST_NAME_MAX] = 0;
+    char tmp[HOST_NAME_MAX + 32];
+    snprintf(tmp, sizeof(tmp), "%s.%d", host, int(getpid()));
+    id = tmp;
+  }
+};
+}  // namespace
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static Context* api_ctx = NULL;
+
+static int64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return int64_t(ts.tv_sec) * 1000000000LL + ts.tv_nsec;
+}
+
+static bool HasPrefix(const char* name, const char* prefix) {
+  return strncmp(name, prefix, strlen(prefix)) == 0;
+}
+
+// Scan a directory without consuming dirfd, whose offset a dup shares.
+static DIR* OpenDir(int dirfd) {
+  DIR* dir = fdopendir(dup(dirfd));
+  if (dir != NULL) {
+    rewinddir(dir);
+  }
+  return dir;
+}
+
+// Return true if every entry of the directory is a log, so a container
+// whose marker is not written yet can be claimed.
+static bool OnlyLogs(int dirfd) {
+  DIR* dir = OpenDir(dirfd);
+  if (dir == NULL) {
+    return false;
+  }
+  bool ok = true;
+  struct dirent* e;
+  while (ok && (e = readdir(dir)) != NULL) {
+    ok = strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0 ||
+         HasPrefix(e->d_name, "data.") || HasPrefix(e->d_name, "index.");
+  }
+  closedir(dir);
+  return ok;
+}
+
+// Caller holds w->mu.
+static int FlushLocked(Writer* w) {
+  if (w->pending.empty()) {
+    return 0;
+  }
+  size_t n = w->pending.size() * sizeof(IndexEntry);
+  ssize_t r = posix_write(w->index_fd, &w->pending[0], n);
+  w->pending.clear();
+  return r == ssize_t(n) ? 0 : -1;
+}
+
+// Caller holds w->mu.
+static void AddEntryLocked(Writer* w, off_t logical, off_t length,
+                           off_t physical) {
+  int64_t now = std::max(NowNanos(), w->last_time + 1);
+  w->last_time = now;
+  w->version++;
+  if (!w->pending.empty() && physical >= 0) {
+    IndexEntry& last = w->pending.back();
+    // Sequential writes extend one entry, which keeps the index compact
+    if (last.physical >= 0 && last.logical + last.length == logical &&
+        last.physical + last.length == physical) {
+      last.length += length;
+      return;
+    }
+  }
+  IndexEntry e;
+  e.logical = logical;
+  e.length = length;
+  e.physical = physical;
+  e.time = now;
+  w->pending.push_back(e);
+  if (w->pending.size() >= Context::kMaxPending) {
+    FlushLocked(w);
+  }
+}
+
+static ssize_t Append(Writer* w, const char* buf, size_t sz, off_t off) {
+  pthread_mutex_lock(&w->mu);
+  ssize_t n = posix_pwrite(w->data_fd, buf, sz, w->data_size);
+  if (n > 0) {
+    AddEntryLocked(w, off, n, w->data_size);
+    w->data_size += n;
+  }
+  pthread_mutex_unlock(&w->mu);
+  return n;
+}
+
+static Writer* FindWriter(int dirfd) {
+  struct stat st;
+  if (posix_fstat(dirfd, &st) != 0) {
+    return NULL;
+  }
+  Writer* w = NULL;
+  pthread_mutex_lock(&api_ctx->mu);
+  WriterMap::iterator it =
+      api_ctx->writers.find(std::make_pair(st.st_dev, st.st_ino));
+  if (it != api_ctx->writers.end()) {
+    w = it->second;
+    w->refs++;
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+  return w;
+}
+
+static void PutWriter(Writer* w) {
+  pthread_mutex_lock(&api_ctx->mu);
+  bool last = --w->refs == 0;
+  if (last) {
+    api_ctx->writers.erase(std::make_pair(w->dev, w->ino));
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+  if (last) {
+    FlushLocked(w);
+    posix_close(w->data_fd);
+    posix_close(w->index_fd);
+    posix_close(w->lock_fd);
+    pthread_mutex_destroy(&w->mu);
+    delete w;
+  }
+}
+
+// Return the writer of this process for the container open as dirfd. If
+// truncate is set and no other process writes the container, a truncation
+// is recorded before any other process can start writing.
+static Writer* GetWriter(int dirfd, bool truncate) {
+  struct stat st;
+  if (posix_fstat(dirfd, &st) != 0) {
+    return NULL;
+  }
+  std::string data = "data." + api_ctx->id;
+  std::string index = "index." + api_ctx->id;
+  pthread_mutex_lock(&api_ctx->mu);
+  std::pair<dev_t, ino_t> key(st.st_dev, st.st_ino);
+  Writer*& w = api_ctx->writers[key];
+  if (w == NULL) {
+    int data_fd = openat(dirfd, data.c_str(), O_WRONLY | O_CREAT, 0644);
+    int index_fd =
+        openat(dirfd, index.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    int lock_fd = openat(dirfd, kMarker, O_RDONLY);
+    bool exclusive = false;
+    if (lock_fd != -1 && truncate) {
+      exclusive = flock(lock_fd, LOCK_EX | LOCK_NB) == 0;
+    }
+    struct stat dst;
+    if (data_fd == -1 || index_fd == -1 || lock_fd == -1 ||
+        (!exclusive && flock(lock_fd, LOCK_SH) != 0) ||
+        posix_fstat(data_fd, &dst) != 0) {
+      int err = errno;
+      if (data_fd != -1) posix_close(data_fd);
+      if (index_fd != -1) posix_close(index_fd);
+      if (lock_fd != -1) posix_close(lock_fd);
+      api_ctx->writers.erase(key);
+      pthread_mutex_unlock(&api_ctx->mu);
+      errno = err;
+      return NULL;
+    }
+    w = new Writer;
+    w->dev = st.st_dev;
+    w->ino = st.st_ino;
+    w->data_fd = data_fd;
+    w->index_fd = index_fd;
+    w->lock_fd = lock_fd;
+    w->refs = 0;
+    pthread_mutex_init(&w->mu, NULL);
+    w->data_size = dst.st_size;
+    w->last_time = 0;
+    w->version = 0;
+    if (exclusive) {
+      // Written out before the lock is shared, so every write another
+      // process makes from now on is later
+      pthread_mutex_lock(&w->mu);
+      AddEntryLocked(w, 0, 0, -1);
+      FlushLocked(w);
+      pthread_mutex_unlock(&w->mu);
+      flock(lock_fd, LOCK_SH);
+    }
+  }
+  w->refs++;
+  Writer* result = w;
+  pthread_mutex_unlock(&api_ctx->mu);
+  return result;
+}
+
+// A forked child writes logs of its own. The writers it inherited append
+// to the parent's logs, so the handles open for writing get new ones and
+// the inherited writers are dropped without writing anything out.
+static void AfterFork() {
+  api_ctx->SetId();
+  pthread_mutex_init(&api_ctx->mu, NULL);
+  WriterMap inherited;
+  inherited.swap(api_ctx->writers);
+  for (size_t fd = 0; fd < api_ctx->handles.size(); fd++) {
+    Handle* h = api_ctx->handles[fd];
+    if (h != NULL) {
+      pthread_mutex_init(&h->mu, NULL);
+      if (h->writer != NULL) {
+        h->writer = GetWriter(h->dirfd, false);
+      }
+    }
+  }
+  for (WriterMap::iterator it = inherited.begin(); it != inherited.end();
+       ++it) {
+    Writer* w = it->second;
+    posix_close(w->data_fd);
+    posix_close(w->index_fd);
+    posix_close(w->lock_fd);
+    delete w;
+  }
+}
+
+static void InitContext() {
+  Context* ctx = new Context;
+  api_ctx = ctx;
+  pthread_atfork(NULL, NULL, &AfterFork);
+}
+
+// Index entries of files left open must reach the logs before the process
+// goes away. Run as a destructor, after the atexit handler of the preload
+// library has written out streams that are still open.
+__attribute__((destructor)) static void FlushAtExit() {
+  if (api_ctx == NULL) return;
+  pthread_mutex_lock(&api_ctx->mu);
+  for (WriterMap::iterator it = api_ctx->writers.begin();
+       it != api_ctx->writers.end(); ++it) {
+    Writer* w = it->second;
+    pthread_mutex_lock(&w->mu);
+    FlushLocked(w);
+    pthread_mutex_unlock(&w->mu);
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+}
+
+static void Truncate(Index* idx, off_t length) {
+  std::map<off_t, Extent>::iterator it = idx->extents.lower_bound(length);
+  idx->extents.erase(it, idx->extents.end());
+  if (!idx->extents.empty()) {
+    std::map<off_t, Extent>::iterator last = --idx->extents.end();
+    if (last->first + last->second.length > length) {
+      last->second.length = length - last->first;
+    }
+  }
+  idx->eof = length;
+}
+
+static void Apply(Index* idx, const IndexEntry& e, int log) {
+  if (e.physical < 0) {
+    Truncate(idx, e.logical);
+    return;
+  } else if (e.length == 0) {
+    return;
+  }
+  std::map<off_t, Extent>& extents = idx->extents;
+  const off_t start = e.logical;
+  const off_t end = e.logical + e.length;
+  std::map<off_t, Extent>::iterator it = extents.lower_bound(start);
+  if (it != extents.begin()) {
+    std::map<off_t, Extent>::iterator prev = it;
+    --prev;
+    off_t prev_end = prev->first + prev->second.length;
+    if (prev_end > end) {
+      Extent tail = prev->second;
+      tail.length = prev_end - end;
+      tail.physical += end - prev->first;
+      extents[end] = tail;
+    }
+    if (prev_end > start) {
+      prev->second.length = start - prev->first;
+    }
+  }
+  while (it != extents.end() && it->first < end) {
+    off_t it_end = it->first + it->second.length;
+    if (it_end > end) {
+      Extent tail = it->second;
+      tail.length = it_end - end;
+      tail.physical += end - it->first;
+      extents[end] = tail;
+    }
+    extents.erase(it++);
+  }
+  Extent x;
+  x.length = e.length;
+  x.log = log;
+  x.physical = e.physical;
+  extents[start] = x;
+  idx->eof = std::max(idx->eof, end);
+}
+
+namespace {
+struct TimedEntry {
+  IndexEntry e;
+  int log;
+  size_t seq;  // Position among all entries read, breaks ties
+
+  bool operator<(const TimedEntry& other) const {
+    if (e.time != other.e.time) return e.time < other.e.time;
+    return seq < other.seq;
+  }
+};
+}  // namespace
+
+// Read every index log in the container and merge them. Entries not yet
+// flushed by this process's writer are flushed first.
+static int LoadIndex(int dirfd, Index* idx) {
+  Writer* w = FindWriter(dirfd);
+  if (w != NULL) {
+    pthread_mutex_lock(&w->mu);
+    FlushLocked(w);
+    pthread_mutex_unlock(&w->mu);
+    PutWriter(w);
+  }
+  DIR* dir = OpenDir(dirfd);
+  if (dir == NULL) {
+    return -1;
+  }
+  std::vector<TimedEntry> all;
+  std::vector<IndexEntry> buf;
+  struct dirent* de;
+  while ((de = readdir(dir)) != NULL) {
+    if (!HasPrefix(de->d_name, "index.")) {
+      continue;
+    }
+    int fd = openat(dirfd, de->d_name, O_RDONLY);
+    struct stat st;
+    if (fd == -1 || posix_fstat(fd, &st) != 0) {
+      if (fd != -1) posix_close(fd);
+      continue;
+    }
+    size_t n = st.st_size / sizeof(IndexEntry);
+    buf.resize(n);
+    ssize_t r = 0;
+    if (n != 0) {
+      r = posix_pread(fd, &buf[0], n * sizeof(IndexEntry), 0);
+    }
+    posix_close(fd);
+    if (r < 0) {
+      continue;
+    }
+    n = r / sizeof(IndexEntry);
+    const int log = idx->logs.size();
+    idx->logs.push_back(std::string("data.") + (de->d_name + 6));
+    for (size_t i = 0; i < n; i++) {
+      TimedEntry t;
+      t.e = buf[i];
+      t.log = log;
+      t.seq = all.size();
+      all.push_back(t);
+    }
+    if (st.st_mtim.tv_sec > idx->mtime.tv_sec ||
+        (st.st_mtim.tv_sec == idx->mtime.tv_sec &&
+         st.st_mtim.tv_nsec > idx->mtime.tv_nsec)) {
+      idx->mtime = st.st_mtim;
+    }
+  }
+  closedir(dir);
+  std::sort(all.begin(), all.end());
+  for (size_t i = 0; i < all.size(); i++) {
+    Apply(idx, all[i].e, all[i].log);
+  }
+  return 0;
+}
+
+// Return 1 if dirfd is a container and fill *marker, 0 if it is an
+// ordinary directory, or -1 on errors.
+static int CheckContainer(int dirfd, struct stat* marker) {
+  if (fstatat(dirfd, kMarker, marker, 0) == 0) {
+    return 1;
+  }
+  return errno == ENOENT ? 0 : -1;
+}
+
+static int ContainerStat(const struct stat& marker, const Index* idx,
+                         struct stat* buf) {
+  *buf = marker;
+  buf->st_mode = S_IFREG | (marker.st_mode & 07777);
+  buf->st_nlink = 1;
+  buf->st_size = idx->eof;
+  buf->st_blocks = (idx->eof + 511) / 512;
+  if (idx->mtime.tv_sec > buf->st_mtim.tv_sec) {
+    buf->st_mtim = idx->mtime;
+    buf->st_ctim = idx->mtime;
+  }
+  return 0;
+}
+
+// Caller holds h->mu. Rebuild the index if this process wrote since.
+static Index* IndexLocked(Handle* h) {
+  unsigned long long version = 0;
+  if (h->writer != NULL) {
+    pthread_mutex_lock(&h->writer->mu);
+    version = h->writer->version;
+    pthread_mutex_unlock(&h->writer->mu);
+  }
+  if (h->index == NULL || version != h->version) {
+    Index* idx = new Index;
+    if (LoadIndex(h->dirfd, idx) != 0) {
+      delete idx;
+      return NULL;
+    }
+    // Logs are appended to, so fds already open stay valid
+    std::vector<int> fds(idx->logs.size(), -1);
+    if (h->index != NULL) {
+      for (size_t i = 0; i < h->index->logs.size(); i++) {
+        std::vector<std::string>::iterator it = std::find(
+            idx->logs.begin(), idx->logs.end(), h->index->logs[i]);
+        if (it != idx->logs.end()) {
+          fds[it - idx->logs.begin()] = h->log_fds[i];
+        } else if (h->log_fds[i] != -1) {
+          posix_close(h->log_fds[i]);
+        }
+      }
+      delete h->index;
+    }
+    h->index = idx;
+    h->log_fds.swap(fds);
+    h->version = version;
+  }
+  return h->index;
+}
+
+// Caller holds h->mu.
+static ssize_t ReadLocked(Handle* h, char* buf, size_t sz, off_t off) {
+  Index* idx = IndexLocked(h);
+  if (idx == NULL) {
+    return -1;
+  } else if (off >= idx->eof) {
+    return 0;
+  }
+  sz = std::min<off_t>(sz, idx->eof - off);
+  size_t done = 0;
+  while (done < sz) {
+    off_t pos = off + done;
+    std::map<off_t, Extent>::iterator it = idx->extents.upper_bound(pos);
+    off_t next = (it == idx->extents.end()) ? idx->eof : it->first;
+    size_t n;
+    if (it != idx->extents.begin() &&
+        (--it)->first + it->second.length > pos) {
+      const Extent& x = it->second;
+      const off_t skip = pos - it->first;
+      n = std::min<off_t>(sz - done, x.length - skip);
+      int& fd = h->log_fds[x.log];
+      if (fd == -1) {
+        fd = openat(h->dirfd, idx->logs[x.log].c_str(), O_RDONLY);
+        if (fd == -1) return done ? done : -1;
+      }
+      ssize_t r = posix_pread(fd, buf + done, n, x.physical + skip);
+      if (r < 0) return done ? done : -1;
+      memset(buf + done + r, 0, n - r);  // Past a log cut short by a crash
+    } else {
+      n = std::min<off_t>(sz - done, next - pos);  // A hole
+      memset(buf + done, 0, n);
+    }
+    done += n;
+  }
+  return done;
+}
+
+static Handle* GetHandle(int fd) {
+  Handle* h = NULL;
+  pthread_mutex_lock(&api_ctx->mu);
+  if (fd >= 0 && fd < api_ctx->handles.size()) {
+    h = api_ctx->handles[fd];
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+  if (h == NULL) errno = EBADF;
+  return h;
+}
+
+static ssize_t ReadFile(Handle* h, const struct iovec* iov, int iovcnt,
+                        off_t off) {
+  if (h->is_dir) {
+    errno = EISDIR;
+    return -1;
+  } else if ((h->flags & O_ACCMODE) == O_WRONLY) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = ReadLocked(h, static_cast<char*>(iov[i].iov_base),
+                           iov[i].iov_len, off + total);
+    if (n < 0) return total ? total : -1;
+    total += n;
+    if (n < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+static ssize_t WriteFile(Handle* h, const struct iovec* iov, int iovcnt,
+                         off_t off) {
+  if (h->writer == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = Append(h->writer, static_cast<const char*>(iov[i].iov_base),
+                       iov[i].iov_len, off + total);
+    if (n < 0) return total ? total : -1;
+    total += n;
+    if (n < iov[i].iov_len) break;
+  }
+  return total;
+}
+
+// Read or write at the file offset and advance it.
+static ssize_t SequentialIO(int fd, const struct iovec* iov, int iovcnt,
+                            bool write) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&h->mu);
+  ssize_t n;
+  if (!write) {
+    n = ReadFile(h, iov, iovcnt, h->off);
+  } else {
+    if (h->flags & O_APPEND) {
+      Index* idx = IndexLocked(h);
+      if (idx != NULL) h->off = idx->eof;
+    }
+    n = WriteFile(h, iov, iovcnt, h->off);
+  }
+  if (n > 0) h->off += n;
+  pthread_mutex_unlock(&h->mu);
+  return n;
+}
+
+// Remove a container and everything in it.
+static int RemoveContainer(const char* path) {
+  int dirfd = posix_open(path, O_RDONLY | O_DIRECTORY, 0);
+  if (dirfd == -1) {
+    return -1;
+  }
+  DIR* dir = OpenDir(dirfd);
+  if (dir != NULL) {
+    struct dirent* e;
+    while ((e = readdir(dir)) != NULL) {
+      if (strcmp(e->d_name, ".") != 0 && strcmp(e->d_name, "..") != 0) {
+        unlinkat(dirfd, e->d_name, 0);
+      }
+    }
+    closedir(dir);
+  }
+  posix_close(dirfd);
+  return rmdir(path);
+}
+
+extern "C" {
+
+int pdlfs_mkdir(const char* path, mode_t mode) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  return api_ctx->Mkdir(path, mode);
+}
+
+int pdlfs_open(const char* path, int oflags, mode_t mode, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  char p[PATH_MAX];
+  if (!api_ctx->FullPath(path, p)) {
+    return -1;
+  }
+
+  const bool write = (oflags & O_ACCMODE) != O_RDONLY;
+  int dirfd = posix_open(p, O_RDONLY | O_DIRECTORY, 0);
+  bool created = false;
+  if (dirfd == -1 && errno == ENOENT && (oflags & O_CREAT)) {
+    // Other ranks may be creating the same container
+    if (posix_mkdir(p, Context::kDirMode) != 0 && errno != EEXIST) {
+      return -1;
+    }
+    dirfd = posix_open(p, O_RDONLY | O_DIRECTORY, 0);
+  }
+  if (dirfd == -1) {
+    if (errno == ENOTDIR) errno = EMEDIUMTYPE;  // Not made by this backend
+    return -1;
+  }
+
+  struct stat marker;
+  int r = CheckContainer(dirfd, &marker);
+  if (r == 0 && (oflags & O_CREAT) && OnlyLogs(dirfd)) {
+    int fd = openat(dirfd, kMarker, O_WRONLY | O_CREAT | O_EXCL,
+                    mode & 07777);
+    if (fd != -1) {
+      created = true;
+      posix_close(fd);
+    }
+    r = CheckContainer(dirfd, &marker);
+  }
+  int err = 0;
+  if (r == -1) {
+    err = errno;
+  } else if (r == 1 && (oflags & O_CREAT) && (oflags & O_EXCL) && !created) {
+    err = EEXIST;
+  } else if (r == 0 && (write || (oflags & O_CREAT))) {
+    err = EISDIR;
+  } else if (r == 1 && (oflags & O_DIRECTORY)) {
+    err = ENOTDIR;
+  }
+  if (err != 0) {
+    posix_close(dirfd);
+    errno = err;
+    return -1;
+  }
+
+  Handle* h = new Handle;
+  h->dirfd = dirfd;
+  h->flags = oflags;
+  h->is_dir = r == 0;
+  h->writer = NULL;
+  pthread_mutex_init(&h->mu, NULL);
+  h->off = 0;
+  h->index = NULL;
+  h->version = 0;
+  if (write) {
+    h->writer = GetWriter(dirfd, (oflags & O_TRUNC) != 0);
+    if (h->writer == NULL) {
+      err = errno;
+      posix_close(dirfd);
+      pthread_mutex_destroy(&h->mu);
+      delete h;
+      errno = err;
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&api_ctx->mu);
+  int fd;
+  if (!api_ctx->free_fds.empty()) {
+    fd = api_ctx->free_fds.back();
+    api_ctx->free_fds.pop_back();
+    api_ctx->handles[fd] = h;
+  } else {
+    fd = api_ctx->handles.size();
+    api_ctx->handles.push_back(h);
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+
+  if (pdlfs_fstat(fd, buf) != 0) {
+    err = errno;
+    pdlfs_close(fd);
+    errno = err;
+    return -1;
+  }
+
+  return fd;
+}
+
+ssize_t pdlfs_pread(int fd, void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sz;
+  return pdlfs_preadv(fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_read(int fd, void* buf, size_t sz) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sz;
+  return pdlfs_readv(fd, &iov, 1);
+}
+
+ssize_t pdlfs_pwrite(int fd, const void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(buf);
+  iov.iov_len = sz;
+  return pdlfs_pwritev(fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_write(int fd, const void* buf, size_t sz) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(buf);
+  iov.iov_len = sz;
+  return pdlfs_writev(fd, &iov, 1);
+}
+
+ssize_t pdlfs_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  } else if (off < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&h->mu);
+  ssize_t n = ReadFile(h, iov, iovcnt, off);
+  pthread_mutex_unlock(&h->mu);
+  return n;
+}
+
+ssize_t pdlfs_readv(int fd, const struct iovec* iov, int iovcnt) {
+  return SequentialIO(fd, iov, iovcnt, false);
+}
+
+ssize_t pdlfs_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  } else if (off < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return WriteFile(h, iov, iovcnt, off);
+}
+
+ssize_t pdlfs_writev(int fd, const struct iovec* iov, int iovcnt) {
+  return SequentialIO(fd, iov, iovcnt, true);
+}
+
+int pdlfs_stat(const char* path, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  char p[PATH_MAX];
+  if (!api_ctx->FullPath(path, p)) {
+    return -1;
+  }
+
+  if (posix_stat(p, buf) != 0) {
+    return -1;
+  } else if (!S_ISDIR(buf->st_mode)) {
+    return 0;
+  }
+  int dirfd = posix_open(p, O_RDONLY | O_DIRECTORY, 0);
+  if (dirfd == -1) {
+    return -1;
+  }
+  struct stat marker;
+  int r = CheckContainer(dirfd, &marker);
+  if (r == 1) {
+    Index idx;
+    r = LoadIndex(dirfd, &idx);
+    if (r == 0) {
+      r = ContainerStat(marker, &idx, buf);
+    }
+  }
+  int err = errno;
+  posix_close(dirfd);
+  errno = err;
+  return r == -1 ? -1 : 0;
+}
+
+int pdlfs_rename(const char* oldpath, const char* newpath) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(oldpath != NULL && newpath != NULL);
+  assert(oldpath[0] == '/' && newpath[0] == '/');
+
+  char p[PATH_MAX];
+  char q[PATH_MAX];
+  if (!api_ctx->FullPath(oldpath, p) || !api_ctx->FullPath(newpath, q)) {
+    return -1;
+  }
+
+  // A file replaces an existing file, which is a non-empty container
+  struct stat a, b;
+  std::string pm = std::string(p) + "/" + kMarker;
+  std::string qm = std::string(q) + "/" + kMarker;
+  if (strcmp(p, q) != 0 && posix_stat(pm.c_str(), &a) == 0 &&
+      posix_stat(qm.c_str(), &b) == 0) {
+    RemoveContainer(q);
+  }
+
+  return posix_rename(p, q);
+}
+
+int pdlfs_fstat(int fd, struct stat* buf) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  } else if (h->is_dir) {
+    return posix_fstat(h->dirfd, buf);
+  }
+
+  struct stat marker;
+  if (CheckContainer(h->dirfd, &marker) != 1) {
+    return -1;
+  }
+  pthread_mutex_lock(&h->mu);
+  Index* idx = IndexLocked(h);
+  int r = idx != NULL ? ContainerStat(marker, idx, buf) : -1;
+  pthread_mutex_unlock(&h->mu);
+  return r;
+}
+
+int pdlfs_ftruncate(int fd, off_t length) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  } else if (h->writer == NULL || length < 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  pthread_mutex_lock(&h->writer->mu);
+  AddEntryLocked(h->writer, length, 0, -1);
+  pthread_mutex_unlock(&h->writer->mu);
+  return 0;
+}
+
+int pdlfs_fsync(int fd, int datasync) {
+  Handle* h = GetHandle(fd);
+  if (h == NULL) {
+    return -1;
+  } else if (h->writer == NULL) {
+    return 0;
+  }
+
+  Writer* w = h->writer;
+  pthread_mutex_lock(&w->mu);
+  int r = FlushLocked(w);
+  if (r == 0) {
+    r = datasync ? posix_fdatasync(w->data_fd) : posix_fsync(w->data_fd);
+  }
+  if (r == 0) {
+    r = datasync ? posix_fdatasync(w->index_fd) : posix_fsync(w->index_fd);
+  }
+  pthread_mutex_unlock(&w->mu);
+  return r;
+}
+
+int pdlfs_close(int fd) {
+  Handle* h = NULL;
+  pthread_mutex_lock(&api_ctx->mu);
+  if (fd >= 0 && fd < api_ctx->handles.size() &&
+      api_ctx->handles[fd] != NULL) {
+    h = api_ctx->handles[fd];
+    api_ctx->handles[fd] = NULL;
+    api_ctx->free_fds.push_back(fd);
+  }
+  pthread_mutex_unlock(&api_ctx->mu);
+  if (h == NULL) {
+    errno = EBADF;
+    return -1;
+  }
+
+  if (h->writer != NULL) {
+    PutWriter(h->writer);
+  }
+  for (size_t i = 0; i < h->log_fds.size(); i++) {
+    if (h->log_fds[i] != -1) posix_close(h->log_fds[i]);
+  }
+  delete h->index;
+  posix_close(h->dirfd);
+  pthread_mutex_destroy(&h->mu);
+  delete h;
+  return 0;
+}
+
+}  // extern C
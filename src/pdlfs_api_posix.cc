@@ -8,39 +8,1352 @@
  */
 
 #include <assert.h>
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <deque>
+#include <map>
 #include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "local_root.h"
 #include "pdlfs-preload/pdlfs_api.h"
 #include "posix_api.h"
-#include "preload.h"
+
+// With PDLFS_DirShards set, files are spread over that many hidden
+// subdirectories of their directory, picked by a hash of their name, so
+// creates and lookups in one large directory do not all contend for the
+// same directory lock. Shards are made on first use. Directories are not
+// sharded, and neither are files made before sharding was turned on;
+// lookups that miss in the shard fall back to the plain path, and so do
+// creates, so a new file never shadows an old one. Old files move into
+// a shard when they are renamed.
+static unsigned int dir_shards = 0;
+
+static uint32_t HashName(const char* name) {
+  uint32_t h = 2166136261U;  // FNV-1a
+  for (const char* c = name; *c != 0; c++) {
+    h = (h ^ static_cast<unsigned char>(*c)) * 16777619U;
+  }
+  return h;
+}
+
+// Like JoinPath, but puts files in the shard of their name.
+static bool ShardedPath(const std::string& root, const char* path,
+                        char* buf) {
+  if (dir_shards == 0) {
+    return JoinPath(root, path, buf);
+  }
+  const char* name = strrchr(path, '/') + 1;
+  char shard[32];
+  int k = snprintf(shard, sizeof(shard), ".pdlfs-shard-%u/",
+                   HashName(name) % dir_shards);
+  size_t n = root.size();
+  size_t d = name - path;
+  size_t m = strlen(name);
+  if (n + d + k + m >= PATH_MAX) {
+    errno = ENAMETOOLONG;
+    return false;
+  }
+  memcpy(buf, root.data(), n);
+  memcpy(buf + n, path, d);
+  memcpy(buf + n + d, shard, k);
+  memcpy(buf + n + d + k, name, m + 1);
+  return true;
+}
+
+// Make the shard holding p, a path made by ShardedPath.
+// Return 0 on success, or -1 on errors.
+static int MakeShard(const char* p) {
+  if (dir_shards == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  std::string dir(p, strrchr(p, '/') - p);
+  int r = posix_mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+  return (r == 0 || errno == EEXIST) ? 0 : -1;
+}
+
+// Like ShardedPath, but gives the plain path of a file or directory made
+// before sharding so that creating path does not shadow it. *old, if
+// given, is set to whether that is the case.
+static bool PathToCreate(const std::string& root, const char* path,
+                         char* buf, bool* old = NULL) {
+  if (old != NULL) *old = false;
+  if (!ShardedPath(root, path, buf)) {
+    return false;
+  }
+  if (dir_shards != 0 && posix_access(buf, F_OK) != 0 && errno == ENOENT) {
+    char p[PATH_MAX];
+    if (JoinPath(root, path, p) && posix_access(p, F_OK) == 0) {
+      strcpy(buf, p);
+      if (old != NULL) *old = true;
+    }
+  }
+  return true;
+}
+
+// Open p, a path made by ShardedPath, making its shard when creating it.
+static int OpenFile(const char* p, int oflags, mode_t mode) {
+  int fd = posix_open(p, oflags, mode);
+  if (fd == -1 && errno == ENOENT && (oflags & O_CREAT) &&
+      MakeShard(p) == 0) {
+    fd = posix_open(p, oflags, mode);
+  }
+  return fd;
+}
 
 namespace {
 
-struct Context {
-  static const int kDirMode = S_IRWXU | S_IRWXG | S_IRWXO;
-  std::string pdlfs_root;
+struct StagedFile {
+  StagedFile() : writers(0), size(0), queued(false), failed(false) {}
+  int writers;  // Descriptors open for writing the staged copy
+  off_t size;  // Charged against the stage capacity while queued
+  bool queued;  // Closed and waiting for, or being copied by, the drainer
+  bool failed;  // Closed but the last copy failed, so due for a retry
+};
+
+// New files opened for writing land in a fast node-local directory first.
+// Once the last writer closes one, a background thread copies it to the
+// capacity tier with large sequential writes and removes the staged copy.
+// Until then opens and stats of the file are served from the stage. New
+// files wait while the bytes queued for draining exceed the capacity.
+// Files that fail to drain stay in the stage and are queued again after
+// kRetrySeconds, and by Flush().
+class Stage {
+ public:
+  Stage(const std::string& dir, const std::string& root,
+        unsigned long long capacity, size_t drain_size);
+
+  // Return true if the open was handled here, with the result in *fd.
+  // Otherwise the file lives in the capacity tier only.
+  bool Open(const char* path, int oflags, mode_t mode, int* fd);
+
+  // Return true if path has a staged copy, with the result in *r.
+  bool Stat(const char* path, struct stat* buf, int* r);
+  bool Rename(const char* oldpath, const char* newpath, int* r);
+
+  // Called before fd is closed.
+  void Close(int fd);
+
+  // Queue files still open for writing or due for a retry and wait until
+  // all are drained.
+  void Flush();
+
+ private:
+  static const int kRetrySeconds = 1;
+
+  static void* DrainThread(void* arg);
+  void QueueLocked(const std::string& path, StagedFile* f, off_t size);
+  void RetryLocked();
+  bool Copy(const std::string& path);
+  void Log(const char* what, const std::string& path);
+  static void MakeParents(const char* path);
+
+  typedef std::map<std::string, StagedFile> Manifest;
+  const std::string dir_;
+  const std::string root_;
+  const unsigned long long capacity_;
+  const size_t drain_size_;
+  int log_fd_;  // Manifest log, -1 if it cannot be written
+  pthread_mutex_t mu_;
+  pthread_cond_t cv_;  // Signaled whenever the manifest changes
+  Manifest files_;  // Files with a staged copy
+  std::map<int, std::string> writers_;  // Path of each staged fd
+  std::deque<std::string> queue_;
+  unsigned long long queued_bytes_;
+  bool draining_;
+  bool failed_;  // Some files are due for a retry
+};
+
+Stage::Stage(const std::string& dir, const std::string& root,
+             unsigned long long capacity, size_t drain_size)
+    : dir_(dir),
+      root_(root),
+      capacity_(capacity),
+      drain_size_(drain_size),
+      queued_bytes_(0),
+      draining_(false),
+      failed_(false) {
+  pthread_mutex_init(&mu_, NULL);
+  pthread_cond_init(&cv_, NULL);
+  posix_mkdir(dir_.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+  std::string log = dir_ + "/MANIFEST";
+  log_fd_ = posix_open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+  // The drainer should not take signals meant for the application
+  sigset_t all, old;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  pthread_t t;
+  int r = pthread_create(&t, NULL, &Stage::DrainThread, this);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  if (r != 0) {
+    fprintf(stderr, "!!! FATAL error: cannot start the stage drainer\n");
+    abort();
+  }
+  pthread_detach(t);
+}
+
+void Stage::MakeParents(const char* path) {
+  std::string dir = path;
+  for (size_t i = 1; i < dir.size(); i++) {
+    if (dir[i] == '/') {
+      dir[i] = 0;
+      posix_mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+      dir[i] = '/';
+    }
+  }
+}
+
+void Stage::Log(const char* what, const std::string& path) {
+  if (log_fd_ != -1) {
+    std::string line = what;
+    line += " " + path + "\n";
+    posix_write(log_fd_, line.data(), line.size());
+  }
+}
+
+bool Stage::Open(const char* path, int oflags, mode_t mode, int* fd) {
+  const bool write = (oflags & O_ACCMODE) != O_RDONLY;
+  char s[PATH_MAX];
+  if (!JoinPath(dir_, path, s)) {
+    return false;
+  }
+  pthread_mutex_lock(&mu_);
+  Manifest::iterator it = files_.find(path);
+  // A file cannot be written again while it is being copied out
+  while (write && it != files_.end() && it->second.queued) {
+    pthread_cond_wait(&cv_, &mu_);
+    it = files_.find(path);
+  }
+  if (it == files_.end()) {
+    if (!write || !(oflags & O_CREAT)) {
+      pthread_mutex_unlock(&mu_);
+      return false;
+    }
+    // Existing files are updated in place unless they are truncated
+    if (!(oflags & O_TRUNC) || (oflags & O_EXCL)) {
+      char p[PATH_MAX];
+      struct stat st;
+      if (PathToCreate(root_, path, p) && posix_stat(p, &st) == 0) {
+        pthread_mutex_unlock(&mu_);
+        if (oflags & O_EXCL) {
+          errno = EEXIST;
+          *fd = -1;
+          return true;
+        }
+        return false;
+      }
+    }
+    while (queued_bytes_ >= capacity_ && !queue_.empty()) {
+      pthread_cond_wait(&cv_, &mu_);
+    }
+    it = files_.find(path);
+    if (it == files_.end()) {
+      MakeParents(s);
+      oflags = (oflags & ~O_EXCL) | O_TRUNC;  // Drop leftovers from a crash
+    }
+  }
+  *fd = posix_open(s, oflags, mode);
+  if (*fd != -1 && write) {
+    StagedFile& f = files_[path];
+    f.writers++;
+    f.failed = false;  // Queued again on close
+    writers_[*fd] = path;
+  }
+  pthread_mutex_unlock(&mu_);
+  return true;
+}
 
-  void Init() {
-    std::string path = pdlfs_root;
-    posix_mkdir(path.c_str(), kDirMode);
+bool Stage::Stat(const char* path, struct stat* buf, int* r) {
+  char s[PATH_MAX];
+  pthread_mutex_lock(&mu_);
+  bool staged = files_.count(path) != 0;
+  if (staged) {
+    *r = JoinPath(dir_, path, s) ? posix_stat(s, buf) : -1;
   }
+  pthread_mutex_unlock(&mu_);
+  return staged;
+}
 
-  explicit Context() {
-    const char* env = getenv("PDLFS_Root");
-    if (env == NULL) env = DEFAULT_PDLFS_ROOT;
-    std::string root = env;
-    if (root.empty()) root = DEFAULT_PDLFS_ROOT;
-    assert(root[0] == '/');
-    assert(root.size() > 1);
-    while (root.length() != 1 && root[root.size() - 1] == '/') {
-      root.resize(root.size() - 1);
+bool Stage::Rename(const char* oldpath, const char* newpath, int* r) {
+  char s[PATH_MAX];
+  char t[PATH_MAX];
+  char p[PATH_MAX];
+  if (!JoinPath(dir_, oldpath, s) || !JoinPath(dir_, newpath, t) ||
+      !ShardedPath(root_, oldpath, p)) {
+    *r = -1;
+    return true;
+  }
+  pthread_mutex_lock(&mu_);
+  Manifest::iterator src, dst;
+  while (true) {
+    src = files_.find(oldpath);
+    dst = files_.find(newpath);
+    if ((src == files_.end() || !src->second.queued) &&
+        (dst == files_.end() || !dst->second.queued)) {
+      break;
+    }
+    pthread_cond_wait(&cv_, &mu_);
+  }
+  bool staged = src != files_.end() || dst != files_.end();
+  if (dst != files_.end()) {
+    errno = EBUSY;  // Cannot replace a file that is still being written
+    *r = -1;
+  } else if (src != files_.end()) {
+    MakeParents(t);
+    *r = posix_rename(s, t);
+    if (*r == 0) {
+      posix_unlink(p);  // Drop any copy drained earlier
+      files_[newpath] = src->second;
+      files_.erase(src);
+      for (std::map<int, std::string>::iterator w = writers_.begin();
+           w != writers_.end(); ++w) {
+        if (w->second == oldpath) w->second = newpath;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mu_);
+  return staged;
+}
+
+void Stage::QueueLocked(const std::string& path, StagedFile* f, off_t size) {
+  f->size = size;
+  f->queued = true;
+  queued_bytes_ += size;
+  queue_.push_back(path);
+  Log("staged", path);
+  pthread_cond_broadcast(&cv_);
+}
+
+void Stage::RetryLocked() {
+  failed_ = false;
+  for (Manifest::iterator it = files_.begin(); it != files_.end(); ++it) {
+    StagedFile& f = it->second;
+    if (f.failed && f.writers == 0 && !f.queued) {
+      f.failed = false;
+      QueueLocked(it->first, &f, f.size);
+    }
+  }
+}
+
+void Stage::Close(int fd) {
+  pthread_mutex_lock(&mu_);
+  std::map<int, std::string>::iterator w = writers_.find(fd);
+  if (w != writers_.end()) {
+    StagedFile& f = files_[w->second];
+    if (--f.writers == 0) {
+      struct stat st;
+      QueueLocked(w->second, &f, posix_fstat(fd, &st) == 0 ? st.st_size : 0);
+    }
+    writers_.erase(w);
+  }
+  pthread_mutex_unlock(&mu_);
+}
+
+void Stage::Flush() {
+  char s[PATH_MAX];
+  pthread_mutex_lock(&mu_);
+  for (Manifest::iterator it = files_.begin(); it != files_.end(); ++it) {
+    if (it->second.writers != 0) {
+      struct stat st;
+      bool ok = JoinPath(dir_, it->first.c_str(), s) && posix_stat(s, &st) == 0;
+      it->second.writers = 0;
+      QueueLocked(it->first, &it->second, ok ? st.st_size : 0);
+    }
+  }
+  writers_.clear();
+  RetryLocked();
+  while (!queue_.empty() || draining_) {
+    pthread_cond_wait(&cv_, &mu_);
+  }
+  pthread_mutex_unlock(&mu_);
+}
+
+bool Stage::Copy(const std::string& path) {
+  char s[PATH_MAX];
+  char p[PATH_MAX];
+  if (!JoinPath(dir_, path.c_str(), s) ||
+      !PathToCreate(root_, path.c_str(), p)) {
+    return false;
+  }
+  int in = posix_open(s, O_RDONLY, 0);
+  if (in == -1) {
+    return false;
+  }
+  struct stat st;
+  int out = -1;
+  if (posix_fstat(in, &st) == 0) {
+    MakeParents(p);
+    out = posix_open(p, O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 07777);
+  }
+  bool ok = out != -1;
+  std::vector<char> buf(ok ? drain_size_ : 0);
+  off_t off = 0;
+  while (ok) {
+    ssize_t n = posix_pread(in, &buf[0], buf.size(), off);
+    if (n <= 0) {
+      ok = n == 0;
+      break;
+    }
+    ok = posix_pwrite(out, &buf[0], n, off) == n;
+    off += n;
+  }
+  if (out != -1 && posix_close(out) != 0) {
+    ok = false;
+  }
+  posix_close(in);
+  return ok;
+}
+
+void* Stage::DrainThread(void* arg) {
+  Stage* stage = reinterpret_cast<Stage*>(arg);
+  char s[PATH_MAX];
+  pthread_mutex_lock(&stage->mu_);
+  while (true) {
+    while (stage->queue_.empty()) {
+      if (!stage->failed_) {
+        pthread_cond_wait(&stage->cv_, &stage->mu_);
+        continue;
+      }
+      struct timespec deadline;
+      clock_gettime(CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += kRetrySeconds;
+      if (pthread_cond_timedwait(&stage->cv_, &stage->mu_, &deadline) ==
+          ETIMEDOUT) {
+        stage->RetryLocked();
+      }
+    }
+    std::string path = stage->queue_.front();
+    stage->queue_.pop_front();
+    stage->draining_ = true;
+    pthread_mutex_unlock(&stage->mu_);
+    bool ok = stage->Copy(path);
+    int err = errno;
+    pthread_mutex_lock(&stage->mu_);
+    Manifest::iterator it = stage->files_.find(path);
+    stage->queued_bytes_ -= it->second.size;
+    if (ok) {
+      // Removed under the lock so a new copy cannot be staged meanwhile
+      stage->files_.erase(it);
+      if (JoinPath(stage->dir_, path.c_str(), s)) {
+        posix_unlink(s);
+      }
+      stage->Log("drained", path);
+    } else {
+      // Kept in the stage and retried later
+      it->second.queued = false;
+      it->second.failed = true;
+      stage->failed_ = true;
+      fprintf(stderr, "!!! ERROR cannot drain %s: %s\n", path.c_str(),
+              strerror(err));
+    }
+    stage->draining_ = false;
+    pthread_cond_broadcast(&stage->cv_);
+  }
+  return NULL;
+}
+
+// A record of the index log of a process. Records of all logs are replayed
+// in time order at startup to rebuild the index.
+struct PackRecord {
+  enum { kPut = 1, kDelete = 2, kRename = 3 };
+  uint32_t type;
+  uint32_t name_len;  // Followed by the name
+  uint32_t new_name_len;  // Followed by the new name of a rename
+  uint32_t mode;
+  uint64_t container;  // Sequence number of the container of a put
+  uint64_t offset;
+  uint64_t length;
+  uint64_t mtime;  // Of the file, in nanoseconds since the epoch
+  uint64_t time;  // When the record was written
+};
+
+struct LoggedRecord {
+  PackRecord rec;
+  std::string names;
+  bool operator<(const LoggedRecord& other) const {
+    return rec.time < other.rec.time;
+  }
+};
+
+// Where the content of a packed file lives
+struct PackEntry {
+  int container;  // Index into Pack::containers_, -1 if not written yet
+  off_t offset;
+  off_t length;
+  mode_t mode;
+  uint64_t time;
+};
+
+// A packed file open in this process, shared by its descriptors
+struct PackedFile {
+  std::string name;
+  std::string data;
+  mode_t mode;
+  uint64_t time;
+  bool dirty;  // Changed since it was last written to a container
+  std::vector<int> fds;
+};
+
+struct PackHandle {
+  PackedFile* file;
+  int flags;
+  off_t off;  // Used by read() and write()
+};
+
+// New files are packed into a few large containers per process rather
+// than created one by one, so writing many small files costs bandwidth
+// instead of metadata operations. A packed file is held in memory while
+// open and appended to a container when it is last closed, followed by a
+// record in the process's index log. Processes that have a file open at
+// the same time do not see each other's changes; the last to close wins.
+// Opens, reads, stats and renames of packed files are served from an index
+// of all logs, loaded at startup. A file that grows past max_file is moved
+// to a regular file. Files created with O_EXCL are regular files so the
+// backend can tell whether another process made the name first. Packed
+// files are not listed by readdir.
+class Pack {
+ public:
+  Pack(const std::string& root, size_t max_file,
+       unsigned long long container_size);
+
+  // Return true if the open was handled here, with the result in *fd.
+  // path is the name given to the backend and p its full path.
+  bool Open(const char* path, const char* p, int oflags, mode_t mode,
+            int* fd);
+
+  // Return true if path is packed, with the result in *r.
+  bool Stat(const char* path, struct stat* buf, int* r);
+  bool Rename(const char* oldpath, const char* newpath, const char* q,
+              int* r);
+
+  // Called after p is made by the backend.
+  void AddDir(const char* p);
+
+  // Return true if fd is a packed file, with the result in *r. off is -1
+  // for read() and write().
+  bool Io(int fd, const struct iovec* iov, int iovcnt, off_t off, bool write,
+          ssize_t* r);
+  bool Fstat(int fd, struct stat* buf, int* r);
+  bool Ftruncate(int fd, off_t length, int* r);
+  bool Fsync(int fd, int datasync, int* r);
+  bool Close(int fd, int* r);
+
+  // Write out files that are still open, as exit closes them.
+  void FlushOpen();
+
+  void AfterFork();
+
+ private:
+  typedef std::unordered_map<std::string, PackEntry> Index;
+  typedef std::unordered_set<std::string> NameSet;
+
+  bool MayOwn(int fd) const {
+    return fd >= 0 && __atomic_load_n(&num_handles_, __ATOMIC_ACQUIRE) != 0;
+  }
+
+  void Load();
+  void LoadLog(const std::string& name, std::vector<LoggedRecord>* recs);
+  int Exists(const char* p);
+  int ReadEntry(const PackEntry& e, std::string* data);
+  int Persist(PackedFile* f);
+  int Spill(PackedFile* f);
+  int AppendRecord(const PackRecord& rec, const std::string& names);
+  void ForgetFile(PackedFile* f);
+  void FillStat(const std::string& name, off_t size, mode_t mode,
+                uint64_t time, struct stat* buf) const;
+
+  const std::string root_;
+  const std::string dir_;  // Containers and index logs
+  const size_t max_file_;
+  const unsigned long long container_size_;
+  dev_t dev_;
+  pthread_mutex_t mu_;
+  Index index_;
+  std::vector<std::string> containers_;
+  std::vector<int> container_fds_;  // Opened for reading on demand
+  std::unordered_map<std::string, NameSet> dirs_;  // Regular files seen
+  std::unordered_map<std::string, PackedFile*> open_;
+  std::unordered_map<int, PackHandle> handles_;
+  int num_handles_;
+  int null_fd_;  // Handles are duplicates of it
+  std::string id_;  // Host and pid naming this process's files
+  int log_fd_;  // Index log, -1 until the first file is written
+  int data_fd_;  // Current container, -1 if none
+  int data_index_;  // Index of the current container in containers_
+  uint64_t data_seq_;
+  off_t data_tail_;
+};
+
+static uint64_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return uint64_t(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+static std::string ProcessId() {
+  char host[HOST_NAME_MAX + 1];
+  if (gethostname(host, sizeof(host)) != 0) {
+    strcpy(host, "localhost");
+  }
+  host[HOST_NAME_MAX] = 0;
+  char tmp[HOST_NAME_MAX + 32];
+  snprintf(tmp, sizeof(tmp), "%s.%d", host, int(getpid()));
+  return tmp;
+}
+
+// Split p into the directory and the last component.
+static void SplitPath(const char* p, std::string* dir, std::string* base) {
+  const char* slash = strrchr(p, '/');
+  if (slash == p) {
+    dir->assign("/");
+  } else {
+    dir->assign(p, slash - p);
+  }
+  base->assign(slash + 1);
+}
+
+Pack::Pack(const std::string& root, size_t max_file,
+           unsigned long long container_size)
+    : root_(root),
+      dir_(root + "/.pdlfs-pack"),
+      max_file_(max_file),
+      container_size_(container_size),
+      dev_(0),
+      num_handles_(0),
+      id_(ProcessId()),
+      log_fd_(-1),
+      data_fd_(-1),
+      data_index_(-1),
+      data_seq_(0),
+      data_tail_(0) {
+  pthread_mutex_init(&mu_, NULL);
+  posix_mkdir(dir_.c_str(), S_IRWXU | S_IRWXG | S_IRWXO);
+  struct stat st;
+  if (posix_stat(dir_.c_str(), &st) == 0) {
+    dev_ = st.st_dev;
+  }
+  null_fd_ = posix_open("/dev/null", O_RDONLY | O_CLOEXEC, 0);
+  if (null_fd_ == -1) {
+    fprintf(stderr, "!!! FATAL error: cannot open /dev/null\n");
+    abort();
+  }
+  Load();
+}
+
+void Pack::LoadLog(const std::string& name, std::vector<LoggedRecord>* recs) {
+  std::string path = dir_ + "/" + name;
+  int fd = posix_open(path.c_str(), O_RDONLY, 0);
+  if (fd == -1) {
+    return;
+  }
+  struct stat st;
+  std::string log;
+  if (posix_fstat(fd, &st) == 0 && st.st_size > 0) {
+    log.resize(st.st_size);
+    ssize_t n = posix_pread(fd, &log[0], log.size(), 0);
+    log.resize(n > 0 ? n : 0);
+  }
+  posix_close(fd);
+  // Containers are named after the log that refers to them
+  const std::string prefix = dir_ + "/data." + name.substr(6) + ".";
+  std::map<uint64_t, int> seqs;
+  size_t pos = 0;
+  while (pos + sizeof(PackRecord) <= log.size()) {
+    LoggedRecord r;
+    memcpy(&r.rec, log.data() + pos, sizeof(r.rec));
+    size_t len = size_t(r.rec.name_len) + r.rec.new_name_len;
+    if (pos + sizeof(r.rec) + len > log.size()) {
+      break;  // Cut short by a crash
+    }
+    r.names = log.substr(pos + sizeof(r.rec), len);
+    pos += sizeof(r.rec) + len;
+    if (r.rec.type == PackRecord::kPut) {
+      std::map<uint64_t, int>::iterator it = seqs.find(r.rec.container);
+      if (it == seqs.end()) {
+        char tmp[32];
+        snprintf(tmp, sizeof(tmp), "%llu",
+                 static_cast<unsigned long long>(r.rec.container));
+        containers_.push_back(prefix + tmp);
+        container_fds_.push_back(-1);
+        it = seqs.insert(std::make_pair(r.rec.container,
+                                        int(containers_.size() - 1)))
+                 .first;
+      }
+      r.rec.container = it->second;
+    }
+    recs->push_back(r);
+  }
+}
+
+void Pack::Load() {
+  int dirfd = posix_open(dir_.c_str(), O_RDONLY | O_DIRECTORY, 0);
+  if (dirfd == -1) {
+    return;
+  }
+  DIR* dir = fdopendir(dirfd);
+  if (dir == NULL) {
+    posix_close(dirfd);
+    return;
+  }
+  std::vector<LoggedRecord> recs;
+  struct dirent* ent;
+  while ((ent = readdir(dir)) != NULL) {
+    if (strncmp(ent->d_name, "index.", 6) == 0) {
+      LoadLog(ent->d_name, &recs);
+    }
+  }
+  closedir(dir);
+  std::stable_sort(recs.begin(), recs.end());
+  for (size_t i = 0; i < recs.size(); i++) {
+    const PackRecord& rec = recs[i].rec;
+    std::string name = recs[i].names.substr(0, rec.name_len);
+    if (rec.type == PackRecord::kPut) {
+      PackEntry& e = index_[name];
+      e.container = rec.container;
+      e.offset = rec.offset;
+      e.length = rec.length;
+      e.mode = rec.mode;
+      e.time = rec.mtime;
+    } else if (rec.type == PackRecord::kDelete) {
+      index_.erase(name);
+    } else if (rec.type == PackRecord::kRename) {
+      Index::iterator it = index_.find(name);
+      if (it != index_.end()) {
+        PackEntry e = it->second;
+        index_.erase(it);
+        index_[recs[i].names.substr(rec.name_len)] = e;
+      }
+    }
+  }
+}
+
+// Return 1 if p names a regular file or directory, 0 if not, and -1 if its
+// parent cannot be read. Each directory is listed once.
+int Pack::Exists(const char* p) {
+  std::string dir, base;
+  SplitPath(p, &dir, &base);
+  std::unordered_map<std::string, NameSet>::iterator it = dirs_.find(dir);
+  if (it == dirs_.end()) {
+    int dirfd = posix_open(dir.c_str(), O_RDONLY | O_DIRECTORY, 0);
+    if (dirfd == -1 && errno == ENOENT && MakeShard(p) == 0) {
+      dirfd = posix_open(dir.c_str(), O_RDONLY | O_DIRECTORY, 0);
+    }
+    if (dirfd == -1) {
+      return -1;
+    }
+    DIR* d = fdopendir(dirfd);
+    if (d == NULL) {
+      posix_close(dirfd);
+      return -1;
+    }
+    NameSet names;
+    struct dirent* ent;
+    while ((ent = readdir(d)) != NULL) {
+      names.insert(ent->d_name);
+    }
+    closedir(d);
+    it = dirs_.insert(std::make_pair(dir, names)).first;
+  }
+  return it->second.count(base) != 0 ? 1 : 0;
+}
+
+void Pack::AddDir(const char* p) {
+  pthread_mutex_lock(&mu_);
+  std::string dir, base;
+  SplitPath(p, &dir, &base);
+  std::unordered_map<std::string, NameSet>::iterator it = dirs_.find(dir);
+  if (it != dirs_.end()) {
+    it->second.insert(base);
+  }
+  dirs_.insert(std::make_pair(std::string(p), NameSet()));
+  pthread_mutex_unlock(&mu_);
+}
+
+int Pack::ReadEntry(const PackEntry& e, std::string* data) {
+  data->clear();
+  if (e.container == -1 || e.length == 0) {
+    return 0;
+  }
+  int& fd = container_fds_[e.container];
+  if (fd == -1) {
+    fd = posix_open(containers_[e.container].c_str(), O_RDONLY, 0);
+    if (fd == -1) return -1;
+  }
+  data->resize(e.length);
+  off_t done = 0;
+  while (done < e.length) {
+    ssize_t n = posix_pread(fd, &(*data)[done], e.length - done,
+                            e.offset + done);
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+bool Pack::Open(const char* path, const char* p, int oflags, mode_t mode,
+                int* fd) {
+  pthread_mutex_lock(&mu_);
+  Index::iterator it = index_.find(path);
+  const bool excl = (oflags & O_CREAT) && (oflags & O_EXCL);
+  if (it == index_.end() && (!(oflags & O_CREAT) || excl || Exists(p) != 0)) {
+    // A regular file, or an error for the caller to report. Listings are
+    // not refreshed, so an exclusive create is left to the backend.
+    if (excl) {
+      std::string dir, base;
+      SplitPath(p, &dir, &base);
+      std::unordered_map<std::string, NameSet>::iterator d = dirs_.find(dir);
+      if (d != dirs_.end()) {
+        d->second.insert(base);
+      }
+    }
+    pthread_mutex_unlock(&mu_);
+    return false;
+  }
+  *fd = -1;
+  if (it != index_.end() && excl) {
+    errno = EEXIST;
+    pthread_mutex_unlock(&mu_);
+    return true;
+  }
+  int cmd = (oflags & O_CLOEXEC) ? F_DUPFD_CLOEXEC : F_DUPFD;
+  int h = posix_fcntl1(null_fd_, cmd, 0);
+  if (h == -1) {
+    pthread_mutex_unlock(&mu_);
+    return true;
+  }
+  PackedFile* f;
+  std::unordered_map<std::string, PackedFile*>::iterator o = open_.find(path);
+  if (o != open_.end()) {
+    f = o->second;
+  } else {
+    f = new PackedFile;
+    f->name = path;
+    if (it == index_.end()) {
+      f->mode = mode & 07777;
+      f->time = NowNanos();
+      f->dirty = true;
+      PackEntry e = {-1, 0, 0, f->mode, f->time};
+      index_[path] = e;
+    } else {
+      f->mode = it->second.mode;
+      f->time = it->second.time;
+      f->dirty = false;
+      if (ReadEntry(it->second, &f->data) != 0) {
+        int err = errno;
+        delete f;
+        posix_close(h);
+        errno = err;
+        pthread_mutex_unlock(&mu_);
+        return true;
+      }
+    }
+    open_[path] = f;
+  }
+  if ((oflags & O_TRUNC) && (oflags & O_ACCMODE) != O_RDONLY) {
+    f->data.clear();
+    f->time = NowNanos();
+    f->dirty = true;
+  }
+  PackHandle ph = {f, oflags, 0};
+  handles_[h] = ph;
+  f->fds.push_back(h);
+  __atomic_add_fetch(&num_handles_, 1, __ATOMIC_RELEASE);
+  *fd = h;
+  pthread_mutex_unlock(&mu_);
+  return true;
+}
+
+void Pack::FillStat(const std::string& name, off_t size, mode_t mode,
+                    uint64_t time, struct stat* buf) const {
+  memset(buf, 0, sizeof(*buf));
+  buf->st_dev = dev_;
+  buf->st_ino = std::hash<std::string>()(name);
+  buf->st_mode = S_IFREG | mode;
+  buf->st_nlink = 1;
+  buf->st_uid = getuid();
+  buf->st_gid = getgid();
+  buf->st_size = size;
+  buf->st_blksize = 4096;
+  buf->st_blocks = (size + 511) / 512;
+  buf->st_mtim.tv_sec = time / 1000000000ULL;
+  buf->st_mtim.tv_nsec = time % 1000000000ULL;
+  buf->st_ctim = buf->st_atim = buf->st_mtim;
+}
+
+bool Pack::Stat(const char* path, struct stat* buf, int* r) {
+  pthread_mutex_lock(&mu_);
+  bool found = true;
+  std::unordered_map<std::string, PackedFile*>::iterator o = open_.find(path);
+  Index::iterator it;
+  if (o != open_.end()) {
+    PackedFile* f = o->second;
+    FillStat(f->name, f->data.size(), f->mode, f->time, buf);
+  } else if ((it = index_.find(path)) != index_.end()) {
+    const PackEntry& e = it->second;
+    FillStat(it->first, e.length, e.mode, e.time, buf);
+  } else {
+    found = false;
+  }
+  pthread_mutex_unlock(&mu_);
+  *r = 0;
+  return found;
+}
+
+// A regular file renamed over a packed one replaces it, and a packed file
+// renamed over a regular one removes it.
+bool Pack::Rename(const char* oldpath, const char* newpath, const char* q,
+                  int* r) {
+  pthread_mutex_lock(&mu_);
+  Index::iterator it = index_.find(oldpath);
+  if (it == index_.end()) {
+    *r = 0;
+    Index::iterator dst = index_.find(newpath);
+    if (dst != index_.end()) {
+      PackRecord rec = {PackRecord::kDelete, uint32_t(strlen(newpath))};
+      rec.time = NowNanos();
+      if (dst->second.container == -1 ||
+          AppendRecord(rec, newpath) == 0) {
+        index_.erase(dst);
+      } else {
+        *r = -1;
+      }
+    }
+    // The regular file shows up at newpath if the rename succeeds
+    std::string dir, base;
+    SplitPath(q, &dir, &base);
+    std::unordered_map<std::string, NameSet>::iterator d = dirs_.find(dir);
+    if (d != dirs_.end()) {
+      d->second.insert(base);
+    }
+    pthread_mutex_unlock(&mu_);
+    return *r != 0;  // Otherwise the caller renames the regular file
+  }
+  PackEntry e = it->second;
+  if (e.container != -1) {
+    PackRecord rec = {PackRecord::kRename, uint32_t(strlen(oldpath)),
+                      uint32_t(strlen(newpath))};
+    rec.time = NowNanos();
+    if (AppendRecord(rec, std::string(oldpath) + newpath) != 0) {
+      *r = -1;
+      pthread_mutex_unlock(&mu_);
+      return true;
+    }
+  }
+  index_.erase(it);
+  index_[newpath] = e;
+  std::unordered_map<std::string, PackedFile*>::iterator o =
+      open_.find(oldpath);
+  if (o != open_.end()) {
+    PackedFile* f = o->second;
+    open_.erase(o);
+    f->name = newpath;
+    open_[newpath] = f;
+  }
+  if (Exists(q) == 1) {
+    std::string dir, base;
+    SplitPath(q, &dir, &base);
+    posix_unlink(q);
+    dirs_[dir].erase(base);
+  }
+  *r = 0;
+  pthread_mutex_unlock(&mu_);
+  return true;
+}
+
+int Pack::AppendRecord(const PackRecord& rec, const std::string& names) {
+  if (log_fd_ == -1) {
+    std::string log = dir_ + "/index." + id_;
+    log_fd_ = posix_open(log.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (log_fd_ == -1) return -1;
+  }
+  std::string buf(reinterpret_cast<const char*>(&rec), sizeof(rec));
+  buf.append(names);
+  if (posix_write(log_fd_, buf.data(), buf.size()) != buf.size()) {
+    return -1;
+  }
+  return 0;
+}
+
+// Append the content of f to the current container, starting a new one
+// once it is full. Containers are never reused so records of a process
+// with the same id from an earlier run stay valid.
+int Pack::Persist(PackedFile* f) {
+  const off_t size = f->data.size();
+  if (data_fd_ == -1 ||
+      (data_tail_ != 0 && data_tail_ + size > container_size_)) {
+    if (data_fd_ != -1) data_seq_++;
+    int fd = -1;
+    std::string path;
+    while (fd == -1) {
+      char tmp[32];
+      snprintf(tmp, sizeof(tmp), ".%llu",
+               static_cast<unsigned long long>(data_seq_));
+      path = dir_ + "/data." + id_ + tmp;
+      fd = posix_open(path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+      if (fd == -1 && errno != EEXIST) {
+        return -1;
+      } else if (fd == -1) {
+        data_seq_++;
+      }
+    }
+    containers_.push_back(path);
+    container_fds_.push_back(fd);
+    data_fd_ = fd;
+    data_index_ = containers_.size() - 1;
+    data_tail_ = 0;
+  }
+  off_t done = 0;
+  while (done < size) {
+    ssize_t n = posix_pwrite(data_fd_, f->data.data() + done, size - done,
+                             data_tail_ + done);
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      return -1;
+    }
+    done += n;
+  }
+  PackRecord rec = {PackRecord::kPut, uint32_t(f->name.size()), 0,
+                    uint32_t(f->mode)};
+  rec.container = data_seq_;
+  rec.offset = data_tail_;
+  rec.length = size;
+  rec.mtime = f->time;
+  rec.time = NowNanos();
+  if (AppendRecord(rec, f->name) != 0) {
+    return -1;
+  }
+  PackEntry e = {data_index_, data_tail_, size, f->mode, f->time};
+  index_[f->name] = e;
+  data_tail_ += size;
+  f->dirty = false;
+  return 0;
+}
+
+// The name of f may have been taken over by a rename.
+void Pack::ForgetFile(PackedFile* f) {
+  std::unordered_map<std::string, PackedFile*>::iterator o =
+      open_.find(f->name);
+  if (o != open_.end() && o->second == f) {
+    open_.erase(o);
+  }
+  delete f;
+}
+
+// Move f to a regular file. Each descriptor is replaced in place by one
+// of its own on the new file so offsets stay independent. Nothing is
+// moved, and f stays packed, unless every descriptor can be replaced.
+int Pack::Spill(PackedFile* f) {
+  char p[PATH_MAX];
+  if (!ShardedPath(root_, f->name.c_str(), p)) {
+    return -1;
+  }
+  int fd = OpenFile(p, O_RDWR | O_CREAT | O_TRUNC, f->mode);
+  if (fd == -1) {
+    return -1;
+  }
+  off_t done = 0;
+  const off_t size = f->data.size();
+  while (done < size) {
+    ssize_t n = posix_pwrite(fd, f->data.data() + done, size - done, done);
+    if (n <= 0) {
+      if (n == 0) errno = EIO;
+      break;
+    }
+    done += n;
+  }
+  posix_close(fd);
+  std::vector<int> tmps;
+  while (done == size && tmps.size() < f->fds.size()) {
+    const PackHandle& ph = handles_[f->fds[tmps.size()]];
+    int tmp = posix_open(p, O_RDWR | (ph.flags & O_APPEND), 0);
+    if (tmp == -1) break;
+    tmps.push_back(tmp);
+  }
+  if (tmps.size() < f->fds.size()) {
+    int err = errno;
+    for (size_t i = 0; i < tmps.size(); i++) {
+      posix_close(tmps[i]);
+    }
+    posix_unlink(p);
+    errno = err;
+    return -1;
+  }
+  for (size_t i = 0; i < f->fds.size(); i++) {
+    int h = f->fds[i];
+    const PackHandle& ph = handles_[h];
+    while (dup2(tmps[i], h) == -1 && (errno == EINTR || errno == EBUSY)) {
+    }
+    posix_close(tmps[i]);
+    if (ph.flags & O_CLOEXEC) {
+      posix_fcntl1(h, F_SETFD, FD_CLOEXEC);
+    }
+    lseek(h, ph.off, SEEK_SET);
+    handles_.erase(h);
+    __atomic_sub_fetch(&num_handles_, 1, __ATOMIC_RELEASE);
+  }
+  Index::iterator it = index_.find(f->name);
+  if (it != index_.end() && it->second.container != -1) {
+    PackRecord rec = {PackRecord::kDelete, uint32_t(f->name.size())};
+    rec.time = NowNanos();
+    AppendRecord(rec, f->name);
+  }
+  if (it != index_.end()) {
+    index_.erase(it);
+  }
+  std::string dir, base;
+  SplitPath(p, &dir, &base);
+  std::unordered_map<std::string, NameSet>::iterator d = dirs_.find(dir);
+  if (d != dirs_.end()) {
+    d->second.insert(base);
+  }
+  ForgetFile(f);
+  return 0;
+}
+
+bool Pack::Io(int fd, const struct iovec* iov, int iovcnt, off_t off,
+              bool write, ssize_t* r) {
+  if (!MayOwn(fd)) return false;
+  pthread_mutex_lock(&mu_);
+  std::unordered_map<int, PackHandle>::iterator it = handles_.find(fd);
+  if (it == handles_.end()) {
+    pthread_mutex_unlock(&mu_);
+    return false;
+  }
+  PackHandle& h = it->second;
+  PackedFile* f = h.file;
+  off_t pos = (off >= 0) ? off : h.off;
+  int mode = h.flags & O_ACCMODE;
+  size_t n = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    n += iov[i].iov_len;
+  }
+  if (write ? mode == O_RDONLY : mode == O_WRONLY) {
+    errno = EBADF;
+    *r = -1;
+  } else if (write) {
+    if (h.flags & O_APPEND) pos = f->data.size();
+    if (pos + n > f->data.size()) {
+      f->data.resize(pos + n);
+    }
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(&f->data[pos], iov[i].iov_base, iov[i].iov_len);
+      pos += iov[i].iov_len;
+    }
+    if (off < 0) h.off = pos;
+    f->time = NowNanos();
+    f->dirty = true;
+    *r = n;
+    if (f->data.size() > max_file_ && Spill(f) != 0) {
+      *r = -1;
+    }
+  } else {
+    size_t done = 0;
+    for (int i = 0; i < iovcnt && pos < f->data.size(); i++) {
+      size_t k = std::min<size_t>(iov[i].iov_len, f->data.size() - pos);
+      memcpy(iov[i].iov_base, f->data.data() + pos, k);
+      pos += k;
+      done += k;
+    }
+    if (off < 0) h.off = pos;
+    *r = done;
+  }
+  pthread_mutex_unlock(&mu_);
+  return true;
+}
+
+bool Pack::Fstat(int fd, struct stat* buf, int* r) {
+  if (!MayOwn(fd)) return false;
+  pthread_mutex_lock(&mu_);
+  std::unordered_map<int, PackHandle>::iterator it = handles_.find(fd);
+  bool found = it != handles_.end();
+  if (found) {
+    PackedFile* f = it->second.file;
+    FillStat(f->name, f->data.size(), f->mode, f->time, buf);
+    *r = 0;
+  }
+  pthread_mutex_unlock(&mu_);
+  return found;
+}
+
+bool Pack::Ftruncate(int fd, off_t length, int* r) {
+  if (!MayOwn(fd)) return false;
+  pthread_mutex_lock(&mu_);
+  std::unordered_map<int, PackHandle>::iterator it = handles_.find(fd);
+  bool found = it != handles_.end();
+  if (found) {
+    PackedFile* f = it->second.file;
+    *r = 0;
+    if ((it->second.flags & O_ACCMODE) == O_RDONLY || length < 0) {
+      errno = (length < 0) ? EINVAL : EBADF;
+      *r = -1;
+    } else {
+      f->data.resize(length);
+      f->time = NowNanos();
+      f->dirty = true;
+      if (f->data.size() > max_file_ && Spill(f) != 0) {
+        *r = -1;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mu_);
+  return found;
+}
+
+// The content of a file is written out when its last descriptor is closed.
+// A packed file is written out ahead of its close.
+bool Pack::Fsync(int fd, int datasync, int* r) {
+  if (!MayOwn(fd)) return false;
+  pthread_mutex_lock(&mu_);
+  std::unordered_map<int, PackHandle>::iterator it = handles_.find(fd);
+  bool found = it != handles_.end();
+  if (found) {
+    PackedFile* f = it->second.file;
+    *r = 0;
+    if (f->dirty && Persist(f) != 0) {
+      *r = -1;
+    } else if (data_fd_ != -1 && (datasync ? posix_fdatasync(data_fd_)
+                                           : posix_fsync(data_fd_)) != 0) {
+      *r = -1;
+    } else if (log_fd_ != -1 && (datasync ? posix_fdatasync(log_fd_)
+                                          : posix_fsync(log_fd_)) != 0) {
+      *r = -1;
+    }
+  }
+  pthread_mutex_unlock(&mu_);
+  return found;
+}
+
+bool Pack::Close(int fd, int* r) {
+  if (!MayOwn(fd)) return false;
+  pthread_mutex_lock(&mu_);
+  std::unordered_map<int, PackHandle>::iterator it = handles_.find(fd);
+  if (it == handles_.end()) {
+    pthread_mutex_unlock(&mu_);
+    return false;
+  }
+  PackedFile* f = it->second.file;
+  handles_.erase(it);
+  __atomic_sub_fetch(&num_handles_, 1, __ATOMIC_RELEASE);
+  f->fds.erase(std::find(f->fds.begin(), f->fds.end(), fd));
+  *r = 0;
+  if (f->fds.empty()) {
+    if (f->dirty && Persist(f) != 0) {
+      *r = -1;
+    }
+    ForgetFile(f);
+  }
+  pthread_mutex_unlock(&mu_);
+  int err = errno;
+  posix_close(fd);
+  errno = err;
+  return true;
+}
+
+void Pack::FlushOpen() {
+  pthread_mutex_lock(&mu_);
+  for (std::unordered_map<std::string, PackedFile*>::iterator it =
+           open_.begin();
+       it != open_.end(); ++it) {
+    if (it->second->dirty) {
+      Persist(it->second);
+    }
+  }
+  pthread_mutex_unlock(&mu_);
+}
+
+// A forked child writes logs and containers of its own. Files it inherited
+// open are written out by the parent, so the child writes out only those
+// it changes.
+void Pack::AfterFork() {
+  pthread_mutex_init(&mu_, NULL);
+  for (std::unordered_map<std::string, PackedFile*>::iterator it =
+           open_.begin();
+       it != open_.end(); ++it) {
+    it->second->dirty = false;
+  }
+  id_ = ProcessId();
+  if (log_fd_ != -1) {
+    posix_close(log_fd_);
+    log_fd_ = -1;
+  }
+  data_fd_ = -1;
+  data_seq_ = 0;
+  data_tail_ = 0;
+}
+
+struct Context : public LocalRoot {
+  Stage* stage;  // NULL if files are not staged
+  Pack* pack;  // NULL if small files are not packed
+
+  // The full path of a file, which is in a shard if directories are
+  // sharded.
+  bool FilePath(const char* path, char* buf) const {
+    return ShardedPath(pdlfs_root, path, buf);
+  }
+
+  // The full path at which to create a file. This is the plain path if
+  // directories are sharded but a file or directory of that name was made
+  // before sharding, in which case *old is set.
+  bool CreatePath(const char* path, char* buf, bool* old = NULL) const {
+    return PathToCreate(pdlfs_root, path, buf, old);
+  }
+
+  explicit Context() : stage(NULL), pack(NULL) {
+    const char* env = getenv("PDLFS_StageDir");
+    if (env != NULL && env[0] != 0) {
+      std::string dir = env;
+      while (dir.length() != 1 && dir[dir.size() - 1] == '/') {
+        dir.resize(dir.size() - 1);
+      }
+      unsigned long long capacity = 1ULL << 30;
+      env = getenv("PDLFS_StageCapacity");
+      if (env != NULL && strtoull(env, NULL, 10) > 0) {
+        capacity = strtoull(env, NULL, 10);
+      }
+      size_t drain_size = 8 << 20;
+      env = getenv("PDLFS_StageDrainSize");
+      if (env != NULL && strtoull(env, NULL, 10) > 0) {
+        drain_size = strtoull(env, NULL, 10);
+      }
+      stage = new Stage(dir, pdlfs_root, capacity, drain_size);
+    }
+    env = getenv("PDLFS_DirShards");
+    if (env != NULL) {
+      dir_shards = strtoul(env, NULL, 10);
+    }
+    env = getenv("PDLFS_Pack");
+    if (env != NULL && atoi(env) != 0) {
+      size_t max_file = 1 << 20;
+      env = getenv("PDLFS_PackMaxFile");
+      if (env != NULL && strtoull(env, NULL, 10) > 0) {
+        max_file = strtoull(env, NULL, 10);
+      }
+      unsigned long long container_size = 1ULL << 30;
+      env = getenv("PDLFS_PackContainerSize");
+      if (env != NULL && strtoull(env, NULL, 10) > 0) {
+        container_size = strtoull(env, NULL, 10);
+      }
+      pack = new Pack(pdlfs_root, max_file, container_size);
     }
-    pdlfs_root = root;
-    Init();
   }
 };
 }  // namespace
@@ -48,9 +1361,31 @@ struct Context {
 static pthread_once_t once = PTHREAD_ONCE_INIT;
 static Context* api_ctx = NULL;
 
+// Packed files left open and staged files must reach the capacity tier
+// before the process goes away. Run as a destructor, after the atexit
+// handler of the preload library has written out streams and mappings
+// that are still open.
+__attribute__((destructor)) static void FlushAtExit() {
+  if (api_ctx == NULL) return;
+  if (api_ctx->pack != NULL) api_ctx->pack->FlushOpen();
+  if (api_ctx->stage != NULL) api_ctx->stage->Flush();
+}
+
+static void PackAfterFork() { api_ctx->pack->AfterFork(); }
+
 static void InitContext() {
   Context* ctx = new Context;
   api_ctx = ctx;
+  if (ctx->pack != NULL) {
+    pthread_atfork(NULL, NULL, &PackAfterFork);
+  }
+}
+
+// Return true if fd is a packed file, with the result in *r.
+static inline bool PackedIo(int fd, const struct iovec* iov, int iovcnt,
+                            off_t off, bool write, ssize_t* r) {
+  return api_ctx->pack != NULL &&
+         api_ctx->pack->Io(fd, iov, iovcnt, off, write, r);
 }
 
 extern "C" {
@@ -63,10 +1398,28 @@ int pdlfs_mkdir(const char* path, mode_t mode) {
   assert(path != NULL);
   assert(path[0] == '/');
 
-  std::string p = api_ctx->pdlfs_root;
-  p += path;
+  char p[PATH_MAX];
+  if (!api_ctx->FullPath(path, p)) {
+    return -1;
+  }
 
-  return posix_mkdir(p.c_str(), mode);
+  if (dir_shards != 0) {
+    char s[PATH_MAX];
+    if (!api_ctx->FilePath(path, s)) {
+      return -1;
+    }
+    if (posix_access(s, F_OK) == 0) {
+      errno = EEXIST;
+      return -1;
+    }
+  }
+
+  int r = posix_mkdir(p, mode);
+  if (r == 0 && api_ctx->pack != NULL) {
+    api_ctx->pack->AddDir(p);
+  }
+
+  return r;
 }
 
 int pdlfs_open(const char* path, int oflags, mode_t mode, struct stat* buf) {
@@ -77,15 +1430,42 @@ int pdlfs_open(const char* path, int oflags, mode_t mode, struct stat* buf) {
   assert(path != NULL);
   assert(path[0] == '/');
 
-  std::string p = api_ctx->pdlfs_root;
-  p += path;
+  // Directories are never in a shard
+  bool plain = dir_shards == 0 || (oflags & O_DIRECTORY) != 0;
+  char p[PATH_MAX];
+  bool old = false;  // Made before sharding, so known to exist
+  bool ok;
+  if (plain) {
+    ok = api_ctx->FullPath(path, p);
+  } else if (oflags & O_CREAT) {
+    ok = api_ctx->CreatePath(path, p, &old);
+  } else {
+    ok = api_ctx->FilePath(path, p);
+  }
+  if (!ok) {
+    return -1;
+  }
 
-  int fd = posix_open(p.c_str(), oflags, mode);
+  int fd;
+  // New files are packed rather than staged if both are enabled
+  bool packed = api_ctx->pack != NULL && !old &&
+                api_ctx->pack->Open(path, p, oflags, mode, &fd);
+  if (!packed && (api_ctx->stage == NULL ||
+                  !api_ctx->stage->Open(path, oflags, mode, &fd))) {
+    fd = OpenFile(p, oflags, mode);
+    if (fd == -1 && errno == ENOENT && !plain && !(oflags & O_CREAT)) {
+      // A directory, or a file made before sharding
+      if (!api_ctx->FullPath(path, p)) {
+        return -1;
+      }
+      fd = posix_open(p, oflags, mode);
+    }
+  }
   if (fd != -1) {
-    int r = posix_fstat(fd, buf);
+    int r = pdlfs_fstat(fd, buf);
     if (r == -1) {
       int err = errno;
-      posix_close(fd);
+      pdlfs_close(fd);
       errno = err;
       return -1;
     }
@@ -102,31 +1482,175 @@ int pdlfs_creat(const char* path, mode_t mode) {
   assert(path != NULL);
   assert(path[0] == '/');
 
-  std::string p = api_ctx->pdlfs_root;
-  p += path;
+  char p[PATH_MAX];
+  if (!api_ctx->CreatePath(path, p)) {
+    return -1;
+  }
 
-  return posix_creat(p.c_str(), mode);
+  return OpenFile(p, O_CREAT | O_WRONLY | O_TRUNC, mode);
 }
 
 ssize_t pdlfs_pread(int fd, void* buf, size_t sz, off_t off) {
+  struct iovec iov = {buf, sz};
+  ssize_t r;
+  if (PackedIo(fd, &iov, 1, off, false, &r)) return r;
   return posix_pread(fd, buf, sz, off);
 }
 
 ssize_t pdlfs_read(int fd, void* buf, size_t sz) {
+  struct iovec iov = {buf, sz};
+  ssize_t r;
+  if (PackedIo(fd, &iov, 1, -1, false, &r)) return r;
   return posix_read(fd, buf, sz);
 }
 
 ssize_t pdlfs_pwrite(int fd, const void* buf, size_t sz, off_t off) {
+  struct iovec iov = {const_cast<void*>(buf), sz};
+  ssize_t r;
+  if (PackedIo(fd, &iov, 1, off, true, &r)) return r;
   return posix_pwrite(fd, buf, sz, off);
 }
 
 ssize_t pdlfs_write(int fd, const void* buf, size_t sz) {
+  struct iovec iov = {const_cast<void*>(buf), sz};
+  ssize_t r;
+  if (PackedIo(fd, &iov, 1, -1, true, &r)) return r;
   return posix_write(fd, buf, sz);
 }
 
-int pdlfs_fstat(int fd, struct stat* buf) { return posix_fstat(fd, buf); }
+ssize_t pdlfs_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  ssize_t r;
+  if (PackedIo(fd, iov, iovcnt, off, false, &r)) return r;
+  return posix_preadv(fd, iov, iovcnt, off);
+}
+
+ssize_t pdlfs_readv(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t r;
+  if (PackedIo(fd, iov, iovcnt, -1, false, &r)) return r;
+  return posix_readv(fd, iov, iovcnt);
+}
+
+ssize_t pdlfs_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  ssize_t r;
+  if (PackedIo(fd, iov, iovcnt, off, true, &r)) return r;
+  return posix_pwritev(fd, iov, iovcnt, off);
+}
+
+ssize_t pdlfs_writev(int fd, const struct iovec* iov, int iovcnt) {
+  ssize_t r;
+  if (PackedIo(fd, iov, iovcnt, -1, true, &r)) return r;
+  return posix_writev(fd, iov, iovcnt);
+}
+
+int pdlfs_stat(const char* path, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  int r;
+  if (api_ctx->pack != NULL && api_ctx->pack->Stat(path, buf, &r)) {
+    return r;
+  }
+  if (api_ctx->stage != NULL && api_ctx->stage->Stat(path, buf, &r)) {
+    return r;
+  }
+  if (dir_shards != 0) {
+    char s[PATH_MAX];
+    if (!api_ctx->FilePath(path, s)) {
+      return -1;
+    }
+    r = posix_stat(s, buf);
+    if (r == 0 || errno != ENOENT) {
+      return r;
+    }
+    // A directory, or a file made before sharding
+  }
+
+  return api_ctx->Stat(path, buf);
+}
+
+int pdlfs_rename(const char* oldpath, const char* newpath) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(oldpath != NULL && newpath != NULL);
+  assert(oldpath[0] == '/' && newpath[0] == '/');
+
+  char s[PATH_MAX];
+  char t[PATH_MAX];
+  if (!api_ctx->FilePath(oldpath, s) || !api_ctx->CreatePath(newpath, t)) {
+    return -1;
+  }
+
+  int r;
+  if (api_ctx->pack != NULL &&
+      api_ctx->pack->Rename(oldpath, newpath, t, &r)) {
+    return r;
+  }
+  if (api_ctx->stage != NULL &&
+      api_ctx->stage->Rename(oldpath, newpath, &r)) {
+    return r;
+  }
+  if (dir_shards != 0) {
+    if (posix_access(s, F_OK) != 0 && errno == ENOENT) {
+      // A directory, or a file made before sharding, which moves to the
+      // shard of its new name
+      struct stat st;
+      if (!api_ctx->FullPath(oldpath, s)) {
+        return -1;
+      }
+      if (posix_stat(s, &st) == 0 && S_ISDIR(st.st_mode)) {
+        return api_ctx->Rename(oldpath, newpath);
+      }
+    }
+    r = posix_rename(s, t);
+    if (r == -1 && errno == ENOENT && posix_access(s, F_OK) == 0 &&
+        MakeShard(t) == 0) {
+      r = posix_rename(s, t);
+    }
+    return r;
+  }
+
+  return api_ctx->Rename(oldpath, newpath);
+}
+
+int pdlfs_fstat(int fd, struct stat* buf) {
+  int r;
+  if (api_ctx->pack != NULL && api_ctx->pack->Fstat(fd, buf, &r)) {
+    return r;
+  }
+  return posix_fstat(fd, buf);
+}
+
+int pdlfs_ftruncate(int fd, off_t length) {
+  int r;
+  if (api_ctx->pack != NULL && api_ctx->pack->Ftruncate(fd, length, &r)) {
+    return r;
+  }
+  return posix_ftruncate(fd, length);
+}
+
+int pdlfs_fsync(int fd, int datasync) {
+  int r;
+  if (api_ctx->pack != NULL && api_ctx->pack->Fsync(fd, datasync, &r)) {
+    return r;
+  }
+  return datasync ? posix_fdatasync(fd) : posix_fsync(fd);
+}
 
 int pdlfs_close(int fd) {
+  int r;
+  if (api_ctx->pack != NULL && api_ctx->pack->Close(fd, &r)) {
+    return r;
+  }
+  if (api_ctx->stage != NULL) {
+    api_ctx->stage->Close(fd);
+  }
   posix_close(fd);
   return 0;
 }
@@ -0,0 +1,583 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+// Same files as the posix backend, but positional reads and writes go
+// through a per-thread io_uring instead of one blocking syscall each.
+// Large transfers are split into chunks submitted together so the device
+// sees a deep queue. Files are registered with each ring on first use,
+// and dropped from all rings on close, and small transfers use a
+// registered bounce buffer. Falls back to plain syscalls if io_uring is
+// not available. Namespace operations are those of LocalRoot.
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#endif
+
+#include "local_root.h"
+#include "pdlfs-preload/pdlfs_api.h"
+#include "posix_api.h"
+
+namespace {
+
+struct Context : public LocalRoot {
+  unsigned entries;      // Ring size
+  size_t chunk_size;     // Max bytes per request
+  size_t fixed_size;     // Size of the registered bounce buffer, 0 if none
+
+  explicit Context() : entries(64), chunk_size(1 << 20), fixed_size(64 << 10) {
+    const char* env = getenv("PDLFS_UringEntries");
+    if (env != NULL && atoi(env) > 0) entries = atoi(env);
+    env = getenv("PDLFS_UringChunk");
+    if (env != NULL && strtoull(env, NULL, 10) > 0) {
+      chunk_size = strtoull(env, NULL, 10);
+    }
+    env = getenv("PDLFS_UringFixedBuffer");
+    if (env != NULL) fixed_size = strtoull(env, NULL, 10);
+  }
+};
+}  // namespace
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static Context* api_ctx = NULL;
+
+static void InitContext() {
+  Context* ctx = new Context;
+  api_ctx = ctx;
+}
+
+#ifdef __NR_io_uring_setup
+namespace {
+
+enum { kMaxFixedFiles = 4096 };
+
+// An io_uring owned by a single thread. Each call submits all of its
+// requests at once and waits for them to complete.
+class Ring {
+ public:
+  static Ring* Open(const Context* ctx);
+  ~Ring();
+
+  // Transfer the segments at off. Return the number of bytes transferred,
+  // stopping at the first short transfer, or -1 if nothing was transferred.
+  ssize_t Rw(bool write, int fd, const struct iovec* iov, int iovcnt,
+             off_t off);
+
+  // Drop fd from the ring's file table, which otherwise keeps the file
+  // open after it is closed. May be called from any thread.
+  void Unregister(int fd);
+
+ private:
+  Ring() {}
+
+  ssize_t RwFixed(bool write, int fd, const struct iovec* iov, int iovcnt,
+                  size_t total, off_t off);
+  int FileIndex(int fd);
+  struct io_uring_sqe* NextSqe();
+  void SubmitAndWait(unsigned n, std::vector<int>* results);
+
+  int ring_fd_;
+  void* sq_ptr_;
+  size_t sq_size_;
+  void* cq_ptr_;
+  size_t cq_size_;
+  struct io_uring_sqe* sqes_;
+  size_t sqes_size_;
+  unsigned* sq_head_;
+  unsigned* sq_tail_;
+  unsigned* sq_mask_;
+  unsigned* sq_array_;
+  unsigned* cq_head_;
+  unsigned* cq_tail_;
+  unsigned* cq_mask_;
+  struct io_uring_cqe* cqes_;
+  unsigned entries_;
+  size_t chunk_size_;
+  char* fixed_buf_;  // NULL if buffers could not be registered
+  size_t fixed_size_;
+  bool fixed_files_;  // Whether a sparse file table was registered
+  std::vector<unsigned char> registered_;  // Indexed by fd
+  std::vector<struct iovec> iovs_;
+
+  // No copying allowed
+  Ring(const Ring&);
+  void operator=(const Ring&);
+};
+
+static int Setup(unsigned entries, struct io_uring_params* p) {
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int Enter(int fd, unsigned to_submit, unsigned min_complete) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                 IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int Register(int fd, unsigned opcode, void* arg, unsigned nr) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+Ring* Ring::Open(const Context* ctx) {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  int fd = Setup(ctx->entries, &p);
+  if (fd == -1) {
+    return NULL;
+  }
+  Ring* r = new Ring;
+  r->ring_fd_ = fd;
+  r->sq_size_ = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  const bool single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+  if (single_mmap) {
+    if (r->cq_size_ > r->sq_size_) r->sq_size_ = r->cq_size_;
+    r->cq_size_ = r->sq_size_;
+  }
+  r->sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sq_ptr_ = posix_mmap(NULL, r->sq_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  r->cq_ptr_ = single_mmap ? r->sq_ptr_
+                           : posix_mmap(NULL, r->cq_size_,
+                                        PROT_READ | PROT_WRITE,
+                                        MAP_SHARED | MAP_POPULATE, fd,
+                                        IORING_OFF_CQ_RING);
+  void* sqes = posix_mmap(NULL, r->sqes_size_, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  if (r->sq_ptr_ == MAP_FAILED || r->cq_ptr_ == MAP_FAILED ||
+      sqes == MAP_FAILED) {
+    if (sqes != MAP_FAILED) posix_munmap(sqes, r->sqes_size_);
+    if (!single_mmap && r->cq_ptr_ != MAP_FAILED) {
+      posix_munmap(r->cq_ptr_, r->cq_size_);
+    }
+    if (r->sq_ptr_ != MAP_FAILED) posix_munmap(r->sq_ptr_, r->sq_size_);
+    posix_close(fd);
+    delete r;
+    return NULL;
+  }
+  char* sq = reinterpret_cast<char*>(r->sq_ptr_);
+  char* cq = reinterpret_cast<char*>(r->cq_ptr_);
+  r->sqes_ = reinterpret_cast<struct io_uring_sqe*>(sqes);
+  r->sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+  r->sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+  r->sq_mask_ = reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+  r->sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+  r->cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+  r->cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+  r->cq_mask_ = reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+  r->cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+  r->entries_ = p.sq_entries;
+  r->chunk_size_ = ctx->chunk_size;
+
+  r->fixed_buf_ = NULL;
+  r->fixed_size_ = 0;
+  void* buf;
+  if (ctx->fixed_size != 0 &&
+      posix_memalign(&buf, 4096, ctx->fixed_size) == 0) {
+    struct iovec iov;
+    iov.iov_base = buf;
+    iov.iov_len = ctx->fixed_size;
+    if (Register(fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0) {
+      r->fixed_buf_ = reinterpret_cast<char*>(buf);
+      r->fixed_size_ = ctx->fixed_size;
+    } else {
+      free(buf);
+    }
+  }
+
+  std::vector<int> fds(kMaxFixedFiles, -1);
+  r->fixed_files_ =
+      Register(fd, IORING_REGISTER_FILES, &fds[0], kMaxFixedFiles) == 0;
+  if (r->fixed_files_) {
+    r->registered_.resize(kMaxFixedFiles, 0);
+  }
+  return r;
+}
+
+// Closing the ring also drops its registered buffers and files.
+Ring::~Ring() {
+  posix_munmap(sqes_, sqes_size_);
+  if (cq_ptr_ != sq_ptr_) posix_munmap(cq_ptr_, cq_size_);
+  posix_munmap(sq_ptr_, sq_size_);
+  posix_close(ring_fd_);
+  free(fixed_buf_);
+}
+
+// Return the index fd is registered at, or -1 if it cannot be registered.
+int Ring::FileIndex(int fd) {
+  if (!fixed_files_ || fd < 0 || fd >= kMaxFixedFiles) {
+    return -1;
+  }
+  if (__atomic_load_n(&registered_[fd], __ATOMIC_ACQUIRE) == 0) {
+    struct io_uring_files_update update;
+    memset(&update, 0, sizeof(update));
+    update.offset = fd;
+    update.fds = reinterpret_cast<uintptr_t>(&fd);
+    if (Register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1) != 1) {
+      return -1;
+    }
+    __atomic_store_n(&registered_[fd], 1, __ATOMIC_RELEASE);
+  }
+  return fd;
+}
+
+void Ring::Unregister(int fd) {
+  if (!fixed_files_ || fd < 0 || fd >= kMaxFixedFiles ||
+      __atomic_load_n(&registered_[fd], __ATOMIC_ACQUIRE) == 0) {
+    return;
+  }
+  int none = -1;
+  struct io_uring_files_update update;
+  memset(&update, 0, sizeof(update));
+  update.offset = fd;
+  update.fds = reinterpret_cast<uintptr_t>(&none);
+  Register(ring_fd_, IORING_REGISTER_FILES_UPDATE, &update, 1);
+  __atomic_store_n(&registered_[fd], 0, __ATOMIC_RELEASE);
+}
+
+struct io_uring_sqe* Ring::NextSqe() {
+  unsigned tail = *sq_tail_;
+  unsigned idx = tail & *sq_mask_;
+  struct io_uring_sqe* sqe = &sqes_[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sq_array_[idx] = idx;
+  __atomic_store_n(sq_tail_, tail + 1, __ATOMIC_RELEASE);
+  return sqe;
+}
+
+// Submit n queued requests and wait for all of them. results[i] is the
+// result of the request whose user_data is i.
+void Ring::SubmitAndWait(unsigned n, std::vector<int>* results) {
+  unsigned to_submit = n;
+  unsigned reaped = 0;
+  while (reaped < n) {
+    int r = Enter(ring_fd_, to_submit, n - reaped);
+    if (r == -1) {
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+        continue;
+      }
+      fprintf(stderr, "!!! FATAL error: io_uring_enter failed (%d)\n", errno);
+      abort();
+    }
+    to_submit -= r;
+    unsigned head = *cq_head_;
+    while (head != __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &cqes_[head & *cq_mask_];
+      (*results)[cqe->user_data] = cqe->res;
+      head++;
+      reaped++;
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  }
+}
+
+// Small transfers go through the registered buffer as a single request.
+ssize_t Ring::RwFixed(bool write, int fd, const struct iovec* iov, int iovcnt,
+                      size_t total, off_t off) {
+  if (write) {
+    char* p = fixed_buf_;
+    for (int i = 0; i < iovcnt; i++) {
+      memcpy(p, iov[i].iov_base, iov[i].iov_len);
+      p += iov[i].iov_len;
+    }
+  }
+  int idx = FileIndex(fd);
+  struct io_uring_sqe* sqe = NextSqe();
+  sqe->opcode = write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED;
+  sqe->fd = idx != -1 ? idx : fd;
+  sqe->flags = idx != -1 ? IOSQE_FIXED_FILE : 0;
+  sqe->off = off;
+  sqe->addr = reinterpret_cast<uintptr_t>(fixed_buf_);
+  sqe->len = total;
+  sqe->buf_index = 0;
+  sqe->user_data = 0;
+  std::vector<int> results(1);
+  SubmitAndWait(1, &results);
+  if (results[0] < 0) {
+    errno = -results[0];
+    return -1;
+  }
+  if (!write) {
+    const char* p = fixed_buf_;
+    size_t left = results[0];
+    for (int i = 0; i < iovcnt && left != 0; i++) {
+      size_t n = iov[i].iov_len < left ? iov[i].iov_len : left;
+      memcpy(iov[i].iov_base, p, n);
+      p += n;
+      left -= n;
+    }
+  }
+  return results[0];
+}
+
+ssize_t Ring::Rw(bool write, int fd, const struct iovec* iov, int iovcnt,
+                 off_t off) {
+  size_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    total += iov[i].iov_len;
+  }
+  if (total == 0) {
+    return 0;
+  }
+  if (total <= fixed_size_) {
+    return RwFixed(write, fd, iov, iovcnt, total, off);
+  }
+
+  // Cut the segments into chunks, one request each
+  iovs_.clear();
+  for (int i = 0; i < iovcnt; i++) {
+    char* base = reinterpret_cast<char*>(iov[i].iov_base);
+    for (size_t done = 0; done < iov[i].iov_len; done += chunk_size_) {
+      struct iovec piece;
+      piece.iov_base = base + done;
+      piece.iov_len = iov[i].iov_len - done;
+      if (piece.iov_len > chunk_size_) piece.iov_len = chunk_size_;
+      iovs_.push_back(piece);
+    }
+  }
+  int idx = FileIndex(fd);
+  ssize_t transferred = 0;
+  off_t pos = off;
+  std::vector<int> results;
+  for (size_t first = 0; first < iovs_.size(); first += entries_) {
+    unsigned n = iovs_.size() - first;
+    if (n > entries_) n = entries_;
+    for (unsigned i = 0; i < n; i++) {
+      struct io_uring_sqe* sqe = NextSqe();
+      sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+      sqe->fd = idx != -1 ? idx : fd;
+      sqe->flags = idx != -1 ? IOSQE_FIXED_FILE : 0;
+      sqe->off = pos;
+      sqe->addr = reinterpret_cast<uintptr_t>(&iovs_[first + i]);
+      sqe->len = 1;
+      sqe->user_data = i;
+      pos += iovs_[first + i].iov_len;
+    }
+    results.assign(n, 0);
+    SubmitAndWait(n, &results);
+    for (unsigned i = 0; i < n; i++) {
+      if (results[i] < 0) {
+        if (transferred == 0) {
+          errno = -results[i];
+          return -1;
+        }
+        return transferred;
+      }
+      transferred += results[i];
+      if (static_cast<size_t>(results[i]) < iovs_[first + i].iov_len) {
+        return transferred;
+      }
+    }
+  }
+  return transferred;
+}
+}  // namespace
+
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ring_key;
+static pthread_mutex_t rings_mu = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<Ring*>* rings = NULL;  // Of all threads, guarded by rings_mu
+
+static void DeleteRing(void* arg) {
+  if (arg != reinterpret_cast<void*>(-1)) {
+    Ring* r = reinterpret_cast<Ring*>(arg);
+    pthread_mutex_lock(&rings_mu);
+    rings->erase(std::find(rings->begin(), rings->end(), r));
+    pthread_mutex_unlock(&rings_mu);
+    delete r;
+  }
+}
+
+// A forked child shares the kernel rings of its parent through the ring
+// fds and the queue memory mapped from them. The child drops its copies
+// without submitting or reaping anything, and its threads open new rings.
+static void RingsAfterFork() {
+  pthread_mutex_init(&rings_mu, NULL);
+  for (size_t i = 0; i < rings->size(); i++) {
+    delete (*rings)[i];
+  }
+  rings->clear();
+  pthread_setspecific(ring_key, NULL);
+}
+
+static void InitRingKey() {
+  rings = new std::vector<Ring*>;
+  pthread_key_create(&ring_key, &DeleteRing);
+  pthread_atfork(NULL, NULL, &RingsAfterFork);
+}
+
+// Return the calling thread's ring, or NULL if io_uring is not available.
+static Ring* ThreadRing() {
+  pthread_once(&ring_once, &InitRingKey);
+  void* r = pthread_getspecific(ring_key);
+  if (r == NULL) {
+    int err = errno;
+    Ring* ring = Ring::Open(api_ctx);
+    if (ring != NULL) {
+      pthread_mutex_lock(&rings_mu);
+      rings->push_back(ring);
+      pthread_mutex_unlock(&rings_mu);
+      r = ring;
+    } else {
+      r = reinterpret_cast<void*>(-1);  // Do not retry
+    }
+    pthread_setspecific(ring_key, r);
+    errno = err;
+  }
+  return r != reinterpret_cast<void*>(-1) ? reinterpret_cast<Ring*>(r) : NULL;
+}
+
+static ssize_t Rw(bool write, int fd, const struct iovec* iov, int iovcnt,
+                  off_t off) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+  Ring* ring = ThreadRing();
+  if (ring == NULL) {
+    return write ? posix_pwritev(fd, iov, iovcnt, off)
+                 : posix_preadv(fd, iov, iovcnt, off);
+  }
+  return ring->Rw(write, fd, iov, iovcnt, off);
+}
+
+// Drop fd from every ring before it is closed and its number reused.
+static void Forget(int fd) {
+  if (rings == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&rings_mu);
+  for (size_t i = 0; i < rings->size(); i++) {
+    (*rings)[i]->Unregister(fd);
+  }
+  pthread_mutex_unlock(&rings_mu);
+}
+#else
+static ssize_t Rw(bool write, int fd, const struct iovec* iov, int iovcnt,
+                  off_t off) {
+  return write ? posix_pwritev(fd, iov, iovcnt, off)
+               : posix_preadv(fd, iov, iovcnt, off);
+}
+
+static void Forget(int fd) {}
+#endif
+
+extern "C" {
+
+int pdlfs_mkdir(const char* path, mode_t mode) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  return api_ctx->Mkdir(path, mode);
+}
+
+int pdlfs_open(const char* path, int oflags, mode_t mode, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  return api_ctx->Open(path, oflags, mode, buf);
+}
+
+ssize_t pdlfs_pread(int fd, void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = sz;
+  return Rw(false, fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_read(int fd, void* buf, size_t sz) {
+  return posix_read(fd, buf, sz);
+}
+
+ssize_t pdlfs_pwrite(int fd, const void* buf, size_t sz, off_t off) {
+  struct iovec iov;
+  iov.iov_base = const_cast<void*>(buf);
+  iov.iov_len = sz;
+  return Rw(true, fd, &iov, 1, off);
+}
+
+ssize_t pdlfs_write(int fd, const void* buf, size_t sz) {
+  return posix_write(fd, buf, sz);
+}
+
+ssize_t pdlfs_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  return Rw(false, fd, iov, iovcnt, off);
+}
+
+ssize_t pdlfs_readv(int fd, const struct iovec* iov, int iovcnt) {
+  return posix_readv(fd, iov, iovcnt);
+}
+
+ssize_t pdlfs_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  return Rw(true, fd, iov, iovcnt, off);
+}
+
+ssize_t pdlfs_writev(int fd, const struct iovec* iov, int iovcnt) {
+  return posix_writev(fd, iov, iovcnt);
+}
+
+int pdlfs_stat(const char* path, struct stat* buf) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(path != NULL);
+  assert(path[0] == '/');
+
+  return api_ctx->Stat(path, buf);
+}
+
+int pdlfs_rename(const char* oldpath, const char* newpath) {
+  if (api_ctx == NULL) {
+    pthread_once(&once, &InitContext);
+  }
+
+  assert(oldpath != NULL && newpath != NULL);
+  assert(oldpath[0] == '/' && newpath[0] == '/');
+
+  return api_ctx->Rename(oldpath, newpath);
+}
+
+int pdlfs_fstat(int fd, struct stat* buf) { return posix_fstat(fd, buf); }
+
+int pdlfs_ftruncate(int fd, off_t length) {
+  return posix_ftruncate(fd, length);
+}
+
+int pdlfs_fsync(int fd, int datasync) {
+  return datasync ? posix_fdatasync(fd) : posix_fsync(fd);
+}
+
+int pdlfs_close(int fd) {
+  Forget(fd);
+  posix_close(fd);
+  return 0;
+}
+
+}  // extern C
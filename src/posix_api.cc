@@ -36,20 +36,53 @@ struct PosixAPI {
     LoadSym("read", &read);
     LoadSym("pwrite", &pwrite);
     LoadSym("write", &write);
+    LoadSym("preadv", &preadv);
+    LoadSym("readv", &readv);
+    LoadSym("pwritev", &pwritev);
+    LoadSym("writev", &writev);
+    LoadSym("__xstat", &xstat);
+    LoadSym("__lxstat", &lxstat);
     LoadSym("__fxstat", &fxstat);
+    LoadSym("access", &access);
+    LoadSym("rename", &rename);
+    LoadSym("unlink", &unlink);
     LoadSym("ftruncate", &ftruncate);
     LoadSym("fcntl", &fcntl);
+    LoadSym("fsync", &fsync);
+    LoadSym("fdatasync", &fdatasync);
     LoadSym("close", &close);
+    LoadSym("aio_read", &aio_read);
+    LoadSym("aio_write", &aio_write);
+    LoadSym("aio_fsync", &aio_fsync);
+    LoadSym("aio_suspend", &aio_suspend);
+    LoadSym("aio_cancel", &aio_cancel);
+    LoadSym("aio_error", &aio_error);
+    LoadSym("aio_return", &aio_return);
+    LoadSym("lio_listio", &lio_listio);
+    LoadSym("mmap", &mmap);
+    LoadSym("munmap", &munmap);
+    LoadSym("msync", &msync);
     LoadSym("fopen", &fopen);
     LoadSym("fread", &fread);
     LoadSym("fwrite", &fwrite);
     LoadSym("fseek", &fseek);
     LoadSym("ftell", &ftell);
     LoadSym("fflush", &fflush);
+    LoadSym("setvbuf", &setvbuf);
     LoadSym("fclose", &fclose);
     LoadSym("clearerr", &clearerr);
     LoadSym("ferror", &ferror);
     LoadSym("feof", &feof);
+    LoadSym("fseeko", &fseeko);
+    LoadSym("ftello", &ftello);
+    LoadSym("rewind", &rewind);
+    LoadSym("vfprintf", &vfprintf);
+    LoadSym("fputs", &fputs);
+    LoadSym("fputc", &fputc);
+    LoadSym("fgets", &fgets);
+    LoadSym("fgetc", &fgetc);
+    LoadSym("ungetc", &ungetc);
+    LoadSym("fileno", &fileno);
   }
 
   int (*mkdir)(const char*, mode_t);
@@ -59,20 +92,53 @@ struct PosixAPI {
   ssize_t (*read)(int, void*, size_t);
   ssize_t (*pwrite)(int, const void*, size_t, off_t);
   ssize_t (*write)(int, const void*, size_t);
+  ssize_t (*preadv)(int, const struct iovec*, int, off_t);
+  ssize_t (*readv)(int, const struct iovec*, int);
+  ssize_t (*pwritev)(int, const struct iovec*, int, off_t);
+  ssize_t (*writev)(int, const struct iovec*, int);
+  int (*xstat)(int, const char*, struct stat*);
+  int (*lxstat)(int, const char*, struct stat*);
   int (*fxstat)(int, int, struct stat*);
+  int (*access)(const char*, int);
+  int (*rename)(const char*, const char*);
+  int (*unlink)(const char*);
   int (*ftruncate)(int, off_t);
   int (*fcntl)(int, int, ...);
+  int (*fsync)(int);
+  int (*fdatasync)(int);
   int (*close)(int);
+  int (*aio_read)(struct aiocb*);
+  int (*aio_write)(struct aiocb*);
+  int (*aio_fsync)(int, struct aiocb*);
+  int (*aio_suspend)(const struct aiocb* const[], int, const struct timespec*);
+  int (*aio_cancel)(int, struct aiocb*);
+  int (*aio_error)(const struct aiocb*);
+  ssize_t (*aio_return)(struct aiocb*);
+  int (*lio_listio)(int, struct aiocb* const[], int, struct sigevent*);
+  void* (*mmap)(void*, size_t, int, int, int, off_t);
+  int (*munmap)(void*, size_t);
+  int (*msync)(void*, size_t, int);
   FILE* (*fopen)(const char*, const char*);
   size_t (*fread)(void*, size_t, size_t, FILE*);
   size_t (*fwrite)(const void*, size_t, size_t, FILE*);
   int (*fseek)(FILE*, long int, int);
   long int (*ftell)(FILE*);
   int (*fflush)(FILE*);
+  int (*setvbuf)(FILE*, char*, int, size_t);
   int (*fclose)(FILE*);
   void (*clearerr)(FILE*);
   int (*ferror)(FILE*);
   int (*feof)(FILE*);
+  int (*fseeko)(FILE*, off_t, int);
+  off_t (*ftello)(FILE*);
+  void (*rewind)(FILE*);
+  int (*vfprintf)(FILE*, const char*, va_list);
+  int (*fputs)(const char*, FILE*);
+  int (*fputc)(int, FILE*);
+  char* (*fgets)(char*, int, FILE*);
+  int (*fgetc)(FILE*);
+  int (*ungetc)(int, FILE*);
+  int (*fileno)(FILE*);
 };
 }  // namespace
 
@@ -142,6 +208,170 @@ ssize_t posix_write(int fd, const void* buf, size_t sz) {
   return posix_api->write(fd, buf, sz);
 }
 
+ssize_t posix_preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->preadv(fd, iov, iovcnt, off);
+}
+
+ssize_t posix_readv(int fd, const struct iovec* iov, int iovcnt) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->readv(fd, iov, iovcnt);
+}
+
+ssize_t posix_pwritev(int fd, const struct iovec* iov, int iovcnt,
+                      off_t off) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->pwritev(fd, iov, iovcnt, off);
+}
+
+ssize_t posix_writev(int fd, const struct iovec* iov, int iovcnt) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->writev(fd, iov, iovcnt);
+}
+
+int posix_stat(const char* path, struct stat* buf) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->xstat(_STAT_VER, path, buf);
+}
+
+int posix_lstat(const char* path, struct stat* buf) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->lxstat(_STAT_VER, path, buf);
+}
+
+int posix_access(const char* path, int mode) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->access(path, mode);
+}
+
+int posix_rename(const char* oldpath, const char* newpath) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->rename(oldpath, newpath);
+}
+
+int posix_unlink(const char* path) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->unlink(path);
+}
+
+int posix_aio_read(struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_read(cb);
+}
+
+int posix_aio_write(struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_write(cb);
+}
+
+int posix_aio_fsync(int op, struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_fsync(op, cb);
+}
+
+int posix_aio_suspend(const struct aiocb* const list[], int nent,
+                      const struct timespec* timeout) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_suspend(list, nent, timeout);
+}
+
+int posix_aio_cancel(int fd, struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_cancel(fd, cb);
+}
+
+int posix_aio_error(const struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_error(cb);
+}
+
+ssize_t posix_aio_return(struct aiocb* cb) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->aio_return(cb);
+}
+
+int posix_lio_listio(int mode, struct aiocb* const list[], int nent,
+                     struct sigevent* sevp) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->lio_listio(mode, list, nent, sevp);
+}
+
+void* posix_mmap(void* addr, size_t len, int prot, int flags, int fd,
+                 off_t off) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->mmap(addr, len, prot, flags, fd, off);
+}
+
+int posix_munmap(void* addr, size_t len) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->munmap(addr, len);
+}
+
+int posix_msync(void* addr, size_t len, int flags) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->msync(addr, len, flags);
+}
+
 int posix_fstat(int fd, struct stat* buf) {
   if (posix_api == NULL) {
     pthread_once(&once, &__init_posix_api);
@@ -174,6 +404,22 @@ int posix_fcntl1(int fd, int cmd, int arg) {
   return posix_api->fcntl(fd, cmd, arg);
 }
 
+int posix_fsync(int fd) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fsync(fd);
+}
+
+int posix_fdatasync(int fd) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fdatasync(fd);
+}
+
 int posix_close(int fd) {
   if (posix_api == NULL) {
     pthread_once(&once, &__init_posix_api);
@@ -230,6 +476,14 @@ int posix_fflush(FILE* stream) {
   return posix_api->fflush(stream);
 }
 
+int posix_setvbuf(FILE* stream, char* buf, int mode, size_t size) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->setvbuf(stream, buf, mode, size);
+}
+
 int posix_fclose(FILE* stream) {
   if (posix_api == NULL) {
     pthread_once(&once, &__init_posix_api);
@@ -262,4 +516,84 @@ int posix_feof(FILE* stream) {
   return posix_api->feof(stream);
 }
 
+int posix_fseeko(FILE* stream, off_t off, int whence) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fseeko(stream, off, whence);
+}
+
+off_t posix_ftello(FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->ftello(stream);
+}
+
+void posix_rewind(FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->rewind(stream);
+}
+
+int posix_vfprintf(FILE* stream, const char* fmt, va_list ap) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->vfprintf(stream, fmt, ap);
+}
+
+int posix_fputs(const char* s, FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fputs(s, stream);
+}
+
+int posix_fputc(int c, FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fputc(c, stream);
+}
+
+char* posix_fgets(char* s, int n, FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fgets(s, n, stream);
+}
+
+int posix_fgetc(FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fgetc(stream);
+}
+
+int posix_ungetc(int c, FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->ungetc(c, stream);
+}
+
+int posix_fileno(FILE* stream) {
+  if (posix_api == NULL) {
+    pthread_once(&once, &__init_posix_api);
+  }
+
+  return posix_api->fileno(stream);
+}
+
 }  // extern C
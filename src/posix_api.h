@@ -9,9 +9,12 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <aio.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -24,10 +27,37 @@ ssize_t posix_pread(int __fd, void* __buf, size_t __sz, off_t __off);
 ssize_t posix_read(int __fd, void* __buf, size_t __sz);
 ssize_t posix_pwrite(int __fd, const void* __buf, size_t __sz, off_t __off);
 ssize_t posix_write(int __fd, const void* __buf, size_t __sz);
+ssize_t posix_preadv(int __fd, const struct iovec* __iov, int __iovcnt,
+                     off_t __off);
+ssize_t posix_readv(int __fd, const struct iovec* __iov, int __iovcnt);
+ssize_t posix_pwritev(int __fd, const struct iovec* __iov, int __iovcnt,
+                      off_t __off);
+ssize_t posix_writev(int __fd, const struct iovec* __iov, int __iovcnt);
+int posix_stat(const char* __path, struct stat* __buf);
+int posix_lstat(const char* __path, struct stat* __buf);
+int posix_access(const char* __path, int __mode);
+int posix_rename(const char* __oldpath, const char* __newpath);
+int posix_unlink(const char* __path);
+void* posix_mmap(void* __addr, size_t __len, int __prot, int __flags,
+                 int __fd, off_t __off);
+int posix_munmap(void* __addr, size_t __len);
+int posix_msync(void* __addr, size_t __len, int __flags);
+int posix_aio_read(struct aiocb* __aiocbp);
+int posix_aio_write(struct aiocb* __aiocbp);
+int posix_aio_fsync(int __op, struct aiocb* __aiocbp);
+int posix_aio_suspend(const struct aiocb* const __list[], int __nent,
+                      const struct timespec* __timeout);
+int posix_aio_cancel(int __fd, struct aiocb* __aiocbp);
+int posix_aio_error(const struct aiocb* __aiocbp);
+ssize_t posix_aio_return(struct aiocb* __aiocbp);
+int posix_lio_listio(int __mode, struct aiocb* const __list[], int __nent,
+                     struct sigevent* __sevp);
 int posix_fstat(int __fd, struct stat* __buf);
 int posix_ftruncate(int __fd, off_t __length);
 int posix_fcntl0(int __fd, int __cmd);
 int posix_fcntl1(int __fd, int __cmd, int arg);
+int posix_fsync(int __fd);
+int posix_fdatasync(int __fd);
 int posix_close(int __fd);
 
 int posix_feof(FILE* __file);
@@ -39,7 +69,18 @@ size_t posix_fwrite(const void* __ptr, size_t __sz, size_t __n, FILE* __stream);
 int posix_fseek(FILE* __stream, long int __off, int __whence);
 long int posix_ftell(FILE* __stream);
 int posix_fflush(FILE* __stream);
+int posix_setvbuf(FILE* __stream, char* __buf, int __mode, size_t __size);
 int posix_fclose(FILE* __stream);
+int posix_fseeko(FILE* __stream, off_t __off, int __whence);
+off_t posix_ftello(FILE* __stream);
+void posix_rewind(FILE* __stream);
+int posix_vfprintf(FILE* __stream, const char* __fmt, va_list __ap);
+int posix_fputs(const char* __s, FILE* __stream);
+int posix_fputc(int __c, FILE* __stream);
+char* posix_fgets(char* __s, int __n, FILE* __stream);
+int posix_fgetc(FILE* __stream);
+int posix_ungetc(int __c, FILE* __stream);
+int posix_fileno(FILE* __stream);
 
 #ifdef __cplusplus
 }
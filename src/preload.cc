@@ -7,30 +7,43 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <aio.h>
 #include <assert.h>
+#include <dlfcn.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
+#include <algorithm>
 #include <map>
+#include <set>
 #include <string>
+#include <vector>
 
+#include "attr_cache.h"
 #include "buffered_io.h"
-#include "pdlfs-preload/pdlfs_api.h"
+#include "checksum_io.h"
+#include "compressed_io.h"
+#include "mapped_io.h"
+#include "mount_table.h"
 #include "posix_api.h"
 #include "preload.h"
+#include "thread_pool.h"
+#include "write_cache.h"
 
 #ifdef HAVE_MPI
 #include <mpi/mpi.h>
 #endif
-#ifdef HAVE_ATOMIC
-#include <atomic>
-#endif
 #ifdef GLOG
 #include <glog/logging.h>
 #endif
@@ -51,36 +64,125 @@ struct Logger {
 
 void Logger::Logv(const char* fmt, va_list ap) {
   char tmp[500];
-  vsnprintf(tmp, sizeof(tmp), fmt, ap);
-  fprintf(file, "[%d] %s", id, tmp);
+  int n = snprintf(tmp, sizeof(tmp), "[%d] ", id);
+  vsnprintf(tmp + n, sizeof(tmp) - n, fmt, ap);
+  posix_fputs(tmp, file);
   posix_fflush(file);
 }
 
+enum OpType {
+  kMkdir,
+  kOpen,
+  kCreat,
+  kFstat,
+  kPread,
+  kRead,
+  kPwrite,
+  kWrite,
+  kClose,
+  kFeof,
+  kFerror,
+  kClearerr,
+  kFopen,
+  kFread,
+  kFwrite,
+  kFseek,
+  kFtell,
+  kFflush,
+  kFclose,
+  kSetvbuf,
+  kFsync,
+  kFdatasync,
+  kPreadv,
+  kReadv,
+  kPwritev,
+  kWritev,
+  kStat,
+  kLstat,
+  kAccess,
+  kRename,
+  kFtruncate,
+  kMmap,
+  kMunmap,
+  kMsync,
+  kAioRead,
+  kAioWrite,
+  kAioFsync,
+  kAioSuspend,
+  kAioCancel,
+  kLioListio,
+  kFprintf,
+  kFputs,
+  kFputc,
+  kFgets,
+  kFgetc,
+  kUngetc,
+  kRewind,
+  kFileno,
+  kFseeko,
+  kFtello,
+  kNumOps
+};
+
+static const char* const kOpNames[kNumOps] = {
+    "mkdir", "open", "creat", "fstat", "pread", "read", "pwrite", "write",
+    "close", "feof", "ferror", "clearerr", "fopen", "fread", "fwrite", "fseek",
+    "ftell", "fflush", "fclose", "setvbuf", "fsync", "fdatasync", "preadv",
+    "readv", "pwritev", "writev", "stat", "lstat", "access", "rename",
+    "ftruncate", "mmap", "munmap", "msync", "aio_read", "aio_write",
+    "aio_fsync", "aio_suspend", "aio_cancel", "lio_listio", "fprintf",
+    "fputs", "fputc", "fgets", "fgetc", "ungetc", "rewind", "fileno",
+    "fseeko", "ftello"};
+
+typedef unsigned long long ctr_t;
+
+// Only the owner thread updates a counter so a relaxed load followed by a
+// relaxed store is enough; this compiles to a plain add.
+static inline void Add(ctr_t* ctr, ctr_t n) {
+  __atomic_store_n(ctr, __atomic_load_n(ctr, __ATOMIC_RELAXED) + n,
+                   __ATOMIC_RELAXED);
+}
+
+static inline ctr_t Load(const ctr_t* ctr) {
+  return __atomic_load_n(ctr, __ATOMIC_RELAXED);
+}
+
+// Log2-bucketed latency histogram. Bucket i counts latencies in
+// [2^(i-1), 2^i) nanoseconds.
+struct Histogram {
+  enum { kNumBuckets = 64 };
+  ctr_t buckets[kNumBuckets];
+  ctr_t num;
+  ctr_t sum;
+  ctr_t max;
+
+  void Add(ctr_t nanos) {
+    int b = (nanos == 0) ? 0 : 64 - __builtin_clzll(nanos);
+    if (b >= kNumBuckets) b = kNumBuckets - 1;
+    ::Add(&buckets[b], 1);
+    ::Add(&num, 1);
+    ::Add(&sum, nanos);
+    if (nanos > Load(&max)) {
+      __atomic_store_n(&max, nanos, __ATOMIC_RELAXED);
+    }
+  }
+
+  void Merge(const Histogram& other);
+
+  // Return an estimate of the p-th percentile in nanoseconds.
+  double Percentile(double p) const;
+};
+
 struct CallStats {
-#ifdef HAVE_ATOMIC
-  typedef std::atomic_int ctr_t;
-#else
-  typedef int ctr_t;
-#endif
-  ctr_t mkdir;
-  ctr_t open;
-  ctr_t creat;
-  ctr_t fstat;
-  ctr_t pread;
-  ctr_t read;
-  ctr_t pwrite;
-  ctr_t write;
-  ctr_t close;
-  ctr_t feof;
-  ctr_t ferror;
-  ctr_t clearerr;
-  ctr_t fopen;
-  ctr_t fread;
-  ctr_t fwrite;
-  ctr_t fseek;
-  ctr_t ftell;
-  ctr_t fflush;
-  ctr_t fclose;
+  ctr_t calls[kNumOps];
+  ctr_t errors[kNumOps];
+  ctr_t bytes_read;
+  ctr_t bytes_written;
+  ctr_t short_reads;
+  ctr_t short_writes;
+  Histogram latency[kNumOps];
+
+  void Merge(const CallStats& other);
 };
 
 enum FileType { kPDLFS, kPOSIX };
@@ -88,31 +190,201 @@ enum FileType { kPDLFS, kPOSIX };
 struct ParsedPath {
   FileType type;
   const char* path;
+  const Mount* mount;  // Set if type is kPDLFS
+};
+
+// State kept for each file opened through pdlfs.
+struct OpenFile {
+  OpenFile(const PdlfsOps* ops, const char* path, int flags, off_t size)
+      : ops(ops),
+        path(path),
+        cache(NULL),
+        flags(flags),
+        off(0),
+        size(size),
+        pins(0),
+        stream(NULL) {
+    pthread_mutex_init(&mu, NULL);
+  }
+
+  ~OpenFile() {
+    delete cache;
+    pthread_mutex_destroy(&mu);
+  }
+
+  pthread_mutex_t mu;
+  const PdlfsOps* const ops;  // Backend of the file's mount
+  const std::string path;     // Path within pdlfs
+  // Dirty data not yet written to the backend, or NULL if write caching
+  // is disabled. When writes are cached, the file position is tracked
+  // here and read/write go through pdlfs_pread/pdlfs_pwrite.
+  WriteCache* cache;
+  int flags;
+  off_t off;
+  off_t size;
+  int pins;  // Users that keep the file past the call that looked it up
+  // Set if the descriptor was handed out by fileno(). The backend file
+  // then belongs to the stream and is only closed by fclose().
+  FILE* stream;
+};
+
+// A flat table mapping file descriptors returned to the application to the
+// descriptors opened by the underlying file system. The table is directly
+// indexed by fd so that a lookup is a single wait-free load. Updates must be
+// serialized by the caller. When the table grows, the old array is retired
+// but never freed since concurrent readers may still be using it.
+class FdTable {
+ public:
+  FdTable() : table_(NewTable(NULL, kInitialSize)) {}
+
+  // Return true and set *type and *__fd if fd has been registered.
+  // If file is not NULL, it is set to the state of a pdlfs file.
+  bool Lookup(int fd, FileType* type, int* __fd, OpenFile** file = NULL) const {
+    const Table* t = __atomic_load_n(&table_, __ATOMIC_ACQUIRE);
+    if (fd < 0 || fd >= t->size) {
+      return false;
+    }
+    const Slot* slot = &t->slots[fd];
+    int v = __atomic_load_n(&slot->value, __ATOMIC_ACQUIRE);
+    if (v == 0) {
+      return false;
+    } else if (v > 0) {
+      *type = kPOSIX;
+      *__fd = v - 1;
+    } else {
+      *type = kPDLFS;
+      *__fd = -v - 1;
+    }
+    if (file != NULL) {
+      *file = __atomic_load_n(&slot->file, __ATOMIC_RELAXED);
+    }
+    return true;
+  }
+
+  bool Contains(int fd) const {
+    FileType type;
+    int __fd;
+    return Lookup(fd, &type, &__fd);
+  }
+
+  // REQUIRES: external synchronization.
+  void Insert(int fd, FileType type, int __fd, OpenFile* file = NULL) {
+    assert(fd >= 0 && __fd >= 0);
+    Table* t = table_;
+    if (fd >= t->size) {
+      int size = t->size;
+      while (fd >= size) size *= 2;
+      t = NewTable(t, size);
+      __atomic_store_n(&table_, t, __ATOMIC_RELEASE);
+    }
+    Slot* slot = &t->slots[fd];
+    int v = (type == kPOSIX) ? __fd + 1 : -1 * (__fd + 1);
+    __atomic_store_n(&slot->file, file, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->value, v, __ATOMIC_RELEASE);
+  }
+
+  // Return the state of the removed file, if any, which the caller owns.
+  // REQUIRES: external synchronization.
+  OpenFile* Remove(int fd) {
+    Table* t = table_;
+    OpenFile* file = NULL;
+    if (fd >= 0 && fd < t->size) {
+      Slot* slot = &t->slots[fd];
+      __atomic_store_n(&slot->value, 0, __ATOMIC_RELEASE);
+      file = slot->file;
+      __atomic_store_n(&slot->file, static_cast<OpenFile*>(NULL),
+                       __ATOMIC_RELAXED);
+    }
+    return file;
+  }
+
+ private:
+  struct Slot {
+    int value;
+    OpenFile* file;
+  };
+
+  struct Table {
+    int size;
+    Slot* slots;
+    Table* prev;  // Retired, but may still be read concurrently
+  };
+
+  static Table* NewTable(Table* prev, int size) {
+    Table* t = new Table;
+    t->size = size;
+    t->slots = new Slot[size]();
+    t->prev = prev;
+    if (prev != NULL) {
+      for (int i = 0; i < prev->size; i++) {
+        t->slots[i] = prev->slots[i];
+      }
+    }
+    return t;
+  }
+
+  enum { kInitialSize = 1024 };
+  Table* table_;
+
+  // No copying allowed
+  FdTable(const FdTable&);
+  void operator=(const FdTable&);
 };
 
+// Call counters owned by a single thread. A shard is only updated by its
+// owner, so counting needs no atomic read-modify-write. Shards are padded
+// to a cache line to avoid false sharing and are merged when reported.
+// The shard of an exiting thread is folded into the retired counters and
+// kept for the next thread.
+enum { kCacheLineSize = 64 };
+
+struct StatsShard {
+  CallStats stats[2];  // Indexed by FileType
+  StatsShard* next;
+  // Epoch in which the owner's current call began looking up open files,
+  // or 0 if it holds none. See RetireFile().
+  unsigned long long epoch;
+} __attribute__((aligned(kCacheLineSize)));
+
 struct Context {
-  CallStats posix_stats;
-  CallStats pdlfs_stats;
-  Logger* logger;
-  std::string pdlfs_root;
-  std::map<int, int> fd_map;
-  std::map<FILE*, FileType> files;
+  StatsShard* shards;  // Shards of live threads, guarded by mutex
+  StatsShard* free_shards;  // Shards of exited threads, guarded by mutex
+  CallStats retired[2];  // Counters of exited threads, guarded by mutex
+  Logger* logger;  // Opened on first use, once the rank may be known
+  int rank;  // MPI rank, or -1 if not known
+  bool timing;  // Collect per-call latency histograms
+  size_t write_cache_size;  // Per-file write cache size, 0 if disabled
+  unsigned long long write_cache_age;  // Max age of cached data in nanos
+  AttrCache* attr_cache;  // NULL if attribute caching is disabled
+  std::string pdlfs_root;  // Relative paths are redirected here
+  MountTable mounts;
+  FdTable fd_table;
   int fd;
 
+  // Write the absolute form of a relative path into buf, which holds
+  // PATH_MAX bytes. Return NULL if the result does not fit.
+  const char* Redirect(const char* path, char* buf) const {
+    size_t n = pdlfs_root.size();
+    size_t m = strlen(path);
+    if (n + 1 + m >= PATH_MAX) {
+      errno = ENAMETOOLONG;
+      return NULL;
+    }
+    memcpy(buf, pdlfs_root.data(), n);
+    buf[n] = '/';
+    memcpy(buf + n + 1, path, m + 1);
+    return buf;
+  }
+
   bool ParsePath(const char* path, ParsedPath* result) {
     assert(path != NULL);
     assert(strlen(path) != 0);
     if (path[0] != '/') {
       return false;
     } else {
-      if (strncmp(path, pdlfs_root.data(), pdlfs_root.length()) == 0 &&
-          (path[pdlfs_root.length()] == '/' ||
-           path[pdlfs_root.length()] == 0)) {
+      result->mount = mounts.Lookup(path, &result->path);
+      if (result->mount != NULL) {
         result->type = kPDLFS;
-        result->path = path + pdlfs_root.length();
-        if (result->path[0] == 0) {
-          result->path = "/";
-        }
       } else {
         result->type = kPOSIX;
         result->path = path;
@@ -121,44 +393,159 @@ struct Context {
     }
   }
 
+  // Check a mount point named by var and remove trailing slashes.
+  static std::string MountPoint(const char* var, const std::string& path) {
+    std::string root = path;
+    if (root.empty() || root[0] != '/') {
+      fprintf(stderr, "%s must be an absolute path\n", var);
+      abort();
+    }
+    while (root.length() != 1 && root[root.size() - 1] == '/') {
+      root.resize(root.size() - 1);
+    }
+    if (root.size() == 1) {
+      fprintf(stderr, "%s cannot be the root\n", var);
+      abort();
+    }
+    return root;
+  }
+
+  // Put the checksum layer on top of a backend if PDLFS_Checksum is set.
+  static const PdlfsOps* Stack(const PdlfsOps* ops) {
+    const char* env = getenv("PDLFS_Checksum");
+    if (env == NULL || atoi(env) == 0) {
+      return ops;
+    }
+    const PdlfsOps* result = ChecksumPdlfsOps(ops);
+    if (result == NULL) {
+      fprintf(stderr, "!!! FATAL error: too many backends to checksum\n");
+      abort();
+    }
+    return result;
+  }
+
+  // Mount the backends listed in spec, a comma-separated list of
+  // path:backend entries. A backend is a library path, or a name such as
+  // posix for libpdlfs-preload-posix.so. Mounted backends see full paths,
+  // so several mounts can share one backend. Relative paths are redirected
+  // under the first mount.
+  void LoadMounts(const char* spec) {
+    std::map<std::string, const PdlfsOps*> backends;
+    const char* p = spec;
+    while (*p != 0) {
+      const char* end = strchr(p, ',');
+      if (end == NULL) end = p + strlen(p);
+      std::string entry(p, end);
+      p = (*end == ',') ? end + 1 : end;
+      if (entry.empty()) continue;
+      size_t colon = entry.rfind(':');
+      if (colon == std::string::npos || colon + 1 == entry.size()) {
+        fprintf(stderr, "PDLFS_Mounts: %s has no backend\n", entry.c_str());
+        abort();
+      }
+      std::string prefix = MountPoint("PDLFS_Mounts", entry.substr(0, colon));
+      std::string name = entry.substr(colon + 1);
+      const PdlfsOps*& ops = backends[name];
+      if (ops == NULL) {
+        std::string lib = name;
+        if (lib.find('/') == std::string::npos) {
+          lib = "libpdlfs-preload-" + name + ".so";
+        }
+        void* handle = dlopen(lib.c_str(), RTLD_NOW | RTLD_LOCAL);
+        PdlfsOps* loaded = new PdlfsOps;
+        if (handle == NULL || !LoadPdlfsOps(handle, loaded)) {
+          fprintf(stderr, "!!! FATAL error: cannot load backend %s: %s\n",
+                  lib.c_str(), handle == NULL ? dlerror() : "missing calls");
+          abort();
+        }
+        ops = Stack(loaded);
+      }
+      if (!mounts.Add(prefix, 0, ops)) {
+        fprintf(stderr, "PDLFS_Mounts: %s is mounted twice\n", prefix.c_str());
+        abort();
+      }
+      // Make sure the mount point exists inside the backend
+      for (size_t i = 1; i <= prefix.size(); i++) {
+        if (i == prefix.size() || prefix[i] == '/') {
+          ops->mkdir(prefix.substr(0, i).c_str(), 0777);
+        }
+      }
+      if (pdlfs_root.empty()) {
+        pdlfs_root = prefix;
+      }
+    }
+    if (pdlfs_root.empty()) {
+      fprintf(stderr, "PDLFS_Mounts has no mounts\n");
+      abort();
+    }
+  }
+
   // File descriptor 0, 1, 2 are reserved for stdin, stdout, and stderr
-  Context() : fd(2) {
-    int rank = -1;
+  Context()
+      : shards(NULL),
+        free_shards(NULL),
+        logger(NULL),
+        rank(-1),
+        timing(false),
+        write_cache_size(0),
+        write_cache_age(1000000000ULL),
+        attr_cache(NULL),
+        fd(2) {
 #ifdef HAVE_MPI
     int mpi;
     MPI_Initialized(&mpi);
     if (mpi) {
       MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+    } else {
+      // Launchers tell each rank its number before MPI is up
+      static const char* const kRankVars[] = {"OMPI_COMM_WORLD_RANK",
+                                              "PMIX_RANK", "PMI_RANK"};
+      for (size_t i = 0; i < sizeof(kRankVars) / sizeof(kRankVars[0]); i++) {
+        const char* env = getenv(kRankVars[i]);
+        if (env != NULL && env[0] != 0) {
+          rank = atoi(env);
+          break;
+        }
+      }
     }
 #endif
-    memset(&posix_stats, 0, sizeof(CallStats));
-    memset(&pdlfs_stats, 0, sizeof(CallStats));
-    FILE* f = posix_fopen("/tmp/pdlfs_preload.log", "w");
-    logger = new Logger(rank, f);
-    const char* env = getenv("PDLFS_Root");
-    if (env == NULL) {
-      env = DEFAULT_PDLFS_ROOT;
-    }
-    std::string root = env;
-    if (root.empty()) {
-      root = DEFAULT_PDLFS_ROOT;
-    }
-    if (root[0] != '/') {
-      fprintf(stderr, "PDLFS_Root must be an absolute path\n");
-      abort();
+    const char* timing_env = getenv("PDLFS_Timing");
+    if (timing_env != NULL) {
+      timing = atoi(timing_env) != 0;
     }
-    if (root.size() == 1) {
-      fprintf(stderr, "PDLFS_Root cannot be the root\n");
-      abort();
+    const char* cache_env = getenv("PDLFS_WriteCache");
+    if (cache_env != NULL) {
+      write_cache_size = strtoull(cache_env, NULL, 10);
     }
-    // Removing tailing slashes
-    while (root.length() != 1 && root[root.size() - 1] == '/') {
-      root.resize(root.size() - 1);
+    cache_env = getenv("PDLFS_WriteCacheAge");
+    if (cache_env != NULL) {
+      write_cache_age = strtoull(cache_env, NULL, 10) * 1000000ULL;
+    }
+    const char* ttl_env = getenv("PDLFS_AttrCacheTTL");
+    if (ttl_env != NULL && strtoull(ttl_env, NULL, 10) != 0) {
+      attr_cache = new AttrCache(strtoull(ttl_env, NULL, 10) * 1000000ULL);
+    }
+    const char* mounts_env = getenv("PDLFS_Mounts");
+    if (mounts_env != NULL && mounts_env[0] != 0) {
+      LoadMounts(mounts_env);
+    } else {
+      const char* env = getenv("PDLFS_Root");
+      if (env == NULL || env[0] == 0) {
+        env = DEFAULT_PDLFS_ROOT;
+      }
+      pdlfs_root = MountPoint("PDLFS_Root", env);
+      // The backend was loaded with LD_PRELOAD and sees paths below the root
+      PdlfsOps* ops = new PdlfsOps;
+      if (!LoadPdlfsOps(RTLD_DEFAULT, ops)) {
+        fprintf(stderr, "!!! FATAL error: no pdlfs backend is loaded\n");
+        abort();
+      }
+      mounts.Add(pdlfs_root, pdlfs_root.size(), Stack(ops));
     }
-    pdlfs_root = root;
   }
 
   ~Context() {
+    delete attr_cache;
     if (logger != NULL) {
       delete logger;
     }
@@ -169,12 +556,51 @@ struct Context {
 static const bool kRedirectCurDir = true;
 static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_once_t log_once = PTHREAD_ONCE_INIT;
+static pthread_once_t flush_once = PTHREAD_ONCE_INIT;
 static Context* fs_ctx = NULL;
 
+// Open files are looked up without the lock, so a file removed from the
+// fd table may still be in use by calls running on other threads. It is
+// retired and only freed once no call that could have seen it is left.
+struct RetiredFile {
+  unsigned long long epoch;
+  OpenFile* file;
+};
+
+static unsigned long long file_epoch = 1;
+static std::vector<RetiredFile>* retired_files;  // Guarded by mutex
+// Open files that have a write cache, by path. Guarded by mutex.
+static std::multimap<std::string, OpenFile*>* cached_files;
+
+static void FlushAllCached();
+
+// Each MPI rank logs to its own file so that ranks sharing a node do not
+// overwrite each other. Processes outside of MPI use the plain name.
+static void LogName(int rank, char* name, size_t n) {
+  if (rank >= 0) {
+    snprintf(name, n, "/tmp/pdlfs_preload.%d.log", rank);
+  } else {
+    snprintf(name, n, "/tmp/pdlfs_preload.log");
+  }
+}
+
+static void OpenLog() {
+  char name[64];
+  LogName(fs_ctx->rank, name, sizeof(name));
+  FILE* f = posix_fopen(name, "w");
+  fs_ctx->logger = new Logger(fs_ctx->rank, f != NULL ? f : stderr);
+}
+
+static Logger* GetLogger() {
+  pthread_once(&log_once, &OpenLog);
+  return fs_ctx->logger;
+}
+
 static void Logv(const char* fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
-  fs_ctx->logger->Logv(fmt, ap);
+  GetLogger()->Logv(fmt, ap);
   va_end(ap);
 }
 
@@ -182,29 +608,232 @@ static void Trace(const char* fmt, ...) {
 #ifndef NOTRACE
   va_list ap;
   va_start(ap, fmt);
-  fs_ctx->logger->Logv(fmt, ap);
+  GetLogger()->Logv(fmt, ap);
   va_end(ap);
 #endif
 }
 
+void Histogram::Merge(const Histogram& other) {
+  for (int i = 0; i < kNumBuckets; i++) {
+    buckets[i] += Load(&other.buckets[i]);
+  }
+  num += Load(&other.num);
+  sum += Load(&other.sum);
+  ctr_t m = Load(&other.max);
+  if (m > max) max = m;
+}
+
+double Histogram::Percentile(double p) const {
+  if (num == 0) return 0;
+  double threshold = num * (p / 100.0);
+  double cumulative = 0;
+  for (int b = 0; b < kNumBuckets; b++) {
+    if (buckets[b] == 0) continue;
+    if (cumulative + buckets[b] >= threshold) {
+      // Interpolate within the bucket
+      double left = (b == 0) ? 0 : static_cast<double>(1ULL << (b - 1));
+      double right = (b == 0) ? 1 : static_cast<double>(1ULL << b) - 1;
+      if (right > max) right = max;
+      if (left > right) left = right;
+      double pos = (threshold - cumulative) / buckets[b];
+      return left + (right - left) * pos;
+    }
+    cumulative += buckets[b];
+  }
+  return max;
+}
+
+void CallStats::Merge(const CallStats& other) {
+  for (int i = 0; i < kNumOps; i++) {
+    calls[i] += Load(&other.calls[i]);
+    errors[i] += Load(&other.errors[i]);
+    latency[i].Merge(other.latency[i]);
+  }
+  bytes_read += Load(&other.bytes_read);
+  bytes_written += Load(&other.bytes_written);
+  short_reads += Load(&other.short_reads);
+  short_writes += Load(&other.short_writes);
+}
+
 static void LogStats(const char* prefix, const CallStats& stats) {
-  Logv("num %s_mkdir\t%d\n", prefix, static_cast<int>(stats.mkdir));
-  Logv("num %s_open\t%d\n", prefix, static_cast<int>(stats.open));
-  Logv("num %s_pread\t%d\n", prefix, static_cast<int>(stats.pread));
-  Logv("num %s_pwrite\t%d\n", prefix, static_cast<int>(stats.pwrite));
-  Logv("num %s_read\t%d\n", prefix, static_cast<int>(stats.read));
-  Logv("num %s_write\t%d\n", prefix, static_cast<int>(stats.write));
-  Logv("num %s_close\t%d\n", prefix, static_cast<int>(stats.close));
-  Logv("num %s_fopen\t%d\n", prefix, static_cast<int>(stats.fopen));
-  Logv("num %s_fread\t%d\n", prefix, static_cast<int>(stats.fread));
-  Logv("num %s_fwrite\t%d\n", prefix, static_cast<int>(stats.fwrite));
-  Logv("num %s_fflush\t%d\n", prefix, static_cast<int>(stats.fflush));
-  Logv("num %s_fclose\t%d\n", prefix, static_cast<int>(stats.fclose));
+  for (int i = 0; i < kNumOps; i++) {
+    Logv("num %s_%s\t%llu\n", prefix, kOpNames[i], stats.calls[i]);
+  }
+  for (int i = 0; i < kNumOps; i++) {
+    Logv("num %s_%s_errors\t%llu\n", prefix, kOpNames[i], stats.errors[i]);
+  }
+  Logv("num %s_bytes_read\t%llu\n", prefix, stats.bytes_read);
+  Logv("num %s_bytes_written\t%llu\n", prefix, stats.bytes_written);
+  Logv("num %s_short_reads\t%llu\n", prefix, stats.short_reads);
+  Logv("num %s_short_writes\t%llu\n", prefix, stats.short_writes);
+  for (int i = 0; i < kNumOps; i++) {
+    const Histogram& h = stats.latency[i];
+    if (h.num != 0) {
+      Logv("lat %s_%s\tavg %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f (us)\n",
+           prefix, kOpNames[i], h.sum / 1000.0 / h.num,
+           h.Percentile(50) / 1000.0, h.Percentile(90) / 1000.0,
+           h.Percentile(99) / 1000.0, h.max / 1000.0);
+    }
+  }
+}
+
+static void MutexLock();
+static void MutexUnlock();
+
+// Merge the counters of all threads.
+static void MergeStats(CallStats* pdlfs_stats, CallStats* posix_stats) {
+  memset(pdlfs_stats, 0, sizeof(CallStats));
+  memset(posix_stats, 0, sizeof(CallStats));
+  MutexLock();
+  pdlfs_stats->Merge(fs_ctx->retired[kPDLFS]);
+  posix_stats->Merge(fs_ctx->retired[kPOSIX]);
+  for (StatsShard* s = fs_ctx->shards; s != NULL; s = s->next) {
+    pdlfs_stats->Merge(s->stats[kPDLFS]);
+    posix_stats->Merge(s->stats[kPOSIX]);
+  }
+  MutexUnlock();
+}
+
+#ifdef HAVE_MPI
+typedef std::vector<std::pair<std::string, double> > Counters;
+
+static void AddCounter(Counters* counters, const char* prefix,
+                       const char* name, const char* suffix, double value) {
+  std::string s = prefix;
+  s += "_";
+  s += name;
+  s += suffix;
+  counters->push_back(std::make_pair(s, value));
+}
+
+static void AddCounters(Counters* counters, const char* prefix,
+                        const CallStats& stats) {
+  for (int i = 0; i < kNumOps; i++) {
+    AddCounter(counters, prefix, kOpNames[i], "", stats.calls[i]);
+    AddCounter(counters, prefix, kOpNames[i], "_errors", stats.errors[i]);
+    AddCounter(counters, prefix, kOpNames[i], "_us",
+               stats.latency[i].sum / 1000.0);
+  }
+  AddCounter(counters, prefix, "bytes_read", "", stats.bytes_read);
+  AddCounter(counters, prefix, "bytes_written", "", stats.bytes_written);
+  AddCounter(counters, prefix, "short_reads", "", stats.short_reads);
+  AddCounter(counters, prefix, "short_writes", "", stats.short_writes);
+}
+
+// Learn the rank once MPI is up. A log opened before then, under the
+// plain name, is moved to the file of the rank.
+static void SetRank() {
+  MPI_Comm_rank(MPI_COMM_WORLD, &fs_ctx->rank);
+  Logger* logger = fs_ctx->logger;
+  if (logger != NULL && logger->id != fs_ctx->rank) {
+    char from[64];
+    char to[64];
+    LogName(logger->id, from, sizeof(from));
+    LogName(fs_ctx->rank, to, sizeof(to));
+    posix_rename(from, to);
+    logger->id = fs_ctx->rank;
+  }
+}
+
+// Reduce the counters of all ranks to rank 0, which writes the min, max,
+// mean, and imbalance (max over mean) of each counter to the job-wide log,
+// /tmp/pdlfs_preload.job.log, along with the ranks holding the min and the
+// max. Counters that are 0 on
+// every rank are left out. Must be called by all ranks before MPI is
+// finalized.
+static void ReduceStats() {
+  int size;
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  CallStats pdlfs_stats;
+  CallStats posix_stats;
+  MergeStats(&pdlfs_stats, &posix_stats);
+  Counters counters;
+  AddCounters(&counters, "pdlfs", pdlfs_stats);
+  AddCounters(&counters, "posix", posix_stats);
+  CompressionStats cz;
+  GetCompressionStats(&cz);
+  counters.push_back(std::make_pair(
+      "pdlfs_compressed_logical_bytes_written", cz.logical_written));
+  counters.push_back(std::make_pair(
+      "pdlfs_compressed_physical_bytes_written", cz.physical_written));
+  counters.push_back(
+      std::make_pair("pdlfs_compressed_logical_bytes_read", cz.logical_read));
+  counters.push_back(std::make_pair("pdlfs_compressed_physical_bytes_read",
+                                    cz.physical_read));
+  ChecksumStats crc;
+  GetChecksumStats(&crc);
+  counters.push_back(
+      std::make_pair("pdlfs_checksummed_bytes", crc.bytes_checksummed));
+  counters.push_back(
+      std::make_pair("pdlfs_verified_bytes", crc.bytes_verified));
+  counters.push_back(
+      std::make_pair("pdlfs_checksum_mismatches", crc.mismatches));
+  struct Loc {
+    double value;
+    int rank;
+  };
+  const int n = counters.size();
+  std::vector<Loc> local(n);
+  std::vector<Loc> min(n);
+  std::vector<Loc> max(n);
+  std::vector<double> values(n);
+  std::vector<double> sum(n);
+  for (int i = 0; i < n; i++) {
+    local[i].value = values[i] = counters[i].second;
+    local[i].rank = fs_ctx->rank;
+  }
+  MPI_Reduce(&local[0], &min[0], n, MPI_DOUBLE_INT, MPI_MINLOC, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&local[0], &max[0], n, MPI_DOUBLE_INT, MPI_MAXLOC, 0,
+             MPI_COMM_WORLD);
+  MPI_Reduce(&values[0], &sum[0], n, MPI_DOUBLE, MPI_SUM, 0, MPI_COMM_WORLD);
+  if (fs_ctx->rank != 0) {
+    return;
+  }
+  FILE* f = posix_fopen("/tmp/pdlfs_preload.job.log", "w");
+  if (f == NULL) {
+    return;
+  }
+  char tmp[500];
+  snprintf(tmp, sizeof(tmp), "job ranks\t%d\n", size);
+  posix_fputs(tmp, f);
+  for (int i = 0; i < n; i++) {
+    if (max[i].value == 0) continue;
+    double mean = sum[i] / size;
+    snprintf(tmp, sizeof(tmp),
+             "job %s\tsum %.0f min %.0f (rank %d) max %.0f (rank %d) "
+             "mean %.1f imbalance %.2f\n",
+             counters[i].first.c_str(), sum[i], min[i].value, min[i].rank,
+             max[i].value, max[i].rank, mean, max[i].value / mean);
+    posix_fputs(tmp, f);
+  }
+  posix_fclose(f);
 }
+#endif
 
 static void __do_at_exit() {
-  LogStats("pdlfs", fs_ctx->pdlfs_stats);
-  LogStats("posix", fs_ctx->posix_stats);
+  // Streams left open still buffer data that must reach the backends
+  pdlfs_fflushall();
+  pdlfs_msyncall();
+  FlushAllCached();
+  CallStats pdlfs_stats;
+  CallStats posix_stats;
+  MergeStats(&pdlfs_stats, &posix_stats);
+  LogStats("pdlfs", pdlfs_stats);
+  LogStats("posix", posix_stats);
+  CompressionStats cz;
+  GetCompressionStats(&cz);
+  Logv("num pdlfs_compressed_logical_bytes_written\t%llu\n",
+       cz.logical_written);
+  Logv("num pdlfs_compressed_physical_bytes_written\t%llu\n",
+       cz.physical_written);
+  Logv("num pdlfs_compressed_logical_bytes_read\t%llu\n", cz.logical_read);
+  Logv("num pdlfs_compressed_physical_bytes_read\t%llu\n", cz.physical_read);
+  ChecksumStats crc;
+  GetChecksumStats(&crc);
+  Logv("num pdlfs_checksummed_bytes\t%llu\n", crc.bytes_checksummed);
+  Logv("num pdlfs_verified_bytes\t%llu\n", crc.bytes_verified);
+  Logv("num pdlfs_checksum_mismatches\t%llu\n", crc.mismatches);
   delete fs_ctx;
 }
 
@@ -218,6 +847,8 @@ static void __init_ctx() {
   google::InitGoogleLogging("pdlfs");
   google::InstallFailureSignalHandler();
 #endif
+  retired_files = new std::vector<RetiredFile>;
+  cached_files = new std::multimap<std::string, OpenFile*>;
   Context* ctx = new Context;
   fs_ctx = ctx;
   atexit(&__do_at_exit);
@@ -237,432 +868,2444 @@ static void MutexUnlock() {
   }
 }
 
+static void BeginLookup();
+static void RetireFile(OpenFile* file);
+
+// A file returned through file, including one removed from the table,
+// stays valid until the calling thread's call is counted.
 static bool __check_file_by_fd(int fd, FileType* type, int* __fd,
-                               bool remove = false) {
+                               OpenFile** file = NULL, bool remove = false) {
   assert(fs_ctx != NULL);
-  bool ok = true;
-  int tmp;
-  MutexLock();
-  std::map<int, int>::iterator it;
-  it = fs_ctx->fd_map.find(fd);
-  if (it == fs_ctx->fd_map.end()) {
-    ok = false;
-  } else if (it->second >= 0) {
-    *type = kPOSIX;
-    *__fd = it->second;
-  } else {
-    *type = kPDLFS;
-    tmp = -1 * it->second;
-    tmp--;
-    *__fd = tmp;
+  bool ok = fs_ctx->fd_table.Lookup(fd, type, __fd);
+  if (ok && *type == kPDLFS && file != NULL) {
+    BeginLookup();
+    ok = fs_ctx->fd_table.Lookup(fd, type, __fd, file);
   }
   if (ok && remove) {
-    fs_ctx->fd_map.erase(it);
+    if (file != NULL) {
+      *file = NULL;
+    }
+    MutexLock();
+    ok = fs_ctx->fd_table.Lookup(fd, type, __fd);
+    if (ok) {
+      OpenFile* f = fs_ctx->fd_table.Remove(fd);
+      if (f != NULL) {
+        RetireFile(f);
+      }
+      if (file != NULL) {
+        *file = f;
+      }
+    }
+    MutexUnlock();
   }
-  MutexUnlock();
   return ok;
 }
 
-static bool __check_file(FILE* f, FileType* type, bool remove = false) {
-  assert(fs_ctx != NULL);
-  bool ok = true;
-  MutexLock();
-  std::map<FILE*, FileType>::iterator it;
-  it = fs_ctx->files.find(f);
-  if (it == fs_ctx->files.end()) {
-    ok = false;
-  } else {
-    *type = it->second;
-    if (remove) {
-      fs_ctx->files.erase(f);
+// Paths used when writes to a pdlfs file are cached. Reads first write out
+// any cached data they overlap so that they see earlier writes.
+static ssize_t CachedPwrite(OpenFile* file, const void* buf, size_t sz,
+                            off_t off) {
+  pthread_mutex_lock(&file->mu);
+  ssize_t n = file->cache->Write(buf, sz, off);
+  if (n > 0 && off + n > file->size) {
+    file->size = off + n;
+  }
+  pthread_mutex_unlock(&file->mu);
+  return n;
+}
+
+static ssize_t CachedWrite(OpenFile* file, const void* buf, size_t sz) {
+  pthread_mutex_lock(&file->mu);
+  off_t off = file->off;
+  ssize_t n = file->cache->Write(buf, sz, off);
+  if (n > 0) {
+    file->off = off + n;
+    if (file->off > file->size) {
+      file->size = file->off;
     }
   }
-  MutexUnlock();
-  return ok;
+  pthread_mutex_unlock(&file->mu);
+  return n;
 }
 
-extern "C" {
+static ssize_t CachedPread(OpenFile* file, int __fd, void* buf, size_t sz,
+                           off_t off) {
+  pthread_mutex_lock(&file->mu);
+  int r = file->cache->Flush(off, sz);
+  pthread_mutex_unlock(&file->mu);
+  if (r != 0) {
+    return -1;
+  }
+  return file->ops->pread(__fd, buf, sz, off);
+}
 
-int mkdir(const char* path, mode_t mode) __THROW {
-  if (fs_ctx == NULL) {
-    pthread_once(&once, &__init_ctx);
+static ssize_t CachedRead(OpenFile* file, int __fd, void* buf, size_t sz) {
+  pthread_mutex_lock(&file->mu);
+  ssize_t n = file->cache->Flush(file->off, sz);
+  if (n == 0) {
+    n = file->ops->pread(__fd, buf, sz, file->off);
+    if (n > 0) {
+      file->off += n;
+    }
   }
-  if (path == NULL) {
-    errno = EINVAL;
+  pthread_mutex_unlock(&file->mu);
+  return n;
+}
+
+static size_t IovLength(const struct iovec* iov, int iovcnt) {
+  size_t sz = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    sz += iov[i].iov_len;
+  }
+  return sz;
+}
+
+// Caller must hold file->mu.
+static ssize_t CacheWritev(OpenFile* file, const struct iovec* iov,
+                           int iovcnt, off_t off) {
+  ssize_t total = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    ssize_t n = file->cache->Write(iov[i].iov_base, iov[i].iov_len,
+                                   off + total);
+    if (n == -1) {
+      return total == 0 ? -1 : total;
+    }
+    total += n;
+    if (static_cast<size_t>(n) < iov[i].iov_len) {
+      break;
+    }
+  }
+  if (total > 0 && off + total > file->size) {
+    file->size = off + total;
+  }
+  return total;
+}
+
+static ssize_t CachedPwritev(OpenFile* file, const struct iovec* iov,
+                             int iovcnt, off_t off) {
+  pthread_mutex_lock(&file->mu);
+  ssize_t n = CacheWritev(file, iov, iovcnt, off);
+  pthread_mutex_unlock(&file->mu);
+  return n;
+}
+
+static ssize_t CachedWritev(OpenFile* file, const struct iovec* iov,
+                            int iovcnt) {
+  pthread_mutex_lock(&file->mu);
+  off_t off = file->off;
+  ssize_t n = CacheWritev(file, iov, iovcnt, off);
+  if (n > 0) {
+    file->off = off + n;
+  }
+  pthread_mutex_unlock(&file->mu);
+  return n;
+}
+
+static ssize_t CachedPreadv(OpenFile* file, int __fd, const struct iovec* iov,
+                            int iovcnt, off_t off) {
+  pthread_mutex_lock(&file->mu);
+  int r = file->cache->Flush(off, IovLength(iov, iovcnt));
+  pthread_mutex_unlock(&file->mu);
+  if (r != 0) {
     return -1;
   }
-  std::string tmp;
-  if (kRedirectCurDir && path[0] != '/') {
-    tmp = fs_ctx->pdlfs_root + "/";
-    tmp += path;
-    path = tmp.c_str();
+  return file->ops->preadv(__fd, iov, iovcnt, off);
+}
+
+static ssize_t CachedReadv(OpenFile* file, int __fd, const struct iovec* iov,
+                           int iovcnt) {
+  pthread_mutex_lock(&file->mu);
+  ssize_t n = file->cache->Flush(file->off, IovLength(iov, iovcnt));
+  if (n == 0) {
+    n = file->ops->preadv(__fd, iov, iovcnt, file->off);
+    if (n > 0) {
+      file->off += n;
+    }
   }
+  pthread_mutex_unlock(&file->mu);
+  return n;
+}
 
-  int r;
-  ParsedPath parsed;
-  bool ok = fs_ctx->ParsePath(path, &parsed);
-  if (!ok || parsed.type == kPOSIX) {
-    parsed.type = kPOSIX;
-    const char* p = ok ? parsed.path : path;
-    fs_ctx->posix_stats.mkdir++;
-    Trace("posix_mkdir %s\n", p);
-    r = posix_mkdir(p, mode);
+static int CachedSync(OpenFile* file) {
+  pthread_mutex_lock(&file->mu);
+  int r = file->cache->FlushAll();
+  pthread_mutex_unlock(&file->mu);
+  return r;
+}
+
+// Shared by fsync(), fdatasync(), and aio_fsync().
+static int PdlfsSync(OpenFile* file, int __fd, bool datasync) {
+  int r = (file->cache != NULL) ? CachedSync(file) : 0;
+  if (r == 0 && file->ops->fsync != NULL) {
+    r = file->ops->fsync(__fd, datasync);
+  }
+  return r;
+}
+
+// Keep the cached attributes of a pdlfs file in step with a write of n
+// bytes at off. For writes at the file position (off < 0) the position is
+// only known here when the write cache is on; otherwise the entry is
+// dropped and refetched by the next stat.
+static void AttrWrite(OpenFile* file, ssize_t n, off_t off) {
+  AttrCache* attrs = fs_ctx->attr_cache;
+  if (attrs == NULL || n <= 0) {
+    return;
+  }
+  off_t end = -1;
+  if (off >= 0) {
+    end = off + n;
+  } else if (file->cache != NULL) {
+    pthread_mutex_lock(&file->mu);
+    end = file->off;
+    pthread_mutex_unlock(&file->mu);
+  }
+  if (end >= 0) {
+    attrs->Extend(file->path, end);
   } else {
-    fs_ctx->pdlfs_stats.mkdir++;
-    Trace("pdlfs_mkdir %s\n", parsed.path);
-    r = pdlfs_mkdir(parsed.path, mode);
+    attrs->Erase(file->path);
+  }
+}
+
+// Approximate access(2) for a pdlfs file from its attributes.
+static int CheckAccess(const struct stat& buf, int mode) {
+  mode &= R_OK | W_OK | X_OK;
+  if (mode == 0) {
+    return 0;
   }
+  int bits;
+  uid_t uid = getuid();
+  if (uid == 0) {
+    bits = R_OK | W_OK;
+    if (S_ISDIR(buf.st_mode) || (buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+      bits |= X_OK;
+    }
+  } else if (buf.st_uid == uid) {
+    bits = (buf.st_mode >> 6) & 7;
+  } else if (buf.st_gid == getgid()) {
+    bits = (buf.st_mode >> 3) & 7;
+  } else {
+    bits = buf.st_mode & 7;
+  }
+  if ((bits & mode) != mode) {
+    errno = EACCES;
+    return -1;
+  }
+  return 0;
+}
+
+static __thread StatsShard* tls_shard = NULL;
+static pthread_key_t shard_key;
+static pthread_once_t shard_once = PTHREAD_ONCE_INIT;
+
+// Called as a thread exits. The counters of the thread are kept and its
+// shard is reset for reuse.
+static void ReleaseShard(void* arg) {
+  StatsShard* shard = reinterpret_cast<StatsShard*>(arg);
+  MutexLock();
+  StatsShard** p = &fs_ctx->shards;
+  while (*p != shard) {
+    p = &(*p)->next;
+  }
+  *p = shard->next;
+  fs_ctx->retired[kPDLFS].Merge(shard->stats[kPDLFS]);
+  fs_ctx->retired[kPOSIX].Merge(shard->stats[kPOSIX]);
+  memset(shard, 0, sizeof(StatsShard));
+  shard->next = fs_ctx->free_shards;
+  fs_ctx->free_shards = shard;
+  MutexUnlock();
+  tls_shard = NULL;
+}
+
+static void InitShardKey() { pthread_key_create(&shard_key, &ReleaseShard); }
+
+static StatsShard* NewShard() {
+  int err = errno;
+  pthread_once(&shard_once, &InitShardKey);
+  MutexLock();
+  StatsShard* shard = fs_ctx->free_shards;
+  if (shard != NULL) {
+    fs_ctx->free_shards = shard->next;
+  } else {
+    void* ptr;
+    if (posix_memalign(&ptr, kCacheLineSize, sizeof(StatsShard)) != 0) {
+      abort();
+    }
+    shard = reinterpret_cast<StatsShard*>(ptr);
+    memset(shard, 0, sizeof(StatsShard));
+  }
+  shard->next = fs_ctx->shards;
+  fs_ctx->shards = shard;
+  MutexUnlock();
+  pthread_setspecific(shard_key, shard);
+  errno = err;
+  return shard;
+}
+
+static inline StatsShard* Shard() {
+  StatsShard* shard = tls_shard;
+  if (shard == NULL) {
+    shard = tls_shard = NewShard();
+  }
+  return shard;
+}
+
+static inline CallStats* Stats(FileType type) {
+  return &Shard()->stats[type];
+}
+
+// Announce that the current call may look up open files. The epoch is
+// published before any lookup and withdrawn when the call is counted.
+static void BeginLookup() {
+  StatsShard* shard = Shard();
+  if (shard->epoch == 0) {
+    __atomic_store_n(&shard->epoch,
+                     __atomic_load_n(&file_epoch, __ATOMIC_ACQUIRE),
+                     __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+static inline void EndLookup() {
+  __atomic_store_n(&tls_shard->epoch, 0, __ATOMIC_RELEASE);
+}
+
+// Keep a file past the end of the current call. REQUIRES: the file has
+// been looked up by the current call, or mutex is held and the file is
+// still in cached_files.
+static inline void Pin(OpenFile* file) {
+  __atomic_add_fetch(&file->pins, 1, __ATOMIC_RELAXED);
+}
+
+static inline void Unpin(OpenFile* file) {
+  __atomic_sub_fetch(&file->pins, 1, __ATOMIC_RELEASE);
+}
+
+// Free retired files that are neither pinned nor visible to any call
+// that started before they were removed. REQUIRES: mutex is held.
+static void ReclaimFiles() {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  unsigned long long oldest = ~0ULL;
+  for (StatsShard* s = fs_ctx->shards; s != NULL; s = s->next) {
+    unsigned long long e = __atomic_load_n(&s->epoch, __ATOMIC_ACQUIRE);
+    if (e != 0 && e < oldest) {
+      oldest = e;
+    }
+  }
+  std::vector<RetiredFile>* files = retired_files;
+  size_t j = 0;
+  for (size_t i = 0; i < files->size(); i++) {
+    const RetiredFile& r = (*files)[i];
+    if (r.epoch <= oldest &&
+        __atomic_load_n(&r.file->pins, __ATOMIC_ACQUIRE) == 0) {
+      delete r.file;
+    } else {
+      (*files)[j++] = r;
+    }
+  }
+  files->resize(j);
+}
+
+// Take ownership of a file just removed from the fd table.
+// REQUIRES: mutex is held.
+static void RetireFile(OpenFile* file) {
+  if (file->cache != NULL) {
+    typedef std::multimap<std::string, OpenFile*>::iterator Iter;
+    std::pair<Iter, Iter> range = cached_files->equal_range(file->path);
+    for (Iter it = range.first; it != range.second; ++it) {
+      if (it->second == file) {
+        cached_files->erase(it);
+        break;
+      }
+    }
+  }
+  RetiredFile r;
+  r.epoch = __atomic_add_fetch(&file_epoch, 1, __ATOMIC_SEQ_CST);
+  r.file = file;
+  retired_files->push_back(r);
+  ReclaimFiles();
+}
+
+// Write out data that open files of path other than self have cached over
+// [off, off + sz), or all of it if off is negative, so that a read through
+// any descriptor, stream or mapping sees every write made before it.
+// Return 0 on success, or -1 on errors.
+static int FlushCached(const PdlfsOps* ops, const std::string& path,
+                       const OpenFile* self, off_t off, size_t sz) {
+  if (fs_ctx->write_cache_size == 0) {
+    return 0;
+  }
+  typedef std::multimap<std::string, OpenFile*>::iterator Iter;
+  std::vector<OpenFile*> files;
+  MutexLock();
+  std::pair<Iter, Iter> range = cached_files->equal_range(path);
+  for (Iter it = range.first; it != range.second; ++it) {
+    if (it->second != self && it->second->ops == ops) {
+      Pin(it->second);
+      files.push_back(it->second);
+    }
+  }
+  MutexUnlock();
+  int r = 0;
+  for (size_t i = 0; i < files.size(); i++) {
+    pthread_mutex_lock(&files[i]->mu);
+    int s = (off < 0) ? files[i]->cache->FlushAll()
+                      : files[i]->cache->Flush(off, sz);
+    pthread_mutex_unlock(&files[i]->mu);
+    Unpin(files[i]);
+    if (s != 0) r = -1;
+  }
+  return r;
+}
+
+// Return the position of a file whose position is tracked by its write
+// cache, or -1 if the backend keeps it.
+static off_t CachedOffset(OpenFile* file) {
+  if (file->cache == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&file->mu);
+  off_t off = file->off;
+  pthread_mutex_unlock(&file->mu);
+  return off;
+}
+
+static int FlushStream(FILE* stream) {
+  if (fs_ctx->write_cache_size == 0) {
+    return 0;
+  }
+  const PdlfsOps* ops;
+  const char* path;
+  int flags;
+  pdlfs_fbackend(stream, &ops, &path, &flags);
+  return FlushCached(ops, path, NULL, -1, 0);
+}
+
+// Descriptors left open are closed by exit, which writes out their caches.
+static void FlushAllCached() {
+  MutexLock();
+  std::multimap<std::string, OpenFile*>::iterator it;
+  for (it = cached_files->begin(); it != cached_files->end(); ++it) {
+    pthread_mutex_lock(&it->second->mu);
+    it->second->cache->FlushAll();
+    pthread_mutex_unlock(&it->second->mu);
+  }
+  MutexUnlock();
+}
+
+// Write out data cached longer than PDLFS_WriteCacheAge even if the file
+// sees no further writes.
+static void* FlushThread(void* arg) {
+  const unsigned long long age = *reinterpret_cast<unsigned long long*>(arg);
+  delete reinterpret_cast<unsigned long long*>(arg);
+  const unsigned long long interval = std::max(age / 2, 1000000ULL);
+  struct timespec ts;
+  ts.tv_sec = interval / 1000000000ULL;
+  ts.tv_nsec = interval % 1000000000ULL;
+  std::vector<OpenFile*> files;
+  for (;;) {
+    nanosleep(&ts, NULL);
+    MutexLock();
+    std::multimap<std::string, OpenFile*>::iterator it;
+    for (it = cached_files->begin(); it != cached_files->end(); ++it) {
+      Pin(it->second);
+      files.push_back(it->second);
+    }
+    MutexUnlock();
+    for (size_t i = 0; i < files.size(); i++) {
+      pthread_mutex_lock(&files[i]->mu);
+      // Errors leave the data cached; the next write or close reports them
+      files[i]->cache->FlushExpired();
+      pthread_mutex_unlock(&files[i]->mu);
+      Unpin(files[i]);
+    }
+    files.clear();
+  }
+  return NULL;
+}
+
+static void StartFlushThread() {
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  pthread_t t;
+  unsigned long long* age = new unsigned long long(fs_ctx->write_cache_age);
+  if (pthread_create(&t, &attr, &FlushThread, age) != 0) {
+    delete age;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+static inline ctr_t NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<ctr_t>(ts.tv_sec) * 1000000000ULL + ts.tv_nsec;
+}
+
+// Return the start time of a call, or 0 if timing is disabled.
+static inline ctr_t TimerStart() { return fs_ctx->timing ? NowNanos() : 0; }
+
+static inline void Record(CallStats* stats, OpType op, ctr_t start) {
+  EndLookup();
+  Add(&stats->calls[op], 1);
+  if (start != 0) {
+    stats->latency[op].Add(NowNanos() - start);
+  }
+}
+
+// Count a call and whether it failed. Returns r.
+template <typename T>
+static inline T Account(FileType type, OpType op, T r, bool failed,
+                        ctr_t start) {
+  CallStats* stats = Stats(type);
+  Record(stats, op, start);
+  if (failed) {
+    Add(&stats->errors[op], 1);
+  }
+  return r;
+}
+
+// Count a data transfer of n out of sz bytes. Returns n.
+static inline ssize_t AccountIO(FileType type, OpType op, ssize_t n, size_t sz,
+                                bool is_write, ctr_t start) {
+  CallStats* stats = Stats(type);
+  Record(stats, op, start);
+  if (n < 0) {
+    Add(&stats->errors[op], 1);
+  } else {
+    Add(is_write ? &stats->bytes_written : &stats->bytes_read, n);
+    if (static_cast<size_t>(n) < sz) {
+      Add(is_write ? &stats->short_writes : &stats->short_reads, 1);
+    }
+  }
+  return n;
+}
+
+// Streams opened by pdlfs_fopen() are self-identifying, so classifying
+// a stream needs neither the lock nor a lookup.
+static inline bool __check_file(FILE* f, FileType* type) {
+  *type = pdlfs_isfile(f) ? kPDLFS : kPOSIX;
+  return true;
+}
+
+static bool IsWriteStream(FILE* f) {
+  const PdlfsOps* ops;
+  const char* path;
+  int flags;
+  pdlfs_fbackend(f, &ops, &path, &flags);
+  return (flags & O_ACCMODE) != O_RDONLY;
+}
+
+// Give a pdlfs stream a descriptor mapped to the backend file under it.
+// The descriptor stays valid until fclose() or close().
+static int __stream_fd(FILE* f) {
+  const char* path;
+  int flags;
+  const PdlfsOps* ops;
+  int __fd = pdlfs_fbackend(f, &ops, &path, &flags);
+  MutexLock();
+  int fd = pdlfs_fileno(f);
+  if (fd == -1) {
+    fd = ++fs_ctx->fd;
+    OpenFile* file = new OpenFile(ops, path, flags, 0);
+    file->stream = f;
+    fs_ctx->fd_table.Insert(fd, kPDLFS, __fd, file);
+    pdlfs_setfileno(f, fd);
+  }
+  MutexUnlock();
+  return fd;
+}
+
+// Formatted output shared by the printf family. Streams other than pdlfs
+// ones may be written to while the context is still being set up.
+static int __vfprintf(FILE* file, const char* fmt, va_list ap) {
+  if (fs_ctx == NULL && !pdlfs_isfile(file)) {
+    return posix_vfprintf(file, fmt, ap);
+  }
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_vfprintf(file, fmt, ap);
+  } else {
+    r = posix_vfprintf(file, fmt, ap);
+  }
+
+  return AccountIO(type, kFprintf, r, r < 0 ? 0 : r, true, start);
+}
+
+extern "C" {
+
+int mkdir(const char* path, mode_t mode) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (kRedirectCurDir && path[0] != '/') {
+    path = fs_ctx->Redirect(path, tmp);
+    if (path == NULL) {
+      return -1;
+    }
+  }
+
+  int r;
+  ParsedPath parsed;
+  bool ok = fs_ctx->ParsePath(path, &parsed);
+  if (!ok || parsed.type == kPOSIX) {
+    parsed.type = kPOSIX;
+    const char* p = ok ? parsed.path : path;
+    Trace("posix_mkdir %s\n", p);
+    r = posix_mkdir(p, mode);
+  } else {
+    Trace("pdlfs_mkdir %s\n", parsed.path);
+    r = parsed.mount->ops->mkdir(parsed.path, mode);
+  }
+
+  return Account(parsed.type, kMkdir, r, r == -1, start);
+}
+
+int open(const char* path, int oflags, ...) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  if (path == NULL) {
+    errno = EINVAL;
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (kRedirectCurDir && path[0] != '/') {
+    path = fs_ctx->Redirect(path, tmp);
+    if (path == NULL) {
+      return -1;
+    }
+  }
+  va_list args;
+  va_start(args, oflags);
+  mode_t mode;
+  if (O_CREAT == (oflags & O_CREAT)) {
+    mode = va_arg(args, mode_t);
+  }
+  va_end(args);
+
+  int __fd;
+  struct stat buf;
+  ParsedPath parsed;
+  bool ok = fs_ctx->ParsePath(path, &parsed);
+  if (!ok || parsed.type == kPOSIX) {
+    parsed.type = kPOSIX;
+    const char* p = ok ? parsed.path : path;
+    Trace("posix_open %s\n", p);
+    __fd = posix_open(p, oflags, mode);
+  } else {
+    Trace("pdlfs_open %s\n", parsed.path);
+    __fd = parsed.mount->ops->open(parsed.path, oflags, mode, &buf);
+  }
+  if (__fd == -1) {
+    return Account(parsed.type, kOpen, __fd, true, start);
+  }
+
+  int err = 0;
+  int fd;
+  MutexLock();
+  if (parsed.type == kPOSIX) {
+    if (!fs_ctx->fd_table.Contains(__fd)) {
+      fd = __fd;
+    } else {
+      fd = posix_fcntl1(__fd, F_DUPFD, ++fs_ctx->fd);
+      err = errno;
+      posix_close(__fd);
+    }
+    if (fd != -1) {
+      fs_ctx->fd_table.Insert(fd, kPOSIX, fd);
+    }
+  } else {
+    if (fs_ctx->attr_cache != NULL) {
+      fs_ctx->attr_cache->Put(parsed.path, buf);
+    }
+    const PdlfsOps* ops = parsed.mount->ops;
+    OpenFile* file = new OpenFile(ops, parsed.path, oflags, buf.st_size);
+    // Appends land at the end of the file as the backend sees it, which
+    // only the backend knows once other descriptors or ranks append too
+    if (fs_ctx->write_cache_size != 0 && (oflags & O_ACCMODE) != O_RDONLY &&
+        (oflags & O_APPEND) == 0) {
+      file->cache = new WriteCache(ops, __fd, fs_ctx->write_cache_size,
+                                   fs_ctx->write_cache_age);
+      cached_files->insert(std::make_pair(file->path, file));
+    }
+    fd = ++fs_ctx->fd;
+    fs_ctx->fd_table.Insert(fd, kPDLFS, __fd, file);
+  }
+  if (fd > fs_ctx->fd) {
+    fs_ctx->fd = fd;
+  }
+  MutexUnlock();
+  if (err != 0) {
+    errno = err;
+  }
+  if (parsed.type == kPDLFS && fs_ctx->write_cache_size != 0) {
+    pthread_once(&flush_once, &StartFlushThread);
+  }
+
+  return Account(parsed.type, kOpen, fd, fd == -1, start);
+}
+
+int creat(const char* path, mode_t mode) {
+  return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+}
+
+int fstat(int fd, struct stat* buf) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    AttrCache* attrs = fs_ctx->attr_cache;
+    if (attrs != NULL && attrs->Get(file->path, buf)) {
+      r = 0;
+    } else {
+      r = file->ops->fstat(__fd, buf);
+      if (r == 0 && attrs != NULL) {
+        attrs->Put(file->path, *buf);
+      }
+    }
+    if (r == 0 && file->cache != NULL) {
+      pthread_mutex_lock(&file->mu);
+      if (file->cache->End() > buf->st_size) {
+        buf->st_size = file->cache->End();
+      }
+      pthread_mutex_unlock(&file->mu);
+    }
+  } else {
+    type = kPOSIX;
+    r = posix_fstat(fd, buf);
+  }
+
+  return Account(type, kFstat, r, r == -1, start);
+}
+
+// Code built with _FILE_OFFSET_BITS=64 calls the *64 names. On LP64
+// targets struct stat64 has the same layout as struct stat.
+static_assert(sizeof(struct stat64) == sizeof(struct stat),
+              "stat64 differs from stat");
+
+int fstat64(int fd, struct stat64* buf) __THROW {
+  return fstat(fd, reinterpret_cast<struct stat*>(buf));
+}
+
+// glibc fails calls made for a structure layout it does not know.
+static bool KnownStatVersion(int ver) {
+#ifdef _STAT_VER_KERNEL
+  if (ver == _STAT_VER_KERNEL) {
+    return true;
+  }
+#endif
+  if (ver != _STAT_VER) {
+    errno = EINVAL;
+    return false;
+  }
+  return true;
+}
+
+int __fxstat(int ver, int fd, struct stat* buf) __THROW {
+  if (!KnownStatVersion(ver)) {
+    return -1;
+  }
+  return fstat(fd, buf);
+}
+
+int __fxstat64(int ver, int fd, struct stat64* buf) __THROW {
+  return __fxstat(ver, fd, reinterpret_cast<struct stat*>(buf));
+}
+
+int ftruncate(int fd, off_t len) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    r = (file->cache != NULL) ? CachedSync(file) : 0;
+    if (r == 0) {
+      r = file->ops->ftruncate(__fd, len);
+    }
+    if (r == 0) {
+      pthread_mutex_lock(&file->mu);
+      file->size = len;
+      pthread_mutex_unlock(&file->mu);
+      if (fs_ctx->attr_cache != NULL) {
+        fs_ctx->attr_cache->Truncate(file->path, len);
+      }
+    }
+  } else {
+    type = kPOSIX;
+    r = posix_ftruncate(fd, len);
+  }
+
+  return Account(type, kFtruncate, r, r == -1, start);
+}
+
+// Attributes of a pdlfs file by path. The size covers data written to open
+// files of the path that is still held by their write caches.
+static int PdlfsStat(const ParsedPath& parsed, struct stat* buf) {
+  int r;
+  AttrCache* attrs = fs_ctx->attr_cache;
+  if (attrs != NULL && attrs->Get(parsed.path, buf)) {
+    r = 0;
+  } else {
+    r = parsed.mount->ops->stat(parsed.path, buf);
+    if (r == 0 && attrs != NULL) {
+      attrs->Put(parsed.path, *buf);
+    }
+  }
+  if (r == 0 && fs_ctx->write_cache_size != 0) {
+    typedef std::multimap<std::string, OpenFile*>::iterator Iter;
+    MutexLock();
+    std::pair<Iter, Iter> range = cached_files->equal_range(parsed.path);
+    for (Iter it = range.first; it != range.second; ++it) {
+      OpenFile* file = it->second;
+      if (file->ops == parsed.mount->ops) {
+        pthread_mutex_lock(&file->mu);
+        if (file->cache->End() > buf->st_size) {
+          buf->st_size = file->cache->End();
+        }
+        pthread_mutex_unlock(&file->mu);
+      }
+    }
+    MutexUnlock();
+  }
+  return r;
+}
+
+// stat and lstat are the same for pdlfs files since pdlfs has no symlinks.
+static int __stat(const char* path, struct stat* buf, OpType op) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  if (path == NULL || path[0] == 0) {
+    errno = (path == NULL) ? EFAULT : ENOENT;
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (kRedirectCurDir && path[0] != '/') {
+    path = fs_ctx->Redirect(path, tmp);
+    if (path == NULL) {
+      return -1;
+    }
+  }
+
+  int r;
+  ParsedPath parsed;
+  bool ok = fs_ctx->ParsePath(path, &parsed);
+  if (!ok || parsed.type == kPOSIX) {
+    parsed.type = kPOSIX;
+    const char* p = ok ? parsed.path : path;
+    Trace("posix_stat %s\n", p);
+    r = (op == kLstat) ? posix_lstat(p, buf) : posix_stat(p, buf);
+  } else {
+    Trace("pdlfs_stat %s\n", parsed.path);
+    r = PdlfsStat(parsed, buf);
+  }
+
+  return Account(parsed.type, op, r, r == -1, start);
+}
+
+int stat(const char* path, struct stat* buf) __THROW {
+  return __stat(path, buf, kStat);
+}
+
+int lstat(const char* path, struct stat* buf) __THROW {
+  return __stat(path, buf, kLstat);
+}
+
+int stat64(const char* path, struct stat64* buf) __THROW {
+  return __stat(path, reinterpret_cast<struct stat*>(buf), kStat);
+}
+
+int lstat64(const char* path, struct stat64* buf) __THROW {
+  return __stat(path, reinterpret_cast<struct stat*>(buf), kLstat);
+}
+
+int __xstat(int ver, const char* path, struct stat* buf) __THROW {
+  if (!KnownStatVersion(ver)) {
+    return -1;
+  }
+  return __stat(path, buf, kStat);
+}
+
+int __lxstat(int ver, const char* path, struct stat* buf) __THROW {
+  if (!KnownStatVersion(ver)) {
+    return -1;
+  }
+  return __stat(path, buf, kLstat);
+}
+
+int __xstat64(int ver, const char* path, struct stat64* buf) __THROW {
+  return __xstat(ver, path, reinterpret_cast<struct stat*>(buf));
+}
+
+int __lxstat64(int ver, const char* path, struct stat64* buf) __THROW {
+  return __lxstat(ver, path, reinterpret_cast<struct stat*>(buf));
+}
+
+int access(const char* path, int mode) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  if (path == NULL || path[0] == 0) {
+    errno = (path == NULL) ? EFAULT : ENOENT;
+    return -1;
+  }
+  char tmp[PATH_MAX];
+  if (kRedirectCurDir && path[0] != '/') {
+    path = fs_ctx->Redirect(path, tmp);
+    if (path == NULL) {
+      return -1;
+    }
+  }
+
+  int r;
+  ParsedPath parsed;
+  bool ok = fs_ctx->ParsePath(path, &parsed);
+  if (!ok || parsed.type == kPOSIX) {
+    parsed.type = kPOSIX;
+    const char* p = ok ? parsed.path : path;
+    Trace("posix_access %s\n", p);
+    r = posix_access(p, mode);
+  } else {
+    Trace("pdlfs_access %s\n", parsed.path);
+    struct stat buf;
+    r = PdlfsStat(parsed, &buf);
+    if (r == 0) {
+      r = CheckAccess(buf, mode);
+    }
+  }
+
+  return Account(parsed.type, kAccess, r, r == -1, start);
+}
+
+int rename(const char* oldpath, const char* newpath) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  if (oldpath == NULL || newpath == NULL) {
+    errno = EFAULT;
+    return -1;
+  }
+  if (oldpath[0] == 0 || newpath[0] == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  char tmp1[PATH_MAX];
+  char tmp2[PATH_MAX];
+  if (kRedirectCurDir && oldpath[0] != '/') {
+    oldpath = fs_ctx->Redirect(oldpath, tmp1);
+    if (oldpath == NULL) {
+      return -1;
+    }
+  }
+  if (kRedirectCurDir && newpath[0] != '/') {
+    newpath = fs_ctx->Redirect(newpath, tmp2);
+    if (newpath == NULL) {
+      return -1;
+    }
+  }
+
+  int r;
+  ParsedPath parsed1, parsed2;
+  bool ok1 = fs_ctx->ParsePath(oldpath, &parsed1);
+  bool ok2 = fs_ctx->ParsePath(newpath, &parsed2);
+  if (!ok1) parsed1.type = kPOSIX;
+  if (!ok2) parsed2.type = kPOSIX;
+  if (parsed1.type == kPOSIX && parsed2.type == kPOSIX) {
+    const char* p = ok1 ? parsed1.path : oldpath;
+    const char* q = ok2 ? parsed2.path : newpath;
+    Trace("posix_rename %s %s\n", p, q);
+    r = posix_rename(p, q);
+  } else if (parsed1.type != parsed2.type || parsed1.mount != parsed2.mount) {
+    parsed1.type = kPDLFS;
+    errno = EXDEV;
+    r = -1;
+  } else {
+    Trace("pdlfs_rename %s %s\n", parsed1.path, parsed2.path);
+    if (fs_ctx->attr_cache != NULL) {
+      fs_ctx->attr_cache->Erase(parsed1.path);
+      fs_ctx->attr_cache->Erase(parsed2.path);
+    }
+    r = parsed1.mount->ops->rename(parsed1.path, parsed2.path);
+  }
+
+  return Account(parsed1.type, kRename, r, r == -1, start);
+}
+
+ssize_t pread(int fd, void* buf, size_t sz, off_t off) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    if (FlushCached(file->ops, file->path, file, off, sz) != 0) {
+      n = -1;
+    } else if (file->cache != NULL) {
+      n = CachedPread(file, __fd, buf, sz, off);
+    } else {
+      n = file->ops->pread(__fd, buf, sz, off);
+    }
+  } else {
+    type = kPOSIX;
+    n = posix_pread(fd, buf, sz, off);
+  }
+
+  return AccountIO(type, kPread, n, sz, false, start);
+}
+
+ssize_t read(int fd, void* buf, size_t sz) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    off_t off = CachedOffset(file);
+    if (FlushCached(file->ops, file->path, file, off, sz) != 0) {
+      n = -1;
+    } else if (file->cache != NULL) {
+      n = CachedRead(file, __fd, buf, sz);
+    } else {
+      n = file->ops->read(__fd, buf, sz);
+    }
+  } else {
+    type = kPOSIX;
+    n = posix_read(fd, buf, sz);
+  }
+
+  return AccountIO(type, kRead, n, sz, false, start);
+}
+
+ssize_t pwrite(int fd, const void* buf, size_t sz, off_t off) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+#ifndef NOWRITE
+    if (file->cache != NULL) {
+      n = CachedPwrite(file, buf, sz, off);
+    } else {
+      n = file->ops->pwrite(__fd, buf, sz, off);
+    }
+    AttrWrite(file, n, off);
+#else
+    return sz;
+#endif
+  } else {
+    type = kPOSIX;
+    n = posix_pwrite(fd, buf, sz, off);
+  }
+
+  return AccountIO(type, kPwrite, n, sz, true, start);
+}
+
+ssize_t write(int fd, const void* buf, size_t sz) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+#ifndef NOWRITE
+    if (file->cache != NULL) {
+      n = CachedWrite(file, buf, sz);
+    } else {
+      n = file->ops->write(__fd, buf, sz);
+    }
+    AttrWrite(file, n, -1);
+#else
+    return sz;
+#endif
+  } else {
+    type = kPOSIX;
+    n = posix_write(fd, buf, sz);
+  }
+
+  return AccountIO(type, kWrite, n, sz, true, start);
+}
+
+ssize_t preadv(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    if (FlushCached(file->ops, file->path, file, off,
+                    IovLength(iov, iovcnt)) != 0) {
+      n = -1;
+    } else if (file->cache != NULL) {
+      n = CachedPreadv(file, __fd, iov, iovcnt, off);
+    } else {
+      n = file->ops->preadv(__fd, iov, iovcnt, off);
+    }
+  } else {
+    type = kPOSIX;
+    n = posix_preadv(fd, iov, iovcnt, off);
+  }
+
+  return AccountIO(type, kPreadv, n, IovLength(iov, iovcnt), false, start);
+}
+
+ssize_t readv(int fd, const struct iovec* iov, int iovcnt) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    off_t off = CachedOffset(file);
+    if (FlushCached(file->ops, file->path, file, off,
+                    IovLength(iov, iovcnt)) != 0) {
+      n = -1;
+    } else if (file->cache != NULL) {
+      n = CachedReadv(file, __fd, iov, iovcnt);
+    } else {
+      n = file->ops->readv(__fd, iov, iovcnt);
+    }
+  } else {
+    type = kPOSIX;
+    n = posix_readv(fd, iov, iovcnt);
+  }
+
+  return AccountIO(type, kReadv, n, IovLength(iov, iovcnt), false, start);
+}
+
+ssize_t preadv64(int fd, const struct iovec* iov, int iovcnt, off64_t off) {
+  return preadv(fd, iov, iovcnt, off);
+}
+
+ssize_t pwritev(int fd, const struct iovec* iov, int iovcnt, off_t off) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+#ifndef NOWRITE
+    if (file->cache != NULL) {
+      n = CachedPwritev(file, iov, iovcnt, off);
+    } else {
+      n = file->ops->pwritev(__fd, iov, iovcnt, off);
+    }
+    AttrWrite(file, n, off);
+#else
+    return IovLength(iov, iovcnt);
+#endif
+  } else {
+    type = kPOSIX;
+    n = posix_pwritev(fd, iov, iovcnt, off);
+  }
+
+  return AccountIO(type, kPwritev, n, IovLength(iov, iovcnt), true, start);
+}
+
+ssize_t pwritev64(int fd, const struct iovec* iov, int iovcnt, off64_t off) {
+  return pwritev(fd, iov, iovcnt, off);
+}
+
+ssize_t writev(int fd, const struct iovec* iov, int iovcnt) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  ssize_t n;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+#ifndef NOWRITE
+    if (file->cache != NULL) {
+      n = CachedWritev(file, iov, iovcnt);
+    } else {
+      n = file->ops->writev(__fd, iov, iovcnt);
+    }
+    AttrWrite(file, n, -1);
+#else
+    return IovLength(iov, iovcnt);
+#endif
+  } else {
+    type = kPOSIX;
+    n = posix_writev(fd, iov, iovcnt);
+  }
+
+  return AccountIO(type, kWritev, n, IovLength(iov, iovcnt), true, start);
+}
+
+int close(int fd) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  const bool remove_fd = true;
+  int r;
+  FileType type;
+  int __fd;
+  OpenFile* file = NULL;
+  if (__check_file_by_fd(fd, &type, &__fd, &file, remove_fd) &&
+      type == kPDLFS) {
+    int err = 0;
+    if (file->cache != NULL && CachedSync(file) != 0) {
+      err = errno;
+    }
+    if (fs_ctx->attr_cache != NULL) {
+      fs_ctx->attr_cache->Erase(file->path);
+    }
+    if (file->stream != NULL) {
+      MutexLock();
+      pdlfs_setfileno(file->stream, -1);
+      MutexUnlock();
+      r = 0;
+    } else {
+      r = file->ops->close(__fd);
+    }
+    if (err != 0) {
+      errno = err;
+      r = -1;
+    }
+  } else {
+    type = kPOSIX;
+    r = posix_close(fd);
+  }
+
+  return Account(type, kClose, r, r == -1, start);
+}
+
+// Anonymous mappings never touch a file system and are passed through
+// without being counted. So are munmap and msync on anything but pdlfs
+// mappings, which cannot be told apart from anonymous ones cheaply.
+void* mmap(void* addr, size_t len, int prot, int flags, int fd,
+           off_t off) __THROW {
+  // A fixed mapping of any kind replaces the pdlfs mappings in its way
+  if ((flags & MAP_FIXED) != 0 && pdlfs_ismapped(addr, len)) {
+    pdlfs_mapfixed(addr, len);
+  }
+  if (fs_ctx == NULL || fd < 0 || (flags & MAP_ANONYMOUS) != 0) {
+    return posix_mmap(addr, len, prot, flags, fd, off);
+  }
+  ctr_t start = TimerStart();
+  void* r;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    if (FlushCached(file->ops, file->path, file, -1, 0) != 0 ||
+        (file->cache != NULL && CachedSync(file) != 0)) {
+      r = MAP_FAILED;
+    } else {
+      Trace("pdlfs_mmap %s\n", file->path.c_str());
+      r = pdlfs_mmap(file->ops, file->path.c_str(), file->flags, addr, len,
+                     prot, flags, off);
+    }
+  } else {
+    type = kPOSIX;
+    r = posix_mmap(addr, len, prot, flags, fd, off);
+  }
+
+  return Account(type, kMmap, r, r == MAP_FAILED, start);
+}
+
+void* mmap64(void* addr, size_t len, int prot, int flags, int fd,
+             off64_t off) __THROW {
+  return mmap(addr, len, prot, flags, fd, off);
+}
+
+int munmap(void* addr, size_t len) __THROW {
+  if (fs_ctx == NULL || !pdlfs_ismapped(addr, len)) {
+    return posix_munmap(addr, len);
+  }
+  ctr_t start = TimerStart();
+  int r = pdlfs_munmap(addr, len);
+  return Account(kPDLFS, kMunmap, r, r == -1, start);
+}
+
+int msync(void* addr, size_t len, int flags) {
+  if (fs_ctx == NULL || !pdlfs_ismapped(addr, len)) {
+    return posix_msync(addr, len, flags);
+  }
+  ctr_t start = TimerStart();
+  int r = pdlfs_msync(addr, len, flags);
+  return Account(kPDLFS, kMsync, r, r == -1, start);
+}
+
+// The write cache is written out first since the backend has not seen
+// its data yet. Backends without pdlfs_fsync get no further than that.
+static int __sync(int fd, OpType op) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(fd, &type, &__fd, &file) && type == kPDLFS) {
+    r = PdlfsSync(file, __fd, op == kFdatasync);
+  } else {
+    type = kPOSIX;
+    r = (op == kFsync) ? posix_fsync(fd) : posix_fdatasync(fd);
+  }
+
+  return Account(type, op, r, r == -1, start);
+}
+
+int fsync(int fd) { return __sync(fd, kFsync); }
+
+int fdatasync(int fd) { return __sync(fd, kFdatasync); }
+
+}  // extern C
+
+// Asynchronous I/O on pdlfs files runs on the I/O thread pool. The status
+// of each request is kept here, keyed by its aiocb, and is answered by
+// aio_error() and aio_return() until the result has been collected.
+// Requests handed to lio_listio() that are contiguous on the same file are
+// merged into one vectored transfer.
+namespace {
+struct AioBatch {
+  int pending;  // Requests not yet done, plus one for any run by glibc
+  bool wait;    // Caller waits for the batch and owns it
+  struct sigevent sev;  // Sent when done if !wait
+};
+
+struct AioRequest {
+  OpType op;  // kAioRead, kAioWrite, or kAioFsync
+  bool datasync;  // For kAioFsync
+  bool canceled;  // Set by aio_cancel() before the request has started
+  int __fd;
+  OpenFile* file;
+  off_t off;
+  std::vector<struct aiocb*> cbs;  // Contiguous, in offset order
+  AioBatch* batch;  // NULL if not part of a lio_listio() call
+  ctr_t start;
+};
+
+struct AioStatus {
+  int fd;   // aio_fildes when submitted
+  int err;  // EINPROGRESS until done
+  ssize_t ret;
+  AioRequest* req;  // Until the request starts or is canceled
+};
+
+struct SigeventCall {
+  void (*function)(union sigval);
+  union sigval value;
+};
+}  // namespace
+
+typedef std::map<const struct aiocb*, AioStatus> AioStatusMap;
+
+static pthread_once_t aio_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t aio_mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t aio_cv;  // Signaled whenever a request completes
+static AioStatusMap* aio_status;  // Guarded by aio_mu
+
+static void InitAio() {
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&aio_cv, &attr);
+  pthread_condattr_destroy(&attr);
+  aio_status = new AioStatusMap;
+}
+
+static void* SigeventThread(void* arg) {
+  SigeventCall* call = reinterpret_cast<SigeventCall*>(arg);
+  call->function(call->value);
+  delete call;
+  return NULL;
+}
+
+static void Notify(const struct sigevent& sev) {
+  if (sev.sigev_notify == SIGEV_SIGNAL) {
+    sigqueue(getpid(), sev.sigev_signo, sev.sigev_value);
+  } else if (sev.sigev_notify == SIGEV_THREAD) {
+    SigeventCall* call = new SigeventCall;
+    call->function = sev.sigev_notify_function;
+    call->value = sev.sigev_value;
+    pthread_attr_t attr;
+    pthread_attr_t* attrp = reinterpret_cast<pthread_attr_t*>(
+        sev.sigev_notify_attributes);
+    if (attrp == NULL) {
+      pthread_attr_init(&attr);
+      attrp = &attr;
+    }
+    pthread_attr_setdetachstate(attrp, PTHREAD_CREATE_DETACHED);
+    pthread_t t;
+    if (pthread_create(&t, attrp, &SigeventThread, call) != 0) {
+      delete call;
+    }
+    if (attrp == &attr) {
+      pthread_attr_destroy(&attr);
+    }
+  }
+}
+
+// Caller holds aio_mu.
+static inline bool AioDoneLocked(const struct aiocb* cb) {
+  AioStatusMap::iterator it = aio_status->find(cb);
+  if (it != aio_status->end()) {
+    return it->second.err != EINPROGRESS;
+  }
+  return posix_aio_error(cb) != EINPROGRESS;
+}
+
+// Drop any status left over from an earlier request on cb that is now
+// handed to glibc, which then answers for it.
+static void ForgetAio(struct aiocb* const* cbs, int n) {
+  pthread_mutex_lock(&aio_mu);
+  for (int i = 0; i < n; i++) {
+    if (cbs[i] != NULL) aio_status->erase(cbs[i]);
+  }
+  pthread_mutex_unlock(&aio_mu);
+}
+
+// Set the results of the requests of req and return the batch that has
+// become done with it, if any. *sev is set to the notification to send
+// for a request not in a batch. Caller holds aio_mu.
+static AioBatch* CompleteLocked(AioRequest* req, ssize_t n, int err,
+                                struct sigevent* sev) {
+  // Hand out the bytes transferred in offset order
+  ssize_t left = n;
+  for (size_t i = 0; i < req->cbs.size(); i++) {
+    struct aiocb* cb = req->cbs[i];
+    AioStatus& s = (*aio_status)[cb];
+    if (n < 0) {
+      s.ret = -1;
+    } else {
+      ssize_t r = std::min(left, static_cast<ssize_t>(cb->aio_nbytes));
+      s.ret = (req->op == kAioFsync) ? 0 : r;
+      left -= r;
+    }
+    s.err = err;
+    s.req = NULL;
+  }
+  AioBatch* done_batch = NULL;
+  if (req->batch == NULL) {
+    *sev = req->cbs[0]->aio_sigevent;
+  } else {
+    sev->sigev_notify = SIGEV_NONE;
+    if (--req->batch->pending == 0 && !req->batch->wait) {
+      done_batch = req->batch;
+    }
+  }
+  pthread_cond_broadcast(&aio_cv);
+  return done_batch;
+}
+
+static void FinishBatch(AioBatch* batch) {
+  if (batch != NULL) {
+    Notify(batch->sev);
+    delete batch;
+  }
+}
+
+// Called by glibc once the requests of a batch it runs are done.
+static void PosixBatchDone(union sigval value) {
+  AioBatch* batch = reinterpret_cast<AioBatch*>(value.sival_ptr);
+  AioBatch* done_batch = NULL;
+  pthread_mutex_lock(&aio_mu);
+  if (--batch->pending == 0) {
+    done_batch = batch;
+  }
+  pthread_cond_broadcast(&aio_cv);
+  pthread_mutex_unlock(&aio_mu);
+  FinishBatch(done_batch);
+}
+
+static void RunAio(void* arg) {
+  AioRequest* req = reinterpret_cast<AioRequest*>(arg);
+  OpenFile* file = req->file;
+  pthread_mutex_lock(&aio_mu);
+  bool canceled = req->canceled;
+  for (size_t i = 0; !canceled && i < req->cbs.size(); i++) {
+    (*aio_status)[req->cbs[i]].req = NULL;  // No longer cancelable
+  }
+  pthread_mutex_unlock(&aio_mu);
+  if (canceled) {  // Completed by aio_cancel()
+    Unpin(file);
+    delete req;
+    return;
+  }
+
+  const int iovcnt = req->cbs.size();
+  std::vector<struct iovec> iov(iovcnt);
+  size_t sz = 0;
+  for (int i = 0; i < iovcnt; i++) {
+    iov[i].iov_base = const_cast<void*>(req->cbs[i]->aio_buf);
+    iov[i].iov_len = req->cbs[i]->aio_nbytes;
+    sz += iov[i].iov_len;
+  }
+  ssize_t n;
+  if (req->op == kAioRead) {
+    if (FlushCached(file->ops, file->path, file, req->off, sz) != 0) {
+      n = -1;
+    } else if (file->cache != NULL) {
+      n = CachedPreadv(file, req->__fd, &iov[0], iovcnt, req->off);
+    } else {
+      n = file->ops->preadv(req->__fd, &iov[0], iovcnt, req->off);
+    }
+  } else if (req->op == kAioWrite) {
+    n = (file->cache != NULL)
+            ? CachedPwritev(file, &iov[0], iovcnt, req->off)
+            : file->ops->pwritev(req->__fd, &iov[0], iovcnt, req->off);
+    AttrWrite(file, n, req->off);
+  } else {
+    n = PdlfsSync(file, req->__fd, req->datasync);
+  }
+  int err = (n < 0) ? errno : 0;
+  AccountIO(kPDLFS, req->op, n, sz, req->op == kAioWrite, req->start);
+
+  struct sigevent sev;
+  pthread_mutex_lock(&aio_mu);
+  AioBatch* done_batch = CompleteLocked(req, n, err, &sev);
+  pthread_mutex_unlock(&aio_mu);
+  Notify(sev);
+  FinishBatch(done_batch);
+  Unpin(file);
+  delete req;
+}
+
+// Mark the requests in flight and queue them.
+static void StartAio(AioRequest** reqs, size_t n) {
+  pthread_mutex_lock(&aio_mu);
+  for (size_t i = 0; i < n; i++) {
+    reqs[i]->canceled = false;
+    for (size_t j = 0; j < reqs[i]->cbs.size(); j++) {
+      struct aiocb* cb = reqs[i]->cbs[j];
+      AioStatus s = {cb->aio_fildes, EINPROGRESS, 0, reqs[i]};
+      (*aio_status)[cb] = s;
+    }
+  }
+  pthread_mutex_unlock(&aio_mu);
+  for (size_t i = 0; i < n; i++) {
+    io_thread_pool()->Schedule(&RunAio, reqs[i]);
+  }
+}
+
+// sync_op is the operation passed to aio_fsync().
+static int __aio_rw(struct aiocb* cb, OpType op, int sync_op) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  pthread_once(&aio_once, &InitAio);
+  ctr_t start = TimerStart();
+  FileType type;
+  int __fd;
+  OpenFile* file;
+  if (__check_file_by_fd(cb->aio_fildes, &type, &__fd, &file) &&
+      type == kPDLFS) {
+    if (op != kAioFsync && cb->aio_offset < 0) {
+      errno = EINVAL;
+      return Account(kPDLFS, op, -1, true, start);
+    }
+    AioRequest* req = new AioRequest;
+    req->op = op;
+    req->datasync = (sync_op == O_DSYNC);
+    req->__fd = __fd;
+    req->file = file;
+    req->off = cb->aio_offset;
+    req->cbs.push_back(cb);
+    req->batch = NULL;
+    req->start = start;
+    Pin(file);
+    EndLookup();
+    StartAio(&req, 1);
+    return 0;  // Counted when done
+  }
+
+  ForgetAio(&cb, 1);
+  int r;
+  if (op == kAioRead) {
+    r = posix_aio_read(cb);
+  } else if (op == kAioWrite) {
+    r = posix_aio_write(cb);
+  } else {
+    r = posix_aio_fsync(sync_op, cb);
+  }
+  return Account(kPOSIX, op, r, r == -1, start);
+}
+
+static bool AioBefore(const struct aiocb* a, const struct aiocb* b) {
+  if (a->aio_fildes != b->aio_fildes) return a->aio_fildes < b->aio_fildes;
+  if (a->aio_lio_opcode != b->aio_lio_opcode) {
+    return a->aio_lio_opcode < b->aio_lio_opcode;
+  }
+  return a->aio_offset < b->aio_offset;
+}
+
+extern "C" {
+
+int aio_read(struct aiocb* cb) __THROW { return __aio_rw(cb, kAioRead, 0); }
+
+int aio_write(struct aiocb* cb) __THROW { return __aio_rw(cb, kAioWrite, 0); }
+
+int aio_fsync(int op, struct aiocb* cb) __THROW {
+  if (op != O_SYNC && op != O_DSYNC) {
+    errno = EINVAL;
+    return -1;
+  }
+  return __aio_rw(cb, kAioFsync, op);
+}
+
+int aio_error(const struct aiocb* cb) __THROW {
+  pthread_once(&aio_once, &InitAio);
+  pthread_mutex_lock(&aio_mu);
+  AioStatusMap::iterator it = aio_status->find(cb);
+  if (it != aio_status->end()) {
+    int err = it->second.err;
+    pthread_mutex_unlock(&aio_mu);
+    return err;
+  }
+  pthread_mutex_unlock(&aio_mu);
+  return posix_aio_error(cb);
+}
+
+// The status of a request is forgotten once its result is collected.
+ssize_t aio_return(struct aiocb* cb) __THROW {
+  pthread_once(&aio_once, &InitAio);
+  pthread_mutex_lock(&aio_mu);
+  AioStatusMap::iterator it = aio_status->find(cb);
+  if (it != aio_status->end()) {
+    ssize_t r = it->second.ret;
+    if (it->second.err == EINPROGRESS) {
+      errno = EINVAL;
+      r = -1;
+    } else {
+      aio_status->erase(it);
+    }
+    pthread_mutex_unlock(&aio_mu);
+    return r;
+  }
+  pthread_mutex_unlock(&aio_mu);
+  return posix_aio_return(cb);
+}
+
+int lio_listio(int mode, struct aiocb* const list[], int nent,
+               struct sigevent* sevp) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  pthread_once(&aio_once, &InitAio);
+  ctr_t start = TimerStart();
+  if (mode != LIO_WAIT && mode != LIO_NOWAIT) {
+    errno = EINVAL;
+    return -1;
+  }
+  std::vector<struct aiocb*> ours;
+  std::vector<struct aiocb*> theirs;
+  for (int i = 0; i < nent; i++) {
+    struct aiocb* cb = list[i];
+    if (cb == NULL || cb->aio_lio_opcode == LIO_NOP) {
+      continue;
+    }
+    FileType type;
+    int __fd;
+    if (__check_file_by_fd(cb->aio_fildes, &type, &__fd) && type == kPDLFS) {
+      if ((cb->aio_lio_opcode != LIO_READ &&
+           cb->aio_lio_opcode != LIO_WRITE) ||
+          cb->aio_offset < 0) {
+        errno = EINVAL;
+        return Account(kPDLFS, kLioListio, -1, true, start);
+      }
+      ours.push_back(cb);
+    } else {
+      theirs.push_back(cb);
+    }
+  }
+  if (!theirs.empty()) {
+    ForgetAio(&theirs[0], theirs.size());
+  }
+  if (ours.empty()) {
+    int r = posix_lio_listio(mode, list, nent, sevp);
+    return Account(kPOSIX, kLioListio, r, r == -1, start);
+  }
+
+  // Merge requests that continue one another on the same file
+  std::stable_sort(ours.begin(), ours.end(), &AioBefore);
+  std::vector<AioRequest*> reqs;
+  std::vector<struct aiocb*> bad;
+  AioBatch* batch = new AioBatch;
+  batch->wait = (mode == LIO_WAIT);
+  if (sevp != NULL && !batch->wait) {
+    batch->sev = *sevp;
+  } else {
+    batch->sev.sigev_notify = SIGEV_NONE;
+  }
+  for (size_t i = 0; i < ours.size(); i++) {
+    struct aiocb* cb = ours[i];
+    AioRequest* last = reqs.empty() ? NULL : reqs.back();
+    if (last != NULL && last->cbs[0]->aio_fildes == cb->aio_fildes &&
+        last->cbs[0]->aio_lio_opcode == cb->aio_lio_opcode &&
+        last->cbs.size() < IOV_MAX) {
+      struct aiocb* prev = last->cbs.back();
+      if (prev->aio_offset + static_cast<off_t>(prev->aio_nbytes) ==
+          cb->aio_offset) {
+        last->cbs.push_back(cb);
+        continue;
+      }
+    }
+    AioRequest* req = new AioRequest;
+    FileType type;
+    if (!__check_file_by_fd(cb->aio_fildes, &type, &req->__fd, &req->file) ||
+        type != kPDLFS) {
+      // Closed by another thread since it was classified above
+      delete req;
+      bad.push_back(cb);
+      continue;
+    }
+    Pin(req->file);
+    req->op = (cb->aio_lio_opcode == LIO_READ) ? kAioRead : kAioWrite;
+    req->datasync = false;
+    req->off = cb->aio_offset;
+    req->cbs.push_back(cb);
+    req->batch = batch;
+    req->start = start;
+    reqs.push_back(req);
+  }
+  // Without a wait, glibc reports the end of its share of the batch
+  // through a notification rather than have a pool thread block on it
+  const bool posix_part = (mode == LIO_NOWAIT) && !theirs.empty();
+  batch->pending = reqs.size() + (posix_part ? 1 : 0);
+  if (!bad.empty()) {
+    pthread_mutex_lock(&aio_mu);
+    for (size_t i = 0; i < bad.size(); i++) {
+      AioStatus s = {bad[i]->aio_fildes, EBADF, -1, NULL};
+      (*aio_status)[bad[i]] = s;
+    }
+    pthread_mutex_unlock(&aio_mu);
+  }
+  if (!reqs.empty()) {
+    StartAio(&reqs[0], reqs.size());
+  } else if (batch->pending == 0 && !batch->wait) {
+    FinishBatch(batch);
+  }
+
+  int r = 0;
+  int err = 0;
+  if (posix_part) {
+    struct sigevent sev;
+    memset(&sev, 0, sizeof(sev));
+    sev.sigev_notify = SIGEV_THREAD;
+    sev.sigev_notify_function = &PosixBatchDone;
+    sev.sigev_value.sival_ptr = batch;
+    r = posix_lio_listio(mode, &theirs[0], theirs.size(), &sev);
+    err = errno;
+    // glibc notifies even when only some requests could be queued
+    if (r == -1 && err != EIO) {
+      PosixBatchDone(sev.sigev_value);
+    }
+  } else if (!theirs.empty()) {
+    r = posix_lio_listio(mode, &theirs[0], theirs.size(), NULL);
+    err = errno;
+  }
+  if (mode == LIO_WAIT) {
+    pthread_mutex_lock(&aio_mu);
+    while (batch->pending != 0) {
+      pthread_cond_wait(&aio_cv, &aio_mu);
+    }
+    for (size_t i = 0; i < ours.size(); i++) {
+      if ((*aio_status)[ours[i]].err != 0) {
+        r = -1;
+        err = EIO;
+      }
+    }
+    pthread_mutex_unlock(&aio_mu);
+    delete batch;
+  } else if (!bad.empty()) {
+    r = -1;
+    err = EIO;
+  }
+  if (r == -1) {
+    errno = err;
+  }
+
+  return Account(kPDLFS, kLioListio, r, r == -1, start);
+}
+
+int aio_suspend(const struct aiocb* const list[], int nent,
+                const struct timespec* timeout) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  pthread_once(&aio_once, &InitAio);
+  ctr_t start = TimerStart();
+  std::vector<const struct aiocb*> ours;
+  std::vector<const struct aiocb*> theirs;
+  pthread_mutex_lock(&aio_mu);
+  for (int i = 0; i < nent; i++) {
+    const struct aiocb* cb = list[i];
+    if (cb == NULL) {
+      continue;
+    } else if (AioDoneLocked(cb)) {
+      pthread_mutex_unlock(&aio_mu);
+      return Account(kPOSIX, kAioSuspend, 0, false, start);
+    } else if (aio_status->count(cb) != 0) {
+      ours.push_back(cb);
+    } else {
+      theirs.push_back(cb);
+    }
+  }
+  if (ours.empty()) {
+    pthread_mutex_unlock(&aio_mu);
+    int r = posix_aio_suspend(list, nent, timeout);
+    return Account(kPOSIX, kAioSuspend, r, r == -1, start);
+  }
+
+  struct timespec deadline;
+  if (timeout != NULL) {
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= 1000000000L) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+  }
+  int r = -1;
+  while (r == -1) {
+    for (size_t i = 0; i < ours.size(); i++) {
+      if (AioDoneLocked(ours[i])) r = 0;
+    }
+    if (r == 0) {
+      break;
+    }
+    if (!theirs.empty()) {
+      // Poll the requests glibc runs while waiting for ours
+      pthread_mutex_unlock(&aio_mu);
+      struct timespec tick = {0, 1000000};
+      int s = posix_aio_suspend(&theirs[0], theirs.size(), &tick);
+      int e = errno;
+      pthread_mutex_lock(&aio_mu);
+      if (s == 0) {
+        r = 0;
+      } else if (e != EAGAIN) {
+        errno = e;
+        break;
+      }
+    } else if (timeout == NULL) {
+      pthread_cond_wait(&aio_cv, &aio_mu);
+      continue;
+    } else if (pthread_cond_timedwait(&aio_cv, &aio_mu, &deadline) == 0) {
+      continue;
+    }
+    if (r == -1 && timeout != NULL) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec > deadline.tv_sec ||
+          (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+        errno = EAGAIN;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&aio_mu);
+
+  return Account(kPDLFS, kAioSuspend, r, r == -1, start);
+}
+
+// Requests still waiting for a pool thread are canceled; ones already
+// running are left to finish. A request merged by lio_listio() with
+// others can only be canceled as a whole, that is, through fd alone.
+int aio_cancel(int fd, struct aiocb* cb) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  pthread_once(&aio_once, &InitAio);
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  int __fd;
+  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
+    if (cb != NULL && cb->aio_fildes != fd) {
+      errno = EINVAL;
+      return Account(kPDLFS, kAioCancel, -1, true, start);
+    }
+    std::vector<AioRequest*> reqs;
+    bool not_canceled = false;
+    pthread_mutex_lock(&aio_mu);
+    AioStatusMap::iterator it = aio_status->begin();
+    if (cb != NULL) {
+      it = aio_status->find(cb);
+    }
+    for (; it != aio_status->end(); ++it) {
+      if (cb != NULL && it->first != cb) {
+        break;
+      }
+      AioStatus& s = it->second;
+      if (s.fd != fd || s.err != EINPROGRESS) {
+        continue;
+      }
+      AioRequest* req = s.req;
+      if (req == NULL || (cb != NULL && req->cbs.size() != 1)) {
+        not_canceled = true;
+      } else if (!req->canceled) {
+        req->canceled = true;
+        reqs.push_back(req);
+      }
+    }
+    std::vector<struct sigevent> sevs;
+    std::vector<AioBatch*> batches;
+    for (size_t i = 0; i < reqs.size(); i++) {
+      struct sigevent sev;
+      batches.push_back(CompleteLocked(reqs[i], -1, ECANCELED, &sev));
+      sevs.push_back(sev);
+    }
+    pthread_mutex_unlock(&aio_mu);
+    for (size_t i = 0; i < reqs.size(); i++) {
+      Notify(sevs[i]);
+      FinishBatch(batches[i]);
+    }
+    if (not_canceled) {
+      r = AIO_NOTCANCELED;
+    } else if (!reqs.empty()) {
+      r = AIO_CANCELED;
+    } else {
+      r = AIO_ALLDONE;
+    }
+  } else {
+    type = kPOSIX;
+    r = posix_aio_cancel(fd, cb);
+  }
+
+  return Account(type, kAioCancel, r, r == -1, start);
+}
+
+// <aio.h> renames the calls above under _FILE_OFFSET_BITS=64. On LP64
+// targets struct aiocb64 has the same layout as struct aiocb.
+static_assert(sizeof(struct aiocb64) == sizeof(struct aiocb),
+              "aiocb64 differs from aiocb");
+
+int aio_read64(struct aiocb64* cb) __THROW {
+  return aio_read(reinterpret_cast<struct aiocb*>(cb));
+}
+
+int aio_write64(struct aiocb64* cb) __THROW {
+  return aio_write(reinterpret_cast<struct aiocb*>(cb));
+}
+
+int aio_fsync64(int op, struct aiocb64* cb) __THROW {
+  return aio_fsync(op, reinterpret_cast<struct aiocb*>(cb));
+}
+
+int aio_error64(const struct aiocb64* cb) __THROW {
+  return aio_error(reinterpret_cast<const struct aiocb*>(cb));
+}
+
+ssize_t aio_return64(struct aiocb64* cb) __THROW {
+  return aio_return(reinterpret_cast<struct aiocb*>(cb));
+}
 
-  return r;
+int lio_listio64(int mode, struct aiocb64* const list[], int nent,
+                 struct sigevent* sevp) __THROW {
+  return lio_listio(mode, reinterpret_cast<struct aiocb* const*>(list), nent,
+                    sevp);
 }
 
-int open(const char* path, int oflags, ...) {
+int aio_suspend64(const struct aiocb64* const list[], int nent,
+                  const struct timespec* timeout) {
+  return aio_suspend(reinterpret_cast<const struct aiocb* const*>(list), nent,
+                     timeout);
+}
+
+int aio_cancel64(int fd, struct aiocb64* cb) __THROW {
+  return aio_cancel(fd, reinterpret_cast<struct aiocb*>(cb));
+}
+
+FILE* fopen(const char* fname, const char* modes) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
-  if (path == NULL) {
-    errno = EINVAL;
-    return -1;
-  }
-  std::string tmp;
-  if (kRedirectCurDir && path[0] != '/') {
-    tmp = fs_ctx->pdlfs_root + "/";
-    tmp += path;
-    path = tmp.c_str();
-  }
-  va_list args;
-  va_start(args, oflags);
-  mode_t mode;
-  if (O_CREAT == (oflags & O_CREAT)) {
-    mode = va_arg(args, mode_t);
+  ctr_t start = TimerStart();
+  char tmp[PATH_MAX];
+  if (kRedirectCurDir && fname[0] != '/') {
+    fname = fs_ctx->Redirect(fname, tmp);
+    if (fname == NULL) {
+      return NULL;
+    }
   }
-  va_end(args);
 
-  int __fd;
-  struct stat buf;
+  FILE* f;
   ParsedPath parsed;
-  bool ok = fs_ctx->ParsePath(path, &parsed);
+  bool ok = fs_ctx->ParsePath(fname, &parsed);
   if (!ok || parsed.type == kPOSIX) {
     parsed.type = kPOSIX;
-    const char* p = ok ? parsed.path : path;
-    fs_ctx->posix_stats.open++;
-    Trace("posix_open %s\n", p);
-    __fd = posix_open(p, oflags, mode);
+    const char* p = ok ? parsed.path : fname;
+    Trace("posix_fopen %s\n", p);
+    f = posix_fopen(p, modes);
   } else {
-    fs_ctx->pdlfs_stats.open++;
-    Trace("pdlfs_open %s\n", parsed.path);
-    __fd = pdlfs_open(parsed.path, oflags, mode, &buf);
-  }
-  if (__fd == -1) {
-    return __fd;
-  }
-
-  int err = 0;
-  int fd;
-  MutexLock();
-  if (parsed.type == kPOSIX) {
-    if (fs_ctx->fd_map.count(__fd) == 0) {
-      fd = __fd;
-    } else {
-      fd = posix_fcntl1(__fd, F_DUPFD, ++fs_ctx->fd);
-      err = errno;
-      posix_close(__fd);
+    Trace("pdlfs_fopen %s\n", parsed.path);
+    f = NULL;
+    if (FlushCached(parsed.mount->ops, parsed.path, NULL, -1, 0) == 0) {
+      f = pdlfs_fopen(parsed.mount->ops, parsed.path, modes);
     }
-    if (fd != -1) {
-      fs_ctx->fd_map[fd] = fd;
+    // Writes through streams are not tracked by the attribute cache
+    if (f != NULL && fs_ctx->attr_cache != NULL && IsWriteStream(f)) {
+      fs_ctx->attr_cache->Hold(parsed.path);
     }
-  } else {
-    fd = ++fs_ctx->fd;
-    fs_ctx->fd_map[fd] = -1 * (__fd + 1);
-  }
-  if (fd > fs_ctx->fd) {
-    fs_ctx->fd = fd;
-  }
-  MutexUnlock();
-  if (err != 0) {
-    errno = err;
   }
 
-  return fd;
+  return Account(parsed.type, kFopen, f, f == NULL, start);
 }
 
-int creat(const char* path, mode_t mode) {
-  return open(path, O_CREAT | O_WRONLY | O_TRUNC, mode);
+size_t fread(void* ptr, size_t sz, size_t n, FILE* file) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  size_t r;
+  FileType type;
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = (FlushStream(file) == 0) ? pdlfs_fread(ptr, sz, n, file) : 0;
+  } else {
+    r = posix_fread(ptr, sz, n, file);
+  }
+
+  AccountIO(type, kFread, r * sz, n * sz, false, start);
+  return r;
 }
 
-int fstat(int fd, struct stat* buf) __THROW {
+size_t fwrite(const void* ptr, size_t sz, size_t n, FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  size_t r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.fstat++;
-    return pdlfs_fstat(__fd, buf);
+  if (__check_file(file, &type) && type == kPDLFS) {
+#ifndef NOWRITE
+    // Trace("pdlfs_fwrite %llu\n", (long long unsigned)(sz * n));
+    r = pdlfs_fwrite(ptr, sz, n, file);
+#else
+    return n;
+#endif
   } else {
-    fs_ctx->posix_stats.fstat++;
-    return posix_fstat(fd, buf);
+    // Trace("posix_fwrite %llu\n", (long long unsigned)(sz * n));
+    r = posix_fwrite(ptr, sz, n, file);
   }
+
+  AccountIO(type, kFwrite, r * sz, n * sz, true, start);
+  return r;
 }
 
-ssize_t pread(int fd, void* buf, size_t sz, off_t off) {
+int fseek(FILE* file, long int off, int whence) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.pread++;
-    return pdlfs_pread(__fd, buf, sz, off);
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_fseek(file, off, whence);
   } else {
-    fs_ctx->posix_stats.pread++;
-    return posix_pread(fd, buf, sz, off);
+    r = posix_fseek(file, off, whence);
   }
+
+  return Account(type, kFseek, r, r == -1, start);
 }
 
-ssize_t read(int fd, void* buf, size_t sz) {
+long int ftell(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  long int r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.read++;
-    return pdlfs_read(__fd, buf, sz);
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_ftell(file);
   } else {
-    fs_ctx->posix_stats.read++;
-    return posix_read(fd, buf, sz);
+    r = posix_ftell(file);
   }
+
+  return Account(type, kFtell, r, r == -1, start);
 }
 
-ssize_t pwrite(int fd, const void* buf, size_t sz, off_t off) {
+int fflush(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
-#ifndef NOWRITE
-    fs_ctx->pdlfs_stats.pwrite++;
-    return pdlfs_pwrite(__fd, buf, sz, off);
-#else
-    return sz;
-#endif
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_fflush(file);
   } else {
-    fs_ctx->posix_stats.pwrite++;
-    return posix_pwrite(fd, buf, sz, off);
+    r = posix_fflush(file);
   }
+
+  return Account(type, kFflush, r, r == EOF, start);
 }
 
-ssize_t write(int fd, const void* buf, size_t sz) {
+int setvbuf(FILE* file, char* buf, int mode, size_t size) __THROW {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd) && type == kPDLFS) {
-#ifndef NOWRITE
-    fs_ctx->pdlfs_stats.write++;
-    return pdlfs_write(__fd, buf, sz);
-#else
-    return sz;
-#endif
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_setvbuf(file, buf, mode, size);
   } else {
-    fs_ctx->posix_stats.write++;
-    return posix_write(fd, buf, sz);
+    r = posix_setvbuf(file, buf, mode, size);
   }
+
+  return Account(type, kSetvbuf, r, r != 0, start);
 }
 
-int close(int fd) {
+int fclose(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
-  const bool remove_fd = true;
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
-  int __fd;
-  if (__check_file_by_fd(fd, &type, &__fd, remove_fd) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.close++;
-    return pdlfs_close(__fd);
+  if (__check_file(file, &type) && type == kPDLFS) {
+    int fd = pdlfs_fileno(file);
+    if (fd != -1) {
+      int __fd;
+      __check_file_by_fd(fd, &type, &__fd, NULL, true);
+      type = kPDLFS;
+    }
+    std::string path;
+    if (fs_ctx->attr_cache != NULL && IsWriteStream(file)) {
+      const PdlfsOps* ops;
+      const char* p;
+      int flags;
+      pdlfs_fbackend(file, &ops, &p, &flags);
+      path = p;
+    }
+    r = pdlfs_fclose(file);
+    if (!path.empty()) {
+      fs_ctx->attr_cache->Release(path);
+    }
   } else {
-    fs_ctx->posix_stats.close++;
-    return posix_close(fd);
+    r = posix_fclose(file);
   }
+
+  return Account(type, kFclose, r, r == EOF, start);
 }
 
-FILE* fopen(const char* fname, const char* modes) {
+void clearerr(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  FileType type;
+  if (__check_file(file, &type) && type == kPDLFS) {
+    pdlfs_clearerr(file);
+  } else {
+    posix_clearerr(file);
+  }
+
+  Account(type, kClearerr, 0, false, start);
+}
+
+int ferror(FILE* file) __THROW {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
-  std::string tmp;
-  if (kRedirectCurDir && fname[0] != '/') {
-    tmp = fs_ctx->pdlfs_root + "/";
-    tmp += fname;
-    fname = tmp.c_str();
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_ferror(file);
+  } else {
+    r = posix_ferror(file);
   }
 
-  FILE* f;
-  ParsedPath parsed;
-  bool ok = fs_ctx->ParsePath(fname, &parsed);
-  if (!ok || parsed.type == kPOSIX) {
-    parsed.type = kPOSIX;
-    const char* p = ok ? parsed.path : fname;
-    fs_ctx->posix_stats.fopen++;
-    Trace("posix_fopen %s\n", p);
-    f = posix_fopen(p, modes);
-    if (f == NULL) {
-      return NULL;
-    }
+  return Account(type, kFerror, r, false, start);
+}
+
+int feof(FILE* file) __THROW {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  ctr_t start = TimerStart();
+  int r;
+  FileType type;
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_feof(file);
   } else {
-    fs_ctx->pdlfs_stats.fopen++;
-    Trace("pdlfs_fopen %s\n", parsed.path);
-    f = pdlfs_fopen(parsed.path, modes);
-    if (f == NULL) {
-      return NULL;
-    }
+    r = posix_feof(file);
   }
 
-  MutexLock();
-  std::pair<FILE*, FileType> pair(f, parsed.type);
-  fs_ctx->files.insert(pair);
-  MutexUnlock();
-
-  return f;
+  return Account(type, kFeof, r, false, start);
 }
 
-size_t fread(void* ptr, size_t sz, size_t n, FILE* file) {
+int fseeko(FILE* file, off_t off, int whence) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.fread++;
-    return pdlfs_fread(ptr, sz, n, file);
+    r = pdlfs_fseeko(file, off, whence);
   } else {
-    fs_ctx->posix_stats.fread++;
-    return posix_fread(ptr, sz, n, file);
+    r = posix_fseeko(file, off, whence);
   }
+
+  return Account(type, kFseeko, r, r == -1, start);
 }
 
-size_t fwrite(const void* ptr, size_t sz, size_t n, FILE* file) {
+int fseeko64(FILE* file, off64_t off, int whence) {
+  return fseeko(file, off, whence);
+}
+
+off_t ftello(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  off_t r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-#ifndef NOWRITE
-    fs_ctx->pdlfs_stats.fwrite++;
-    // Trace("pdlfs_fwrite %llu\n", (long long unsigned)(sz * n));
-    return pdlfs_fwrite(ptr, sz, n, file);
-#else
-    return n;
-#endif
+    r = pdlfs_ftello(file);
   } else {
-    fs_ctx->posix_stats.fwrite++;
-    // Trace("posix_fwrite %llu\n", (long long unsigned)(sz * n));
-    return posix_fwrite(ptr, sz, n, file);
+    r = posix_ftello(file);
   }
+
+  return Account(type, kFtello, r, r == -1, start);
 }
 
-int fseek(FILE* file, long int off, int whence) {
+off64_t ftello64(FILE* file) { return ftello(file); }
+
+void rewind(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.fseek++;
-    return pdlfs_fseek(file, off, whence);
+    pdlfs_rewind(file);
   } else {
-    fs_ctx->posix_stats.fseek++;
-    return posix_fseek(file, off, whence);
+    posix_rewind(file);
   }
+
+  Account(type, kRewind, 0, false, start);
 }
 
-long int ftell(FILE* file) {
+int fileno(FILE* file) __THROW {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.ftell++;
-    return pdlfs_ftell(file);
+    r = pdlfs_fileno(file);
+    if (r == -1) {
+      r = __stream_fd(file);
+    }
   } else {
-    fs_ctx->posix_stats.ftell++;
-    return posix_ftell(file);
+    r = posix_fileno(file);
   }
+
+  return Account(type, kFileno, r, r == -1, start);
 }
 
-int fflush(FILE* file) {
+int vfprintf(FILE* file, const char* fmt, va_list ap) {
+  return __vfprintf(file, fmt, ap);
+}
+
+int fprintf(FILE* file, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int r = __vfprintf(file, fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+// Callers built with _FORTIFY_SOURCE. Format strings are not checked.
+int __vfprintf_chk(FILE* file, int flag, const char* fmt, va_list ap) {
+  return __vfprintf(file, fmt, ap);
+}
+
+int __fprintf_chk(FILE* file, int flag, const char* fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  int r = __vfprintf(file, fmt, ap);
+  va_end(ap);
+  return r;
+}
+
+int fputs(const char* s, FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.fflush++;
-    return pdlfs_fflush(file);
+    r = pdlfs_fputs(s, file);
   } else {
-    fs_ctx->posix_stats.fflush++;
-    return posix_fflush(file);
+    r = posix_fputs(s, file);
   }
+
+  size_t n = strlen(s);
+  AccountIO(type, kFputs, r == EOF ? -1 : n, n, true, start);
+  return r;
 }
 
-int fclose(FILE* file) {
+int fputc(int c, FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
-  const bool remove_file = true;
-  if (__check_file(file, &type, remove_file) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.fclose++;
-    return pdlfs_fclose(file);
+  if (__check_file(file, &type) && type == kPDLFS) {
+    r = pdlfs_fputc(c, file);
   } else {
-    fs_ctx->posix_stats.fclose++;
-    return posix_fclose(file);
+    r = posix_fputc(c, file);
   }
+
+  AccountIO(type, kFputc, r == EOF ? -1 : 1, 1, true, start);
+  return r;
 }
 
-void clearerr(FILE* file) {
+int putc(int c, FILE* file) { return fputc(c, file); }
+
+char* fgets(char* s, int n, FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  char* r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.clearerr++;
-    pdlfs_clearerr(file);
+    r = (FlushStream(file) == 0) ? pdlfs_fgets(s, n, file) : NULL;
   } else {
-    fs_ctx->posix_stats.clearerr++;
-    posix_clearerr(file);
+    r = posix_fgets(s, n, file);
   }
+
+  AccountIO(type, kFgets, r == NULL ? 0 : strlen(r), n > 0 ? n - 1 : 0,
+            false, start);
+  return r;
 }
 
-int ferror(FILE* file) __THROW {
+char* __fgets_chk(char* s, size_t size, int n, FILE* file) {
+  if (n > 0 && static_cast<size_t>(n) > size) {
+    abort();
+  }
+  return fgets(s, n, file);
+}
+
+int fgetc(FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.ferror++;
-    return pdlfs_ferror(file);
+    r = (FlushStream(file) == 0) ? pdlfs_fgetc(file) : EOF;
   } else {
-    fs_ctx->posix_stats.ferror++;
-    return posix_ferror(file);
+    r = posix_fgetc(file);
   }
+
+  AccountIO(type, kFgetc, r == EOF ? 0 : 1, 1, false, start);
+  return r;
 }
 
-int feof(FILE* file) __THROW {
+int getc(FILE* file) { return fgetc(file); }
+
+int ungetc(int c, FILE* file) {
   if (fs_ctx == NULL) {
     pthread_once(&once, &__init_ctx);
   }
+  ctr_t start = TimerStart();
+  int r;
   FileType type;
   if (__check_file(file, &type) && type == kPDLFS) {
-    fs_ctx->pdlfs_stats.feof++;
-    return pdlfs_feof(file);
+    r = pdlfs_ungetc(c, file);
   } else {
-    fs_ctx->posix_stats.feof++;
-    return posix_feof(file);
+    r = posix_ungetc(c, file);
+  }
+
+  return Account(type, kUngetc, r, r == EOF, start);
+}
+
+#ifdef HAVE_MPI
+int MPI_Init(int* argc, char*** argv) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  int r = PMPI_Init(argc, argv);
+  if (r == MPI_SUCCESS) {
+    SetRank();
+  }
+  return r;
+}
+
+int MPI_Init_thread(int* argc, char*** argv, int required, int* provided) {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
   }
+  int r = PMPI_Init_thread(argc, argv, required, provided);
+  if (r == MPI_SUCCESS) {
+    SetRank();
+  }
+  return r;
+}
+
+// Statistics are reduced across ranks here since MPI can no longer be used
+// by the time the process exits. Each rank still logs its own counters at
+// exit, to a file named after its rank.
+int MPI_Finalize() {
+  if (fs_ctx == NULL) {
+    pthread_once(&once, &__init_ctx);
+  }
+  SetRank();  // In case MPI was started without the calls above
+  ReduceStats();
+  return PMPI_Finalize();
 }
+#endif
 
 }  // extern C
@@ -12,6 +12,10 @@
 #include <sys/types.h>
 
 #define DEFAULT_PDLFS_ROOT "/tmp/pdlfs"
+struct iovec;
+struct aiocb;
+struct sigevent;
+struct timespec;
 struct _IO_FILE;
 typedef struct _IO_FILE FILE;
 #ifndef __THROW
@@ -26,10 +30,35 @@ extern int mkdir(const char* __path, mode_t __mode) __THROW;
 extern int open(const char* __path, int __oflags, ...);
 extern int creat(const char* __path, mode_t __mode);
 extern int fstat(int __fd, struct stat* __statbuf) __THROW;
+extern int stat(const char* __path, struct stat* __statbuf) __THROW;
+extern int lstat(const char* __path, struct stat* __statbuf) __THROW;
+extern int access(const char* __path, int __mode) __THROW;
+extern int rename(const char* __oldpath, const char* __newpath) __THROW;
+extern int ftruncate(int __fd, off_t __length) __THROW;
 extern ssize_t pread(int __fd, void* __buf, size_t __sz, off_t __off);
 extern ssize_t read(int __fd, void* __buf, size_t __sz);
 extern ssize_t pwrite(int __fd, const void* __buf, size_t __sz, off_t __off);
 extern ssize_t write(int __fd, const void* __buf, size_t __sz);
+extern ssize_t preadv(int __fd, const struct iovec* __iov, int __iovcnt,
+                      off_t __off);
+extern ssize_t readv(int __fd, const struct iovec* __iov, int __iovcnt);
+extern ssize_t pwritev(int __fd, const struct iovec* __iov, int __iovcnt,
+                       off_t __off);
+extern ssize_t writev(int __fd, const struct iovec* __iov, int __iovcnt);
+extern void* mmap(void* __addr, size_t __len, int __prot, int __flags,
+                  int __fd, off_t __off) __THROW;
+extern int munmap(void* __addr, size_t __len) __THROW;
+extern int msync(void* __addr, size_t __len, int __flags);
+extern int aio_read(struct aiocb* __aiocbp) __THROW;
+extern int aio_write(struct aiocb* __aiocbp) __THROW;
+extern int aio_fsync(int __op, struct aiocb* __aiocbp) __THROW;
+extern int aio_suspend(const struct aiocb* const __list[], int __nent,
+                       const struct timespec* __timeout);
+extern int aio_cancel(int __fd, struct aiocb* __aiocbp) __THROW;
+extern int lio_listio(int __mode, struct aiocb* const __list[], int __nent,
+                      struct sigevent* __sevp) __THROW;
+extern int fsync(int __fd);
+extern int fdatasync(int __fd);
 extern int close(int __fd);
 
 extern int feof(FILE* __file) __THROW;
@@ -41,7 +70,21 @@ extern size_t fwrite(const void* __ptr, size_t __sz, size_t __n, FILE* __file);
 extern int fseek(FILE* __file, long int __off, int __whence);
 extern long int ftell(FILE* __file);
 extern int fflush(FILE* __file);
+extern int setvbuf(FILE* __file, char* __buf, int __mode,
+                   size_t __size) __THROW;
 extern int fclose(FILE* __file);
+extern int fseeko(FILE* __file, off_t __off, int __whence);
+extern off_t ftello(FILE* __file);
+extern void rewind(FILE* __file);
+extern int fileno(FILE* __file) __THROW;
+extern int fprintf(FILE* __file, const char* __fmt, ...);
+extern int fputs(const char* __s, FILE* __file);
+extern int fputc(int __c, FILE* __file);
+extern int putc(int __c, FILE* __file);
+extern char* fgets(char* __s, int __n, FILE* __file);
+extern int fgetc(FILE* __file);
+extern int getc(FILE* __file);
+extern int ungetc(int __c, FILE* __file);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+/*
+ * Measures the per-call cost of metadata-heavy workloads such as create
+ * storms. Run it with and without the preload library to see the overhead
+ * the library adds per open:
+ *
+ *   env LD_PRELOAD="..." preload_bench [num_files] [dir]
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+static unsigned long long NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+         ts.tv_nsec;
+}
+
+static void Report(const char* name, int n, unsigned long long nanos) {
+  fprintf(stderr, "%-12s %8d ops %10.1f ns/op\n", name, n,
+          static_cast<double>(nanos) / n);
+}
+
+static void Fail(const char* what, const char* path) {
+  fprintf(stderr, "!!! ERROR %s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+// Create, reopen, and stat num_files files named by prefix, then look up
+// as many files that do not exist, which is the cheapest trip into the
+// kernel and so shows the library's own overhead most clearly.
+static void Run(const char* label, const char* prefix, int num_files) {
+  char path[256];
+  unsigned long long start = NowNanos();
+  for (int i = 0; i < num_files; i++) {
+    snprintf(path, sizeof(path), "%s%d", prefix, i);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    if (fd == -1) Fail("open", path);
+    close(fd);
+  }
+  unsigned long long create = NowNanos() - start;
+
+  start = NowNanos();
+  for (int i = 0; i < num_files; i++) {
+    snprintf(path, sizeof(path), "%s%d", prefix, i);
+    int fd = open(path, O_RDONLY);
+    if (fd == -1) Fail("open", path);
+    close(fd);
+  }
+  unsigned long long reopen = NowNanos() - start;
+
+  start = NowNanos();
+  for (int i = 0; i < num_files; i++) {
+    snprintf(path, sizeof(path), "%s%d", prefix, i);
+    struct stat buf;
+    if (stat(path, &buf) != 0) Fail("stat", path);
+  }
+  unsigned long long st = NowNanos() - start;
+
+  start = NowNanos();
+  for (int i = 0; i < num_files; i++) {
+    snprintf(path, sizeof(path), "%smissing%d", prefix, i);
+    int fd = open(path, O_RDONLY);
+    if (fd != -1 || errno != ENOENT) Fail("open", path);
+  }
+  unsigned long long miss = NowNanos() - start;
+
+  fprintf(stderr, "%s (%s)\n", label, prefix);
+  Report("create", num_files, create);
+  Report("reopen", num_files, reopen);
+  Report("stat", num_files, st);
+  Report("miss", num_files, miss);
+}
+
+int main(int argc, char* argv[]) {
+  int num_files = argc > 1 ? atoi(argv[1]) : 100000;
+  const char* dir = argc > 2 ? argv[2] : "/tmp/pdlfs/bench";
+  if (num_files <= 0) num_files = 1;
+  mkdir(dir, 0755);
+  char prefix[200];
+  snprintf(prefix, sizeof(prefix), "%s/f", dir);
+  Run("absolute paths", prefix, num_files);
+  // Relative paths are redirected under the pdlfs root
+  mkdir("bench-rel", 0755);
+  Run("relative paths", "bench-rel/f", num_files);
+  return 0;
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+/*
+ * Run under mpirun with the preload library. Each rank writes a file of
+ * its own under /tmp/pdlfs, and rank 0 then checks that the job-wide log
+ * written at MPI_Finalize counts every rank and all of their bytes.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <mpi/mpi.h>
+
+static void ASSERT(bool b) {
+  if (!b) {
+    fprintf(stderr, "!!! ERROR (errno=%d): %s\n", errno, strerror(errno));
+    abort();
+  }
+}
+
+static void FileName(int rank, char* buf, size_t n) {
+  snprintf(buf, n, "/tmp/pdlfs/lalala.%d", rank);
+}
+
+int main(int argc, char* argv[]) {
+  int r = MPI_Init(&argc, &argv);
+  ASSERT(r == MPI_SUCCESS);
+  int rank;
+  int size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+  char path[64];
+  FileName(rank, path, sizeof(path));
+  fprintf(stderr, "Rank %d writing file %s ...\n", rank, path);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  const ssize_t n = strlen(path);
+  for (int i = 0; i <= rank; i++) {
+    ASSERT(write(fd, path, n) == n);
+  }
+  ASSERT(close(fd) == 0);
+  r = MPI_Finalize();
+  ASSERT(r == MPI_SUCCESS);
+
+  if (rank == 0) {
+    fprintf(stderr, "Checking the job log ...\n");
+    double expected = 0;
+    for (int i = 0; i < size; i++) {
+      FileName(i, path, sizeof(path));
+      expected += (i + 1) * strlen(path);
+    }
+    FILE* f = fopen("/tmp/pdlfs_preload.job.log", "r");
+    ASSERT(f != NULL);
+    int ranks = 0;
+    double written = -1;
+    char line[500];
+    while (fgets(line, sizeof(line), f) != NULL) {
+      sscanf(line, "job ranks\t%d", &ranks);
+      sscanf(line, "job pdlfs_bytes_written\tsum %lf", &written);
+    }
+    fclose(f);
+    ASSERT(ranks == size);
+    ASSERT(written == expected);
+  }
+
+  return 0;
+}
@@ -7,17 +7,28 @@
  * found in the LICENSE file. See the AUTHORS file for names of contributors.
  */
 
+#include <aio.h>
+#include <dirent.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include <string>
 #include <vector>
 
+#include "checksum_io.h"
 #include "preload.h"
 
+// Defined by the preload library when it is loaded
+extern void GetChecksumStats(ChecksumStats* stats) __attribute__((weak));
+
 static std::vector<int> open_files;
 
 static void ASSERT(bool b) {
@@ -84,10 +95,1213 @@ static void TEST_BufferedIO(const char* path) {
   ASSERT(r == 0);
 }
 
+// Overwrites that start and end inside blocks, holes, and truncates. With
+// PDLFS_Checksum set, every read is checked against the blocks' checksums.
+static void TEST_UnalignedIO(const char* path) {
+  const size_t kSize = 300000;
+  std::string data(kSize, 0);
+  for (size_t i = 0; i < kSize; i++) {
+    data[i] = static_cast<char>(i * 7);
+  }
+  fprintf(stderr, "Writing unaligned pieces to %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ssize_t n = pwrite(fd, data.data() + 100000, kSize - 100000, 100000);
+  ASSERT(n == kSize - 100000);
+  for (size_t off = 0; off < kSize; off += 33333) {
+    n = pwrite(fd, data.data() + off, 1000, off);
+    ASSERT(n == 1000);
+  }
+  int r = ftruncate(fd, kSize - 12345);
+  ASSERT(r == 0);
+  std::string buf(kSize, 'x');
+  n = pread(fd, &buf[0], kSize, 0);
+  ASSERT(n == kSize - 12345);
+  for (size_t i = 0; i < n; i++) {
+    bool written = (i >= 100000 || i % 33333 < 1000);
+    ASSERT(buf[i] == (written ? data[i] : 0));
+  }
+  n = pread(fd, &buf[0], 10, 150000);
+  ASSERT(n == 10 && memcmp(buf.data(), data.data() + 150000, 10) == 0);
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+// Many small files, some renamed. With PDLFS_Pack set they are packed.
+static void TEST_SmallFiles(const char* dir) {
+  const int kNumFiles = 500;
+  char path[256];
+  char path2[256];
+  char buf[64];
+  fprintf(stderr, "Creating %d small files in %s ...\n", kNumFiles, dir);
+  int r = mkdir(dir, 0755);
+  ASSERT(r == 0 || errno == EEXIST);
+  for (int i = 0; i < kNumFiles; i++) {
+    snprintf(path, sizeof(path), "%s/s%d", dir, i);
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+    ASSERT(fd != -1);
+    int n = snprintf(buf, sizeof(buf), "file %d", i);
+    ssize_t written = write(fd, buf, n);
+    ASSERT(written == n);
+    r = close(fd);
+    ASSERT(r == 0);
+  }
+  for (int i = 0; i < kNumFiles; i += 2) {
+    snprintf(path, sizeof(path), "%s/s%d", dir, i);
+    snprintf(path2, sizeof(path2), "%s/t%d", dir, i);
+    r = rename(path, path2);
+    ASSERT(r == 0);
+  }
+  fprintf(stderr, ">> reading back ...\n");
+  for (int i = 0; i < kNumFiles; i++) {
+    snprintf(path, sizeof(path), "%s/%c%d", dir, i % 2 == 0 ? 't' : 's', i);
+    struct stat stat_buf;
+    r = stat(path, &stat_buf);
+    int n = snprintf(buf, sizeof(buf), "file %d", i);
+    ASSERT(r == 0 && stat_buf.st_size == n && S_ISREG(stat_buf.st_mode));
+    int fd = open(path, O_RDONLY);
+    ASSERT(fd != -1);
+    char back[64];
+    ssize_t read = pread(fd, back, sizeof(back), 0);
+    ASSERT(read == n && memcmp(back, buf, n) == 0);
+    r = close(fd);
+    ASSERT(r == 0);
+  }
+  snprintf(path, sizeof(path), "%s/s0", dir);
+  int fd = open(path, O_RDONLY);
+  ASSERT(fd == -1 && errno == ENOENT);
+}
+
+// Streams matching PDLFS_Compress are stored in compressed blocks, so the
+// file takes less space than the data written to it.
+static void TEST_CompressedIO(const char* path, bool compressed) {
+  const int kRecordSize = 100;
+  const int kNumRecords = 20000;
+  char rec[kRecordSize];
+  fprintf(stderr, "Writing %d records to %s ...\n", kNumRecords, path);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumRecords / 2; i++) {
+    snprintf(rec, sizeof(rec), "%099d", i);
+    size_t written = fwrite(rec, 1, sizeof(rec), f);
+    ASSERT(written == sizeof(rec));
+  }
+  int r = fclose(f);
+  ASSERT(r == 0);
+  f = fopen(path, "a");
+  ASSERT(f != NULL);
+  for (int i = kNumRecords / 2; i < kNumRecords; i++) {
+    snprintf(rec, sizeof(rec), "%099d", i);
+    size_t written = fwrite(rec, 1, sizeof(rec), f);
+    ASSERT(written == sizeof(rec));
+  }
+  r = fclose(f);
+  ASSERT(r == 0);
+  struct stat stat_buf;
+  r = stat(path, &stat_buf);
+  ASSERT(r == 0);
+  if (compressed) {
+    ASSERT(stat_buf.st_size < kNumRecords * kRecordSize);
+  } else {
+    ASSERT(stat_buf.st_size == kNumRecords * kRecordSize);
+  }
+  fprintf(stderr, ">> reading back at random ...\n");
+  f = fopen(path, "r");
+  ASSERT(f != NULL);
+  r = fseek(f, 0, SEEK_END);
+  ASSERT(r == 0 && ftell(f) == kNumRecords * kRecordSize);
+  for (int i = 0; i < 1000; i++) {
+    int k = (i * 7919) % kNumRecords;
+    r = fseek(f, k * kRecordSize, SEEK_SET);
+    ASSERT(r == 0);
+    size_t read = fread(rec, 1, sizeof(rec), f);
+    ASSERT(read == sizeof(rec));
+    ASSERT(atoi(rec) == k && rec[kRecordSize - 1] == 0);
+    ASSERT(ftell(f) == (k + 1) * kRecordSize);
+  }
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+static void TEST_SequentialIO(const char* path) {
+  const int kRecordSize = 100;
+  const int kNumRecords = 20000;
+  char rec[kRecordSize];
+  fprintf(stderr, "Writing %d records to %s ...\n", kNumRecords, path);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumRecords; i++) {
+    memset(rec, 'a' + i % 26, sizeof(rec));
+    size_t written = fwrite(rec, 1, sizeof(rec), f);
+    ASSERT(written == sizeof(rec));
+  }
+  int r = fclose(f);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> reading back ...\n");
+  f = fopen(path, "r");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumRecords; i++) {
+    size_t read = fread(rec, 1, sizeof(rec), f);
+    ASSERT(read == sizeof(rec));
+    ASSERT(rec[0] == 'a' + i % 26 && rec[kRecordSize - 1] == rec[0]);
+  }
+  size_t read = fread(rec, 1, sizeof(rec), f);
+  ASSERT(read == 0 && feof(f));
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+// A child forked after the parent has read ahead through background threads
+// reads a stream of its own. The threads are not inherited, so the child's
+// reads hang unless the pool starts new ones.
+static void TEST_ForkedReader(const char* path) {
+  const int kBlockSize = 4096;
+  const int kNumBlocks = 256;
+  fprintf(stderr, "Reading file %s from a child ...\n", path);
+  std::vector<char> block(kBlockSize);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumBlocks; i++) {
+    memset(&block[0], 'a' + i % 26, kBlockSize);
+    ASSERT(fwrite(&block[0], 1, kBlockSize, f) == kBlockSize);
+  }
+  ASSERT(fclose(f) == 0);
+  f = fopen(path, "r");
+  ASSERT(f != NULL);
+  while (fread(&block[0], 1, kBlockSize, f) == kBlockSize) {
+  }
+  ASSERT(feof(f) && fclose(f) == 0);
+  pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    alarm(10);
+    f = fopen(path, "r");
+    bool ok = f != NULL;
+    for (int i = 0; ok && i < kNumBlocks; i++) {
+      ok = fread(&block[0], 1, kBlockSize, f) == kBlockSize &&
+           block[0] == 'a' + i % 26 && block[kBlockSize - 1] == block[0];
+    }
+    ok = ok && fclose(f) == 0;
+    _exit(ok ? 0 : 1);
+  }
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// A child writes through a stream and exits without closing it. Everything
+// it wrote must still reach the file, as with glibc streams.
+static void TEST_ExitFlush(const char* path) {
+  const int kBlockSize = 4096;
+  const int kNumBlocks = 700;  // More than two default buffers
+  fprintf(stderr, "Writing file %s from a child that exits ...\n", path);
+  pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    std::vector<char> block(kBlockSize);
+    FILE* f = fopen(path, "w");
+    bool ok = f != NULL;
+    for (int i = 0; ok && i < kNumBlocks; i++) {
+      memset(&block[0], 'a' + i % 26, kBlockSize);
+      ok = fwrite(&block[0], 1, kBlockSize, f) == kBlockSize;
+    }
+    exit(ok ? 0 : 1);
+  }
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  fprintf(stderr, ">> reading back ...\n");
+  std::vector<char> block(kBlockSize);
+  FILE* f = fopen(path, "r");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumBlocks; i++) {
+    ASSERT(fread(&block[0], 1, kBlockSize, f) == kBlockSize);
+    ASSERT(block[0] == 'a' + i % 26 && block[kBlockSize - 1] == block[0]);
+  }
+  ASSERT(fread(&block[0], 1, kBlockSize, f) == 0 && feof(f));
+  ASSERT(fclose(f) == 0);
+}
+
+static void TEST_LineBuffering(const char* path) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  int r = setvbuf(f, NULL, _IOLBF, 0);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> writing ...\n");
+  size_t written = fwrite("xxx\n", 1, 4, f);
+  ASSERT(written == 4);
+  fprintf(stderr, ">> reading through another stream ...\n");
+  FILE* f2 = fopen(path, "r");
+  ASSERT(f2 != NULL);
+  char buf[4];
+  size_t read = fread(buf, 1, 4, f2);
+  ASSERT(read == 4);
+  ASSERT(strncmp(buf, "xxx\n", 4) == 0);
+  r = fclose(f2);
+  ASSERT(r == 0);
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+// Closing the descriptor of a stream leaves the stream to fclose().
+static void TEST_StreamDescriptor(const char* path) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  ASSERT(fputs("hello", f) >= 0);
+  ASSERT(fflush(f) == 0);
+  int fd = fileno(f);
+  ASSERT(fd != -1);
+  int r = close(fd);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> opening another descriptor ...\n");
+  int other = open(path, O_RDONLY);
+  ASSERT(other != -1);
+  r = fclose(f);
+  ASSERT(r == 0);
+  char buf[8];
+  ASSERT(pread(other, buf, sizeof(buf), 0) == 5);
+  ASSERT(memcmp(buf, "hello", 5) == 0);
+  r = close(other);
+  ASSERT(r == 0);
+}
+
+static void TEST_FormattedIO(const char* path) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  unlink(path);
+  FILE* f = fopen(path, "wbx");
+  ASSERT(f != NULL);
+  ASSERT(fopen(path, "wx") == NULL && errno == EEXIST);
+  fprintf(stderr, ">> writing ...\n");
+  for (int i = 0; i < 1000; i++) {
+    int n = fprintf(f, "line %d %s\n", i, "xxx");
+    ASSERT(n > 0);
+  }
+  std::string big(1000, 'y');
+  ASSERT(fprintf(f, "%s\n", big.c_str()) == 1001);
+  ASSERT(fputs("tail", f) >= 0);
+  ASSERT(fputc('!', f) == '!');
+  ASSERT(putc('\n', f) == '\n');
+  off_t size = ftello(f);
+  int fd = fileno(f);
+  ASSERT(fd != -1);
+  ASSERT(fileno(f) == fd);
+  int r = fflush(f);
+  ASSERT(r == 0);
+  struct stat buf;
+  r = fstat(fd, &buf);
+  ASSERT(r == 0);
+  ASSERT(buf.st_size == size);
+  r = fclose(f);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> reading back ...\n");
+  f = fopen(path, "rbe");
+  ASSERT(f != NULL);
+  char line[64];
+  char expected[64];
+  for (int i = 0; i < 1000; i++) {
+    ASSERT(fgets(line, sizeof(line), f) == line);
+    snprintf(expected, sizeof(expected), "line %d xxx\n", i);
+    ASSERT(strcmp(line, expected) == 0);
+  }
+  std::string s;
+  while (s.empty() || s[s.size() - 1] != '\n') {
+    ASSERT(fgets(line, sizeof(line), f) == line);
+    s += line;
+  }
+  ASSERT(s == big + "\n");
+  ASSERT(fgets(line, sizeof(line), f) == line);
+  ASSERT(strcmp(line, "tail!\n") == 0);
+  ASSERT(fgets(line, sizeof(line), f) == NULL);
+  ASSERT(feof(f));
+  rewind(f);
+  ASSERT(!feof(f));
+  ASSERT(getc(f) == 'l');
+  ASSERT(ungetc('X', f) == 'X');
+  ASSERT(ftello(f) == 0);
+  ASSERT(fgetc(f) == 'X');
+  ASSERT(fgetc(f) == 'i');
+  r = fseeko(f, 5, SEEK_SET);
+  ASSERT(r == 0);
+  ASSERT(getc(f) == '0');
+  r = fseeko64(f, 5, SEEK_SET);
+  ASSERT(r == 0);
+  ASSERT(ftello64(f) == 5);
+  ASSERT(getc(f) == '0');
+  r = fseeko(f, -6, SEEK_END);
+  ASSERT(r == 0);
+  ASSERT(fgets(line, sizeof(line), f) == line);
+  ASSERT(strcmp(line, "tail!\n") == 0);
+  ASSERT(getc(f) == EOF);
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+// Small out-of-order and overlapping writes followed by reads.
+static void TEST_StridedIO(const char* path) {
+  const int kBlocks = 64;
+  const int kBlockSize = 512;
+  fprintf(stderr, "Creating file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  fprintf(stderr, ">> writing ...\n");
+  char buf[kBlockSize];
+  for (int i = 0; i < kBlocks; i++) {
+    int b = (i * 7) % kBlocks;  // Visit every block out of order
+    memset(buf, 'a' + b % 26, sizeof(buf));
+    ssize_t written = pwrite(fd, buf, sizeof(buf), b * kBlockSize);
+    ASSERT(written == sizeof(buf));
+  }
+  ssize_t written = pwrite(fd, "xyz", 3, kBlockSize - 1);
+  ASSERT(written == 3);
+  fprintf(stderr, ">> reading ...\n");
+  ssize_t read = pread(fd, buf, 5, kBlockSize - 2);
+  ASSERT(read == 5);
+  ASSERT(strncmp(buf, "axyzb", 5) == 0);
+  struct stat info;
+  int r = fstat(fd, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == kBlocks * kBlockSize);
+  r = fsync(fd);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> closing file ...\n");
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+static void TEST_VectoredIO(const char* path) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  fprintf(stderr, ">> writing ...\n");
+  char a[] = "abc", b[] = "defg";
+  struct iovec iov[2];
+  iov[0].iov_base = a;
+  iov[0].iov_len = 3;
+  iov[1].iov_base = b;
+  iov[1].iov_len = 4;
+  ssize_t written = writev(fd, iov, 2);
+  ASSERT(written == 7);
+  written = pwritev(fd, iov, 2, 7);
+  ASSERT(written == 7);
+  fprintf(stderr, ">> reading ...\n");
+  char x[5], y[9];
+  iov[0].iov_base = x;
+  iov[0].iov_len = sizeof(x);
+  iov[1].iov_base = y;
+  iov[1].iov_len = sizeof(y);
+  ssize_t read = preadv(fd, iov, 2, 0);
+  ASSERT(read == 14);
+  ASSERT(strncmp(x, "abcde", 5) == 0);
+  ASSERT(strncmp(y, "fgabcdefg", 9) == 0);
+  read = readv(fd, iov, 2);
+  ASSERT(read == 7);
+  ASSERT(strncmp(x, "abcde", 5) == 0);
+  written = pwritev64(fd, iov, 1, 14);
+  ASSERT(written == 5);
+  read = preadv64(fd, iov, 2, 7);
+  ASSERT(read == 12);
+  ASSERT(strncmp(x, "abcde", 5) == 0);
+  ASSERT(strncmp(y, "fgabcde", 7) == 0);
+  fprintf(stderr, ">> closing file ...\n");
+  int r = close(fd);
+  ASSERT(r == 0);
+}
+
+static void TEST_Attributes(const char* path, const char* newpath) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  struct stat info;
+  int r = stat(path, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == 0);
+  fprintf(stderr, ">> writing ...\n");
+  ssize_t written = pwrite(fd, "abcdef", 6, 10);
+  ASSERT(written == 6);
+  r = stat(path, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == 16);
+  r = ftruncate(fd, 4);
+  ASSERT(r == 0);
+  r = fstat(fd, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == 4);
+  r = lstat(path, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == 4);
+  // The names used by code built with _FILE_OFFSET_BITS=64
+  struct stat64 info64;
+  r = fstat64(fd, &info64);
+  ASSERT(r == 0);
+  ASSERT(info64.st_size == 4);
+  r = stat64(path, &info64);
+  ASSERT(r == 0);
+  ASSERT(info64.st_size == 4);
+  r = lstat64(path, &info64);
+  ASSERT(r == 0);
+  ASSERT(info64.st_size == 4);
+  fprintf(stderr, ">> closing file ...\n");
+  r = close(fd);
+  ASSERT(r == 0);
+  r = access(path, R_OK | W_OK);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> renaming to %s ...\n", newpath);
+  r = rename(path, newpath);
+  ASSERT(r == 0);
+  r = access(path, F_OK);
+  ASSERT(r == -1 && errno == ENOENT);
+  r = stat(newpath, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == 4);
+}
+
+// Sizes seen by stat while a stream writes the file. With
+// PDLFS_AttrCacheTTL set, they must not come from a stale cache entry.
+static void TEST_StreamAttributes(const char* path) {
+  fprintf(stderr, "Creating file %s ...\n", path);
+  FILE* f = fopen(path, "w");
+  ASSERT(f != NULL);
+  struct stat info;
+  int r = stat(path, &info);
+  ASSERT(r == 0 && info.st_size == 0);
+  fprintf(stderr, ">> writing ...\n");
+  size_t written = fwrite("0123456789", 1, 10, f);
+  ASSERT(written == 10);
+  r = fflush(f);
+  ASSERT(r == 0);
+  r = stat(path, &info);
+  ASSERT(r == 0 && info.st_size == 10);
+  written = fwrite("abcde", 1, 5, f);
+  ASSERT(written == 5);
+  fprintf(stderr, ">> closing file ...\n");
+  r = fclose(f);
+  ASSERT(r == 0);
+  r = stat(path, &info);
+  ASSERT(r == 0 && info.st_size == 15);
+}
+
+// With PDLFS_Mounts set to /tmp/pdlfs:posix,/tmp/pdlfs-mem:mem, each
+// mount sees only its own files. The posix backend keeps full paths under
+// its PDLFS_Root; the mem backend keeps nothing on disk.
+static void TEST_Mounts(const char* posix_root) {
+  const char* paths[2] = {"/tmp/pdlfs/lalala.m", "/tmp/pdlfs-mem/lalala.m"};
+  for (int i = 0; i < 2; i++) {
+    fprintf(stderr, "Creating file %s ...\n", paths[i]);
+    int fd = open(paths[i], O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+    ASSERT(fd != -1);
+    ssize_t n = strlen(paths[i]);
+    ASSERT(write(fd, paths[i], n) == n);
+    ASSERT(close(fd) == 0);
+  }
+  fprintf(stderr, ">> reading back ...\n");
+  for (int i = 0; i < 2; i++) {
+    char buf[64];
+    int fd = open(paths[i], O_RDONLY);
+    ASSERT(fd != -1);
+    ssize_t n = read(fd, buf, sizeof(buf));
+    ASSERT(n == ssize_t(strlen(paths[i])));
+    ASSERT(memcmp(buf, paths[i], n) == 0);
+    ASSERT(close(fd) == 0);
+  }
+  fprintf(stderr, ">> checking the posix backend ...\n");
+  std::string p = std::string(posix_root) + paths[0];
+  struct stat info;
+  ASSERT(stat(p.c_str(), &info) == 0);
+  ASSERT(info.st_size == off_t(strlen(paths[0])));
+  p = std::string(posix_root) + paths[1];
+  ASSERT(stat(p.c_str(), &info) == -1 && errno == ENOENT);
+}
+
+// With PDLFS_Checksum set and /tmp/pdlfs mounted on the posix backend, a
+// byte flipped in the backend's copy of a file under root fails reads of
+// its block, and only its block, with EIO.
+// A file put in place of it outside the layer is read without checks.
+static void TEST_Corruption(const char* path, const char* root) {
+  const size_t kSize = 3 << 16;  // Three blocks by default
+  std::string data(kSize, 'x');
+  fprintf(stderr, "Corrupting file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, data.data(), kSize) == ssize_t(kSize));
+  ASSERT(close(fd) == 0);
+  std::string p = std::string(root) + path;
+  fd = open(p.c_str(), O_WRONLY);
+  ASSERT(fd != -1);
+  ASSERT(pwrite(fd, "y", 1, kSize / 2) == 1);
+  ASSERT(close(fd) == 0);
+  fprintf(stderr, ">> reading ...\n");
+  ASSERT(GetChecksumStats != NULL);
+  ChecksumStats before;
+  GetChecksumStats(&before);
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  std::string buf(kSize, 0);
+  ssize_t n = pread(fd, &buf[0], kSize, 0);
+  ASSERT(n == -1 && errno == EIO);
+  n = pread(fd, &buf[0], 4096, 0);
+  ASSERT(n == 4096);
+  n = pread(fd, &buf[0], 4096, kSize - 4096);
+  ASSERT(n == 4096);
+  ASSERT(close(fd) == 0);
+  ChecksumStats after;
+  GetChecksumStats(&after);
+  ASSERT(after.mismatches == before.mismatches + 1);
+  fprintf(stderr, ">> replacing behind the layer ...\n");
+  std::string tmp = p + ".tmp";
+  fd = open(tmp.c_str(), O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, buf.data(), kSize) == ssize_t(kSize));
+  ASSERT(close(fd) == 0);
+  ASSERT(rename(tmp.c_str(), p.c_str()) == 0);
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  n = pread(fd, &buf[0], kSize, 0);
+  ASSERT(n == ssize_t(kSize));
+  ASSERT(close(fd) == 0);
+}
+
+// Small appends extend the checksum of the last block instead of reading
+// the block back, so only the new bytes are checksummed.
+static void TEST_ChecksumAppends(const char* path) {
+  const int kAppends = 64;
+  const size_t kAppendSize = 100;
+  fprintf(stderr, "Appending to file %s ...\n", path);
+  ASSERT(GetChecksumStats != NULL);
+  ChecksumStats before;
+  GetChecksumStats(&before);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  std::string data;
+  for (int i = 0; i < kAppends; i++) {
+    std::string s(kAppendSize, 'a' + i % 26);
+    ASSERT(write(fd, s.data(), s.size()) == ssize_t(s.size()));
+    data += s;
+  }
+  ASSERT(close(fd) == 0);
+  ChecksumStats after;
+  GetChecksumStats(&after);
+  ASSERT(after.bytes_checksummed - before.bytes_checksummed == data.size());
+  fprintf(stderr, ">> reading ...\n");
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  std::string buf(data.size(), 0);
+  ssize_t n = pread(fd, &buf[0], buf.size(), 0);
+  ASSERT(n == ssize_t(data.size()));
+  ASSERT(buf == data);
+  ASSERT(close(fd) == 0);
+  GetChecksumStats(&after);
+  ASSERT(after.mismatches == before.mismatches);
+}
+
+// Return how many shards of dir hold name.
+static int CountInShards(const std::string& dir, const char* name) {
+  DIR* d = opendir(dir.c_str());
+  ASSERT(d != NULL);
+  int n = 0;
+  struct dirent* e;
+  while ((e = readdir(d)) != NULL) {
+    struct stat info;
+    std::string p = dir + "/" + e->d_name + "/" + name;
+    if (strncmp(e->d_name, ".pdlfs-shard-", 13) == 0 &&
+        stat(p.c_str(), &info) == 0) {
+      n++;
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+// With PDLFS_DirShards set and /tmp/pdlfs mounted on the posix backend,
+// new files land in a shard under root, while a file and a directory made
+// there before sharding stay reachable and are never shadowed.
+static void TEST_DirShards(const char* root) {
+  fprintf(stderr, "Sharding files under %s ...\n", root);
+  std::string dir = std::string(root) + "/tmp";
+  mkdir(dir.c_str(), 0755);
+  dir += "/pdlfs";
+  mkdir(dir.c_str(), 0755);
+  mkdir((dir + "/lalala.sd").c_str(), 0755);
+  std::string old = dir + "/lalala.s1";
+  int fd = open(old.c_str(), O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, "old", 3) == 3);
+  ASSERT(close(fd) == 0);
+  fd = open("/tmp/pdlfs/lalala.s2", O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, "new", 3) == 3);
+  ASSERT(close(fd) == 0);
+  struct stat info;
+  ASSERT(stat((dir + "/lalala.s2").c_str(), &info) == -1 && errno == ENOENT);
+  ASSERT(CountInShards(dir, "lalala.s2") == 1);
+  fprintf(stderr, ">> opening files made before sharding ...\n");
+  char buf[8];
+  fd = open("/tmp/pdlfs/lalala.s1", O_RDONLY);
+  ASSERT(fd != -1);
+  ASSERT(read(fd, buf, sizeof(buf)) == 3 && memcmp(buf, "old", 3) == 0);
+  ASSERT(close(fd) == 0);
+  fd = open("/tmp/pdlfs/lalala.s1", O_CREAT | O_EXCL | O_WRONLY, DEFFILEMODE);
+  ASSERT(fd == -1 && errno == EEXIST);
+  fd = open("/tmp/pdlfs/lalala.s1", O_CREAT | O_WRONLY | O_APPEND,
+            DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, "er", 2) == 2);
+  ASSERT(close(fd) == 0);
+  ASSERT(CountInShards(dir, "lalala.s1") == 0);
+  ASSERT(stat(old.c_str(), &info) == 0 && info.st_size == 5);
+  fd = open("/tmp/pdlfs/lalala.sd", O_CREAT | O_WRONLY, DEFFILEMODE);
+  ASSERT(fd == -1);
+  ASSERT(CountInShards(dir, "lalala.sd") == 0);
+  fprintf(stderr, ">> renaming over a sharded file ...\n");
+  ASSERT(rename("/tmp/pdlfs/lalala.s1", "/tmp/pdlfs/lalala.s2") == 0);
+  ASSERT(stat(old.c_str(), &info) == -1 && errno == ENOENT);
+  ASSERT(CountInShards(dir, "lalala.s2") == 1);
+  fd = open("/tmp/pdlfs/lalala.s2", O_RDONLY);
+  ASSERT(fd != -1);
+  ASSERT(read(fd, buf, sizeof(buf)) == 5 && memcmp(buf, "older", 5) == 0);
+  ASSERT(close(fd) == 0);
+}
+
+// Ranks forked from one process write interleaved blocks of one file,
+// half of them through the descriptor they inherited and the rest through
+// one they open. All keep the file open until every rank has written.
+static void TEST_SharedFile(const char* path, int ranks) {
+  const int kBlockSize = 4096;
+  const int kRounds = 4;
+  fprintf(stderr, "Writing file %s from %d ranks ...\n", path, ranks);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  int ready[2];
+  int go[2];
+  ASSERT(pipe(ready) == 0 && pipe(go) == 0);
+  std::vector<pid_t> pids;
+  for (int rank = 0; rank < ranks; rank++) {
+    pid_t pid = fork();
+    ASSERT(pid != -1);
+    if (pid == 0) {
+      close(ready[0]);
+      close(go[1]);
+      int wfd = (rank % 2 == 0) ? fd : open(path, O_WRONLY);
+      bool ok = wfd != -1;
+      std::vector<char> block(kBlockSize, 'a' + rank);
+      for (int i = 0; ok && i < kRounds; i++) {
+        off_t off = off_t(i * ranks + rank) * kBlockSize;
+        ok = pwrite(wfd, &block[0], kBlockSize, off) == kBlockSize;
+      }
+      char c = 0;
+      ok = ok && write(ready[1], &c, 1) == 1;
+      ok = ok && read(go[0], &c, 1) == 0;  // Closed once all have written
+      if (wfd != fd) ok = ok && close(wfd) == 0;
+      ok = ok && close(fd) == 0;
+      _exit(ok ? 0 : 1);
+    }
+    pids.push_back(pid);
+  }
+  close(ready[1]);
+  close(go[0]);
+  for (int rank = 0; rank < ranks; rank++) {
+    char c;
+    ASSERT(read(ready[0], &c, 1) == 1);
+  }
+  close(go[1]);
+  close(ready[0]);
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    ASSERT(waitpid(pids[i], &status, 0) == pids[i]);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+  int r = close(fd);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> reading back ...\n");
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  struct stat info;
+  r = fstat(fd, &info);
+  ASSERT(r == 0 && info.st_size == off_t(kRounds) * ranks * kBlockSize);
+  std::vector<char> block(kBlockSize);
+  for (int i = 0; i < kRounds * ranks; i++) {
+    ssize_t n = pread(fd, &block[0], kBlockSize, off_t(i) * kBlockSize);
+    ASSERT(n == kBlockSize);
+    ASSERT(block[0] == 'a' + i % ranks && block[kBlockSize - 1] == block[0]);
+  }
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+// Ranks forked after the directory was listed race to create one file with
+// O_EXCL. Exactly one of them may succeed.
+static void TEST_ExclusiveCreate(const char* prefix, int ranks) {
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s.%d", prefix, int(getpid()));
+  fprintf(stderr, "Creating file %s from %d ranks ...\n", path, ranks);
+  int fd = open(prefix, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(close(fd) == 0);
+  std::vector<pid_t> pids;
+  for (int rank = 0; rank < ranks; rank++) {
+    pid_t pid = fork();
+    ASSERT(pid != -1);
+    if (pid == 0) {
+      fd = open(path, O_CREAT | O_EXCL | O_WRONLY, DEFFILEMODE);
+      if (fd == -1) _exit(errno == EEXIST ? 1 : 2);
+      _exit(close(fd) == 0 ? 0 : 2);
+    }
+    pids.push_back(pid);
+  }
+  int created = 0;
+  for (size_t i = 0; i < pids.size(); i++) {
+    int status;
+    ASSERT(waitpid(pids[i], &status, 0) == pids[i]);
+    ASSERT(WIFEXITED(status) && WEXITSTATUS(status) != 2);
+    if (WEXITSTATUS(status) == 0) created++;
+  }
+  ASSERT(created == 1);
+  fd = open(path, O_CREAT | O_EXCL | O_WRONLY, DEFFILEMODE);
+  ASSERT(fd == -1 && errno == EEXIST);
+}
+
+// A child that closes a descriptor it inherited must not write out the
+// file again, or its copy could replace what the parent wrote later.
+static void TEST_InheritedFile(const char* path) {
+  fprintf(stderr, "Sharing file %s with a child ...\n", path);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(write(fd, "xxx", 3) == 3);
+  int go[2];
+  ASSERT(pipe(go) == 0);
+  pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    close(go[1]);
+    char c;
+    bool ok = read(go[0], &c, 1) == 0;  // Closed once the parent is done
+    ok = ok && close(fd) == 0;
+    _exit(ok ? 0 : 1);
+  }
+  close(go[0]);
+  ASSERT(write(fd, "yyy", 3) == 3);
+  ASSERT(close(fd) == 0);
+  close(go[1]);
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  fprintf(stderr, ">> reading back from a new process ...\n");
+  std::string cmd = std::string("cat ") + path;
+  FILE* f = popen(cmd.c_str(), "r");
+  ASSERT(f != NULL);
+  char buf[16];
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  ASSERT(pclose(f) == 0);
+  ASSERT(n == 6 && memcmp(buf, "xxxyyy", 6) == 0);
+}
+
+// With PDLFS_WriteCache set, cached writes reach the backend within twice
+// PDLFS_WriteCacheAge even if the file sees no further calls.
+static void TEST_CacheAge(const char* path) {
+  const char* env = getenv("PDLFS_WriteCacheAge");
+  int age_ms = (env != NULL) ? atoi(env) : 1000;
+  fprintf(stderr, "Writing file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ssize_t written = pwrite(fd, "abc", 3, 0);
+  ASSERT(written == 3);
+  fprintf(stderr, ">> reading through another fd after %d ms ...\n",
+          3 * age_ms);
+  usleep(3 * age_ms * 1000);
+  int fd2 = open(path, O_RDONLY);
+  ASSERT(fd2 != -1);
+  char buf[3];
+  ssize_t read = pread(fd2, buf, 3, 0);
+  ASSERT(read == 3 && memcmp(buf, "abc", 3) == 0);
+  int r = close(fd2);
+  ASSERT(r == 0);
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+// Writes cached by one descriptor are seen by reads through another
+// descriptor, a stream and a mapping. Appends through several descriptors
+// all land at the end of the file.
+static void TEST_CacheCoherence(const char* path) {
+  fprintf(stderr, "Reading file %s while it is written ...\n", path);
+  int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  int fd2 = open(path, O_RDONLY);
+  ASSERT(fd2 != -1);
+  char buf[16];
+  ASSERT(write(fd, "abc", 3) == 3);
+  ASSERT(pread(fd2, buf, 3, 0) == 3 && memcmp(buf, "abc", 3) == 0);
+  ASSERT(write(fd, "def", 3) == 3);
+  ASSERT(read(fd2, buf, 6) == 6 && memcmp(buf, "abcdef", 6) == 0);
+  ASSERT(pwrite(fd, "g", 1, 0) == 1);
+  FILE* f = fopen(path, "r");
+  ASSERT(f != NULL);
+  ASSERT(fread(buf, 1, 6, f) == 6 && memcmp(buf, "gbcdef", 6) == 0);
+  ASSERT(fclose(f) == 0);
+  ASSERT(pwrite(fd, "h", 1, 1) == 1);
+  void* p = mmap(NULL, 6, PROT_READ, MAP_SHARED, fd2, 0);
+  ASSERT(p != MAP_FAILED);
+  ASSERT(memcmp(p, "ghcdef", 6) == 0);
+  ASSERT(munmap(p, 6) == 0);
+  ASSERT(close(fd2) == 0);
+  ASSERT(close(fd) == 0);
+  fprintf(stderr, ">> appending through two fds ...\n");
+  fd = open(path, O_WRONLY | O_APPEND);
+  ASSERT(fd != -1);
+  fd2 = open(path, O_WRONLY | O_APPEND);
+  ASSERT(fd2 != -1);
+  ASSERT(write(fd, "x", 1) == 1);
+  ASSERT(write(fd2, "y", 1) == 1);
+  ASSERT(write(fd, "z", 1) == 1);
+  ASSERT(close(fd2) == 0);
+  ASSERT(close(fd) == 0);
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  ssize_t n = read(fd, buf, sizeof(buf));
+  ASSERT(n == 9 && memcmp(buf, "ghcdefxyz", 9) == 0);
+  ASSERT(close(fd) == 0);
+}
+
+// A child writes through a descriptor it leaves open when it exits.
+static void TEST_CacheExit(const char* path) {
+  fprintf(stderr, "Writing file %s from a child that exits ...\n", path);
+  pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    int fd = open(path, O_CREAT | O_WRONLY | O_TRUNC, DEFFILEMODE);
+    exit(fd != -1 && write(fd, "abc", 3) == 3 ? 0 : 1);
+  }
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  struct stat info;
+  ASSERT(stat(path, &info) == 0 && info.st_size == 3);
+}
+
+static void TEST_MappedIO(const char* path) {
+  const size_t kSize = (3 << 20) + 100;
+  std::vector<char> data(kSize);
+  for (size_t i = 0; i < kSize; i++) {
+    data[i] = static_cast<char>(i % 251);
+  }
+  fprintf(stderr, "Creating file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ssize_t written = pwrite(fd, &data[0], kSize, 0);
+  ASSERT(written == kSize);
+  fprintf(stderr, ">> mapping ...\n");
+  char* p = static_cast<char*>(
+      mmap(NULL, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  ASSERT(p != MAP_FAILED);
+  int r = close(fd);
+  ASSERT(r == 0);
+  ASSERT(memcmp(p + (2 << 20), &data[2 << 20], kSize - (2 << 20)) == 0);
+  ASSERT(memcmp(p, &data[0], kSize) == 0);
+  memcpy(p + 4090, "xyzxyz", 6);
+  r = msync(p, kSize, MS_SYNC);
+  ASSERT(r == 0);
+  p[kSize - 1] = 'z';
+  fprintf(stderr, ">> unmapping ...\n");
+  r = munmap(p, kSize);
+  ASSERT(r == 0);
+  fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  char buf[6];
+  ssize_t read = pread(fd, buf, 6, 4090);
+  ASSERT(read == 6);
+  ASSERT(memcmp(buf, "xyzxyz", 6) == 0);
+  read = pread(fd, buf, 1, kSize - 1);
+  ASSERT(read == 1);
+  ASSERT(buf[0] == 'z');
+  struct stat info;
+  r = fstat(fd, &info);
+  ASSERT(r == 0);
+  ASSERT(info.st_size == kSize);
+  p = static_cast<char*>(mmap64(NULL, 8192, PROT_READ, MAP_SHARED, fd, 0));
+  ASSERT(p != MAP_FAILED);
+  ASSERT(memcmp(p + 4090, "xyzxyz", 6) == 0);
+  r = munmap(p, 8192);
+  ASSERT(r == 0);
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+// Pages of a shared writable mapping that are only read are not written
+// back, so they do not undo writes made through the fd meanwhile. Neither
+// are pages of a mapping replaced by a MAP_FIXED anonymous one.
+static void TEST_MappedWriteBack(const char* path) {
+  const size_t kSize = 3 * 4096;
+  fprintf(stderr, "Mapping file %s while it is written ...\n", path);
+  std::vector<char> data(kSize, 'a');
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(pwrite(fd, &data[0], kSize, 0) == kSize);
+  char* p = static_cast<char*>(
+      mmap(NULL, kSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  ASSERT(p != MAP_FAILED);
+  ASSERT(memcmp(p, &data[0], kSize) == 0);
+  p[4096] = 'x';
+  ASSERT(pwrite(fd, "bb", 2, 0) == 2);
+  ASSERT(pwrite(fd, "cc", 2, 2 * 4096) == 2);
+  ASSERT(msync(p, kSize, MS_SYNC) == 0);
+  ASSERT(pwrite(fd, "d", 1, 4096 + 1) == 1);
+  void* q = mmap(p + 2 * 4096, 4096, PROT_READ | PROT_WRITE,
+                 MAP_FIXED | MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ASSERT(q == p + 2 * 4096);
+  memset(q, 'z', 4096);
+  ASSERT(munmap(p, kSize) == 0);
+  char buf[2];
+  ASSERT(pread(fd, buf, 2, 0) == 2 && memcmp(buf, "bb", 2) == 0);
+  ASSERT(pread(fd, buf, 2, 4096) == 2 && memcmp(buf, "xd", 2) == 0);
+  ASSERT(pread(fd, buf, 2, 2 * 4096) == 2 && memcmp(buf, "cc", 2) == 0);
+  ASSERT(close(fd) == 0);
+}
+
+// A child writes through a shared mapping it never unmaps.
+static void TEST_MappedExit(const char* path) {
+  fprintf(stderr, "Mapping file %s in a child that exits ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  ASSERT(pwrite(fd, "aaa", 3, 0) == 3);
+  ASSERT(close(fd) == 0);
+  pid_t pid = fork();
+  ASSERT(pid != -1);
+  if (pid == 0) {
+    fd = open(path, O_RDWR);
+    char* p = (fd == -1) ? static_cast<char*>(MAP_FAILED)
+                         : static_cast<char*>(mmap(NULL, 3, PROT_WRITE,
+                                                   MAP_SHARED, fd, 0));
+    if (p == MAP_FAILED) _exit(1);
+    p[1] = 'b';
+    exit(0);
+  }
+  int status;
+  ASSERT(waitpid(pid, &status, 0) == pid);
+  ASSERT(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  // Packed files are looked up in what this process loaded of the index
+  fprintf(stderr, ">> reading back from a new process ...\n");
+  std::string cmd = std::string("cat ") + path;
+  FILE* f = popen(cmd.c_str(), "r");
+  ASSERT(f != NULL);
+  char buf[4];
+  size_t n = fread(buf, 1, sizeof(buf), f);
+  ASSERT(pclose(f) == 0);
+  ASSERT(n == 3 && memcmp(buf, "aba", 3) == 0);
+}
+
+static void TEST_AsyncIO(const char* path) {
+  const int kBlocks = 8;
+  const int kBlockSize = 4096;
+  fprintf(stderr, "Creating file %s ...\n", path);
+  int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, DEFFILEMODE);
+  ASSERT(fd != -1);
+  fprintf(stderr, ">> writing ...\n");
+  std::vector<char> data(kBlocks * kBlockSize);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = 'a' + i / kBlockSize;
+  }
+  struct aiocb cbs[kBlocks];
+  struct aiocb* list[kBlocks];
+  memset(cbs, 0, sizeof(cbs));
+  for (int i = 0; i < kBlocks; i++) {
+    int b = kBlocks - 1 - i;  // Submitted out of order
+    cbs[i].aio_fildes = fd;
+    cbs[i].aio_lio_opcode = LIO_WRITE;
+    cbs[i].aio_buf = &data[b * kBlockSize];
+    cbs[i].aio_nbytes = kBlockSize;
+    cbs[i].aio_offset = b * kBlockSize;
+    list[i] = &cbs[i];
+  }
+  int r = lio_listio(LIO_WAIT, list, kBlocks, NULL);
+  ASSERT(r == 0);
+  for (int i = 0; i < kBlocks; i++) {
+    ASSERT(aio_error(&cbs[i]) == 0);
+    ASSERT(aio_return(&cbs[i]) == kBlockSize);
+  }
+  fprintf(stderr, ">> reading ...\n");
+  char buf[kBlockSize];
+  struct aiocb cb;
+  memset(&cb, 0, sizeof(cb));
+  cb.aio_fildes = fd;
+  cb.aio_buf = buf;
+  cb.aio_nbytes = sizeof(buf);
+  cb.aio_offset = 3 * kBlockSize;
+  r = aio_read(&cb);
+  ASSERT(r == 0);
+  const struct aiocb* pending[1] = {&cb};
+  while (aio_error(&cb) == EINPROGRESS) {
+    r = aio_suspend(pending, 1, NULL);
+    ASSERT(r == 0 || errno == EINTR);
+  }
+  ASSERT(aio_error(&cb) == 0);
+  ASSERT(aio_return(&cb) == kBlockSize);
+  ASSERT(buf[0] == 'd' && buf[kBlockSize - 1] == 'd');
+  // The names used by code built with _FILE_OFFSET_BITS=64
+  struct aiocb64 cb64;
+  memset(&cb64, 0, sizeof(cb64));
+  cb64.aio_fildes = fd;
+  cb64.aio_buf = buf;
+  cb64.aio_nbytes = sizeof(buf);
+  cb64.aio_offset = 5 * kBlockSize;
+  r = aio_read64(&cb64);
+  ASSERT(r == 0);
+  const struct aiocb64* pending64[1] = {&cb64};
+  while (aio_error64(&cb64) == EINPROGRESS) {
+    r = aio_suspend64(pending64, 1, NULL);
+    ASSERT(r == 0 || errno == EINTR);
+  }
+  ASSERT(aio_error64(&cb64) == 0);
+  ASSERT(aio_return64(&cb64) == kBlockSize);
+  ASSERT(buf[0] == 'f' && buf[kBlockSize - 1] == 'f');
+  fprintf(stderr, ">> syncing ...\n");
+  memset(&cb, 0, sizeof(cb));
+  cb.aio_fildes = fd;
+  r = aio_fsync(O_SYNC, &cb);
+  ASSERT(r == 0);
+  while (aio_error(&cb) == EINPROGRESS) {
+    r = aio_suspend(pending, 1, NULL);
+    ASSERT(r == 0 || errno == EINTR);
+  }
+  ASSERT(aio_error(&cb) == 0);
+  ASSERT(aio_return(&cb) == 0);
+  fprintf(stderr, ">> canceling ...\n");
+  const int kReads = 256;
+  std::vector<struct aiocb> reads(kReads);
+  std::vector<char> rbuf(kReads * kBlockSize);
+  for (int i = 0; i < kReads; i++) {
+    memset(&reads[i], 0, sizeof(reads[i]));
+    reads[i].aio_fildes = fd;
+    reads[i].aio_buf = &rbuf[i * kBlockSize];
+    reads[i].aio_nbytes = kBlockSize;
+    reads[i].aio_offset = (i % kBlocks) * kBlockSize;
+    r = aio_read(&reads[i]);
+    ASSERT(r == 0);
+  }
+  r = aio_cancel(fd, NULL);
+  ASSERT(r == AIO_CANCELED || r == AIO_NOTCANCELED || r == AIO_ALLDONE);
+  int canceled = 0;
+  for (int i = 0; i < kReads; i++) {
+    const struct aiocb* one[1] = {&reads[i]};
+    while (aio_error(&reads[i]) == EINPROGRESS) {
+      aio_suspend(one, 1, NULL);
+    }
+    if (aio_error(&reads[i]) == ECANCELED) {
+      ASSERT(aio_return(&reads[i]) == -1);
+      canceled++;
+    } else {
+      ASSERT(aio_error(&reads[i]) == 0);
+      ASSERT(aio_return(&reads[i]) == kBlockSize);
+    }
+  }
+  ASSERT(r != AIO_ALLDONE || canceled == 0);
+  ASSERT(r != AIO_CANCELED || canceled != 0);
+  ASSERT(aio_cancel(fd, NULL) == AIO_ALLDONE);
+  fprintf(stderr, ">> closing file ...\n");
+  r = close(fd);
+  ASSERT(r == 0);
+}
+
+// Writes larger than the stream buffer mixed with small ones.
+static void TEST_LargeWrites(const char* path) {
+  const size_t kLargeSize = 8 << 20;
+  std::vector<char> large(kLargeSize);
+  for (size_t i = 0; i < kLargeSize; i++) {
+    large[i] = static_cast<char>(i % 251);
+  }
+  fprintf(stderr, "Creating file %s ...\n", path);
+  FILE* f = fopen(path, "w+");
+  ASSERT(f != NULL);
+  fprintf(stderr, ">> writing ...\n");
+  size_t written = fwrite("xxx", 1, 3, f);
+  ASSERT(written == 3);
+  written = fwrite(&large[0], 1, kLargeSize, f);
+  ASSERT(written == kLargeSize);
+  written = fwrite("yyy", 1, 3, f);
+  ASSERT(written == 3);
+  ASSERT(ftell(f) == kLargeSize + 6);
+  fprintf(stderr, ">> reading ...\n");
+  int r = fseek(f, 0, SEEK_SET);
+  ASSERT(r == 0);
+  std::vector<char> buf(kLargeSize + 6);
+  size_t read = fread(&buf[0], 1, buf.size(), f);
+  ASSERT(read == buf.size());
+  ASSERT(memcmp(&buf[0], "xxx", 3) == 0);
+  ASSERT(memcmp(&buf[3], &large[0], kLargeSize) == 0);
+  ASSERT(memcmp(&buf[kLargeSize + 3], "yyy", 3) == 0);
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+// Full buffers interleaved with seeks, overwrites, and reads. With
+// PDLFS_WriteBehind set, buffers are written out in the background while
+// the stream keeps filling the next one.
+static void TEST_WriteBehind(const char* path) {
+  const int kRecordSize = 1000;
+  const int kNumRecords = 5000;
+  char rec[kRecordSize];
+  fprintf(stderr, "Writing %d records to %s ...\n", kNumRecords, path);
+  FILE* f = fopen(path, "w+");
+  ASSERT(f != NULL);
+  for (int i = 0; i < kNumRecords; i++) {
+    memset(rec, 'a' + i % 26, sizeof(rec));
+    size_t written = fwrite(rec, 1, sizeof(rec), f);
+    ASSERT(written == sizeof(rec));
+    if (i % 1000 == 999) {
+      // Overwrite a record that may still be in flight
+      int r = fseek(f, (i - 500) * kRecordSize, SEEK_SET);
+      ASSERT(r == 0);
+      memset(rec, 'A' + (i - 500) % 26, sizeof(rec));
+      written = fwrite(rec, 1, sizeof(rec), f);
+      ASSERT(written == sizeof(rec));
+      r = fseek(f, 0, SEEK_END);
+      ASSERT(r == 0 && ftell(f) == (i + 1) * kRecordSize);
+    }
+  }
+  int r = fflush(f);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> reading through another fd ...\n");
+  int fd = open(path, O_RDONLY);
+  ASSERT(fd != -1);
+  struct stat info;
+  r = fstat(fd, &info);
+  ASSERT(r == 0 && info.st_size == kNumRecords * kRecordSize);
+  for (int i = 0; i < kNumRecords; i++) {
+    ssize_t read = pread(fd, rec, sizeof(rec), i * kRecordSize);
+    ASSERT(read == sizeof(rec));
+    char c = (i % 1000 == 499) ? 'A' + i % 26 : 'a' + i % 26;
+    ASSERT(rec[0] == c && rec[kRecordSize - 1] == c);
+  }
+  r = close(fd);
+  ASSERT(r == 0);
+  fprintf(stderr, ">> reading back ...\n");
+  r = fseek(f, 499 * kRecordSize, SEEK_SET);
+  ASSERT(r == 0);
+  size_t read = fread(rec, 1, sizeof(rec), f);
+  ASSERT(read == sizeof(rec) && rec[0] == 'A' + 499 % 26);
+  r = fclose(f);
+  ASSERT(r == 0);
+}
+
+// Each pdlfs open consumes a new fd number so this forces the fd table
+// to grow past its initial size.
+static void TEST_ManyFiles(const char* path, int num_files) {
+  fprintf(stderr, "Opening file %s %d times ...\n", path, num_files);
+  for (int i = 0; i < num_files; i++) {
+    int fd = open(path, O_CREAT | O_RDWR, DEFFILEMODE);
+    ASSERT(fd != -1);
+    ssize_t written = pwrite(fd, "x", 1, i);
+    ASSERT(written == 1);
+    int r = close(fd);
+    ASSERT(r == 0);
+  }
+}
+
 static void CloseAll() {
   for (size_t i = 0; i < open_files.size(); i++) {
     close(open_files[i]);
   }
+  open_files.clear();
 }
 
 int main(int argc, char* argv[]) {
@@ -119,5 +1333,87 @@ int main(int argc, char* argv[]) {
 
   TEST_BufferedIO("/tmp/lalala");
   TEST_BufferedIO("/tmp/pdlfs/lalala");
+
+  TEST_StridedIO("/tmp/lalala");
+  TEST_StridedIO("/tmp/pdlfs/lalala");
+
+  TEST_VectoredIO("/tmp/lalala");
+  TEST_VectoredIO("/tmp/pdlfs/lalala");
+
+  TEST_Attributes("/tmp/lalala", "/tmp/lalala2");
+  TEST_Attributes("/tmp/pdlfs/lalala", "/tmp/pdlfs/lalala2");
+
+  TEST_StreamAttributes("/tmp/lalala");
+  TEST_StreamAttributes("/tmp/pdlfs/lalala");
+
+  if (getenv("PDLFS_WriteCache") != NULL) {
+    TEST_CacheAge("/tmp/pdlfs/lalala");
+    TEST_CacheCoherence("/tmp/pdlfs/lalala.c");
+    TEST_CacheExit("/tmp/pdlfs/lalala.c");
+  }
+
+  // Backends that keep files in memory cannot be shared by processes,
+  // and neither can packed files while they are open.
+  if (getenv("TEST_Ranks") != NULL) {
+    TEST_SharedFile("/tmp/lalala", atoi(getenv("TEST_Ranks")));
+    if (getenv("PDLFS_Pack") == NULL) {
+      TEST_SharedFile("/tmp/pdlfs/lalala", atoi(getenv("TEST_Ranks")));
+    }
+    TEST_ExclusiveCreate("/tmp/lalala.x", atoi(getenv("TEST_Ranks")));
+    TEST_ExclusiveCreate("/tmp/pdlfs/lalala.x", atoi(getenv("TEST_Ranks")));
+    TEST_InheritedFile("/tmp/lalala.i");
+    TEST_InheritedFile("/tmp/pdlfs/lalala.i");
+    TEST_ExitFlush("/tmp/pdlfs/lalala.e");
+    TEST_MappedExit("/tmp/pdlfs/lalala.m");
+  }
+
+  if (getenv("PDLFS_Checksum") != NULL) {
+    TEST_ChecksumAppends("/tmp/pdlfs/lalala.ca");
+  }
+  if (getenv("PDLFS_Checksum") != NULL && getenv("PDLFS_Mounts") != NULL) {
+    TEST_Corruption("/tmp/pdlfs/lalala.crc", getenv("PDLFS_Root"));
+  }
+
+  if (getenv("PDLFS_DirShards") != NULL && getenv("PDLFS_Mounts") != NULL) {
+    TEST_DirShards(getenv("PDLFS_Root"));
+  } else if (getenv("PDLFS_Mounts") != NULL) {
+    TEST_Mounts(getenv("PDLFS_Root"));
+  }
+
+  TEST_MappedIO("/tmp/lalala");
+  TEST_MappedIO("/tmp/pdlfs/lalala");
+  TEST_MappedWriteBack("/tmp/pdlfs/lalala.m");
+
+  TEST_AsyncIO("/tmp/lalala");
+  TEST_AsyncIO("/tmp/pdlfs/lalala");
+
+  TEST_LineBuffering("/tmp/lalala");
+  TEST_LineBuffering("/tmp/pdlfs/lalala");
+
+  TEST_FormattedIO("/tmp/lalala3");
+  TEST_FormattedIO("/tmp/pdlfs/lalala3");
+
+  TEST_StreamDescriptor("/tmp/pdlfs/lalala3");
+
+  TEST_LargeWrites("/tmp/lalala");
+  TEST_LargeWrites("/tmp/pdlfs/lalala");
+
+  TEST_SequentialIO("/tmp/lalala");
+  TEST_SequentialIO("/tmp/pdlfs/lalala");
+  TEST_ForkedReader("/tmp/pdlfs/lalala");
+
+  TEST_WriteBehind("/tmp/lalala");
+  TEST_WriteBehind("/tmp/pdlfs/lalala");
+
+  TEST_UnalignedIO("/tmp/lalala");
+  TEST_UnalignedIO("/tmp/pdlfs/lalala");
+
+  TEST_SmallFiles("/tmp/lalala.d");
+  TEST_SmallFiles("/tmp/pdlfs/lalala.d");
+
+  TEST_CompressedIO("/tmp/lalala.z", false);
+  TEST_CompressedIO("/tmp/pdlfs/lalala.z", getenv("PDLFS_Compress") != NULL);
+
+  TEST_ManyFiles("/tmp/pdlfs/lalala", 3000);
   return 0;
 }
@@ -0,0 +1,127 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "thread_pool.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+static void PthreadCall(const char* label, int result) {
+  if (result != 0) {
+    fprintf(stderr, "!!! FATAL error: %s failed (%d)\n", label, result);
+    abort();
+  }
+}
+
+ThreadPool::ThreadPool(int num_threads)
+    : num_threads_(num_threads),
+      started_(false),
+      shutting_down_(false),
+      num_running_(0) {
+  PthreadCall("init mutex", pthread_mutex_init(&mu_, NULL));
+  PthreadCall("init cv", pthread_cond_init(&cv_, NULL));
+}
+
+ThreadPool::~ThreadPool() {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  shutting_down_ = true;
+  PthreadCall("broadcast", pthread_cond_broadcast(&cv_));
+  while (num_running_ != 0) {
+    PthreadCall("wait", pthread_cond_wait(&cv_, &mu_));
+  }
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+  pthread_cond_destroy(&cv_);
+  pthread_mutex_destroy(&mu_);
+}
+
+void* ThreadPool::BGThreadWrapper(void* arg) {
+  reinterpret_cast<ThreadPool*>(arg)->BGThread();
+  return NULL;
+}
+
+void ThreadPool::BGThread() {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  while (true) {
+    while (queue_.empty() && !shutting_down_) {
+      PthreadCall("wait", pthread_cond_wait(&cv_, &mu_));
+    }
+    if (shutting_down_) {
+      break;
+    }
+    Task task = queue_.front();
+    queue_.pop_front();
+    PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+    task.function(task.arg);
+    PthreadCall("lock", pthread_mutex_lock(&mu_));
+  }
+  num_running_--;
+  PthreadCall("broadcast", pthread_cond_broadcast(&cv_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+// REQUIRES: mu_ has been locked.
+void ThreadPool::StartThreads() {
+  // Background threads should not take signals meant for the application
+  sigset_t all, old;
+  sigfillset(&all);
+  PthreadCall("sigmask", pthread_sigmask(SIG_SETMASK, &all, &old));
+  for (int i = 0; i < num_threads_; i++) {
+    pthread_t t;
+    PthreadCall("create thread",
+                pthread_create(&t, NULL, &ThreadPool::BGThreadWrapper, this));
+    PthreadCall("detach thread", pthread_detach(t));
+    num_running_++;
+  }
+  PthreadCall("sigmask", pthread_sigmask(SIG_SETMASK, &old, NULL));
+  started_ = true;
+}
+
+void ThreadPool::Schedule(void (*function)(void*), void* arg) {
+  PthreadCall("lock", pthread_mutex_lock(&mu_));
+  if (!started_) {
+    StartThreads();
+  }
+  Task task;
+  task.function = function;
+  task.arg = arg;
+  queue_.push_back(task);
+  PthreadCall("signal", pthread_cond_signal(&cv_));
+  PthreadCall("unlock", pthread_mutex_unlock(&mu_));
+}
+
+void ThreadPool::AfterFork() {
+  PthreadCall("init mutex", pthread_mutex_init(&mu_, NULL));
+  PthreadCall("init cv", pthread_cond_init(&cv_, NULL));
+  queue_.clear();
+  started_ = false;
+  num_running_ = 0;
+}
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static ThreadPool* pool = NULL;
+
+static void AfterFork() { pool->AfterFork(); }
+
+static void InitPool() {
+  int num_threads = 4;
+  const char* env = getenv("PDLFS_IOThreads");
+  if (env != NULL && atoi(env) > 0) {
+    num_threads = atoi(env);
+  }
+  pool = new ThreadPool(num_threads);
+  pthread_atfork(NULL, NULL, &AfterFork);
+}
+
+ThreadPool* io_thread_pool() {
+  if (pool == NULL) {
+    pthread_once(&once, &InitPool);
+  }
+  return pool;
+}
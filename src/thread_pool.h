@@ -0,0 +1,53 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <pthread.h>
+#include <deque>
+
+// A fixed set of background threads running tasks in FIFO order.
+// Threads are created on the first call to Schedule().
+class ThreadPool {
+ public:
+  explicit ThreadPool(int num_threads);
+  ~ThreadPool();
+
+  void Schedule(void (*function)(void*), void* arg);
+
+  // Called in the child after fork(), which inherits none of the threads.
+  // Queued tasks are dropped and threads are started again on demand.
+  void AfterFork();
+
+ private:
+  struct Task {
+    void (*function)(void*);
+    void* arg;
+  };
+
+  static void* BGThreadWrapper(void* arg);
+  void BGThread();
+  void StartThreads();
+
+  pthread_mutex_t mu_;
+  pthread_cond_t cv_;
+  std::deque<Task> queue_;
+  int num_threads_;
+  bool started_;
+  bool shutting_down_;
+  int num_running_;
+
+  // No copying allowed
+  ThreadPool(const ThreadPool&);
+  void operator=(const ThreadPool&);
+};
+
+// Return the pool shared by all background I/O. Its size is controlled
+// by the PDLFS_IOThreads environment variable.
+extern ThreadPool* io_thread_pool();
@@ -0,0 +1,154 @@
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include "write_cache.h"
+
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+
+#include "mount_table.h"
+
+static inline unsigned long long NowNanos() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<unsigned long long>(ts.tv_sec) * 1000000000ULL +
+         ts.tv_nsec;
+}
+
+WriteCache::WriteCache(const PdlfsOps* ops, int fd, size_t max_bytes,
+                       unsigned long long max_age_nanos)
+    : bytes_(0),
+      oldest_(0),
+      ops_(ops),
+      fd_(fd),
+      max_bytes_(max_bytes),
+      max_age_nanos_(max_age_nanos) {}
+
+WriteCache::~WriteCache() {}
+
+ssize_t WriteCache::Write(const void* buf, size_t sz, off_t off) {
+  if (sz == 0) return 0;
+  if (sz >= max_bytes_) {
+    // Too large to be worth caching
+    if (FlushAll() != 0) {
+      return -1;
+    }
+    return ops_->pwrite(fd_, buf, sz, off);
+  }
+  if (!extents_.empty()) {
+    if (bytes_ + sz > max_bytes_ || NowNanos() - oldest_ > max_age_nanos_) {
+      if (FlushAll() != 0) {
+        return -1;
+      }
+    }
+  }
+  if (extents_.empty()) {
+    oldest_ = NowNanos();
+  }
+
+  const char* data = reinterpret_cast<const char*>(buf);
+  // Find the first extent that overlaps or is adjacent to the new range
+  ExtentMap::iterator it = extents_.upper_bound(off);
+  if (it != extents_.begin()) {
+    ExtentMap::iterator prev = it;
+    --prev;
+    if (prev->first + static_cast<off_t>(prev->second.size()) >= off) {
+      it = prev;
+    }
+  }
+  if (it == extents_.end() || it->first > off) {
+    // Start a new extent at off
+    it = extents_.insert(it, std::make_pair(off, std::string(data, sz)));
+    bytes_ += sz;
+  } else {
+    // Overwrite and possibly extend the extent in place
+    std::string* s = &it->second;
+    size_t pos = off - it->first;
+    if (pos + sz > s->size()) {
+      bytes_ += pos + sz - s->size();
+      s->resize(pos + sz);
+    }
+    memcpy(&(*s)[pos], data, sz);
+  }
+
+  // Absorb later extents the grown extent now overlaps or touches. The new
+  // data wins wherever it overlaps older data.
+  std::string* s = &it->second;
+  off_t e_end = it->first + s->size();
+  ExtentMap::iterator next = it;
+  ++next;
+  while (next != extents_.end() && next->first <= e_end) {
+    off_t n_end = next->first + next->second.size();
+    bytes_ -= next->second.size();
+    if (n_end > e_end) {
+      s->append(next->second, e_end - next->first, std::string::npos);
+      bytes_ += n_end - e_end;
+      e_end = n_end;
+    }
+    extents_.erase(next++);
+  }
+
+  return sz;
+}
+
+int WriteCache::WriteExtent(ExtentMap::iterator it) {
+  const std::string& s = it->second;
+  ssize_t n = ops_->pwrite(fd_, s.data(), s.size(), it->first);
+  if (n != static_cast<ssize_t>(s.size())) {
+    if (n != -1) errno = EIO;
+    return -1;
+  }
+  bytes_ -= s.size();
+  return 0;
+}
+
+int WriteCache::Flush(off_t off, size_t sz) {
+  const off_t end = off + sz;
+  ExtentMap::iterator it = extents_.upper_bound(off);
+  if (it != extents_.begin()) {
+    ExtentMap::iterator prev = it;
+    --prev;
+    if (prev->first + static_cast<off_t>(prev->second.size()) > off) {
+      it = prev;
+    }
+  }
+  while (it != extents_.end() && it->first < end) {
+    if (WriteExtent(it) != 0) {
+      return -1;
+    }
+    extents_.erase(it++);
+  }
+  return 0;
+}
+
+int WriteCache::FlushAll() {
+  ExtentMap::iterator it = extents_.begin();
+  while (it != extents_.end()) {
+    if (WriteExtent(it) != 0) {
+      return -1;
+    }
+    extents_.erase(it++);
+  }
+  return 0;
+}
+
+int WriteCache::FlushExpired() {
+  if (extents_.empty() || NowNanos() - oldest_ <= max_age_nanos_) {
+    return 0;
+  }
+  return FlushAll();
+}
+
+off_t WriteCache::End() const {
+  if (extents_.empty()) return 0;
+  ExtentMap::const_iterator last = extents_.end();
+  --last;
+  return last->first + last->second.size();
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+/*
+ * Copyright (c) 2014-2016 Carnegie Mellon University.
+ *
+ * All rights reserved.
+ *
+ * Use of this source code is governed by a BSD-style license that can be
+ * found in the LICENSE file. See the AUTHORS file for names of contributors.
+ */
+
+#include <sys/types.h>
+#include <map>
+#include <string>
+
+struct PdlfsOps;
+
+// Dirty data written to a single pdlfs file but not yet sent to the
+// backend. Ranges are kept sorted by offset, and adjacent or overlapping
+// ranges are merged so they can be written out as a few large runs.
+// Not thread-safe: callers must serialize access to each cache.
+class WriteCache {
+ public:
+  WriteCache(const PdlfsOps* ops, int fd, size_t max_bytes,
+             unsigned long long max_age_nanos);
+  ~WriteCache();
+
+  // Cache sz bytes to be written at off. Cached data is written out first
+  // if the cache is full or too old. Return sz on success, or -1 on errors.
+  ssize_t Write(const void* buf, size_t sz, off_t off);
+
+  // Write out all cached data overlapping [off, off + sz).
+  // Return 0 on success, or -1 on errors.
+  int Flush(off_t off, size_t sz);
+
+  // Write out all cached data. Return 0 on success, or -1 on errors.
+  int FlushAll();
+
+  // Write out all cached data if the oldest of it has been cached for
+  // longer than the max age. Return 0 on success, or -1 on errors.
+  int FlushExpired();
+
+  // Return the end of the furthest cached range, or 0 if nothing is cached.
+  off_t End() const;
+
+ private:
+  typedef std::map<off_t, std::string> ExtentMap;
+
+  int WriteExtent(ExtentMap::iterator it);
+
+  ExtentMap extents_;  // Start offset -> data
+  size_t bytes_;       // Total size of all extents
+  unsigned long long oldest_;  // When the oldest cached data was written
+  const PdlfsOps* const ops_;
+  const int fd_;
+  const size_t max_bytes_;
+  const unsigned long long max_age_nanos_;
+
+  // No copying allowed
+  WriteCache(const WriteCache&);
+  void operator=(const WriteCache&);
+};